@@ -0,0 +1,84 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sandbox.h"
+
+#define POLICY \
+    "sandbox.default('allow')\n" \
+    "sandbox.on('network.socket.open', function(rule, cred, domain, typ, proto)\n" \
+    "   return domain == sandbox.AF_INET\n" \
+    "end)"
+
+/* forks a child per iteration that attaches a sandbox and exits, so that
+ * each iteration creates and destroys one sandbox
+ */
+int 
+main(int argc, char *argv[])
+{
+    int error = 0;
+    int i = 0;
+    int n = 0;
+    int status = 0;
+    pid_t pid = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "%s <num-iterations>\n", argv[0]);
+        exit(1);
+    }
+
+    n = atoi(argv[1]);
+
+    for (i = 0; i < n; i++) {
+        pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(1);
+        }
+
+        if (pid == 0) {
+            error = sandbox(POLICY, 0);
+            _exit(error != 0);
+        }
+
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+                WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "failed to set sandbox policy\n");
+            exit(1);
+        }
+    }
+
+    return (0);
+}
@@ -0,0 +1,10 @@
+#!/bin/sh
+
+num=100000
+
+printf "attach\n"
+time ./attach $num
+printf "\n"
+
+# mean attach latency and Lua state pool hit rate
+../../sandbox-user/sandbox-stats
@@ -0,0 +1,148 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sandbox.h"
+
+#define POLICY \
+    "sandbox.allow('sandbox.reload')\n" \
+    "sandbox.allow('process.nice')"
+
+/* policies that must not let the process reload them */
+static const char *unreloadable[] = {
+    "sandbox.default('allow')",
+    "sandbox.allow('sandbox')",
+    NULL
+};
+
+/* attaches policy in a child and returns the errno of a reload, 0 if the
+ * reload succeeded
+ */
+static int
+reload_errno(const char *policy)
+{
+    int status = 0;
+    pid_t pid = 0;
+
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+
+    if (pid == 0) {
+        if (sandbox(policy, SANDBOX_PRIVATE) != 0)
+            _exit(255);
+        if (sandbox_reload(POLICY, 0) != 0)
+            _exit(errno);
+        _exit(0);
+    }
+
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status)) {
+        fprintf(stderr, "child did not exit\n");
+        exit(1);
+    }
+
+    return (WEXITSTATUS(status));
+}
+
+static double
+nsecs_per_call(int n)
+{
+    int i = 0;
+    struct timespec start;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++)
+        setpriority(PRIO_PROCESS, 0, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (((end.tv_sec - start.tv_sec) * 1e9 +
+                (end.tv_nsec - start.tv_nsec)) / n);
+}
+
+/* checks that only a policy that names sandbox.reload can be reloaded,
+ * then times a request decided by a sandbox before and after a reload
+ */
+int 
+main(int argc, char *argv[])
+{
+    int i = 0;
+    int n = 0;
+    int error = 0;
+    double before = 0;
+    double after = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "%s <num-iterations>\n", argv[0]);
+        exit(1);
+    }
+
+    n = atoi(argv[1]);
+
+    for (i = 0; unreloadable[i] != NULL; i++) {
+        error = reload_errno(unreloadable[i]);
+        if (error != EPERM) {
+            fprintf(stderr, "reload under \"%s\": %s, expected %s\n",
+                    unreloadable[i], strerror(error), strerror(EPERM));
+            exit(1);
+        }
+    }
+    error = reload_errno(POLICY);
+    if (error != 0) {
+        fprintf(stderr, "reload under \"%s\": %s\n", POLICY, strerror(error));
+        exit(1);
+    }
+
+    if (sandbox(POLICY, SANDBOX_PRIVATE) != 0) {
+        fprintf(stderr, "failed to set sandbox policy\n");
+        exit(1);
+    }
+    before = nsecs_per_call(n);
+    if (sandbox_reload(POLICY, 0) != 0) {
+        perror("sandbox_reload");
+        exit(1);
+    }
+    after = nsecs_per_call(n);
+
+    printf("before reload: %10.1f ns/request\n", before);
+    printf("after reload:  %10.1f ns/request\n", after);
+
+    return (0);
+}
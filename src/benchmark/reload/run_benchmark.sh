@@ -0,0 +1,6 @@
+#!/bin/sh
+
+num=1000000
+
+printf "reload\n"
+./reload $num
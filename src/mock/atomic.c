@@ -54,3 +54,58 @@ atomic_inc_uint_nv(volatile unsigned int *x)
     (*x)++;
     return (*x);
 }
+
+void
+atomic_inc_64(volatile uint64_t *x)
+{
+    (*x)++;
+}
+
+uint32_t
+atomic_cas_32(volatile uint32_t *x, uint32_t expected, uint32_t new)
+{
+    uint32_t old = *x;
+
+    if (old == expected)
+        *x = new;
+    return (old);
+}
+
+void
+atomic_add_64(volatile uint64_t *x, int64_t delta)
+{
+    (*x) += delta;
+}
+
+/* the mock is single-threaded, so the barriers only keep the compiler from
+ * moving memory accesses across them
+ */
+void
+membar_producer(void)
+{
+    __asm __volatile("" ::: "memory");
+}
+
+void
+membar_consumer(void)
+{
+    __asm __volatile("" ::: "memory");
+}
+
+void
+membar_datadep_consumer(void)
+{
+    __asm __volatile("" ::: "memory");
+}
+
+void
+membar_exit(void)
+{
+    __asm __volatile("" ::: "memory");
+}
+
+void
+membar_sync(void)
+{
+    __asm __volatile("" ::: "memory");
+}
@@ -0,0 +1,476 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <msys/kauth.h>
+#include <msys/kmem.h>
+#include <msys/lua.h>
+#include <msys/proc.h>
+#include <msys/queue.h>
+#include <msys/timevar.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua.h>
+
+#include "sandbox.h"
+#include "sandbox_lua.h"
+#include "sandbox_objcache.h"
+#include "sandbox_rule.h"
+#include "sandbox_ruleset.h"
+
+#define BENCH_DEFAULT_ITERATIONS    10000
+#define BENCH_MAX_STACKED           4
+#define BENCH_CACHELINE             64
+
+/* the shape of the ruleset that searches are timed on */
+#define BENCH_NSCOPES               6
+#define BENCH_NACTIONS              16
+#define BENCH_NSUBACTIONS           8
+
+/* the number of rules in the policies whose load is timed */
+#define BENCH_NLOADRULES            10000
+
+static const struct {
+    const char *name;
+    int flags;
+} bench_profiles[] = {
+    {"minimal", 0},
+    {"full", SANDBOX_FULLLIBS},
+    {NULL, 0}   /* sentinel */
+};
+
+static uint64_t
+bench_nsecs(const struct timespec *start, const struct timespec *end)
+{
+    return ((uint64_t)(end->tv_sec - start->tv_sec) * 1000000000 +
+            end->tv_nsec - start->tv_nsec);
+}
+
+/* the memory a fresh state holds once its garbage is collected */
+static size_t
+bench_statebytes(lua_State *L)
+{
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    return ((size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 +
+            lua_gc(L, LUA_GCCOUNTB, 0));
+}
+
+/* Times the creation of the Lua state of a sandbox with the given flags,
+ * and measures its memory.  sandbox_lua_init() is never called, so the
+ * state pool stays empty and every sandbox_lua_newstate() creates a state.
+ */
+static void
+bench_newstate(const char *name, int flags, int n)
+{
+    int i = 0;
+    size_t nbytes = 0;
+    uint64_t nsecs = 0;
+    struct timespec start;
+    struct timespec end;
+    struct sandbox *sandbox = NULL;
+
+    sandbox = kmem_zalloc(sizeof(*sandbox), KM_SLEEP);
+    sandbox->flags = flags;
+
+    for (i = 0; i < n; i++) {
+        nanouptime(&start);
+        sandbox_lua_newstate(sandbox);
+        nanouptime(&end);
+        nsecs += bench_nsecs(&start, &end);
+
+        if (i == 0)
+            nbytes = bench_statebytes(sandbox->K->L);
+        klua_close(sandbox->K);
+        sandbox->K = NULL;
+    }
+
+    printf("%-8s %10.2f us/state %10zu bytes/state\n", name,
+            (double)nsecs / n / 1000, nbytes);
+
+    kmem_free(sandbox, sizeof(*sandbox));
+}
+
+/* set to give each child a cred and sandbox list of its own on fork, as
+ * the module did before children shared their parent's
+ */
+static int bench_forkdups;
+
+/* the cred scope listener of the module, reduced to the sandbox list
+ * handling
+ */
+static int
+bench_cred_cb(kauth_cred_t cred, kauth_action_t action, void *cookie,
+        void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    struct sandbox_list *sandbox_list = NULL;
+    struct proc *child = NULL;
+
+    sandbox_list = kauth_cred_getdata(cred, secmodel_sandbox_key);
+
+    switch (action) {
+    case KAUTH_CRED_COPY:
+        if (sandbox_list != NULL)
+            sandbox_list_copy(sandbox_list, (kauth_cred_t)arg0);
+        break;
+    case KAUTH_CRED_FORK:
+        if (bench_forkdups) {
+            child = arg1;
+            child->p_cred = kauth_cred_dup(cred);
+            kauth_cred_free(cred);
+        }
+        break;
+    case KAUTH_CRED_FREE:
+        if (sandbox_list != NULL)
+            sandbox_list_destroy(sandbox_list);
+        break;
+    default:
+        break;
+    }
+
+    return (KAUTH_RESULT_DEFER);
+}
+
+/* Times fork and exit of a process with nstacked sandboxes, as seen by
+ * the cred hooks: the child takes the parent's cred, and drops it on exit.
+ */
+static void
+bench_fork(int nstacked, int n)
+{
+    int i = 0;
+    int error = 0;
+    uint64_t dupnsecs = 0;
+    uint64_t sharensecs = 0;
+    struct timespec start;
+    struct timespec end;
+    struct proc parent;
+    struct proc child;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_list *sandbox_list = NULL;
+
+    memset(&parent, 0, sizeof(parent));
+    memset(&child, 0, sizeof(child));
+
+    parent.p_cred = kauth_cred_alloc();
+    if (nstacked > 0) {
+        sandbox_list = sandbox_list_create();
+        for (i = 0; i < nstacked; i++) {
+            sandbox = sandbox_create("sandbox.default('defer')", &error);
+            if (sandbox == NULL) {
+                fprintf(stderr, "sandbox_create failed: %d\n", error);
+                exit(1);
+            }
+            SLIST_INSERT_HEAD(&sandbox_list->head, sandbox, sandbox_next);
+        }
+        kauth_cred_setdata(parent.p_cred, secmodel_sandbox_key, sandbox_list);
+    }
+
+    for (bench_forkdups = 1; bench_forkdups >= 0; bench_forkdups--) {
+        for (i = 0; i < n; i++) {
+            nanouptime(&start);
+            kauth_proc_fork(&parent, &child);
+            kauth_cred_free(child.p_cred);
+            nanouptime(&end);
+            if (bench_forkdups)
+                dupnsecs += bench_nsecs(&start, &end);
+            else
+                sharensecs += bench_nsecs(&start, &end);
+        }
+    }
+
+    printf("%-8d %10.2f us/fork (dup) %10.2f us/fork (share)\n", nstacked,
+            (double)dupnsecs / n / 1000, (double)sharensecs / n / 1000);
+
+    kauth_cred_free(parent.p_cred);
+}
+
+/* Times sandbox_ruleset_search() on a ruleset with a rule for every
+ * subaction, first walking the rulenodes' children lists and then, once the
+ * ruleset is sealed, its index.  Searches are for rules that exist, and
+ * for names that do not at each level.
+ */
+static void
+bench_search(int n)
+{
+    int i = 0;
+    int j = 0;
+    int k = 0;
+    int sealed = 0;
+    int nrules = 0;
+    uint64_t nsecs[2] = {0, 0};
+    char names[3][BENCH_NACTIONS * 2][SANDBOX_RULE_MAXNAMELEN];
+    struct sandbox_rule rule;
+    struct sandbox_rule *rules = NULL;
+    struct sandbox_ruleset *set = NULL;
+    struct timespec start;
+    struct timespec end;
+
+    for (i = 0; i < BENCH_NACTIONS * 2; i++) {
+        snprintf(names[0][i], sizeof(names[0][i]), "scope%d", i);
+        snprintf(names[1][i], sizeof(names[1][i]), "action%d", i);
+        snprintf(names[2][i], sizeof(names[2][i]), "subaction%d", i);
+    }
+
+    set = sandbox_ruleset_create(KAUTH_RESULT_DENY);
+    for (i = 0; i < BENCH_NSCOPES; i++) {
+        for (j = 0; j < BENCH_NACTIONS; j++) {
+            for (k = 0; k < BENCH_NSUBACTIONS; k++) {
+                SANDBOX_RULE_MAKE(&rule, names[0][i], names[1][j],
+                        names[2][k]);
+                sandbox_ruleset_insert(set, &rule, SANDBOX_RULETYPE_TRILEAN,
+                        KAUTH_RESULT_ALLOW, NULL);
+            }
+        }
+    }
+
+    /* half the searches are for rules that are not there */
+    nrules = BENCH_NSCOPES * BENCH_NACTIONS * BENCH_NSUBACTIONS * 2;
+    rules = calloc(nrules, sizeof(*rules));
+    for (i = 0; i < nrules; i++) {
+        rules[i].names[0] = names[0][random() % (BENCH_NSCOPES * 2)];
+        rules[i].names[1] = names[1][random() % (BENCH_NACTIONS * 2)];
+        rules[i].names[2] = names[2][random() % (BENCH_NSUBACTIONS * 2)];
+    }
+
+    for (sealed = 0; sealed < 2; sealed++) {
+        if (sealed)
+            sandbox_ruleset_seal(set);
+        nanouptime(&start);
+        for (i = 0; i < n; i++) {
+            for (j = 0; j < nrules; j++)
+                sandbox_ruleset_search(set, &rules[j]);
+        }
+        nanouptime(&end);
+        nsecs[sealed] = bench_nsecs(&start, &end);
+    }
+
+    printf("%zu rulenodes; nodes per %d-byte line: %.2f (list), "
+            "%.2f (index)\n", set->nodes.nobjs, BENCH_CACHELINE,
+            (double)BENCH_CACHELINE / sizeof(struct sandbox_rulenode),
+            (double)BENCH_CACHELINE / sizeof(struct sandbox_rulehot));
+    printf("%-8s %10.2f ns/search\n", "list",
+            (double)nsecs[0] / n / nrules);
+    printf("%-8s %10.2f ns/search\n", "index",
+            (double)nsecs[1] / n / nrules);
+
+    free(rules);
+    sandbox_ruleset_destroy(set);
+}
+
+/* Times the creation of a sandbox from a generated policy of nrules rules,
+ * made of sandbox.allow() and sandbox.deny() calls and, with the same
+ * rules, of one sandbox.rules{} call.  The rules are in no particular
+ * order, as a generator might emit them.
+ */
+static void
+bench_load(int nrules, int n)
+{
+    int i = 0;
+    int bulk = 0;
+    int error = 0;
+    size_t len = 0;
+    size_t size = 0;
+    uint64_t nsecs[2] = {0, 0};
+    char *scripts[2] = {NULL, NULL};
+    char (*rulenames)[SANDBOX_RULE_MAXNAMES * SANDBOX_RULE_MAXNAMELEN] = NULL;
+    struct sandbox *sandbox = NULL;
+    struct timespec start;
+    struct timespec end;
+
+    rulenames = calloc(nrules, sizeof(*rulenames));
+    for (i = 0; i < nrules; i++) {
+        snprintf(rulenames[i], sizeof(rulenames[i]),
+                "scope%ld.action%ld.subaction%d", random() % BENCH_NSCOPES,
+                random() % 1000, i);
+    }
+
+    size = (size_t)nrules * (sizeof(*rulenames) + 32);
+    for (bulk = 0; bulk < 2; bulk++) {
+        scripts[bulk] = calloc(1, size);
+        len = 0;
+        if (bulk)
+            len += snprintf(scripts[bulk] + len, size - len,
+                    "sandbox.rules{allow={\n");
+        for (i = 0; i < nrules; i++) {
+            /* the last quarter of the rules are denied */
+            if (bulk && i == nrules - nrules / 4)
+                len += snprintf(scripts[bulk] + len, size - len,
+                        "}, deny={\n");
+            if (bulk)
+                len += snprintf(scripts[bulk] + len, size - len, "'%s',\n",
+                        rulenames[i]);
+            else
+                len += snprintf(scripts[bulk] + len, size - len,
+                        "sandbox.%s('%s')\n",
+                        i < nrules - nrules / 4 ? "allow" : "deny",
+                        rulenames[i]);
+        }
+        if (bulk)
+            len += snprintf(scripts[bulk] + len, size - len, "}}\n");
+
+        for (i = 0; i < n; i++) {
+            nanouptime(&start);
+            sandbox = sandbox_create(scripts[bulk], &error);
+            nanouptime(&end);
+            nsecs[bulk] += bench_nsecs(&start, &end);
+            if (sandbox == NULL) {
+                fprintf(stderr, "cannot load the policy (%d)\n", error);
+                break;
+            }
+            sandbox_destroy(sandbox);
+        }
+        free(scripts[bulk]);
+    }
+
+    printf("%-8s %10.2f ms/load\n", "calls", (double)nsecs[0] / n / 1000000);
+    printf("%-8s %10.2f ms/load\n", "rules{}", (double)nsecs[1] / n / 1000000);
+
+    free(rulenames);
+}
+
+/* Times sandbox_reload() of a sandbox between two versions of a policy,
+ * and the requests the sandbox decides before its first reload and after
+ * its last, which read the live version through a pserialize read section
+ * (and, for a policy with functions, hold it by its nevals count).
+ */
+static void
+bench_reload(const char *name, const char *script, int n)
+{
+    int i = 0;
+    int error = 0;
+    uint64_t nsecs[3] = {0, 0, 0};
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", "open"}};
+    struct timespec start;
+    struct timespec end;
+    kauth_cred_t cred;
+
+    cred = kauth_cred_alloc();
+    sandbox = sandbox_create(script, &error);
+    if (sandbox == NULL) {
+        fprintf(stderr, "cannot load the policy (%d)\n", error);
+        exit(1);
+    }
+
+    nanouptime(&start);
+    for (i = 0; i < n; i++)
+        (void)sandbox_eval(sandbox, cred, &rule, NULL, NULL);
+    nanouptime(&end);
+    nsecs[0] = bench_nsecs(&start, &end);
+
+    for (i = 0; i < MAX(n / 100, 1); i++) {
+        nanouptime(&start);
+        error = sandbox_reload(sandbox, script, NULL, 0);
+        nanouptime(&end);
+        nsecs[1] += bench_nsecs(&start, &end);
+        if (error != 0) {
+            fprintf(stderr, "cannot reload the policy (%d)\n", error);
+            exit(1);
+        }
+    }
+
+    nanouptime(&start);
+    for (i = 0; i < n; i++)
+        (void)sandbox_eval(sandbox, cred, &rule, NULL, NULL);
+    nanouptime(&end);
+    nsecs[2] = bench_nsecs(&start, &end);
+
+    printf("%-8s %10.2f us/reload %10.2f ns/eval (first) "
+            "%10.2f ns/eval (reloaded)\n", name,
+            (double)nsecs[1] / MAX(n / 100, 1) / 1000,
+            (double)nsecs[0] / n, (double)nsecs[2] / n);
+
+    sandbox_destroy(sandbox);
+    kauth_cred_free(cred);
+}
+
+static void 
+usage(void)
+{
+    fprintf(stderr, 
+            "usage: bench_libsandbox [-n iterations]\n"
+            "\n"
+            "options:\n"
+            "\t-n iterations\n"
+            "\t\tthe number of times each operation is timed (default %d)\n",
+            BENCH_DEFAULT_ITERATIONS);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int c = 0;
+    int i = 0;
+    int n = BENCH_DEFAULT_ITERATIONS;
+    kauth_listener_t listener;
+
+    opterr = 0;
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = atoi(optarg);
+            if (n <= 0)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    sandbox_objcache_init();
+    sandbox_init();
+
+    printf("lua state creation, by library profile\n");
+    for (i = 0; bench_profiles[i].name != NULL; i++)
+        bench_newstate(bench_profiles[i].name, bench_profiles[i].flags, n);
+
+    listener = kauth_listen_scope(KAUTH_SCOPE_CRED, bench_cred_cb, NULL);
+    printf("\nfork, by number of stacked sandboxes\n");
+    for (i = 0; i <= BENCH_MAX_STACKED; i++)
+        bench_fork(i, n);
+    kauth_unlisten_scope(listener);
+
+    printf("\nrule search, by ruleset layout\n");
+    bench_search(MAX(n / 100, 1));
+
+    printf("\n%d-rule policy load, by registration\n", BENCH_NLOADRULES);
+    bench_load(BENCH_NLOADRULES, MAX(n / 1000, 1));
+
+    printf("\npolicy reload, by policy kind\n");
+    bench_reload("rules", "sandbox.allow('network.socket')", n);
+    bench_reload("function",
+            "sandbox.on('network.socket', function() return true end)", n);
+
+    sandbox_fini();
+    sandbox_objcache_fini();
+
+    return (0);
+}
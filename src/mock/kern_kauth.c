@@ -29,11 +29,61 @@
 
 #include <msys/types.h>
 #include <msys/systm.h>
+#include <msys/queue.h>
 #include <msys/kmem.h>
 #include <msys/kauth.h>
+#include <msys/proc.h>
 
 #include <sys/types.h>
 
+struct kauth_listener {
+    const char *id;
+    kauth_scope_callback_t func;
+    void *cookie;
+    SIMPLEQ_ENTRY(kauth_listener) listener_next;
+};
+
+static SIMPLEQ_HEAD(, kauth_listener) kauth_listeners =
+    SIMPLEQ_HEAD_INITIALIZER(kauth_listeners);
+
+kauth_listener_t
+kauth_listen_scope(const char *id, kauth_scope_callback_t func, void *cookie)
+{
+    struct kauth_listener *listener = NULL;
+
+    listener = kmem_zalloc(sizeof(*listener), KM_SLEEP);
+    listener->id = id;
+    listener->func = func;
+    listener->cookie = cookie;
+    SIMPLEQ_INSERT_TAIL(&kauth_listeners, listener, listener_next);
+
+    return (listener);
+}
+
+void
+kauth_unlisten_scope(kauth_listener_t listener)
+{
+    if (listener == NULL)
+        return;
+
+    SIMPLEQ_REMOVE(&kauth_listeners, listener, kauth_listener, listener_next);
+    kmem_free(listener, sizeof(*listener));
+}
+
+/* see sys/kern/kern_auth.c::kauth_cred_hook */
+static void
+kauth_cred_hook(kauth_cred_t cred, kauth_action_t action, void *arg0,
+        void *arg1)
+{
+    struct kauth_listener *listener = NULL;
+
+    SIMPLEQ_FOREACH(listener, &kauth_listeners, listener_next) {
+        if (strcmp(listener->id, KAUTH_SCOPE_CRED) == 0)
+            (void)listener->func(cred, action, listener->cookie, arg0, arg1,
+                    NULL, NULL);
+    }
+}
+
 kauth_cred_t 
 kauth_cred_alloc(void)
 {
@@ -49,15 +99,64 @@ kauth_cred_alloc(void)
 	cred->cr_svgid = 9;
 	cred->cr_ngroups = 0;
 
+    kauth_cred_hook(cred, KAUTH_CRED_INIT, NULL, NULL);
+
     return (cred);
 }
 
+void
+kauth_cred_hold(kauth_cred_t cred)
+{
+    KASSERT(cred->refcnt > 0);
+
+    cred->refcnt++;
+}
+
 void
 kauth_cred_free(kauth_cred_t cred)
 {
     cred->refcnt--;
-    if (cred->refcnt == 0)
+    if (cred->refcnt == 0) {
+        kauth_cred_hook(cred, KAUTH_CRED_FREE, NULL, NULL);
         kmem_free(cred, sizeof(*cred));
+    }
+}
+
+/* copies all but the specificdata, which the COPY hook's listeners copy */
+void
+kauth_cred_clone(kauth_cred_t from, kauth_cred_t to)
+{
+    to->cr_uid = from->cr_uid;
+    to->cr_euid = from->cr_euid;
+    to->cr_svuid = from->cr_svuid;
+    to->cr_gid = from->cr_gid;
+    to->cr_egid = from->cr_egid;
+    to->cr_svgid = from->cr_svgid;
+    to->cr_ngroups = from->cr_ngroups;
+    memcpy(to->cr_groups, from->cr_groups, sizeof(to->cr_groups));
+
+    kauth_cred_hook(from, KAUTH_CRED_COPY, to, NULL);
+}
+
+kauth_cred_t
+kauth_cred_dup(kauth_cred_t cred)
+{
+    kauth_cred_t new_cred;
+
+    new_cred = kauth_cred_alloc();
+    kauth_cred_clone(cred, new_cred);
+
+    return (new_cred);
+}
+
+/* the child shares the parent's cred; see sys/kern/kern_auth.c */
+void
+kauth_proc_fork(struct proc *parent, struct proc *child)
+{
+    kauth_cred_hold(parent->p_cred);
+    child->p_cred = parent->p_cred;
+
+    kauth_cred_hook(parent->p_cred, KAUTH_CRED_FORK, parent, child);
 }
 
 uid_t
@@ -115,3 +214,19 @@ kauth_cred_group(kauth_cred_t cred, u_int idx)
 
 	return (cred->cr_groups[idx]);
 }
+
+void *
+kauth_cred_getdata(kauth_cred_t cred, kauth_key_t key)
+{
+	KASSERT(cred != NULL);
+
+	return (cred->cr_data);
+}
+
+void
+kauth_cred_setdata(kauth_cred_t cred, kauth_key_t key, void *data)
+{
+	KASSERT(cred != NULL);
+
+	cred->cr_data = data;
+}
@@ -28,8 +28,20 @@
  */
 
 #include <stdlib.h>
+#include <assert.h>
 
 #include <msys/kmem.h>
+#include <msys/pool.h>
+
+struct pool_cache {
+    size_t size;
+    int (*ctor)(void *, void *, int);
+    void (*dtor)(void *, void *);
+    void *arg;
+    void **freelist;    /* constructed objects, ready to hand out */
+    size_t maxfree;
+    struct pool_cache_stats stats;
+};
 
 void *
 kmem_alloc(size_t size, km_flag_t flags)
@@ -48,3 +60,76 @@ kmem_free(void *p, size_t size)
 {
     free(p);
 }
+
+pool_cache_t
+pool_cache_init(size_t size, u_int align, u_int align_offset, u_int flags,
+        const char *wchan, struct pool_allocator *palloc, int ipl,
+        int (*ctor)(void *, void *, int), void (*dtor)(void *, void *),
+        void *arg)
+{
+    struct pool_cache *pc = NULL;
+
+    pc = calloc(1, sizeof(*pc));
+    assert(pc != NULL);
+    pc->size = size;
+    pc->ctor = ctor;
+    pc->dtor = dtor;
+    pc->arg = arg;
+
+    return (pc);
+}
+
+void
+pool_cache_destroy(pool_cache_t pc)
+{
+    size_t i = 0;
+
+    for (i = 0; i < pc->stats.nfree; i++) {
+        if (pc->dtor != NULL)
+            pc->dtor(pc->arg, pc->freelist[i]);
+        free(pc->freelist[i]);
+    }
+    free(pc->freelist);
+    free(pc);
+}
+
+void *
+pool_cache_get(pool_cache_t pc, int flags)
+{
+    void *obj = NULL;
+
+    if (pc->stats.nfree > 0) {
+        obj = pc->freelist[--pc->stats.nfree];
+        pc->stats.nhits++;
+    } else {
+        obj = malloc(pc->size);
+        if (obj == NULL)
+            return (NULL);
+        if (pc->ctor != NULL && pc->ctor(pc->arg, obj, flags) != 0) {
+            free(obj);
+            return (NULL);
+        }
+    }
+    pc->stats.nget++;
+
+    return (obj);
+}
+
+void
+pool_cache_put(pool_cache_t pc, void *obj)
+{
+    if (pc->stats.nfree == pc->maxfree) {
+        pc->maxfree = pc->maxfree ? pc->maxfree * 2 : 16;
+        pc->freelist = realloc(pc->freelist,
+                pc->maxfree * sizeof(*pc->freelist));
+        assert(pc->freelist != NULL);
+    }
+    pc->freelist[pc->stats.nfree++] = obj;
+    pc->stats.nput++;
+}
+
+void
+pool_cache_stats(pool_cache_t pc, struct pool_cache_stats *stats)
+{
+    *stats = pc->stats;
+}
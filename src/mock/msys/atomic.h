@@ -46,6 +46,26 @@ unsigned int	atomic_dec_uint_nv(volatile unsigned int *);
  */
 void		atomic_inc_uint(volatile unsigned int *);
 unsigned int	atomic_inc_uint_nv(volatile unsigned int *);
+void		atomic_inc_64(volatile uint64_t *);
+
+/*
+ * Atomic COMPARE-AND-SWAP
+ */
+uint32_t	atomic_cas_32(volatile uint32_t *, uint32_t, uint32_t);
+
+/*
+ * Atomic ADD
+ */
+void		atomic_add_64(volatile uint64_t *, int64_t);
+
+/*
+ * Memory barriers
+ */
+void		membar_producer(void);
+void		membar_consumer(void);
+void		membar_datadep_consumer(void);
+void		membar_exit(void);
+void		membar_sync(void);
 
 
 #endif /* ! _MSYS_ATOMIC_H_ */
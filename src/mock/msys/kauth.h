@@ -52,10 +52,24 @@ struct kauth_cred {
 	gid_t cr_svgid;			/* saved effective group id */
 	u_int cr_ngroups;		/* number of groups */
 	gid_t cr_groups[16];	/* group memberships */
+	void *cr_data;		/* the mock has a single key */
 };
 
 typedef struct kauth_cred * kauth_cred_t;
 typedef uint32_t kauth_action_t;
+typedef struct kauth_key *kauth_key_t;
+typedef struct kauth_listener *kauth_listener_t;
+
+typedef int (*kauth_scope_callback_t)(kauth_cred_t, kauth_action_t,
+    void *, void *, void *, void *, void *);
+
+struct proc;
+
+/*
+ * Possible scope identifiers.  The mock only calls the listeners of the
+ * credentials scope, from the credential hooks.
+ */
+#define	KAUTH_SCOPE_CRED	"org.netbsd.kauth.cred"
 
 /*
  * Possible return values for a listener.
@@ -382,8 +396,16 @@ enum {
 /* Macro to help passing arguments to authorization wrappers. */
 #define	KAUTH_ARG(arg)	((void *)(unsigned long)(arg))
 
+kauth_listener_t kauth_listen_scope(const char *, kauth_scope_callback_t,
+    void *);
+void kauth_unlisten_scope(kauth_listener_t);
+
 kauth_cred_t kauth_cred_alloc(void);
+void kauth_cred_hold(kauth_cred_t);
 void kauth_cred_free(kauth_cred_t);
+void kauth_cred_clone(kauth_cred_t, kauth_cred_t);
+kauth_cred_t kauth_cred_dup(kauth_cred_t);
+void kauth_proc_fork(struct proc *, struct proc *);
 
 uid_t kauth_cred_getuid(kauth_cred_t);
 uid_t kauth_cred_geteuid(kauth_cred_t);
@@ -394,4 +416,7 @@ gid_t kauth_cred_getsvgid(kauth_cred_t);
 u_int kauth_cred_ngroups(kauth_cred_t);
 gid_t kauth_cred_group(kauth_cred_t, u_int);
 
+void *kauth_cred_getdata(kauth_cred_t, kauth_key_t);
+void kauth_cred_setdata(kauth_cred_t, kauth_key_t, void *);
+
 #endif	/* !_MSYS_KAUTH_H_ */
@@ -0,0 +1,68 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MSYS_POOL_H_
+#define _MSYS_POOL_H_
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The mock pool cache keeps the objects put back to it on a freelist,
+ * which stands in for the kernel's per-CPU caches, and counts what it
+ * does so that tests can check that objects are reused and none leak.
+ */
+
+struct pool_allocator;
+
+typedef struct pool_cache *pool_cache_t;
+
+struct pool_cache_stats {
+    uint64_t nget;      /* objects handed out */
+    uint64_t nput;      /* objects put back */
+    uint64_t nhits;     /* gets served from the freelist */
+    size_t nfree;       /* objects on the freelist */
+};
+
+/* flags to pool_cache_get() */
+#define PR_NOWAIT   0x00
+#define PR_WAITOK   0x01
+
+pool_cache_t pool_cache_init(size_t size, u_int align, u_int align_offset,
+        u_int flags, const char *wchan, struct pool_allocator *palloc,
+        int ipl, int (*ctor)(void *, void *, int),
+        void (*dtor)(void *, void *), void *arg);
+void pool_cache_destroy(pool_cache_t pc);
+void * pool_cache_get(pool_cache_t pc, int flags);
+void pool_cache_put(pool_cache_t pc, void *obj);
+
+/* mock only */
+void pool_cache_stats(pool_cache_t pc, struct pool_cache_stats *stats);
+
+#endif /* !_MSYS_POOL_H_ */
@@ -71,6 +71,10 @@
 #include <sys/types.h>
 
 #include <msys/queue.h>
+#include <msys/kauth.h>
+#include <msys/mutex.h>
+
+struct cwdinfo;
 
 #define MAXCOMLEN 255
 
@@ -109,7 +113,10 @@ struct proc {
 	char		p_trace_enabled;/* p: cached by syscall_intern() */
 	char		p_pad1[2];	/*  unused */
 
+	kmutex_t	*p_lock;	/* :: general mutex */
 	pid_t		p_pid;		/* :: Process identifier. */
+	kauth_cred_t	p_cred;		/* p: Master copy of credentials */
+	struct cwdinfo	*p_cwdi;	/* p: cwd & root dir */
 	struct proc 	*p_pptr;	/* l: Pointer to parent process. */
 	LIST_ENTRY(proc) p_sibling;	/* l: List of sibling processes. */
 	LIST_HEAD(, proc) p_children;	/* l: List of children. */
@@ -147,4 +154,7 @@ struct proc {
 	char		    p_comm[MAXCOMLEN+1];
 };
 
+extern struct proc	*curproc;	/* the process of the calling LWP */
+extern kmutex_t		*proc_lock;
+
 #endif	/* !_MSYS_PROC_H_ */
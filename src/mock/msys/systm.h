@@ -44,6 +44,9 @@
 
 int copystr(const void *kfaddr, void *kdaddr, size_t len, size_t *done);
 
+#include <stdbool.h>
+int kpause(const char *wmesg, bool intr, int timo, void *mtx);
+
 /* sys/systm.h includes lib/libkern/libkern.h.
  * 
  * For simplicty We put the mocks for libkern.h in this header.
@@ -0,0 +1,58 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MSYS_WORKQUEUE_H_
+#define _MSYS_WORKQUEUE_H_
+
+#include <msys/queue.h>
+
+/* The mock is single-threaded, so a workqueue has no thread: work waits on
+ * the queue until workqueue_drain(), which only the mock has, runs it.
+ */
+
+#define PRI_NONE    (-1)
+#define WQ_MPSAFE   0x01
+
+struct cpu_info;
+
+struct work {
+    SIMPLEQ_ENTRY(work) wk_entry;
+};
+
+struct workqueue;
+
+int workqueue_create(struct workqueue **wqp, const char *name,
+        void (*func)(struct work *, void *), void *arg, int prio, int ipl,
+        int flags);
+void workqueue_destroy(struct workqueue *wq);
+void workqueue_enqueue(struct workqueue *wq, struct work *wk,
+        struct cpu_info *ci);
+void workqueue_drain(struct workqueue *wq);
+
+#endif /* !_MSYS_WORKQUEUE_H_ */
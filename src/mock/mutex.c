@@ -0,0 +1,72 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <msys/systm.h>
+#include <msys/mutex.h>
+
+void
+mutex_init(kmutex_t *mtx, kmutex_type_t type, int ipl)
+{
+    mtx->mtx_owned = 0;
+}
+
+void
+mutex_destroy(kmutex_t *mtx)
+{
+    KASSERT(!mtx->mtx_owned);
+}
+
+void
+mutex_enter(kmutex_t *mtx)
+{
+    KASSERT(!mtx->mtx_owned);
+    mtx->mtx_owned = 1;
+}
+
+void
+mutex_exit(kmutex_t *mtx)
+{
+    KASSERT(mtx->mtx_owned);
+    mtx->mtx_owned = 0;
+}
+
+int
+mutex_tryenter(kmutex_t *mtx)
+{
+    if (mtx->mtx_owned)
+        return (0);
+    mtx->mtx_owned = 1;
+    return (1);
+}
+
+int
+mutex_owned(const kmutex_t *mtx)
+{
+    return (mtx->mtx_owned);
+}
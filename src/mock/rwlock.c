@@ -0,0 +1,67 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <msys/systm.h>
+#include <msys/rwlock.h>
+
+void
+rw_init(krwlock_t *rw)
+{
+    rw->rw_readers = 0;
+    rw->rw_writer = 0;
+}
+
+void
+rw_destroy(krwlock_t *rw)
+{
+    KASSERT(rw->rw_readers == 0 && !rw->rw_writer);
+}
+
+void
+rw_enter(krwlock_t *rw, const krw_t op)
+{
+    KASSERT(!rw->rw_writer);
+    if (op == RW_WRITER) {
+        KASSERT(rw->rw_readers == 0);
+        rw->rw_writer = 1;
+    } else {
+        rw->rw_readers++;
+    }
+}
+
+void
+rw_exit(krwlock_t *rw)
+{
+    if (rw->rw_writer) {
+        rw->rw_writer = 0;
+    } else {
+        KASSERT(rw->rw_readers > 0);
+        rw->rw_readers--;
+    }
+}
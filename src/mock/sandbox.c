@@ -35,15 +35,26 @@
 #include <msys/kmem.h>
 #include <msys/kauth.h>
 #include <msys/lua.h>
+#include <msys/errno.h>
 #include <msys/atomic.h>
+#include <msys/mutex.h>
+#include <msys/pserialize.h>
+#include <msys/systm.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
 #include "sandbox.h"
+#include "sandbox_addr.h"
+#include "sandbox_expr.h"
 #include "sandbox_lua.h"
+#include "sandbox_memo.h"
+#include "sandbox_objcache.h"
 #include "sandbox_path.h"
+#include "sandbox_permissive.h"
+#include "sandbox_pred.h"
+#include "sandbox_registry.h"
 #include "sandbox_rule.h"
 #include "sandbox_ruleset.h"
 
@@ -53,8 +64,16 @@
 #define SANDBOX_ARRAY_GET(a, i) ( (i) < (SANDBOX_ARRAY_SIZE(a)) ) ? a[(i)] : NULL
 #define SANDBOX_CAST_PVOID_TO_LUA_INTEGER(arg) ((lua_Integer)  ((intptr_t)(arg))  )
 
+kauth_key_t secmodel_sandbox_key;
+
 static int nsandbox_lists = 0;
 
+/* serializes sandbox_reload(); requests read sandbox->live in sandbox_psz
+ * read sections
+ */
+static kmutex_t sandbox_reloadlock;
+static pserialize_t sandbox_psz;
+
 /* sandbox_system_strmap[KAUTH_SYSTEM_ACCOUNTING] -> "accounting" */
 static const char * sandbox_system_strmap[] = {
     NULL,
@@ -324,20 +343,91 @@ static const char *sandbox_vnode_strmap[] = {
     NULL
 };
 
+/* Evaluates one of a rule's functions.  If the function is pure, its
+ * verdict is looked up in, or else added to, its memo.
+ */
 static int
-sandbox_veval(struct sandbox *sandbox, kauth_cred_t cred,
+sandbox_funcref_veval(struct sandbox *sandbox, struct sandbox_ref *ref,
+        kauth_cred_t cred, const struct sandbox_rule *rule, const char *fmt,
+        va_list ap, uint64_t now)
+{
+    int result = KAUTH_RESULT_DEFER;
+    int cacheable = 0;
+    uint64_t gen = 0;
+    int64_t keys[SANDBOX_MEMO_MAXKEYS];
+    struct sandbox_pred_args args;
+    va_list apsave;
+
+    if (ref->memo != NULL) {
+        va_copy(apsave, ap);
+        sandbox_pred_args_init(&args, fmt, apsave);
+        va_end(apsave);
+        gen = sandbox->generation;
+        if (sandbox_memo_getkeys(ref->memo, cred, &args, keys) == 0) {
+            if (sandbox_memo_lookup(ref->memo, gen, now, keys, &result) == 0)
+                return (result);
+            cacheable = 1;
+        }
+    }
+
+    if (ref->prog != NULL)
+        result = sandbox_expr_veval(ref->prog, cred, fmt, ap);
+    else
+        result = sandbox_lua_veval(sandbox->K, ref, cred, rule, fmt, ap);
+
+    if (cacheable)
+        sandbox_memo_insert(ref->memo, gen, now, keys, result);
+
+    return (result);
+}
+
+/* returns the sockaddr argument of a request, or NULL if it has none */
+static const struct sockaddr *
+sandbox_vsockaddr(const char *fmt, va_list ap)
+{
+    struct sandbox_pred_args args;
+    va_list apsave;
+
+    va_copy(apsave, ap);
+    sandbox_pred_args_init(&args, fmt, apsave);
+    va_end(apsave);
+
+    return (args.sockaddr);
+}
+
+/* Decides a request by one version of a sandbox's policy.  A
+ * SANDBOX_PERMISSIVE version leaves its Lua functions out of the decision,
+ * and queues them to run later on a snapshot of the request.
+ */
+static int
+sandbox_veval_live(struct sandbox *sandbox, kauth_cred_t cred,
         const struct sandbox_rule *rule, struct vnode *vp, const char *fmt, va_list ap)
 {
     int result = KAUTH_RESULT_DEFER;
     int has_allow = 0;
+    int deferred = 0;
+    int counted = 0;
+    uint64_t start = 0;
+    const struct sandbox_rulehot *hot = NULL;
     const struct sandbox_rulenode *node = NULL;
     struct sandbox_ref *ref = NULL;
+    const struct sockaddr *sa = NULL;
     va_list apsave;
 
     SANDBOX_LOG_DEBUG("searching for rule: %s.%s.%s\n", SANDBOX_RULE_SCOPE(rule),
         SANDBOX_RULE_ACTION(rule), SANDBOX_RULE_SUBACTION(rule));
 
-    node = sandbox_ruleset_search(sandbox->ruleset, rule);
+    if (sandbox->ruleset->index != NULL) {
+        hot = sandbox_ruleset_searchhot(sandbox->ruleset, rule);
+        /* a plain allow, deny or defer is decided without the rulenode */
+        if (hot->type == SANDBOX_RULETYPE_TRILEAN) {
+            result = hot->value;
+            goto done;
+        }
+        node = SANDBOX_RULESET_COLD(sandbox->ruleset, hot);
+    } else {
+        node = sandbox_ruleset_search(sandbox->ruleset, rule);
+    }
     SANDBOX_LOG_DEBUG("found rule '%s'\n", node->name);
 
     if (node->type & SANDBOX_RULETYPE_TRILEAN) {
@@ -362,10 +452,56 @@ sandbox_veval(struct sandbox *sandbox, kauth_cred_t cred,
         }
     }
 
+    /* like the path lists, address sets are matched without entering Lua.
+     * A request is denied if its address is in the deny set or missing from
+     * the allow set.
+     */
+    if (node->type & (SANDBOX_RULETYPE_ADDRALLOW | SANDBOX_RULETYPE_ADDRDENY))
+        sa = sandbox_vsockaddr(fmt, ap);
+
+    if ((node->type & SANDBOX_RULETYPE_ADDRDENY) &&
+            sandbox_addr_set_contains(node->addrdeny, sa)) {
+        result = KAUTH_RESULT_DENY;
+        goto done;
+    }
+
+    if (node->type & SANDBOX_RULETYPE_ADDRALLOW) {
+        if (!sandbox_addr_set_contains(node->addrallow, sa)) {
+            result = KAUTH_RESULT_DENY;
+            goto done;
+        }
+        has_allow = 1;
+    }
+
+    /* predicates are cheap and lock-free, so check them before calling
+     * into Lua
+     */
+    if (node->type & SANDBOX_RULETYPE_PREDICATE) {
+        va_copy(apsave, ap);
+        result = sandbox_pred_list_veval(&node->predlist, cred, fmt, apsave);
+        va_end(apsave);
+        if (result == KAUTH_RESULT_DENY)
+            goto done;
+
+        if (result == KAUTH_RESULT_ALLOW)
+            has_allow = 1;
+    }
+
     if (node->type & SANDBOX_RULETYPE_FUNCTION) {
+        counted = (sandbox->flags & SANDBOX_REORDER) || sandbox_refstats;
         SIMPLEQ_FOREACH(ref, &node->funclist, ref_next) {
+            /* compiled expressions never enter Lua, so they still decide */
+            if ((sandbox->flags & SANDBOX_PERMISSIVE) && ref->prog == NULL) {
+                deferred = 1;
+                continue;
+            }
+            /* a pure function's memo needs the time regardless */
             va_copy(apsave, ap);
-            result = sandbox_lua_veval(sandbox->K, ref->value, cred, rule, fmt, apsave);
+            start = (counted || ref->memo != NULL) ? sandbox_ref_clock() : 0;
+            result = sandbox_funcref_veval(sandbox, ref, cred, rule, fmt,
+                    apsave, start);
+            if (counted)
+                sandbox_ref_record(ref, result, sandbox_ref_clock() - start);
             va_end(apsave);
             if (result == KAUTH_RESULT_DENY)
                 goto done;
@@ -373,6 +509,12 @@ sandbox_veval(struct sandbox *sandbox, kauth_cred_t cred,
             if (result == KAUTH_RESULT_ALLOW)
                 has_allow = 1;
         }
+        if (deferred) {
+            va_copy(apsave, ap);
+            sandbox_permissive_enqueue(sandbox, node, cred, rule, fmt,
+                    apsave);
+            va_end(apsave);
+        }
     }
 
     if (node->type & SANDBOX_RULETYPE_WHITELIST) {
@@ -397,6 +539,37 @@ done:
     return (result);
 }
 
+/* Decides a request by the live version of the sandbox's policy, which
+ * sandbox_reload() may replace at any time.  A version without Lua
+ * functions never sleeps, so the request is decided within the pserialize
+ * read section; otherwise, the version is held by its nevals count, which
+ * sandbox_reload() waits to drain before reclaiming it.
+ */
+static int
+sandbox_veval(struct sandbox *sandbox, kauth_cred_t cred,
+        const struct sandbox_rule *rule, struct vnode *vp, const char *fmt, va_list ap)
+{
+    int result = KAUTH_RESULT_DEFER;
+    int s = 0;
+    struct sandbox *live = NULL;
+
+    s = pserialize_read_enter();
+    live = sandbox->live;
+    membar_datadep_consumer();
+    if (live->K == NULL) {
+        result = sandbox_veval_live(live, cred, rule, vp, fmt, ap);
+        pserialize_read_exit(s);
+    } else {
+        atomic_inc_uint(&live->nevals);
+        pserialize_read_exit(s);
+        result = sandbox_veval_live(live, cred, rule, vp, fmt, ap);
+        membar_exit();
+        atomic_dec_uint(&live->nevals);
+    }
+
+    return (result);
+}
+
 /* For MOCK purposes */
 int
 sandbox_eval(struct sandbox *sandbox, kauth_cred_t cred,
@@ -450,32 +623,61 @@ done:
 #define SANDBOX_LIST_EVAL_NOARGS(sandbox_list, cred, rule) \
     sandbox_list_eval(sandbox_list, cred, rule, NULL, NULL)
 
-#define SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, rule, proc) \
-    sandbox_list_eval(sandbox_list, cred, rule, NULL, "p", proc)
+#define SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, rule, proc, locks) \
+    sandbox_list_eval(sandbox_list, cred, rule, NULL, "p", proc, locks)
 
 #define SANDBOX_LIST_EVAL_VNODE(sandbox_list, cred, rule, vp) \
     sandbox_list_eval(sandbox_list, cred, rule, vp, "v", vp)
 
+static void
+sandbox_countfuncs(struct sandbox_rulenode *node, const char *rulename,
+        void *arg)
+{
+    int *nfuncs = arg;
+
+    if (node->type & SANDBOX_RULETYPE_FUNCTION)
+        (*nfuncs)++;
+}
+
+/* params are the packed parameters of a template (see struct
+ * sandbox_template in secmodel_sandbox/sandbox_spec.h), or NULL
+ */
 struct sandbox *
-sandbox_create(const char *script, int *error)
+sandbox_create_template(const char *script, const char *params,
+        size_t paramslen, int *error)
 {
     int result = 0;
+    int nfuncs = 0;
     struct sandbox *sandbox = NULL;
 
     SANDBOX_LOG_TRACE_ENTER;
 
     SANDBOX_LOG_DEBUG("creating new sandbox\n");
 
-    sandbox = kmem_zalloc(sizeof(*sandbox), KM_SLEEP);
+    sandbox = sandbox_objcache_get(SANDBOX_OBJCACHE_SANDBOX);
     sandbox->refcnt = 1;
+    sandbox->live = sandbox;
+    sandbox->generation = 1;
+    sandbox->flags = sandbox_lua_pragmas(script, 0);
     sandbox->ruleset = sandbox_ruleset_create(KAUTH_RESULT_DENY);
     sandbox_lua_newstate(sandbox); /* sets sandbox->K */
 
-    result = sandbox_lua_load(sandbox->K, script);
+    result = sandbox_lua_load(sandbox->K, script, params, paramslen);
     if (result != 0) {
         sandbox_destroy(sandbox);
         sandbox = NULL;
-    } 
+    } else {
+        sandbox_lua_seal(sandbox);
+        sandbox_ruleset_seal(sandbox->ruleset);
+        sandbox->scopes = sandbox_ruleset_scopes(sandbox->ruleset);
+        sandbox_ruleset_foreach(sandbox->ruleset, sandbox_countfuncs,
+                &nfuncs);
+        if (nfuncs == 0) {
+            /* the policy is declarative, so Lua is never entered again */
+            SANDBOX_LOG_DEBUG("no function rules; releasing Lua state\n");
+            sandbox_lua_closestate(sandbox);
+        }
+    }
 
     if (error != NULL)
         *error = result;
@@ -484,6 +686,12 @@ sandbox_create(const char *script, int *error)
     return (sandbox);
 }
 
+struct sandbox *
+sandbox_create(const char *script, int *error)
+{
+    return (sandbox_create_template(script, NULL, 0, error));
+}
+
 void
 sandbox_hold(struct sandbox *sandbox)
 {
@@ -494,21 +702,135 @@ sandbox_hold(struct sandbox *sandbox)
     atomic_inc_uint(&sandbox->refcnt);
 }
 
+/* releases the policy that the sandbox was created with, but not the
+ * sandbox itself
+ */
+static void
+sandbox_releasepolicy(struct sandbox *sandbox)
+{
+    sandbox->scopes = 0;
+    if (sandbox->ruleset != NULL) {
+        sandbox_ruleset_destroy(sandbox->ruleset);
+        sandbox->ruleset = NULL;
+    }
+    if (sandbox->K != NULL)
+        sandbox_lua_closestate(sandbox);
+}
+
 void
 sandbox_destroy(struct sandbox *sandbox)
 {
+    u_int refcnt = 0;
+
     KASSERT(sandbox != NULL);
     KASSERT(sandbox->refcnt > 0);
 
     SANDBOX_LOG_DEBUG("sandbox refcnt %u -> %u\n", sandbox->refcnt, sandbox->refcnt - 1);
 
-    if (atomic_dec_uint_nv(&sandbox->refcnt) > 0)
+    if (sandbox->regent != NULL)
+        refcnt = sandbox_registry_release(sandbox);
+    else
+        refcnt = atomic_dec_uint_nv(&sandbox->refcnt);
+    if (refcnt > 0)
         return;
 
     SANDBOX_LOG_DEBUG("destroying sandbox\n");
-    sandbox_ruleset_destroy(sandbox->ruleset);
-    klua_close(sandbox->K);
-    kmem_free(sandbox, sizeof(*sandbox));
+    if (sandbox->live != sandbox)
+        sandbox_destroy(sandbox->live);
+    sandbox_releasepolicy(sandbox);
+    sandbox_objcache_put(SANDBOX_OBJCACHE_SANDBOX, sandbox);
+}
+
+/* Replaces the policy of the sandbox with one made from script, without
+ * blocking the requests that the sandbox decides meanwhile.  The new
+ * version is built aside, with a ruleset and Lua state of its own, and
+ * published by a single store to sandbox->live; each request sees the one
+ * version or the other.  The old version is reclaimed once a pserialize
+ * grace period has passed and no request still runs its functions.
+ *
+ * A sandbox shared through the registry stands for its script, and so is
+ * never reloaded.
+ */
+int
+sandbox_reload(struct sandbox *sandbox, const char *script,
+        const char *params, size_t paramslen)
+{
+    int error = 0;
+    struct sandbox *old = NULL;
+    struct sandbox *version = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    if (sandbox->regent != NULL) {
+        error = EBUSY;
+        goto fail;
+    }
+
+    version = sandbox_create_template(script, params, paramslen, &error);
+    if (version == NULL)
+        goto fail;
+
+    mutex_enter(&sandbox_reloadlock);
+    old = sandbox->live;
+    membar_producer();
+    sandbox->live = version;
+    pserialize_perform(sandbox_psz);
+    /* queued snapshots count in nevals, and only a drain runs them here */
+    sandbox_permissive_drain();
+    while (old->nevals != 0)
+        kpause("sbreload", false, 1, NULL);
+    membar_sync();
+    if (old == sandbox)
+        sandbox_releasepolicy(sandbox);
+    else
+        sandbox_destroy(old);
+    mutex_exit(&sandbox_reloadlock);
+
+fail:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* True if the live version of the sandbox's policy has a rule of its own
+ * on sandbox.reload, and that rule just allows.  Neither a default nor a
+ * rule on 'sandbox' lets a process replace its policy: the policy must
+ * name the rule.
+ */
+int
+sandbox_reloadable(struct sandbox *sandbox)
+{
+    int s = 0;
+    int reloadable = 0;
+    struct sandbox *live = NULL;
+    const struct sandbox_rulenode *node = NULL;
+    struct sandbox_rule rule = { .names = {NULL, NULL, NULL }};
+
+    SANDBOX_RULE_MAKE(&rule, "sandbox", "reload", NULL);
+
+    s = pserialize_read_enter();
+    live = sandbox->live;
+    membar_datadep_consumer();
+    node = sandbox_ruleset_search(live->ruleset, &rule);
+    reloadable = node->level == sandbox_rule_size(&rule) &&
+        node->type == SANDBOX_RULETYPE_TRILEAN &&
+        node->value == KAUTH_RESULT_ALLOW;
+    pserialize_read_exit(s);
+
+    return (reloadable);
+}
+
+void
+sandbox_init(void)
+{
+    mutex_init(&sandbox_reloadlock, MUTEX_DEFAULT, IPL_NONE);
+    sandbox_psz = pserialize_create();
+}
+
+void
+sandbox_fini(void)
+{
+    pserialize_destroy(sandbox_psz);
+    mutex_destroy(&sandbox_reloadlock);
 }
 
 struct sandbox_list *
@@ -518,7 +840,7 @@ sandbox_list_create(void)
 
     SANDBOX_LOG_TRACE_ENTER;
 
-    sandbox_list = kmem_zalloc(sizeof(*sandbox_list), KM_SLEEP);
+    sandbox_list = sandbox_objcache_get(SANDBOX_OBJCACHE_LIST);
     SLIST_INIT(&sandbox_list->head);
     //secmodel_sandbox_addsandboxlist(sandbox_list);
     nsandbox_lists++;
@@ -528,6 +850,30 @@ sandbox_list_create(void)
     return (sandbox_list);
 }
 
+/* cred is the newly created credential; sandbox_list belongs to some other
+ * credential.  The copy shares the other list's sandboxes, and holds a
+ * reference to each.
+ */
+void
+sandbox_list_copy(const struct sandbox_list *sandbox_list, kauth_cred_t cred)
+{
+    struct sandbox_list *newlist = NULL;
+    struct sandbox *sandbox = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    newlist = sandbox_list_create();
+    newlist->head.slh_first = sandbox_list->head.slh_first;
+
+    SLIST_FOREACH(sandbox, &newlist->head, sandbox_next) {
+        sandbox_hold(sandbox);
+    }
+
+    kauth_cred_setdata(cred, secmodel_sandbox_key, newlist);
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
 void
 sandbox_list_destroy(struct sandbox_list *sandbox_list) 
 {
@@ -540,7 +886,7 @@ sandbox_list_destroy(struct sandbox_list *sandbox_list)
         sandbox_destroy(sandbox);
     }
 
-    kmem_free(sandbox_list, sizeof(*sandbox_list));
+    sandbox_objcache_put(SANDBOX_OBJCACHE_LIST, sandbox_list);
     /* TODO: remove from secmodel_sandbox_lists? */
     nsandbox_lists--;
     SANDBOX_LOG_DEBUG("destroying sandbox_list.  %d remaining\n", nsandbox_lists);
@@ -548,6 +894,35 @@ sandbox_list_destroy(struct sandbox_list *sandbox_list)
     SANDBOX_LOG_TRACE_EXIT;
 }
 
+/* Returns 1 if the process with cred is confined by every sandbox that
+ * the process with ancestor is -- having inherited them across fork, or
+ * attached the same policies, which the registry shares -- and 0
+ * otherwise.  A sandbox list holds the whole chain below its head, so it
+ * is enough to look for ancestor's topmost sandbox.
+ */
+int
+sandbox_cred_inherits(kauth_cred_t cred, kauth_cred_t ancestor)
+{
+    struct sandbox_list *sandbox_list = NULL;
+    struct sandbox *top = NULL;
+    struct sandbox *sandbox = NULL;
+
+    sandbox_list = kauth_cred_getdata(ancestor, secmodel_sandbox_key);
+    if (sandbox_list == NULL || SLIST_EMPTY(&sandbox_list->head))
+        return (1);
+    top = SLIST_FIRST(&sandbox_list->head);
+
+    sandbox_list = kauth_cred_getdata(cred, secmodel_sandbox_key);
+    if (sandbox_list == NULL)
+        return (0);
+    SLIST_FOREACH(sandbox, &sandbox_list->head, sandbox_next) {
+        if (sandbox == top)
+            return (1);
+    }
+
+    return (0);
+}
+
 int
 sandbox_list_evalsystem(struct sandbox_list *sandbox_list, kauth_cred_t cred,
        kauth_action_t action, enum kauth_system_req req, void *arg1,
@@ -756,12 +1131,38 @@ sandbox_list_evalsystem(struct sandbox_list *sandbox_list, kauth_cred_t cred,
     return (result);
 } 
 
+/* the locks on the process that the callers of a process-scope action
+ * hold (see SANDBOX_PRED_LOCKS_NONE)
+ */
+static int
+sandbox_process_locks(kauth_action_t action)
+{
+    switch (action) {
+    case KAUTH_PROCESS_NICE:
+    case KAUTH_PROCESS_PTRACE:
+    case KAUTH_PROCESS_SIGNAL:
+        /* donice(), do_ptrace() and kill1() find the process under
+         * proc_lock and lock it
+         */
+        return (SANDBOX_PRED_LOCKS_BOTH);
+    case KAUTH_PROCESS_FORK:
+        /* fork1() asks about the parent before it takes any lock */
+        return (SANDBOX_PRED_LOCKS_NONE);
+    default:
+        /* KAUTH_PROCESS_CANSEE, for one, comes both with and without
+         * p_lock held
+         */
+        return (SANDBOX_PRED_LOCKS_UNKNOWN);
+    }
+}
+
 int
 sandbox_list_evalprocess(struct sandbox_list *sandbox_list, kauth_cred_t cred,
        kauth_action_t action, struct proc *p, void *arg1, void *arg2, 
        void *arg3)
 {
     int result = KAUTH_RESULT_DEFER;
+    int locks = sandbox_process_locks(action);
     struct sandbox_rule rule = {{ "process", NULL, NULL }};
     enum kauth_process_req req = 0;
 
@@ -775,13 +1176,15 @@ sandbox_list_evalprocess(struct sandbox_list *sandbox_list, kauth_cred_t cred,
     case KAUTH_PROCESS_SCHEDULER_GETPARAM:
     case KAUTH_PROCESS_SETID:
         /* arg1=NULL, arg2=NULL, arg3=NULL */
-        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p);
+        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p,
+                locks);
         break;
     case KAUTH_PROCESS_CANSEE:
         /* arg1=req, arg2=NULL, arg3=NULL */
         req = (enum kauth_process_req)arg1;
         SANDBOX_RULE_SUBACTION(&rule) = SANDBOX_ARRAY_GET(sandbox_process_req_strmap, req);
-        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p);
+        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p,
+                locks);
         break;
     case KAUTH_PROCESS_CORENAME:
         req = (enum kauth_process_req)arg1;
@@ -789,12 +1192,14 @@ sandbox_list_evalprocess(struct sandbox_list *sandbox_list, kauth_cred_t cred,
         case KAUTH_REQ_PROCESS_CORENAME_GET:
             /* arg1=req, arg2=NULL, arg3=NULL */
             SANDBOX_RULE_SUBACTION(&rule) = SANDBOX_ARRAY_GET(sandbox_process_req_strmap, req);
-            result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p);
+            result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p,
+                    locks);
             break;
         case KAUTH_REQ_PROCESS_CORENAME_SET:
             /* arg1=req, arg2=char *cnbuf, arg3=NULL */
             SANDBOX_RULE_SUBACTION(&rule) = SANDBOX_ARRAY_GET(sandbox_process_req_strmap, req);
-            result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p);
+            result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p,
+                    locks);
             break;
         default:
             SANDBOX_LOG_WARN("unknown subaction (%u) for rule: %s.%s\n", req,
@@ -809,21 +1214,24 @@ sandbox_list_evalprocess(struct sandbox_list *sandbox_list, kauth_cred_t cred,
     case KAUTH_PROCESS_STOPFLAG:
         /* arg1=int n, arg2=NULL, arg3=NULL */
         result = sandbox_list_eval(sandbox_list, cred, &rule, NULL, "pi", p,
-                SANDBOX_CAST_PVOID_TO_LUA_INTEGER(arg1));
+                locks, SANDBOX_CAST_PVOID_TO_LUA_INTEGER(arg1));
         break;
     case KAUTH_PROCESS_PROCFS:
         /* arg1=struct pfsnode *pfs, arg2=req, arg3=NULL */
         SANDBOX_RULE_SUBACTION(&rule) = SANDBOX_ARRAY_GET(sandbox_process_req_strmap, (unsigned long)arg2);
-        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p);
+        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p,
+                locks);
         break;
     case KAUTH_PROCESS_RLIMIT:
         /* arg1=req, arg2=struct rlimit *alimit, arg3=int which */
         SANDBOX_RULE_SUBACTION(&rule) = SANDBOX_ARRAY_GET(sandbox_process_req_strmap, (unsigned long)arg1);
-        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p);
+        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p,
+                locks);
         break;
     case KAUTH_PROCESS_SCHEDULER_SETPARAM:
         /* arg1=struct lwp *t, arg2=int lpolicy, arg3=pri_t kpir */
-        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p);
+        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p,
+                locks);
         break;
     default:
         SANDBOX_LOG_WARN("unknown action (%u) for rule: %s\n", action,
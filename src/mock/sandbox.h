@@ -41,6 +41,14 @@
 
 #include "sandbox_ruleset.h"
 
+/* 
+ * sandbox flags (see secmodel_sandbox/sandbox_spec.h); the mock's
+ * sandbox_create() takes none, so tests set them directly
+ */
+#define SANDBOX_REORDER     (1 << 1)
+#define SANDBOX_FULLLIBS    (1 << 2)
+#define SANDBOX_PERMISSIVE  (1 << 4)    /* see sandbox_permissive.h */
+
 struct sandbox_list {
     SLIST_HEAD(, sandbox) head;
     SLIST_ENTRY(sandbox_list) sandbox_list_next;
@@ -48,20 +56,44 @@ struct sandbox_list {
 };
 
 struct sandbox {
-    klua_State  *K;
+    klua_State  *K;         /* NULL if the policy has no functions */
     struct sandbox_ruleset *ruleset;
+    int flags;
+    int scopes;             /* SANDBOX_SCOPE_* flags; see the ruleset */
+    uint64_t generation;    /* of the cached verdicts of pure functions */
     u_int refcnt;
+    struct sandbox_regent *regent;  /* NULL if not in the registry */
+    struct sandbox *live;   /* the version of the policy that decides
+                               requests: the sandbox itself until it is
+                               reloaded; see sandbox_reload() */
+    u_int nevals;           /* requests running this version's functions */
     SLIST_ENTRY(sandbox) sandbox_next;
 };
 
+/* the mock's kauth has a single key, so this is only a name */
+extern kauth_key_t secmodel_sandbox_key;
+
 struct sandbox * sandbox_create(const char *script, int *error);
+struct sandbox * sandbox_create_template(const char *script,
+        const char *params, size_t paramslen, int *error);
 void sandbox_hold(struct sandbox *sandbox);
 void sandbox_destroy(struct sandbox *sandbox);
+int sandbox_reload(struct sandbox *sandbox, const char *script,
+        const char *params, size_t paramslen);
+int sandbox_reloadable(struct sandbox *sandbox);
+
+void sandbox_init(void);
+void sandbox_fini(void);
 
 struct sandbox_list * sandbox_list_create(void);
 
+void sandbox_list_copy(const struct sandbox_list *sandbox_list,
+        kauth_cred_t cred);
+
 void sandbox_list_destroy(struct sandbox_list *sandbox_list);
 
+int sandbox_cred_inherits(kauth_cred_t cred, kauth_cred_t ancestor);
+
 int sandbox_list_evalsystem(struct sandbox_list *sandbox_list,
         kauth_cred_t cred, kauth_action_t action, enum kauth_system_req req,
         void *arg1, void *arg2, void *arg3);
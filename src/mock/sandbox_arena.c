@@ -0,0 +1,108 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <msys/param.h>
+#include <msys/systm.h>
+#include <msys/queue.h>
+#include <msys/kmem.h>
+
+#include "sandbox_arena.h"
+
+#include "sandbox_log.h"
+
+#define SANDBOX_ARENA_ALIGN     sizeof(uint64_t)
+#define SANDBOX_ARENA_ROUNDUP(n) \
+    (((n) + SANDBOX_ARENA_ALIGN - 1) & ~(SANDBOX_ARENA_ALIGN - 1))
+
+#define SANDBOX_ARENA_OBJ(arena, chunk, i) \
+    ((char *)(chunk)->objs + (i) * (arena)->objsize)
+
+void
+sandbox_arena_init(struct sandbox_arena *arena, size_t objsize)
+{
+    SIMPLEQ_INIT(&arena->chunks);
+    arena->objsize = SANDBOX_ARENA_ROUNDUP(objsize);
+    arena->nobjs = 0;
+    arena->nchunks = 0;
+}
+
+/* returns a zeroed object */
+void *
+sandbox_arena_get(struct sandbox_arena *arena)
+{
+    size_t maxobjs = 0;
+    struct sandbox_arena_chunk *chunk = NULL;
+
+    chunk = SIMPLEQ_LAST(&arena->chunks, sandbox_arena_chunk, chunk_next);
+    if (chunk == NULL || chunk->nobjs == chunk->maxobjs) {
+        maxobjs = chunk == NULL ? SANDBOX_ARENA_MINOBJS :
+            MIN(chunk->maxobjs * 2, SANDBOX_ARENA_MAXOBJS);
+        chunk = kmem_zalloc(sizeof(*chunk) + maxobjs * arena->objsize,
+                KM_SLEEP);
+        chunk->size = sizeof(*chunk) + maxobjs * arena->objsize;
+        chunk->maxobjs = maxobjs;
+        SIMPLEQ_INSERT_TAIL(&arena->chunks, chunk, chunk_next);
+        arena->nchunks++;
+        SANDBOX_LOG_DEBUG("arena chunk #%zu holds %zu objects\n",
+                arena->nchunks, maxobjs);
+    }
+
+    arena->nobjs++;
+    return (SANDBOX_ARENA_OBJ(arena, chunk, chunk->nobjs++));
+}
+
+/* calls visit on every object, in the order they were allocated */
+void
+sandbox_arena_foreach(struct sandbox_arena *arena,
+        sandbox_arena_visit_t visit, void *arg)
+{
+    size_t i = 0;
+    struct sandbox_arena_chunk *chunk = NULL;
+
+    SIMPLEQ_FOREACH(chunk, &arena->chunks, chunk_next) {
+        for (i = 0; i < chunk->nobjs; i++)
+            visit(SANDBOX_ARENA_OBJ(arena, chunk, i), arg);
+    }
+}
+
+/* frees the chunks, and with them every object; the arena may be used
+ * again
+ */
+void
+sandbox_arena_destroy(struct sandbox_arena *arena)
+{
+    struct sandbox_arena_chunk *chunk = NULL;
+
+    while ((chunk = SIMPLEQ_FIRST(&arena->chunks)) != NULL) {
+        SIMPLEQ_REMOVE_HEAD(&arena->chunks, chunk_next);
+        kmem_free(chunk, chunk->size);
+    }
+    arena->nobjs = 0;
+    arena->nchunks = 0;
+}
@@ -0,0 +1,72 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SANDBOX_ARENA_H_
+#define _SANDBOX_ARENA_H_
+
+#include <msys/types.h>
+#include <msys/queue.h>
+
+/* An arena hands out objects of one size from chunks that it allocates as
+ * it grows, each twice the size of the last, up to SANDBOX_ARENA_MAXOBJS
+ * objects.  Objects are never freed on their own: destroying the arena
+ * frees its chunks, and so everything allocated from it, at once.  Objects
+ * allocated one after another are next to each other in memory.
+ */
+
+#define SANDBOX_ARENA_MINOBJS   16
+#define SANDBOX_ARENA_MAXOBJS   512
+
+struct sandbox_arena_chunk {
+    SIMPLEQ_ENTRY(sandbox_arena_chunk) chunk_next;
+    size_t size;        /* of the allocation, including this header */
+    size_t nobjs;
+    size_t maxobjs;
+    uint64_t objs[];    /* aligned for any object */
+};
+
+struct sandbox_arena {
+    SIMPLEQ_HEAD(, sandbox_arena_chunk) chunks;
+    size_t objsize;
+    size_t nobjs;
+    size_t nchunks;
+};
+
+typedef void (*sandbox_arena_visit_t)(void *obj, void *arg);
+
+void sandbox_arena_init(struct sandbox_arena *arena, size_t objsize);
+
+void * sandbox_arena_get(struct sandbox_arena *arena);
+
+void sandbox_arena_foreach(struct sandbox_arena *arena,
+        sandbox_arena_visit_t visit, void *arg);
+
+void sandbox_arena_destroy(struct sandbox_arena *arena);
+
+#endif /* !_SANDBOX_ARENA_H_ */
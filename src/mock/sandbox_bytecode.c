@@ -0,0 +1,386 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <msys/types.h>
+#include <msys/systm.h>
+
+#include "sandbox_bytecode.h"
+
+#include "sandbox_log.h"
+
+/* from lundump.h and ldump.c */
+#define SANDBOX_BYTECODE_SIGNATURE  "\x1bLua"
+#define SANDBOX_BYTECODE_VERSION    0x53
+#define SANDBOX_BYTECODE_FORMAT     0
+#define SANDBOX_BYTECODE_DATA       "\x19\x93\r\n\x1a\n"
+#define SANDBOX_BYTECODE_INT        0x5678
+
+/* constant tags (lobject.h) */
+#define SANDBOX_BYTECODE_TNIL       0
+#define SANDBOX_BYTECODE_TBOOLEAN   1
+#define SANDBOX_BYTECODE_TNUMFLT    3
+#define SANDBOX_BYTECODE_TSHRSTR    4
+#define SANDBOX_BYTECODE_TNUMINT    19
+#define SANDBOX_BYTECODE_TLNGSTR    20
+
+/* the few opcodes we look at (lopcodes.h) */
+#define SANDBOX_BYTECODE_OP_LOADK       1
+#define SANDBOX_BYTECODE_OP_LOADBOOL    3
+#define SANDBOX_BYTECODE_OP_LOADNIL     4
+#define SANDBOX_BYTECODE_OP_GETUPVAL    5
+#define SANDBOX_BYTECODE_OP_SETUPVAL    9
+#define SANDBOX_BYTECODE_OP_RETURN      38
+
+#define SANDBOX_BYTECODE_GETOP(i)   ((i) & 0x3f)
+#define SANDBOX_BYTECODE_GETA(i)    (((i) >> 6) & 0xff)
+#define SANDBOX_BYTECODE_GETC(i)    (((i) >> 14) & 0x1ff)
+#define SANDBOX_BYTECODE_GETB(i)    (((i) >> 23) & 0x1ff)
+#define SANDBOX_BYTECODE_GETBX(i)   (((i) >> 14) & 0x3ffff)
+
+/* nested functions are read recursively; give up on deeper chunks rather
+ * than use more kernel stack
+ */
+#define SANDBOX_BYTECODE_MAXDEPTH   16
+
+struct sandbox_bytecode_reader {
+    const uint8_t *p;
+    size_t left;
+    size_t integersize;
+    size_t numbersize;
+};
+
+static int
+sandbox_bytecode_read(struct sandbox_bytecode_reader *r, void *dst, size_t n)
+{
+    if (n > r->left)
+        return (1);
+    if (dst != NULL)
+        memcpy(dst, r->p, n);
+    r->p += n;
+    r->left -= n;
+    return (0);
+}
+
+static int
+sandbox_bytecode_byte(struct sandbox_bytecode_reader *r, uint8_t *v)
+{
+    return (sandbox_bytecode_read(r, v, 1));
+}
+
+static int
+sandbox_bytecode_int(struct sandbox_bytecode_reader *r, int *v)
+{
+    if (sandbox_bytecode_read(r, v, sizeof(*v)) != 0 || *v < 0)
+        return (1);
+    return (0);
+}
+
+static int
+sandbox_bytecode_string(struct sandbox_bytecode_reader *r)
+{
+    uint8_t b = 0;
+    size_t size = 0;
+
+    if (sandbox_bytecode_byte(r, &b) != 0)
+        return (1);
+    size = b;
+    if (b == 0xff && sandbox_bytecode_read(r, &size, sizeof(size)) != 0)
+        return (1);
+    /* the size includes a terminating NUL that is not dumped */
+    if (size == 0)
+        return (0);
+    return (sandbox_bytecode_read(r, NULL, size - 1));
+}
+
+/* skips n items of size each */
+static int
+sandbox_bytecode_skip(struct sandbox_bytecode_reader *r, int n, size_t size)
+{
+    if (size != 0 && (size_t)n > r->left / size)
+        return (1);
+    return (sandbox_bytecode_read(r, NULL, (size_t)n * size));
+}
+
+static int
+sandbox_bytecode_header(struct sandbox_bytecode_reader *r)
+{
+    uint8_t sig[4];
+    uint8_t data[6];
+    uint8_t b = 0;
+    uint8_t sizes[5];
+    int64_t luacint = 0;
+
+    if (sandbox_bytecode_read(r, sig, sizeof(sig)) != 0 ||
+            memcmp(sig, SANDBOX_BYTECODE_SIGNATURE, sizeof(sig)) != 0)
+        return (1);
+    if (sandbox_bytecode_byte(r, &b) != 0 || b != SANDBOX_BYTECODE_VERSION)
+        return (1);
+    if (sandbox_bytecode_byte(r, &b) != 0 || b != SANDBOX_BYTECODE_FORMAT)
+        return (1);
+    if (sandbox_bytecode_read(r, data, sizeof(data)) != 0 ||
+            memcmp(data, SANDBOX_BYTECODE_DATA, sizeof(data)) != 0)
+        return (1);
+
+    /* int, size_t, Instruction, lua_Integer, lua_Number */
+    if (sandbox_bytecode_read(r, sizes, sizeof(sizes)) != 0)
+        return (1);
+    if (sizes[0] != sizeof(int) || sizes[1] != sizeof(size_t) ||
+            sizes[2] != sizeof(uint32_t) || sizes[3] != sizeof(int64_t))
+        return (1);
+    r->integersize = sizes[3];
+    r->numbersize = sizes[4];
+
+    /* checks the byte order */
+    if (sandbox_bytecode_read(r, &luacint, sizeof(luacint)) != 0 ||
+            luacint != SANDBOX_BYTECODE_INT)
+        return (1);
+    if (sandbox_bytecode_read(r, NULL, r->numbersize) != 0)
+        return (1);
+
+    /* number of upvalues of the main function */
+    return (sandbox_bytecode_byte(r, &b));
+}
+
+/* Classifies a function from its first two instructions.  A constant
+ * function compiles to a load of the constant followed by a RETURN of it:
+ *
+ *  return true     LOADBOOL A 1 0; RETURN A 2
+ *  return 'x'      LOADK A Bx;     RETURN A 2
+ *  return nil      LOADNIL A 0;    RETURN A 2
+ *  return upval    GETUPVAL A B;   RETURN A 2
+ *  (empty body)    RETURN 0 1
+ *
+ * *kidx is set for LOADK, whose result depends on the constant's type.
+ */
+static int
+sandbox_bytecode_classify(const uint32_t *code, int sizecode, int *kidx,
+        int *upidx)
+{
+    uint32_t load = 0;
+    uint32_t ret = 0;
+    int a = 0;
+
+    *kidx = -1;
+
+    if (sizecode < 1)
+        return (SANDBOX_BYTECODE_VARIES);
+
+    load = code[0];
+    if (SANDBOX_BYTECODE_GETOP(load) == SANDBOX_BYTECODE_OP_RETURN)
+        return (SANDBOX_BYTECODE_GETB(load) == 1 ? SANDBOX_BYTECODE_FALSE :
+                SANDBOX_BYTECODE_VARIES);
+
+    if (sizecode < 2)
+        return (SANDBOX_BYTECODE_VARIES);
+
+    ret = code[1];
+    a = SANDBOX_BYTECODE_GETA(ret);
+    if (SANDBOX_BYTECODE_GETOP(ret) != SANDBOX_BYTECODE_OP_RETURN ||
+            SANDBOX_BYTECODE_GETB(ret) != 2)
+        return (SANDBOX_BYTECODE_VARIES);
+
+    switch (SANDBOX_BYTECODE_GETOP(load)) {
+    case SANDBOX_BYTECODE_OP_LOADBOOL:
+        /* a non-zero C skips the RETURN */
+        if (SANDBOX_BYTECODE_GETA(load) != a ||
+                SANDBOX_BYTECODE_GETC(load) != 0)
+            break;
+        return (SANDBOX_BYTECODE_GETB(load) ? SANDBOX_BYTECODE_TRUE :
+                SANDBOX_BYTECODE_FALSE);
+    case SANDBOX_BYTECODE_OP_LOADNIL:
+        /* sets registers A through A + B */
+        if (a < (int)SANDBOX_BYTECODE_GETA(load) ||
+                a > (int)(SANDBOX_BYTECODE_GETA(load) +
+                    SANDBOX_BYTECODE_GETB(load)))
+            break;
+        return (SANDBOX_BYTECODE_FALSE);
+    case SANDBOX_BYTECODE_OP_LOADK:
+        if (SANDBOX_BYTECODE_GETA(load) != a)
+            break;
+        *kidx = SANDBOX_BYTECODE_GETBX(load);
+        return (SANDBOX_BYTECODE_VARIES);
+    case SANDBOX_BYTECODE_OP_GETUPVAL:
+        if (SANDBOX_BYTECODE_GETA(load) != a)
+            break;
+        *upidx = SANDBOX_BYTECODE_GETB(load) + 1;
+        return (SANDBOX_BYTECODE_UPVAL);
+    default:
+        break;
+    }
+
+    return (SANDBOX_BYTECODE_VARIES);
+}
+
+static int
+sandbox_bytecode_function(struct sandbox_bytecode_reader *r, int depth,
+        struct sandbox_bytecode_info *info)
+{
+    int i = 0;
+    int n = 0;
+    int kidx = -1;
+    uint8_t tag = 0;
+    uint8_t b = 0;
+    uint32_t insn = 0;
+    uint32_t first[2] = { 0, 0 };
+    const uint8_t *code = NULL;
+
+    if (depth > SANDBOX_BYTECODE_MAXDEPTH)
+        return (1);
+
+    /* source, linedefined, lastlinedefined, numparams, is_vararg,
+     * maxstacksize
+     */
+    if (sandbox_bytecode_string(r) != 0 ||
+            sandbox_bytecode_skip(r, 2, sizeof(int)) != 0 ||
+            sandbox_bytecode_skip(r, 3, 1) != 0)
+        return (1);
+
+    /* code */
+    if (sandbox_bytecode_int(r, &n) != 0)
+        return (1);
+    code = r->p;
+    if (sandbox_bytecode_skip(r, n, sizeof(insn)) != 0)
+        return (1);
+    for (i = 0; i < n; i++) {
+        memcpy(&insn, code + i * sizeof(insn), sizeof(insn));
+        if (SANDBOX_BYTECODE_GETOP(insn) == SANDBOX_BYTECODE_OP_SETUPVAL)
+            info->setupval = 1;
+    }
+    if (depth == 0) {
+        /* code is not necessarily aligned */
+        memcpy(first, code, (n < 2 ? n : 2) * sizeof(insn));
+        info->result = sandbox_bytecode_classify(first, n, &kidx,
+                &info->upidx);
+    }
+
+    /* constants */
+    if (sandbox_bytecode_int(r, &n) != 0)
+        return (1);
+    for (i = 0; i < n; i++) {
+        if (sandbox_bytecode_byte(r, &tag) != 0)
+            return (1);
+        switch (tag) {
+        case SANDBOX_BYTECODE_TNIL:
+            b = 0;
+            break;
+        case SANDBOX_BYTECODE_TBOOLEAN:
+            if (sandbox_bytecode_byte(r, &b) != 0)
+                return (1);
+            break;
+        case SANDBOX_BYTECODE_TNUMFLT:
+            b = 1;
+            if (sandbox_bytecode_read(r, NULL, r->numbersize) != 0)
+                return (1);
+            break;
+        case SANDBOX_BYTECODE_TNUMINT:
+            b = 1;
+            if (sandbox_bytecode_read(r, NULL, r->integersize) != 0)
+                return (1);
+            break;
+        case SANDBOX_BYTECODE_TSHRSTR:
+        case SANDBOX_BYTECODE_TLNGSTR:
+            b = 1;
+            if (sandbox_bytecode_string(r) != 0)
+                return (1);
+            break;
+        default:
+            return (1);
+        }
+        /* only nil and false are false */
+        if (i == kidx)
+            info->result = b ? SANDBOX_BYTECODE_TRUE : SANDBOX_BYTECODE_FALSE;
+    }
+
+    /* upvalues: instack, idx */
+    if (sandbox_bytecode_int(r, &n) != 0 ||
+            sandbox_bytecode_skip(r, n, 2) != 0)
+        return (1);
+
+    /* nested functions */
+    if (sandbox_bytecode_int(r, &n) != 0)
+        return (1);
+    for (i = 0; i < n; i++) {
+        if (sandbox_bytecode_function(r, depth + 1, info) != 0)
+            return (1);
+    }
+
+    /* debug information: lineinfo, locvars, upvalue names */
+    if (sandbox_bytecode_int(r, &n) != 0 ||
+            sandbox_bytecode_skip(r, n, sizeof(int)) != 0)
+        return (1);
+    if (sandbox_bytecode_int(r, &n) != 0)
+        return (1);
+    for (i = 0; i < n; i++) {
+        if (sandbox_bytecode_string(r) != 0 ||
+                sandbox_bytecode_skip(r, 2, sizeof(int)) != 0)
+            return (1);
+    }
+    if (sandbox_bytecode_int(r, &n) != 0)
+        return (1);
+    for (i = 0; i < n; i++) {
+        if (sandbox_bytecode_string(r) != 0)
+            return (1);
+    }
+
+    return (0);
+}
+
+/* Fills in info for the binary chunk.  Returns 0 on success and 1 if the
+ * chunk is malformed or in an unsupported format.
+ */
+int
+sandbox_bytecode_analyze(const void *chunk, size_t len,
+        struct sandbox_bytecode_info *info)
+{
+    int error = 0;
+    struct sandbox_bytecode_reader r;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    memset(info, 0, sizeof(*info));
+    memset(&r, 0, sizeof(r));
+    r.p = chunk;
+    r.left = len;
+
+    error = sandbox_bytecode_header(&r);
+    if (error == 0)
+        error = sandbox_bytecode_function(&r, 0, info);
+    if (error == 0 && r.left != 0)
+        error = 1;
+
+    if (error) {
+        SANDBOX_LOG_DEBUG("cannot read chunk of %zu bytes\n", len);
+        /* assume the worst */
+        info->result = SANDBOX_BYTECODE_VARIES;
+        info->setupval = 1;
+    }
+
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
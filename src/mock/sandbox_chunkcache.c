@@ -0,0 +1,243 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <msys/systm.h>
+#include <msys/kmem.h>
+#include <msys/mutex.h>
+
+#include "sandbox_bytecode.h"
+#include "sandbox_chunkcache.h"
+
+#include "sandbox_log.h"
+
+#define SANDBOX_CHUNKCACHE_FNV_OFFSET   0xcbf29ce484222325ULL
+#define SANDBOX_CHUNKCACHE_FNV_PRIME    0x100000001b3ULL
+
+#define SANDBOX_CHUNKCACHE_SIZE(chunk) \
+    ((chunk)->scriptlen + (chunk)->chunklen)
+
+LIST_HEAD(sandbox_chunk_list, sandbox_chunk);
+
+static struct {
+    kmutex_t lock;
+    struct sandbox_chunk_list buckets[SANDBOX_CHUNKCACHE_NBUCKETS];
+    TAILQ_HEAD(sandbox_chunk_lru, sandbox_chunk) lru;  /* most recently
+                                                          used first */
+    struct sandbox_chunkcache_stats stats;
+} sandbox_chunkcache;
+
+static uint64_t
+sandbox_chunkcache_hash(const char *script)
+{
+    uint64_t h = SANDBOX_CHUNKCACHE_FNV_OFFSET;
+    const char *c = NULL;
+
+    for (c = script; *c != '\0'; c++) {
+        h ^= (u_char)*c;
+        h *= SANDBOX_CHUNKCACHE_FNV_PRIME;
+    }
+
+    return (h);
+}
+
+static void
+sandbox_chunkcache_free(struct sandbox_chunk *chunk)
+{
+    kmem_free(chunk->script, chunk->scriptlen);
+    kmem_free(chunk->chunk, chunk->chunklen);
+    kmem_free(chunk, sizeof(*chunk));
+}
+
+/* unlinks the entry and drops the cache's reference; returns true if that
+ * was the last one, in which case the caller frees the entry once it has
+ * dropped the lock
+ */
+static int
+sandbox_chunkcache_remove(struct sandbox_chunk *chunk)
+{
+    KASSERT(mutex_owned(&sandbox_chunkcache.lock));
+
+    LIST_REMOVE(chunk, chunk_hash);
+    TAILQ_REMOVE(&sandbox_chunkcache.lru, chunk, chunk_lru);
+    sandbox_chunkcache.stats.nbytes -= SANDBOX_CHUNKCACHE_SIZE(chunk);
+
+    return (--chunk->refcnt == 0);
+}
+
+void
+sandbox_chunkcache_init(void)
+{
+    int i = 0;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    mutex_init(&sandbox_chunkcache.lock, MUTEX_DEFAULT, IPL_NONE);
+    for (i = 0; i < SANDBOX_CHUNKCACHE_NBUCKETS; i++)
+        LIST_INIT(&sandbox_chunkcache.buckets[i]);
+    TAILQ_INIT(&sandbox_chunkcache.lru);
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+void
+sandbox_chunkcache_fini(void)
+{
+    struct sandbox_chunk *chunk = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    /* lookups are over by now, so the cache's references are the last */
+    while ((chunk = TAILQ_FIRST(&sandbox_chunkcache.lru)) != NULL) {
+        KASSERT(chunk->refcnt == 1);
+        mutex_enter(&sandbox_chunkcache.lock);
+        sandbox_chunkcache_remove(chunk);
+        mutex_exit(&sandbox_chunkcache.lock);
+        sandbox_chunkcache_free(chunk);
+    }
+    mutex_destroy(&sandbox_chunkcache.lock);
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+/* returns the script's cached chunk, held for the caller, who must release
+ * it with sandbox_chunkcache_release(); or NULL if there is none
+ */
+struct sandbox_chunk *
+sandbox_chunkcache_lookup(const char *script)
+{
+    uint64_t hash = sandbox_chunkcache_hash(script);
+    struct sandbox_chunk *chunk = NULL;
+
+    mutex_enter(&sandbox_chunkcache.lock);
+    LIST_FOREACH(chunk,
+            &sandbox_chunkcache.buckets[hash % SANDBOX_CHUNKCACHE_NBUCKETS],
+            chunk_hash) {
+        if (chunk->hash == hash && strcmp(chunk->script, script) == 0)
+            break;
+    }
+    if (chunk != NULL) {
+        chunk->refcnt++;
+        TAILQ_REMOVE(&sandbox_chunkcache.lru, chunk, chunk_lru);
+        TAILQ_INSERT_HEAD(&sandbox_chunkcache.lru, chunk, chunk_lru);
+        sandbox_chunkcache.stats.nhits++;
+    } else {
+        sandbox_chunkcache.stats.nmisses++;
+    }
+    mutex_exit(&sandbox_chunkcache.lock);
+
+    return (chunk);
+}
+
+void
+sandbox_chunkcache_release(struct sandbox_chunk *chunk)
+{
+    int last = 0;
+
+    mutex_enter(&sandbox_chunkcache.lock);
+    last = --chunk->refcnt == 0;
+    mutex_exit(&sandbox_chunkcache.lock);
+
+    if (last)
+        sandbox_chunkcache_free(chunk);
+}
+
+/* caches a copy of the chunk compiled from the script, unless it is too
+ * large for the cache or another attach cached the script meanwhile
+ */
+void
+sandbox_chunkcache_insert(const char *script, const void *chunk,
+        size_t chunklen, const struct sandbox_bytecode_info *info)
+{
+    struct sandbox_chunk *new = NULL;
+    struct sandbox_chunk *old = NULL;
+    struct sandbox_chunk_list victims;
+    u_int bucket = 0;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    LIST_INIT(&victims);
+    new = kmem_zalloc(sizeof(*new), KM_SLEEP);
+    new->hash = sandbox_chunkcache_hash(script);
+    new->scriptlen = strlen(script) + 1;
+    new->chunklen = chunklen;
+    if (SANDBOX_CHUNKCACHE_SIZE(new) > SANDBOX_CHUNKCACHE_MAXBYTES) {
+        kmem_free(new, sizeof(*new));
+        goto done;
+    }
+    new->script = kmem_alloc(new->scriptlen, KM_SLEEP);
+    memcpy(new->script, script, new->scriptlen);
+    new->chunk = kmem_alloc(chunklen, KM_SLEEP);
+    memcpy(new->chunk, chunk, chunklen);
+    new->info = *info;
+    new->refcnt = 1;
+    bucket = new->hash % SANDBOX_CHUNKCACHE_NBUCKETS;
+
+    mutex_enter(&sandbox_chunkcache.lock);
+    LIST_FOREACH(old, &sandbox_chunkcache.buckets[bucket], chunk_hash) {
+        if (old->hash == new->hash && strcmp(old->script, script) == 0)
+            break;
+    }
+    if (old != NULL) {
+        mutex_exit(&sandbox_chunkcache.lock);
+        sandbox_chunkcache_free(new);
+        goto done;
+    }
+
+    /* evicted entries that nobody holds are freed once the lock is
+     * dropped; their hash links are free to chain them until then
+     */
+    while (sandbox_chunkcache.stats.nbytes + SANDBOX_CHUNKCACHE_SIZE(new) >
+            SANDBOX_CHUNKCACHE_MAXBYTES) {
+        old = TAILQ_LAST(&sandbox_chunkcache.lru, sandbox_chunk_lru);
+        sandbox_chunkcache.stats.nevictions++;
+        if (sandbox_chunkcache_remove(old))
+            LIST_INSERT_HEAD(&victims, old, chunk_hash);
+    }
+
+    LIST_INSERT_HEAD(&sandbox_chunkcache.buckets[bucket], new, chunk_hash);
+    TAILQ_INSERT_HEAD(&sandbox_chunkcache.lru, new, chunk_lru);
+    sandbox_chunkcache.stats.nbytes += SANDBOX_CHUNKCACHE_SIZE(new);
+    mutex_exit(&sandbox_chunkcache.lock);
+
+    while ((old = LIST_FIRST(&victims)) != NULL) {
+        LIST_REMOVE(old, chunk_hash);
+        sandbox_chunkcache_free(old);
+    }
+
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+void
+sandbox_chunkcache_stats(struct sandbox_chunkcache_stats *stats)
+{
+    mutex_enter(&sandbox_chunkcache.lock);
+    *stats = sandbox_chunkcache.stats;
+    mutex_exit(&sandbox_chunkcache.lock);
+}
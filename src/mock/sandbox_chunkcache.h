@@ -0,0 +1,85 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SANDBOX_CHUNKCACHE_H_
+#define _SANDBOX_CHUNKCACHE_H_
+
+#include <msys/types.h>
+#include <msys/queue.h>
+
+#include "sandbox_bytecode.h"
+
+/* The chunk cache keeps the binary chunks that lua_dump() made of policy
+ * scripts the kernel compiled, so that a script attached again is loaded
+ * from its chunk rather than parsed.  Entries are keyed by the script
+ * itself (and found by its hash), and hold what sandbox_bytecode_analyze()
+ * said of the chunk.  Only sandbox_lua_load() inserts chunks, so no chunk
+ * that came from outside the kernel is ever loaded.
+ *
+ * The cache holds at most SANDBOX_CHUNKCACHE_MAXBYTES of scripts and
+ * chunks, and evicts the least recently used entries to make room.  An
+ * entry that is evicted while a lookup holds it is freed on release.
+ */
+
+#define SANDBOX_CHUNKCACHE_MAXBYTES (512 * 1024)
+#define SANDBOX_CHUNKCACHE_NBUCKETS 64
+
+struct sandbox_chunk {
+    uint64_t hash;
+    char *script;
+    size_t scriptlen;   /* including the NUL */
+    void *chunk;
+    size_t chunklen;
+    struct sandbox_bytecode_info info;
+    u_int refcnt;       /* the cache's, while cached, and lookups' */
+    LIST_ENTRY(sandbox_chunk) chunk_hash;
+    TAILQ_ENTRY(sandbox_chunk) chunk_lru;
+};
+
+struct sandbox_chunkcache_stats {
+    uint64_t nhits;
+    uint64_t nmisses;
+    uint64_t nevictions;
+    size_t nbytes;
+};
+
+void sandbox_chunkcache_init(void);
+
+void sandbox_chunkcache_fini(void);
+
+struct sandbox_chunk * sandbox_chunkcache_lookup(const char *script);
+
+void sandbox_chunkcache_release(struct sandbox_chunk *chunk);
+
+void sandbox_chunkcache_insert(const char *script, const void *chunk,
+        size_t chunklen, const struct sandbox_bytecode_info *info);
+
+void sandbox_chunkcache_stats(struct sandbox_chunkcache_stats *stats);
+
+#endif /* !_SANDBOX_CHUNKCACHE_H_ */
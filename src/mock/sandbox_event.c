@@ -0,0 +1,271 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <msys/systm.h>
+#include <msys/atomic.h>
+#include <msys/errno.h>
+#include <msys/kauth.h>
+#include <msys/kmem.h>
+#include <msys/mutex.h>
+#include <msys/socket.h>
+#include <msys/timevar.h>
+#include <msys/un.h>
+#include <msys/vnode.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stddef.h>
+
+#include "sandbox_event.h"
+
+#include "sandbox_log.h"
+
+#define MIN(a, b)   (((a) < (b)) ? (a) : (b))
+
+/* the length of a sockaddr, on systems where it carries one */
+#ifdef SIN6_LEN
+#define SANDBOX_EVENT_SALEN(sa)  ((size_t)(sa)->sa_len)
+#else
+#define SANDBOX_EVENT_SALEN(sa)  sizeof(struct sockaddr_storage)
+#endif
+
+int sandbox_eventson = 0;
+
+static struct sandbox_eventring *sandbox_eventring = NULL;
+static struct sandbox_event *sandbox_eventbuf = NULL;
+static uint64_t sandbox_eventmask = 0;
+static size_t sandbox_eventsize = 0;
+
+static kmutex_t sandbox_eventlock;
+
+/* The reader may write anything to the ring's tail, so only a tail clamped
+ * to [head - nslots, head] is used: one too far behind makes the ring
+ * full, one ahead of head makes it empty.
+ */
+static uint64_t
+sandbox_event_tail(const struct sandbox_eventring *ring, uint64_t head)
+{
+    uint64_t tail = ring->tail;
+
+    if (tail > head)
+        return (head);
+    if (head - tail > sandbox_eventmask + 1)
+        return (head - (sandbox_eventmask + 1));
+    return (tail);
+}
+
+bool
+sandbox_event_pending(void)
+{
+    uint64_t head = 0;
+    struct sandbox_eventring *ring = sandbox_eventring;
+
+    if (ring == NULL)
+        return (false);
+
+    head = ring->head;
+    return (sandbox_event_tail(ring, head) != head);
+}
+
+/* the mock's vnodes carry none of what the kernel records */
+static void
+sandbox_event_vnode(struct sandbox_event *ev, struct vnode *vp)
+{
+    ev->objtype = SANDBOX_EVENT_OBJ_VNODE;
+}
+
+static void
+sandbox_event_sockaddr(struct sandbox_event *ev, const struct sockaddr *sa)
+{
+    size_t len = 0;
+    const struct sockaddr_in *sin = NULL;
+    const struct sockaddr_in6 *sin6 = NULL;
+    const struct sockaddr_un *sun = NULL;
+
+    ev->objtype = SANDBOX_EVENT_OBJ_SOCKADDR;
+    ev->obj.sockaddr.family = sa->sa_family;
+
+    switch (sa->sa_family) {
+    case AF_INET:
+        if (SANDBOX_EVENT_SALEN(sa) < sizeof(*sin))
+            break;
+        sin = (const struct sockaddr_in *)sa;
+        ev->obj.sockaddr.port = ntohs(sin->sin_port);
+        memcpy(ev->obj.sockaddr.addr, &sin->sin_addr, sizeof(sin->sin_addr));
+        break;
+    case AF_INET6:
+        if (SANDBOX_EVENT_SALEN(sa) < sizeof(*sin6))
+            break;
+        sin6 = (const struct sockaddr_in6 *)sa;
+        ev->obj.sockaddr.port = ntohs(sin6->sin6_port);
+        memcpy(ev->obj.sockaddr.addr, &sin6->sin6_addr,
+                sizeof(sin6->sin6_addr));
+        break;
+    case AF_LOCAL:
+        if (SANDBOX_EVENT_SALEN(sa) <= offsetof(struct sockaddr_un, sun_path))
+            break;
+        sun = (const struct sockaddr_un *)sa;
+        len = strnlen(sun->sun_path, MIN(sizeof(sun->sun_path),
+                    SANDBOX_EVENT_SALEN(sa) -
+                    offsetof(struct sockaddr_un, sun_path)));
+        memcpy(ev->obj.sockaddr.path, sun->sun_path,
+                MIN(len, SANDBOX_EVENT_PATHLEN - 1));
+        break;
+    default:
+        break;
+    }
+}
+
+/* Records that the rule with ruleid, level names deep, decided the request
+ * that the lwp lid of process pid made; result is a SANDBOX_EVENT_* result,
+ * and vp and sa, if not NULL, are the request's vnode and sockaddr.  If the
+ * ring is full, the event is dropped.
+ */
+void
+sandbox_event_recordfor(pid_t pid, int32_t lid, kauth_cred_t cred,
+        uint32_t ruleid, int level, int result,
+        const struct sandbox_rule *rule, struct vnode *vp,
+        const struct sockaddr *sa)
+{
+    int i = 0;
+    uint64_t head = 0;
+    struct timespec ts;
+    struct sandbox_eventring *ring = sandbox_eventring;
+    struct sandbox_event *ev = NULL;
+
+    if (ring == NULL)
+        return;
+
+    head = ring->head;
+    if (head - sandbox_event_tail(ring, head) > sandbox_eventmask) {
+        atomic_inc_64(&ring->ndropped);
+        return;
+    }
+    ring->head = head + 1;
+
+    ev = &sandbox_eventbuf[head & sandbox_eventmask];
+    memset(ev, 0, sizeof(*ev));
+    nanouptime(&ts);
+    ev->nsecs = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    ev->ruleid = ruleid;
+    ev->pid = pid;
+    ev->lid = lid;
+    ev->uid = kauth_cred_geteuid(cred);
+    ev->result = result;
+    ev->level = level;
+    for (i = 0; i < SANDBOX_RULE_MAXNAMES && rule->names[i] != NULL; i++)
+        strncpy(ev->names[i], rule->names[i], SANDBOX_EVENT_NAMELEN - 1);
+
+    if (vp != NULL)
+        sandbox_event_vnode(ev, vp);
+    else if (sa != NULL)
+        sandbox_event_sockaddr(ev, sa);
+
+    membar_producer();
+    ev->seq = head + 1;
+}
+
+int
+sandbox_event_start(struct sandbox_events *events)
+{
+    int error = 0;
+    size_t offset = 0;
+    size_t size = 0;
+    struct sandbox_eventring *ring = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    if (events->nevents > SANDBOX_EVENT_MAXEVENTS ||
+            (events->nevents & (events->nevents - 1)) != 0) {
+        error = EINVAL;
+        goto done;
+    }
+
+    mutex_enter(&sandbox_eventlock);
+    if (events->nevents == 0) {
+        sandbox_eventson = 0;
+        goto out;
+    }
+
+    if (sandbox_eventring == NULL) {
+        offset = sizeof(*ring);
+        size = offset + events->nevents * sizeof(struct sandbox_event);
+        ring = kmem_zalloc(size, KM_SLEEP);
+        ring->version = SANDBOX_EVENT_VERSION;
+        ring->eventsize = sizeof(struct sandbox_event);
+        ring->nevents = events->nevents;
+        ring->offset = offset;
+
+        sandbox_eventbuf = (struct sandbox_event *)((char *)ring + offset);
+        sandbox_eventmask = events->nevents - 1;
+        sandbox_eventsize = size;
+        membar_producer();
+        sandbox_eventring = ring;
+    } else if (events->nevents != sandbox_eventmask + 1) {
+        error = EBUSY;
+        goto out;
+    }
+    sandbox_eventson = 1;
+
+out:
+    events->nevents = (sandbox_eventring != NULL) ? sandbox_eventmask + 1 : 0;
+    events->size = sandbox_eventsize;
+    mutex_exit(&sandbox_eventlock);
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* stands in for mapping the ring from /dev/sandbox; NULL until started */
+struct sandbox_eventring *
+sandbox_event_map(void)
+{
+    return (sandbox_eventring);
+}
+
+void
+sandbox_event_init(void)
+{
+    mutex_init(&sandbox_eventlock, MUTEX_DEFAULT, IPL_NONE);
+}
+
+void
+sandbox_event_fini(void)
+{
+    sandbox_eventson = 0;
+
+    if (sandbox_eventring != NULL) {
+        kmem_free(sandbox_eventring, sandbox_eventsize);
+        sandbox_eventring = NULL;
+        sandbox_eventbuf = NULL;
+        sandbox_eventsize = 0;
+    }
+
+    mutex_destroy(&sandbox_eventlock);
+}
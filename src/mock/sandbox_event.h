@@ -0,0 +1,132 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SANDBOX_EVENT_H_
+#define _SANDBOX_EVENT_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <msys/kauth.h>
+#include <msys/socket.h>
+#include <msys/vnode.h>
+
+#include "sandbox_rule.h"
+
+/* The event ring of the kernel's sandbox_event.c, without /dev/sandbox:
+ * the tests read the ring, and write its tail, through sandbox_event_map()
+ * rather than a mapping, and nothing waits for events.  The mock has no
+ * lwps, so only sandbox_event_recordfor() is kept.  The ring's layout is
+ * that of the kernel's sandbox_spec.h.
+ */
+
+#define SANDBOX_EVENT_VERSION       1   /* SANDBOX_VERSION */
+#define SANDBOX_EVENT_MAXEVENTS     (1 << 18)
+
+/* sandbox_event results */
+#define SANDBOX_EVENT_ALLOW         0
+#define SANDBOX_EVENT_DENY          1
+#define SANDBOX_EVENT_WOULDDENY     2   /* by a function of a
+                                           SANDBOX_PERMISSIVE sandbox */
+
+/* what a sandbox_event's obj describes */
+#define SANDBOX_EVENT_OBJ_NONE      0
+#define SANDBOX_EVENT_OBJ_VNODE     1
+#define SANDBOX_EVENT_OBJ_SOCKADDR  2
+
+#define SANDBOX_EVENT_NAMELEN       32
+#define SANDBOX_EVENT_PATHLEN       32
+
+struct sandbox_event {
+    volatile uint64_t   seq;
+    uint64_t            nsecs;      /* since boot */
+    uint32_t            ruleid;
+    int32_t             pid;
+    int32_t             lid;
+    uint32_t            uid;        /* effective */
+    uint8_t             result;     /* SANDBOX_EVENT_* */
+    uint8_t             level;
+    uint8_t             objtype;    /* SANDBOX_EVENT_OBJ_* */
+    uint8_t             pad[5];
+    char                names[3][SANDBOX_EVENT_NAMELEN];   /* scope,
+                                                           action and req */
+    union {
+        struct {
+            uint64_t    fsid;
+            uint64_t    fileid;     /* always 0 in the mock */
+            uint32_t    type;       /* enum vtype */
+        } vnode;
+        struct {
+            uint8_t     family;
+            uint8_t     pad;
+            uint16_t    port;       /* host order */
+            uint8_t     pad2[4];
+            uint8_t     addr[16];
+            char        path[SANDBOX_EVENT_PATHLEN];   /* AF_LOCAL,
+                                                        truncated */
+        } sockaddr;
+    } obj;
+};
+
+struct sandbox_eventring {
+    uint32_t            version;    /* SANDBOX_EVENT_VERSION */
+    uint32_t            eventsize;  /* sizeof(struct sandbox_event) */
+    uint64_t            nevents;    /* a power of two */
+    uint64_t            offset;     /* of the first event */
+    volatile uint64_t   head;
+    volatile uint64_t   ndropped;
+    uint64_t            pad[3];
+    volatile uint64_t   tail;       /* in a cache line of its own */
+};
+
+struct sandbox_events {
+    size_t  nevents;    /* in; out: the ring's */
+    size_t  size;       /* out: of the ring and its events */
+};
+
+/* nonzero while events are recorded */
+extern int sandbox_eventson;
+
+void sandbox_event_init(void);
+
+void sandbox_event_fini(void);
+
+int sandbox_event_start(struct sandbox_events *events);
+
+void sandbox_event_recordfor(pid_t pid, int32_t lid, kauth_cred_t cred,
+        uint32_t ruleid, int level, int result,
+        const struct sandbox_rule *rule, struct vnode *vp,
+        const struct sockaddr *sa);
+
+bool sandbox_event_pending(void);
+
+struct sandbox_eventring * sandbox_event_map(void);
+
+#endif /* !_SANDBOX_EVENT_H_ */
@@ -0,0 +1,823 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <msys/systm.h>
+#include <msys/kmem.h>
+#include <msys/kauth.h>
+
+#include "sandbox_expr.h"
+#include "sandbox_pred.h"
+
+#include "sandbox_log.h"
+
+/*
+ * Compiler
+ *
+ * The accepted language is the subset of Lua expressions over integers and
+ * booleans:
+ *
+ *  or
+ *  and
+ *  <  >  <=  >=  ~=  ==
+ *  |
+ *  ~
+ *  &
+ *  <<  >>
+ *  +  -
+ *  *  //  %
+ *  not  -  ~   (unary)
+ *
+ * with integer literals, true, false, parentheses, sandbox.CONSTANT, and
+ * the field names of sandbox_pred_lookupfield().  The compiler type-checks
+ * as it goes (e.g., 'and' only takes booleans), so that a program computes
+ * exactly what Lua would.  Anything else -- floats, strings, nil, function
+ * calls, the rule table -- fails compilation, and the caller falls back to
+ * Lua.
+ */
+
+#define SANDBOX_EXPR_MAXNAMELEN 64
+
+#define SANDBOX_EXPR_TYPE_NONE  0   /* compilation failed */
+#define SANDBOX_EXPR_TYPE_INT   1
+#define SANDBOX_EXPR_TYPE_BOOL  2
+
+enum sandbox_expr_tok {
+    TOK_BAD = 0, TOK_EOF, TOK_NUM, TOK_NAME, TOK_TRUE, TOK_FALSE,
+    TOK_AND, TOK_OR, TOK_NOT,
+    TOK_EQ, TOK_NE, TOK_LT, TOK_LE, TOK_GT, TOK_GE,
+    TOK_BOR, TOK_TILDE, TOK_BAND, TOK_SHL, TOK_SHR,
+    TOK_PLUS, TOK_MINUS, TOK_STAR, TOK_IDIV, TOK_MOD,
+    TOK_LPAREN, TOK_RPAREN
+};
+
+struct sandbox_expr_parser {
+    const char *rulename;
+    const char *s;
+    enum sandbox_expr_tok tok;
+    int64_t num;
+    char name[SANDBOX_EXPR_MAXNAMELEN];
+    struct sandbox_expr *prog;
+    sandbox_expr_lookupconst_t lookupconst;
+};
+
+static bool
+sandbox_expr_isdigit(char c)
+{
+    return (c >= '0' && c <= '9');
+}
+
+static bool
+sandbox_expr_isnamechar(char c)
+{
+    return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            sandbox_expr_isdigit(c) || c == '_');
+}
+
+static int
+sandbox_expr_hexval(char c)
+{
+    if (sandbox_expr_isdigit(c))
+        return (c - '0');
+    if (c >= 'a' && c <= 'f')
+        return (c - 'a' + 10);
+    if (c >= 'A' && c <= 'F')
+        return (c - 'A' + 10);
+    return (-1);
+}
+
+static void
+sandbox_expr_lexnum(struct sandbox_expr_parser *p)
+{
+    uint64_t val = 0;
+    int digit = 0;
+    const char *s = p->s;
+
+    p->tok = TOK_BAD;
+
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        s += 2;
+        if (sandbox_expr_hexval(*s) < 0)
+            return;
+        /* like Lua, hex literals wrap around */
+        for (; (digit = sandbox_expr_hexval(*s)) >= 0; s++)
+            val = (val << 4) | digit;
+    } else {
+        for (; sandbox_expr_isdigit(*s); s++) {
+            digit = *s - '0';
+            /* Lua turns an overflowing decimal into a float */
+            if (val > (INT64_MAX - digit) / 10)
+                return;
+            val = val * 10 + digit;
+        }
+    }
+
+    /* floats and malformed numbers */
+    if (sandbox_expr_isnamechar(*s) || *s == '.')
+        return;
+
+    p->num = (int64_t)val;
+    p->s = s;
+    p->tok = TOK_NUM;
+}
+
+static void
+sandbox_expr_lexname(struct sandbox_expr_parser *p)
+{
+    size_t len = 0;
+    const char *s = p->s;
+
+    p->tok = TOK_BAD;
+
+    /* dotted names, such as cred.uid, are a single token */
+    while (sandbox_expr_isnamechar(*s) || *s == '.') {
+        if (s[0] == '.' && (s[1] == '.' || !sandbox_expr_isnamechar(s[1])))
+            return;
+        s++;
+    }
+
+    len = s - p->s;
+    if (len >= SANDBOX_EXPR_MAXNAMELEN)
+        return;
+    memcpy(p->name, p->s, len);
+    p->name[len] = '\0';
+    p->s = s;
+
+    if (strcmp(p->name, "and") == 0)
+        p->tok = TOK_AND;
+    else if (strcmp(p->name, "or") == 0)
+        p->tok = TOK_OR;
+    else if (strcmp(p->name, "not") == 0)
+        p->tok = TOK_NOT;
+    else if (strcmp(p->name, "true") == 0)
+        p->tok = TOK_TRUE;
+    else if (strcmp(p->name, "false") == 0)
+        p->tok = TOK_FALSE;
+    else
+        p->tok = TOK_NAME;
+}
+
+#define SANDBOX_EXPR_LEX1(p, t) \
+    do { (p)->s += 1; (p)->tok = (t); } while (0)
+#define SANDBOX_EXPR_LEX2(p, t) \
+    do { (p)->s += 2; (p)->tok = (t); } while (0)
+
+static void
+sandbox_expr_lex(struct sandbox_expr_parser *p)
+{
+    const char *s = NULL;
+
+    while (*p->s == ' ' || *p->s == '\t' || *p->s == '\n' || *p->s == '\r')
+        p->s++;
+
+    s = p->s;
+    p->tok = TOK_BAD;
+
+    if (*s == '\0') {
+        p->tok = TOK_EOF;
+        return;
+    }
+
+    if (sandbox_expr_isdigit(*s)) {
+        sandbox_expr_lexnum(p);
+        return;
+    }
+
+    if (sandbox_expr_isnamechar(*s)) {
+        sandbox_expr_lexname(p);
+        return;
+    }
+
+    switch (*s) {
+    case '=':
+        if (s[1] == '=')
+            SANDBOX_EXPR_LEX2(p, TOK_EQ);
+        break;
+    case '~':
+        if (s[1] == '=')
+            SANDBOX_EXPR_LEX2(p, TOK_NE);
+        else
+            SANDBOX_EXPR_LEX1(p, TOK_TILDE);
+        break;
+    case '<':
+        if (s[1] == '=')
+            SANDBOX_EXPR_LEX2(p, TOK_LE);
+        else if (s[1] == '<')
+            SANDBOX_EXPR_LEX2(p, TOK_SHL);
+        else
+            SANDBOX_EXPR_LEX1(p, TOK_LT);
+        break;
+    case '>':
+        if (s[1] == '=')
+            SANDBOX_EXPR_LEX2(p, TOK_GE);
+        else if (s[1] == '>')
+            SANDBOX_EXPR_LEX2(p, TOK_SHR);
+        else
+            SANDBOX_EXPR_LEX1(p, TOK_GT);
+        break;
+    case '/':
+        /* a single '/' is float division */
+        if (s[1] == '/')
+            SANDBOX_EXPR_LEX2(p, TOK_IDIV);
+        break;
+    case '-':
+        /* '--' starts a comment; leave those to Lua */
+        if (s[1] != '-')
+            SANDBOX_EXPR_LEX1(p, TOK_MINUS);
+        break;
+    case '|':   SANDBOX_EXPR_LEX1(p, TOK_BOR);      break;
+    case '&':   SANDBOX_EXPR_LEX1(p, TOK_BAND);     break;
+    case '+':   SANDBOX_EXPR_LEX1(p, TOK_PLUS);     break;
+    case '*':   SANDBOX_EXPR_LEX1(p, TOK_STAR);     break;
+    case '%':   SANDBOX_EXPR_LEX1(p, TOK_MOD);      break;
+    case '(':   SANDBOX_EXPR_LEX1(p, TOK_LPAREN);   break;
+    case ')':   SANDBOX_EXPR_LEX1(p, TOK_RPAREN);   break;
+    default:
+        break;
+    }
+}
+
+/* returns the index of the new instruction, or -1 if the program is full.
+ * One slot is always kept free for the final RET.
+ */
+static int
+sandbox_expr_emit(struct sandbox_expr_parser *p, int code, int dst, int src)
+{
+    struct sandbox_expr_insn *insn = NULL;
+
+    if (p->prog->ninsns >= SANDBOX_EXPR_MAXINSNS - 1)
+        return (-1);
+
+    insn = &p->prog->insns[p->prog->ninsns];
+    insn->code = code;
+    insn->dst = dst;
+    insn->src = src;
+    return (p->prog->ninsns++);
+}
+
+/* points the jump at index j to the next instruction to be emitted */
+static void
+sandbox_expr_patch(struct sandbox_expr_parser *p, int j)
+{
+    p->prog->insns[j].k = p->prog->ninsns - j - 1;
+}
+
+static int sandbox_expr_parse_or(struct sandbox_expr_parser *p, int reg);
+
+static int
+sandbox_expr_parse_primary(struct sandbox_expr_parser *p, int reg)
+{
+    int type = SANDBOX_EXPR_TYPE_NONE;
+    int i = 0;
+    int64_t value = 0;
+    struct sandbox_pred_operand operand;
+
+    switch (p->tok) {
+    case TOK_NUM:
+    case TOK_TRUE:
+    case TOK_FALSE:
+        i = sandbox_expr_emit(p, SANDBOX_EXPR_LDI, reg, 0);
+        if (i < 0)
+            return (SANDBOX_EXPR_TYPE_NONE);
+        if (p->tok == TOK_NUM) {
+            p->prog->insns[i].imm = p->num;
+            type = SANDBOX_EXPR_TYPE_INT;
+        } else {
+            p->prog->insns[i].imm = (p->tok == TOK_TRUE);
+            type = SANDBOX_EXPR_TYPE_BOOL;
+        }
+        sandbox_expr_lex(p);
+        break;
+    case TOK_NAME:
+        if (strncmp(p->name, "sandbox.", 8) == 0) {
+            if (p->lookupconst(p->name + 8, &value) != 0)
+                return (SANDBOX_EXPR_TYPE_NONE);
+            i = sandbox_expr_emit(p, SANDBOX_EXPR_LDI, reg, 0);
+            if (i < 0)
+                return (SANDBOX_EXPR_TYPE_NONE);
+            p->prog->insns[i].imm = value;
+        } else {
+            if (sandbox_pred_lookupfield(p->rulename, p->name, &operand) != 0)
+                return (SANDBOX_EXPR_TYPE_NONE);
+            i = sandbox_expr_emit(p, SANDBOX_EXPR_LDF, reg, 0);
+            if (i < 0)
+                return (SANDBOX_EXPR_TYPE_NONE);
+            p->prog->insns[i].field = operand.field;
+            p->prog->insns[i].k = operand.argidx;
+        }
+        type = SANDBOX_EXPR_TYPE_INT;
+        sandbox_expr_lex(p);
+        break;
+    case TOK_LPAREN:
+        sandbox_expr_lex(p);
+        type = sandbox_expr_parse_or(p, reg);
+        if (type == SANDBOX_EXPR_TYPE_NONE || p->tok != TOK_RPAREN)
+            return (SANDBOX_EXPR_TYPE_NONE);
+        sandbox_expr_lex(p);
+        break;
+    default:
+        break;
+    }
+
+    return (type);
+}
+
+static int
+sandbox_expr_parse_unary(struct sandbox_expr_parser *p, int reg)
+{
+    int type = SANDBOX_EXPR_TYPE_NONE;
+    int code = 0;
+    int want = SANDBOX_EXPR_TYPE_INT;
+
+    switch (p->tok) {
+    case TOK_NOT:
+        code = SANDBOX_EXPR_LNOT;
+        want = SANDBOX_EXPR_TYPE_BOOL;
+        break;
+    case TOK_MINUS:
+        code = SANDBOX_EXPR_NEG;
+        break;
+    case TOK_TILDE:
+        code = SANDBOX_EXPR_BNOT;
+        break;
+    default:
+        return (sandbox_expr_parse_primary(p, reg));
+    }
+
+    sandbox_expr_lex(p);
+    type = sandbox_expr_parse_unary(p, reg);
+    if (type != want || sandbox_expr_emit(p, code, reg, 0) < 0)
+        return (SANDBOX_EXPR_TYPE_NONE);
+
+    return (type);
+}
+
+/* the operators of one binary precedence level */
+struct sandbox_expr_binop {
+    enum sandbox_expr_tok tok;
+    int code;
+};
+
+static const struct sandbox_expr_binop sandbox_expr_mulops[] = {
+    { TOK_STAR, SANDBOX_EXPR_MUL },
+    { TOK_IDIV, SANDBOX_EXPR_IDIV },
+    { TOK_MOD,  SANDBOX_EXPR_MOD },
+    { TOK_BAD, 0 }
+};
+
+static const struct sandbox_expr_binop sandbox_expr_addops[] = {
+    { TOK_PLUS,  SANDBOX_EXPR_ADD },
+    { TOK_MINUS, SANDBOX_EXPR_SUB },
+    { TOK_BAD, 0 }
+};
+
+static const struct sandbox_expr_binop sandbox_expr_shiftops[] = {
+    { TOK_SHL, SANDBOX_EXPR_SHL },
+    { TOK_SHR, SANDBOX_EXPR_SHR },
+    { TOK_BAD, 0 }
+};
+
+static const struct sandbox_expr_binop sandbox_expr_bandops[] = {
+    { TOK_BAND, SANDBOX_EXPR_BAND },
+    { TOK_BAD, 0 }
+};
+
+static const struct sandbox_expr_binop sandbox_expr_bxorops[] = {
+    { TOK_TILDE, SANDBOX_EXPR_BXOR },
+    { TOK_BAD, 0 }
+};
+
+static const struct sandbox_expr_binop sandbox_expr_borops[] = {
+    { TOK_BOR, SANDBOX_EXPR_BOR },
+    { TOK_BAD, 0 }
+};
+
+/* lowest to highest precedence; all of these take and produce integers */
+static const struct sandbox_expr_binop *sandbox_expr_intlevels[] = {
+    sandbox_expr_borops,
+    sandbox_expr_bxorops,
+    sandbox_expr_bandops,
+    sandbox_expr_shiftops,
+    sandbox_expr_addops,
+    sandbox_expr_mulops,
+    NULL
+};
+
+static int
+sandbox_expr_parse_int(struct sandbox_expr_parser *p, int reg, int level)
+{
+    int type = SANDBOX_EXPR_TYPE_NONE;
+    const struct sandbox_expr_binop *op = NULL;
+
+    if (sandbox_expr_intlevels[level] == NULL)
+        return (sandbox_expr_parse_unary(p, reg));
+
+    type = sandbox_expr_parse_int(p, reg, level + 1);
+
+    for (;;) {
+        for (op = sandbox_expr_intlevels[level]; op->tok != TOK_BAD; op++) {
+            if (op->tok == p->tok)
+                break;
+        }
+        if (op->tok == TOK_BAD)
+            break;
+
+        if (type != SANDBOX_EXPR_TYPE_INT || reg + 1 >= SANDBOX_EXPR_NREGS)
+            return (SANDBOX_EXPR_TYPE_NONE);
+        sandbox_expr_lex(p);
+        if (sandbox_expr_parse_int(p, reg + 1, level + 1) !=
+                SANDBOX_EXPR_TYPE_INT)
+            return (SANDBOX_EXPR_TYPE_NONE);
+        if (sandbox_expr_emit(p, op->code, reg, reg + 1) < 0)
+            return (SANDBOX_EXPR_TYPE_NONE);
+    }
+
+    return (type);
+}
+
+static const struct sandbox_expr_binop sandbox_expr_cmpops[] = {
+    { TOK_EQ, SANDBOX_EXPR_EQ },
+    { TOK_NE, SANDBOX_EXPR_NE },
+    { TOK_LT, SANDBOX_EXPR_LT },
+    { TOK_LE, SANDBOX_EXPR_LE },
+    { TOK_GT, SANDBOX_EXPR_GT },
+    { TOK_GE, SANDBOX_EXPR_GE },
+    { TOK_BAD, 0 }
+};
+
+static int
+sandbox_expr_parse_cmp(struct sandbox_expr_parser *p, int reg)
+{
+    int type = SANDBOX_EXPR_TYPE_NONE;
+    int rtype = SANDBOX_EXPR_TYPE_NONE;
+    const struct sandbox_expr_binop *op = NULL;
+
+    type = sandbox_expr_parse_int(p, reg, 0);
+
+    for (;;) {
+        for (op = sandbox_expr_cmpops; op->tok != TOK_BAD; op++) {
+            if (op->tok == p->tok)
+                break;
+        }
+        if (op->tok == TOK_BAD)
+            break;
+
+        if (type == SANDBOX_EXPR_TYPE_NONE || reg + 1 >= SANDBOX_EXPR_NREGS)
+            return (SANDBOX_EXPR_TYPE_NONE);
+        sandbox_expr_lex(p);
+        rtype = sandbox_expr_parse_int(p, reg + 1, 0);
+        /* == and ~= compare like types; the ordering operators need
+         * integers
+         */
+        if (rtype != type)
+            return (SANDBOX_EXPR_TYPE_NONE);
+        if (op->code != SANDBOX_EXPR_EQ && op->code != SANDBOX_EXPR_NE &&
+                type != SANDBOX_EXPR_TYPE_INT)
+            return (SANDBOX_EXPR_TYPE_NONE);
+        if (sandbox_expr_emit(p, op->code, reg, reg + 1) < 0)
+            return (SANDBOX_EXPR_TYPE_NONE);
+        type = SANDBOX_EXPR_TYPE_BOOL;
+    }
+
+    return (type);
+}
+
+/* 'and' and 'or' short-circuit with a forward jump over the right operand */
+static int
+sandbox_expr_parse_logic(struct sandbox_expr_parser *p, int reg,
+        enum sandbox_expr_tok tok)
+{
+    int type = SANDBOX_EXPR_TYPE_NONE;
+    int j = 0;
+
+    if (tok == TOK_OR)
+        type = sandbox_expr_parse_logic(p, reg, TOK_AND);
+    else
+        type = sandbox_expr_parse_cmp(p, reg);
+
+    while (p->tok == tok) {
+        if (type != SANDBOX_EXPR_TYPE_BOOL)
+            return (SANDBOX_EXPR_TYPE_NONE);
+        j = sandbox_expr_emit(p, tok == TOK_OR ? SANDBOX_EXPR_JNZ :
+                SANDBOX_EXPR_JZ, reg, 0);
+        if (j < 0)
+            return (SANDBOX_EXPR_TYPE_NONE);
+        sandbox_expr_lex(p);
+        if (tok == TOK_OR)
+            type = sandbox_expr_parse_logic(p, reg, TOK_AND);
+        else
+            type = sandbox_expr_parse_cmp(p, reg);
+        if (type != SANDBOX_EXPR_TYPE_BOOL)
+            return (SANDBOX_EXPR_TYPE_NONE);
+        sandbox_expr_patch(p, j);
+    }
+
+    return (type);
+}
+
+static int
+sandbox_expr_parse_or(struct sandbox_expr_parser *p, int reg)
+{
+    return (sandbox_expr_parse_logic(p, reg, TOK_OR));
+}
+
+/* Returns the verified program for expression s, or NULL if s is outside of
+ * the supported subset.
+ */
+struct sandbox_expr *
+sandbox_expr_compile(const char *rulename, const char *s,
+        sandbox_expr_lookupconst_t lookupconst)
+{
+    int type = SANDBOX_EXPR_TYPE_NONE;
+    int i = 0;
+    struct sandbox_expr_parser p;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    memset(&p, 0, sizeof(p));
+    p.rulename = rulename;
+    p.s = s;
+    p.lookupconst = lookupconst;
+    p.prog = kmem_zalloc(sizeof(*p.prog), KM_SLEEP);
+
+    sandbox_expr_lex(&p);
+    type = sandbox_expr_parse_or(&p, 0);
+    if (type != SANDBOX_EXPR_TYPE_BOOL || p.tok != TOK_EOF)
+        goto fail;
+
+    /* sandbox_expr_emit() reserves this slot */
+    i = p.prog->ninsns++;
+    p.prog->insns[i].code = SANDBOX_EXPR_RET;
+
+    if (sandbox_expr_verify(p.prog) != 0) {
+        SANDBOX_LOG_ERROR("compiled program for '%s' failed verification\n",
+                s);
+        goto fail;
+    }
+
+    SANDBOX_LOG_DEBUG("compiled '%s' to %d instructions\n", s,
+            p.prog->ninsns);
+    goto done;
+
+fail:
+    SANDBOX_LOG_DEBUG("cannot compile '%s'\n", s);
+    sandbox_expr_destroy(p.prog);
+    p.prog = NULL;
+
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (p.prog);
+}
+
+/*
+ * Verifier
+ *
+ * Checks that every opcode, register, and field is valid, that jumps go
+ * forward and stay within the program, and that the program ends in RET.
+ * A program that passes can be run by sandbox_expr_veval() without any
+ * further checks and executes at most ninsns instructions.
+ */
+int
+sandbox_expr_verify(const struct sandbox_expr *prog)
+{
+    int pc = 0;
+    const struct sandbox_expr_insn *insn = NULL;
+
+    if (prog->ninsns <= 0 || prog->ninsns > SANDBOX_EXPR_MAXINSNS)
+        return (1);
+
+    if (prog->insns[prog->ninsns - 1].code != SANDBOX_EXPR_RET)
+        return (1);
+
+    for (pc = 0; pc < prog->ninsns; pc++) {
+        insn = &prog->insns[pc];
+        if (insn->code >= SANDBOX_EXPR_NOPS)
+            return (1);
+        if (insn->dst >= SANDBOX_EXPR_NREGS || insn->src >= SANDBOX_EXPR_NREGS)
+            return (1);
+
+        switch (insn->code) {
+        case SANDBOX_EXPR_LDF:
+            if (insn->field == SANDBOX_PRED_FIELD_NONE ||
+                    insn->field >= SANDBOX_PRED_NFIELDS)
+                return (1);
+            if (insn->field == SANDBOX_PRED_FIELD_ARG &&
+                    (insn->k < 1 || insn->k > SANDBOX_PRED_MAXARGS))
+                return (1);
+            break;
+        case SANDBOX_EXPR_JMP:
+        case SANDBOX_EXPR_JZ:
+        case SANDBOX_EXPR_JNZ:
+            /* forward only, and never past the final RET */
+            if (insn->k < 0 || pc + 1 + insn->k >= prog->ninsns)
+                return (1);
+            break;
+        default:
+            break;
+        }
+    }
+
+    return (0);
+}
+
+void
+sandbox_expr_destroy(struct sandbox_expr *prog)
+{
+    SANDBOX_LOG_TRACE_ENTER;
+
+    KASSERT(prog != NULL);
+
+    kmem_free(prog, sizeof(*prog));
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+/*
+ * Interpreter
+ *
+ * Arithmetic is done on uint64_t so that overflow wraps, as in Lua.  A
+ * missing field or a division by zero -- an error in Lua -- denies.
+ */
+static int64_t
+sandbox_expr_shl(int64_t a, int64_t n)
+{
+    if (n <= -64 || n >= 64)
+        return (0);
+    if (n >= 0)
+        return ((int64_t)((uint64_t)a << n));
+    return ((int64_t)((uint64_t)a >> -n));
+}
+
+static int
+sandbox_expr_run(const struct sandbox_expr *prog, kauth_cred_t cred,
+        const struct sandbox_pred_args *args)
+{
+    int result = KAUTH_RESULT_DENY;
+    int pc = 0;
+    int64_t r[SANDBOX_EXPR_NREGS];
+    int64_t a = 0;
+    int64_t b = 0;
+    int64_t q = 0;
+    const struct sandbox_expr_insn *insn = NULL;
+    struct sandbox_pred_operand operand;
+
+    memset(r, 0, sizeof(r));
+
+    for (pc = 0; pc < prog->ninsns; pc++) {
+        insn = &prog->insns[pc];
+        a = r[insn->dst];
+        b = r[insn->src];
+
+        switch (insn->code) {
+        case SANDBOX_EXPR_LDI:
+            r[insn->dst] = insn->imm;
+            break;
+        case SANDBOX_EXPR_LDF:
+            operand.field = insn->field;
+            operand.argidx = insn->k;
+            if (sandbox_pred_operand_get(&operand, cred, args,
+                        &r[insn->dst]) != 0)
+                goto done;
+            break;
+        case SANDBOX_EXPR_ADD:
+            r[insn->dst] = (int64_t)((uint64_t)a + (uint64_t)b);
+            break;
+        case SANDBOX_EXPR_SUB:
+            r[insn->dst] = (int64_t)((uint64_t)a - (uint64_t)b);
+            break;
+        case SANDBOX_EXPR_MUL:
+            r[insn->dst] = (int64_t)((uint64_t)a * (uint64_t)b);
+            break;
+        case SANDBOX_EXPR_IDIV:
+        case SANDBOX_EXPR_MOD:
+            if (b == 0)
+                goto done;
+            if (b == -1) {
+                /* avoid INT64_MIN / -1 */
+                q = (int64_t)(0 - (uint64_t)a);
+                r[insn->dst] = insn->code == SANDBOX_EXPR_IDIV ? q : 0;
+                break;
+            }
+            q = a / b;
+            if ((a % b != 0) && ((a < 0) != (b < 0)))
+                q--;
+            r[insn->dst] = insn->code == SANDBOX_EXPR_IDIV ? q :
+                (int64_t)((uint64_t)a - (uint64_t)q * (uint64_t)b);
+            break;
+        case SANDBOX_EXPR_BAND:
+            r[insn->dst] = a & b;
+            break;
+        case SANDBOX_EXPR_BOR:
+            r[insn->dst] = a | b;
+            break;
+        case SANDBOX_EXPR_BXOR:
+            r[insn->dst] = a ^ b;
+            break;
+        case SANDBOX_EXPR_SHL:
+            r[insn->dst] = sandbox_expr_shl(a, b);
+            break;
+        case SANDBOX_EXPR_SHR:
+            r[insn->dst] = (b == INT64_MIN) ? 0 : sandbox_expr_shl(a, -b);
+            break;
+        case SANDBOX_EXPR_NEG:
+            r[insn->dst] = (int64_t)(0 - (uint64_t)a);
+            break;
+        case SANDBOX_EXPR_BNOT:
+            r[insn->dst] = ~a;
+            break;
+        case SANDBOX_EXPR_LNOT:
+            r[insn->dst] = !a;
+            break;
+        case SANDBOX_EXPR_EQ:
+            r[insn->dst] = a == b;
+            break;
+        case SANDBOX_EXPR_NE:
+            r[insn->dst] = a != b;
+            break;
+        case SANDBOX_EXPR_LT:
+            r[insn->dst] = a < b;
+            break;
+        case SANDBOX_EXPR_LE:
+            r[insn->dst] = a <= b;
+            break;
+        case SANDBOX_EXPR_GT:
+            r[insn->dst] = a > b;
+            break;
+        case SANDBOX_EXPR_GE:
+            r[insn->dst] = a >= b;
+            break;
+        case SANDBOX_EXPR_JMP:
+            pc += insn->k;
+            break;
+        case SANDBOX_EXPR_JZ:
+            if (a == 0)
+                pc += insn->k;
+            break;
+        case SANDBOX_EXPR_JNZ:
+            if (a != 0)
+                pc += insn->k;
+            break;
+        case SANDBOX_EXPR_RET:
+            result = a != 0 ? KAUTH_RESULT_ALLOW : KAUTH_RESULT_DENY;
+            goto done;
+        }
+    }
+
+done:
+    return (result);
+}
+
+int
+sandbox_expr_veval(const struct sandbox_expr *prog, kauth_cred_t cred,
+        const char *fmt, va_list ap)
+{
+    struct sandbox_pred_args args;
+
+    sandbox_pred_args_init(&args, fmt, ap);
+    return (sandbox_expr_run(prog, cred, &args));
+}
+
+/* A program that never loads a field computes the same result on every
+ * request.  Returns 0 and sets *result (a KAUTH_RESULT_*) if prog is such a
+ * program; returns 1 otherwise.
+ */
+int
+sandbox_expr_constant(const struct sandbox_expr *prog, int *result)
+{
+    int pc = 0;
+    struct sandbox_pred_args args;
+
+    for (pc = 0; pc < prog->ninsns; pc++) {
+        if (prog->insns[pc].code == SANDBOX_EXPR_LDF)
+            return (1);
+    }
+
+    memset(&args, 0, sizeof(args));
+    *result = sandbox_expr_run(prog, NOCRED, &args);
+    return (0);
+}
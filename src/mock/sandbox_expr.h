@@ -0,0 +1,105 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SANDBOX_EXPR_H_
+#define _SANDBOX_EXPR_H_
+
+#include <msys/systm.h>
+#include <msys/kauth.h>
+
+/* A small register machine for policy expressions passed to sandbox.on() as
+ * strings, e.g. sandbox.on('process.nice', 'n >= proc.nice and n < 40').
+ *
+ * Programs are straight-line code with forward jumps only, so the
+ * verifier can bound their running time by their length.  Registers hold
+ * 64-bit integers; field loads name a sandbox_pred operand and fail the
+ * program (deny) if the request does not carry that field.
+ */
+
+#define SANDBOX_EXPR_MAXINSNS   64
+#define SANDBOX_EXPR_NREGS      8
+
+/* opcodes; binary operations compute r[dst] = r[dst] OP r[src] */
+#define SANDBOX_EXPR_LDI    0   /* r[dst] = imm */
+#define SANDBOX_EXPR_LDF    1   /* r[dst] = field (k = argidx) */
+#define SANDBOX_EXPR_ADD    2
+#define SANDBOX_EXPR_SUB    3
+#define SANDBOX_EXPR_MUL    4
+#define SANDBOX_EXPR_IDIV   5   /* floor division, as Lua's // */
+#define SANDBOX_EXPR_MOD    6   /* floor modulo, as Lua's % */
+#define SANDBOX_EXPR_BAND   7
+#define SANDBOX_EXPR_BOR    8
+#define SANDBOX_EXPR_BXOR   9
+#define SANDBOX_EXPR_SHL    10
+#define SANDBOX_EXPR_SHR    11
+#define SANDBOX_EXPR_NEG    12  /* r[dst] = -r[dst] */
+#define SANDBOX_EXPR_BNOT   13  /* r[dst] = ~r[dst] */
+#define SANDBOX_EXPR_LNOT   14  /* r[dst] = !r[dst] */
+#define SANDBOX_EXPR_EQ     15
+#define SANDBOX_EXPR_NE     16
+#define SANDBOX_EXPR_LT     17
+#define SANDBOX_EXPR_LE     18
+#define SANDBOX_EXPR_GT     19
+#define SANDBOX_EXPR_GE     20
+#define SANDBOX_EXPR_JMP    21  /* pc += 1 + k */
+#define SANDBOX_EXPR_JZ     22  /* if (r[dst] == 0) pc += 1 + k */
+#define SANDBOX_EXPR_JNZ    23  /* if (r[dst] != 0) pc += 1 + k */
+#define SANDBOX_EXPR_RET    24  /* allow if r[dst] != 0 */
+#define SANDBOX_EXPR_NOPS   25
+
+struct sandbox_expr_insn {
+    uint8_t code;
+    uint8_t dst;
+    uint8_t src;
+    uint8_t field;      /* LDF: SANDBOX_PRED_FIELD_* */
+    int32_t k;          /* jump offset, or LDF argidx */
+    int64_t imm;        /* LDI */
+};
+
+struct sandbox_expr {
+    int ninsns;
+    struct sandbox_expr_insn insns[SANDBOX_EXPR_MAXINSNS];
+};
+
+/* resolves the name of a sandbox constant; returns 0 on success */
+typedef int (*sandbox_expr_lookupconst_t)(const char *name, int64_t *value);
+
+struct sandbox_expr * sandbox_expr_compile(const char *rulename,
+        const char *s, sandbox_expr_lookupconst_t lookupconst);
+
+int sandbox_expr_verify(const struct sandbox_expr *prog);
+
+void sandbox_expr_destroy(struct sandbox_expr *prog);
+
+int sandbox_expr_veval(const struct sandbox_expr *prog, kauth_cred_t cred,
+        const char *fmt, va_list ap);
+
+int sandbox_expr_constant(const struct sandbox_expr *prog, int *result);
+
+#endif /* !_SANDBOX_EXPR_H_ */
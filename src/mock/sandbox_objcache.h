@@ -0,0 +1,70 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SANDBOX_OBJCACHE_H_
+#define _SANDBOX_OBJCACHE_H_
+
+#include <msys/types.h>
+
+/* The object caches hand out the fixed-size structures that the module
+ * allocates as credentials are copied and rulesets are built: sandbox
+ * lists, sandboxes, rulesets, paths and function references.  (A
+ * ruleset's rulenodes come from the ruleset's own arena.)  Each type
+ * has a pool_cache(9) of its own, whose per-CPU caches spare most
+ * allocations the trip to the allocator.  Objects come back zeroed, as
+ * from kmem_zalloc().
+ *
+ * The types index the allocation counts that sandbox_objcache_stats()
+ * reports, in the order of sandbox_stats.objs.
+ */
+
+#define SANDBOX_OBJCACHE_LIST       0
+#define SANDBOX_OBJCACHE_SANDBOX    1
+#define SANDBOX_OBJCACHE_RULESET    2
+#define SANDBOX_OBJCACHE_PATH       3
+#define SANDBOX_OBJCACHE_REF        4
+#define SANDBOX_OBJCACHE_NTYPES     5
+
+struct sandbox_objcache_stats {
+    uint64_t nallocs;
+    uint64_t nfrees;
+};
+
+void sandbox_objcache_init(void);
+
+void sandbox_objcache_fini(void);
+
+void * sandbox_objcache_get(int type);
+
+void sandbox_objcache_put(int type, void *obj);
+
+void sandbox_objcache_stats(
+        struct sandbox_objcache_stats stats[SANDBOX_OBJCACHE_NTYPES]);
+
+#endif /* !_SANDBOX_OBJCACHE_H_ */
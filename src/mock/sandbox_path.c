@@ -32,6 +32,7 @@
 #include <msys/kmem.h>
 #include <msys/atomic.h>
 
+#include "sandbox_objcache.h"
 #include "sandbox_path.h"
 
 #include "sandbox_log.h"
@@ -45,7 +46,7 @@ sandbox_path_create(const char *path)
 
     KASSERT(path != NULL);
 
-    sp = kmem_zalloc(sizeof(*sp), KM_SLEEP);
+    sp = sandbox_objcache_get(SANDBOX_OBJCACHE_PATH);
     sp->refcnt = 1;
     /* TODO: check for overflow */
     memcpy(sp->path, path, strlen(path));
@@ -82,7 +83,7 @@ sandbox_path_destroy(struct sandbox_path *sp)
 
     SANDBOX_LOG_DEBUG("destroying sandbox_path\n");
     /* TODO: MOCK: mock holdrele */
-    kmem_free(sp, sizeof(*sp));
+    sandbox_objcache_put(SANDBOX_OBJCACHE_PATH, sp);
 
 done:
     SANDBOX_LOG_TRACE_EXIT;
@@ -0,0 +1,270 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <msys/param.h>
+#include <msys/systm.h>
+#include <msys/atomic.h>
+#include <msys/kauth.h>
+#include <msys/kmem.h>
+#include <msys/proc.h>
+#include <msys/socket.h>
+#include <msys/vnode.h>
+#include <msys/workqueue.h>
+
+#include "sandbox.h"
+#include "sandbox_event.h"
+#include "sandbox_lua.h"
+#include "sandbox_permissive.h"
+#include "sandbox_ref.h"
+
+#include "sandbox_log.h"
+
+/* the length of a sockaddr, on systems where it carries one */
+#ifdef SIN6_LEN
+#define SANDBOX_PERMISSIVE_SALEN(sa)  ((size_t)(sa)->sa_len)
+#else
+#define SANDBOX_PERMISSIVE_SALEN(sa)  sizeof(struct sockaddr_storage)
+#endif
+
+static struct workqueue *sandbox_permwq = NULL;
+
+static volatile u_int sandbox_permqueued = 0;
+static volatile uint64_t sandbox_permdropped = 0;
+static volatile uint64_t sandbox_permdenies = 0;
+
+static void
+sandbox_permissive_free(struct sandbox_snapshot *snap)
+{
+    struct sandbox *sandbox = snap->sandbox;
+
+    kauth_cred_free(snap->cred);
+    kmem_free(snap, sizeof(*snap));
+
+    /* the version's policy may be released as soon as nevals drains */
+    membar_exit();
+    atomic_dec_uint(&sandbox->nevals);
+    sandbox_destroy(sandbox);
+    atomic_dec_uint(&sandbox_permqueued);
+}
+
+/* Runs the Lua functions of a snapshot's rule in order, as the request
+ * would have, until one denies.  The compiled expressions among them
+ * decided the request itself.
+ */
+static void
+sandbox_permissive_work(struct work *wk, void *arg)
+{
+    int i = 0;
+    int result = KAUTH_RESULT_DEFER;
+    uint64_t start = 0;
+    struct sandbox_snapshot *snap = (struct sandbox_snapshot *)wk;
+    struct sandbox_ref *ref = NULL;
+    struct vnode *vp = NULL;
+    const struct sockaddr *sa = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    for (i = 0; i < snap->nargs; i++) {
+        if (snap->args[i].type == 'v')
+            vp = snap->args[i].u.vp;
+        else if (snap->args[i].type == 'a')
+            sa = (const struct sockaddr *)&snap->args[i].u.sa;
+    }
+
+    SIMPLEQ_FOREACH(ref, &snap->node->funclist, ref_next) {
+        if (ref->prog != NULL)
+            continue;
+        start = sandbox_ref_clock();
+        result = sandbox_lua_evalsnapshot(snap->sandbox->K, ref, snap);
+        sandbox_ref_record(ref, result, sandbox_ref_clock() - start);
+        if (result == KAUTH_RESULT_DENY)
+            break;
+    }
+
+    if (result == KAUTH_RESULT_DENY) {
+        SANDBOX_LOG_INFO("pid %d would have been denied %s.%s.%s\n",
+                snap->pid, SANDBOX_RULE_SCOPE(&snap->rule),
+                SANDBOX_RULE_ACTION(&snap->rule),
+                SANDBOX_RULE_SUBACTION(&snap->rule));
+        atomic_inc_64(&sandbox_permdenies);
+        if (sandbox_eventson)
+            sandbox_event_recordfor(snap->pid, snap->lid, snap->cred,
+                    snap->node->id, snap->node->level,
+                    SANDBOX_EVENT_WOULDDENY, &snap->rule, vp, sa);
+    }
+
+    sandbox_permissive_free(snap);
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+/* copies the arguments that fmt describes, leaving out the socket, of
+ * which the functions see nothing
+ */
+static void
+sandbox_permissive_copyargs(struct sandbox_snapshot *snap, const char *fmt,
+        va_list ap)
+{
+    const char *c = NULL;
+    struct proc *p = NULL;
+    const struct sockaddr *sa = NULL;
+    struct sandbox_snaparg *arg = NULL;
+
+    for (c = fmt; c != NULL && *c != '\0'; c++) {
+        if (snap->nargs == SANDBOX_PRED_MAXARGS)
+            break;
+
+        arg = &snap->args[snap->nargs];
+        arg->type = *c;
+        switch (*c) {
+        case 'v':
+            arg->u.vp = va_arg(ap, struct vnode *);
+            break;
+        case 'p':
+            p = va_arg(ap, struct proc *);
+            /* the locks the caller holds on it */
+            (void)va_arg(ap, int);
+            arg->u.proc.pid = p->p_pid;
+            arg->u.proc.ppid = p->p_ppid;
+            arg->u.proc.nice = p->p_nice;
+            strncpy(arg->u.proc.comm, p->p_comm,
+                    sizeof(arg->u.proc.comm) - 1);
+            arg->u.proc.comm[sizeof(arg->u.proc.comm) - 1] = '\0';
+            break;
+        case 'i':
+            arg->u.i = va_arg(ap, lua_Integer);
+            break;
+        case 'o':
+            (void)va_arg(ap, struct socket *);
+            break;
+        case 'a':
+            sa = va_arg(ap, const struct sockaddr *);
+            memset(&arg->u.sa, 0, sizeof(arg->u.sa));
+            memcpy(&arg->u.sa, sa, MIN(SANDBOX_PERMISSIVE_SALEN(sa),
+                        sizeof(arg->u.sa)));
+            break;
+        default:
+            SANDBOX_LOG_ERROR("unknown format character '%c'\n", *c);
+            return;
+        }
+        snap->nargs++;
+    }
+}
+
+/* Queues the functions of node, a rule of the sandbox version, to run on
+ * a snapshot of the request.  The caller holds the version by its nevals,
+ * as the snapshot then does too.
+ */
+void
+sandbox_permissive_enqueue(struct sandbox *sandbox,
+        const struct sandbox_rulenode *node, kauth_cred_t cred,
+        const struct sandbox_rule *rule, const char *fmt, va_list ap)
+{
+    int i = 0;
+    struct sandbox_snapshot *snap = NULL;
+
+    KASSERT(sandbox->K != NULL);
+
+    if (sandbox_permwq == NULL) {
+        atomic_inc_64(&sandbox_permdropped);
+        return;
+    }
+
+    if (atomic_inc_uint_nv(&sandbox_permqueued) >
+            SANDBOX_PERMISSIVE_MAXQUEUE) {
+        atomic_dec_uint(&sandbox_permqueued);
+        atomic_inc_64(&sandbox_permdropped);
+        return;
+    }
+
+    snap = kmem_zalloc(sizeof(*snap), KM_SLEEP);
+
+    atomic_inc_uint(&sandbox->nevals);
+    sandbox_hold(sandbox);
+    snap->sandbox = sandbox;
+    snap->node = node;
+    kauth_cred_hold(cred);
+    snap->cred = cred;
+    snap->pid = (curproc != NULL) ? curproc->p_pid : 0;
+    snap->lid = 0;
+
+    SANDBOX_RULE_MAKE(&snap->rule, NULL, NULL, NULL);
+    for (i = 0; i < SANDBOX_RULE_MAXNAMES && rule->names[i] != NULL; i++) {
+        strncpy(snap->buf[i], rule->names[i], SANDBOX_RULE_MAXNAMELEN - 1);
+        snap->rule.names[i] = snap->buf[i];
+    }
+
+    snap->nargs = 0;
+    sandbox_permissive_copyargs(snap, fmt, ap);
+
+    workqueue_enqueue(sandbox_permwq, &snap->work, NULL);
+}
+
+/* runs the queued snapshots, which the kernel's workqueue thread would */
+void
+sandbox_permissive_drain(void)
+{
+    if (sandbox_permwq != NULL)
+        workqueue_drain(sandbox_permwq);
+}
+
+void
+sandbox_permissive_stats(uint64_t *queued, uint64_t *dropped,
+        uint64_t *denies)
+{
+    *queued = sandbox_permqueued;
+    *dropped = sandbox_permdropped;
+    *denies = sandbox_permdenies;
+}
+
+void
+sandbox_permissive_init(void)
+{
+    int error = 0;
+
+    /* without the workqueue, every snapshot is dropped */
+    error = workqueue_create(&sandbox_permwq, "sandboxperm",
+            sandbox_permissive_work, NULL, PRI_NONE, IPL_NONE, WQ_MPSAFE);
+    if (error != 0) {
+        SANDBOX_LOG_ERROR("workqueue_create() failed (%d)\n", error);
+        sandbox_permwq = NULL;
+    }
+}
+
+/* the last snapshots may still hold their sandboxes */
+void
+sandbox_permissive_fini(void)
+{
+    if (sandbox_permwq == NULL)
+        return;
+
+    workqueue_drain(sandbox_permwq);
+    workqueue_destroy(sandbox_permwq);
+    sandbox_permwq = NULL;
+}
@@ -0,0 +1,510 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <msys/systm.h>
+#include <msys/queue.h>
+#include <msys/kmem.h>
+#include <msys/kauth.h>
+#include <msys/mutex.h>
+#include <msys/proc.h>
+#include <msys/filedesc.h>
+#include <msys/lua.h>
+
+#include <lua.h>
+
+#include "sandbox.h"
+#include "sandbox_pred.h"
+
+#include "sandbox_log.h"
+
+/* cred and proc fields may be used with any rule */
+static const struct {
+    const char *name;
+    int field;
+} sandbox_pred_fields[] = {
+    { "cred.uid",   SANDBOX_PRED_FIELD_CRED_UID },
+    { "cred.euid",  SANDBOX_PRED_FIELD_CRED_EUID },
+    { "cred.svuid", SANDBOX_PRED_FIELD_CRED_SVUID },
+    { "cred.gid",   SANDBOX_PRED_FIELD_CRED_GID },
+    { "cred.egid",  SANDBOX_PRED_FIELD_CRED_EGID },
+    { "cred.svgid", SANDBOX_PRED_FIELD_CRED_SVGID },
+    { "proc.pid",   SANDBOX_PRED_FIELD_PROC_PID },
+    { "proc.ppid",  SANDBOX_PRED_FIELD_PROC_PPID },
+    { "proc.nice",  SANDBOX_PRED_FIELD_PROC_NICE },
+    { "proc.sameroot",      SANDBOX_PRED_FIELD_PROC_SAMEROOT },
+    { "proc.samesandbox",   SANDBOX_PRED_FIELD_PROC_SAMESANDBOX },
+    { "proc.descendant",    SANDBOX_PRED_FIELD_PROC_DESCENDANT },
+    { NULL, SANDBOX_PRED_FIELD_NONE }
+};
+
+/* Names for the positional arguments of specific rules.  The argument
+ * index counts every argument after cred, in the order that sandbox.c
+ * passes them (e.g., the proc argument of a process rule is argument 1).
+ * Any rule's arguments may also be referred to as 'arg1', 'arg2', ...
+ */
+static const struct {
+    const char *rulename;
+    const char *name;
+    int argidx;
+} sandbox_pred_aliases[] = {
+    { "network.socket.open",    "domain",   1 },
+    { "network.socket.open",    "type",     2 },
+    { "network.socket.open",    "protocol", 3 },
+    { "network.socket.rawsock", "domain",   1 },
+    { "network.socket.rawsock", "type",     2 },
+    { "network.socket.rawsock", "protocol", 3 },
+    { "process.fork",           "n",        2 },
+    { "process.nice",           "n",        2 },
+    { "process.ptrace",         "n",        2 },
+    { "process.signal",         "n",        2 },
+    { "process.stopflag",       "n",        2 },
+    { "system.module",          "cmd",      1 },
+    { "system.module",          "loadtype", 2 },
+    { NULL, NULL, 0 }
+};
+
+struct sandbox_pred *
+sandbox_pred_create(int result)
+{
+    struct sandbox_pred *pred = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    pred = kmem_zalloc(sizeof(*pred), KM_SLEEP);
+    pred->result = result;
+
+    SANDBOX_LOG_TRACE_EXIT;
+    return (pred);
+}
+
+/* resolves a field name, as used in sandbox.when(), for the given rule.
+ * Returns 0 on success, 1 if the name is unknown.
+ */
+int
+sandbox_pred_lookupfield(const char *rulename, const char *name,
+        struct sandbox_pred_operand *operand)
+{
+    int error = 0;
+    int i = 0;
+    int argidx = 0;
+    char c = '\0';
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    memset(operand, 0, sizeof(*operand));
+
+    for (i = 0; sandbox_pred_fields[i].name != NULL; i++) {
+        if (strcmp(sandbox_pred_fields[i].name, name) == 0) {
+            operand->field = sandbox_pred_fields[i].field;
+            goto done;
+        }
+    }
+
+    for (i = 0; sandbox_pred_aliases[i].rulename != NULL; i++) {
+        if ((strcmp(sandbox_pred_aliases[i].rulename, rulename) == 0) &&
+                (strcmp(sandbox_pred_aliases[i].name, name) == 0)) {
+            operand->field = SANDBOX_PRED_FIELD_ARG;
+            operand->argidx = sandbox_pred_aliases[i].argidx;
+            goto done;
+        }
+    }
+
+    /* argN */
+    if (strncmp(name, "arg", 3) == 0 && strlen(name) == 4) {
+        c = name[3];
+        if (c >= '1' && c <= '0' + SANDBOX_PRED_MAXARGS) {
+            argidx = c - '0';
+            operand->field = SANDBOX_PRED_FIELD_ARG;
+            operand->argidx = argidx;
+            goto done;
+        }
+    }
+
+    error = 1;
+
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* returns the per-rule name of argument argidx, or NULL if it has none */
+const char *
+sandbox_pred_argname(const char *rulename, int argidx)
+{
+    int i = 0;
+
+    for (i = 0; sandbox_pred_aliases[i].rulename != NULL; i++) {
+        if ((strcmp(sandbox_pred_aliases[i].rulename, rulename) == 0) &&
+                (sandbox_pred_aliases[i].argidx == argidx))
+            return (sandbox_pred_aliases[i].name);
+    }
+
+    return (NULL);
+}
+
+/* returns NULL if pred is full */
+struct sandbox_pred_term *
+sandbox_pred_addterm(struct sandbox_pred *pred, int op,
+        const struct sandbox_pred_operand *lhs)
+{
+    struct sandbox_pred_term *term = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    if (pred->nterms == SANDBOX_PRED_MAXTERMS)
+        goto done;
+
+    term = &pred->terms[pred->nterms++];
+    term->op = op;
+    term->lhs = *lhs;
+
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (term);
+}
+
+/* returns 0 on success, 1 if the term's value set is full */
+int
+sandbox_pred_term_addvalue(struct sandbox_pred_term *term, int64_t value)
+{
+    if (term->nvalues == SANDBOX_PRED_MAXVALUES)
+        return (1);
+
+    term->values[term->nvalues++] = value;
+    return (0);
+}
+
+void
+sandbox_pred_destroy(struct sandbox_pred *pred)
+{
+    SANDBOX_LOG_TRACE_ENTER;
+
+    KASSERT(pred != NULL);
+
+    kmem_free(pred, sizeof(*pred));
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+void
+sandbox_pred_list_destroy(struct sandbox_pred_list *pred_list)
+{
+    struct sandbox_pred *pred = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    while (!SIMPLEQ_EMPTY(pred_list)) {
+        pred = SIMPLEQ_FIRST(pred_list);
+        SIMPLEQ_REMOVE_HEAD(pred_list, pred_next);
+        sandbox_pred_destroy(pred);
+    }
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+void
+sandbox_pred_args_init(struct sandbox_pred_args *args, const char *fmt,
+        va_list ap)
+{
+    const char *c = NULL;
+
+    memset(args, 0, sizeof(*args));
+
+    for (c = fmt; c != NULL && *c != '\0'; c++) {
+        if (args->nargs == SANDBOX_PRED_MAXARGS)
+            break;
+
+        switch (*c) {
+        case 'i':
+            args->isint[args->nargs] = 1;
+            args->ints[args->nargs] = va_arg(ap, lua_Integer);
+            break;
+        case 'p':
+            args->procp = va_arg(ap, struct proc *);
+            args->proclocks = va_arg(ap, int);
+            break;
+        case 'a':
+            args->sockaddr = va_arg(ap, const struct sockaddr *);
+            break;
+        case 'v':
+        case 'o':
+            (void)va_arg(ap, void *);
+            break;
+        default:
+            SANDBOX_LOG_ERROR("unknown format character '%c'\n", *c);
+            return;
+        }
+        args->nargs++;
+    }
+}
+
+/* Sets *val to 1 if p is ancestor or one of its descendants.  The walk up
+ * p_pptr needs proc_lock, which is taken here if the caller holds no
+ * locks; a caller that holds p_lock, which orders after it, must hold it
+ * as well.  Returns 1 if which locks the caller holds is not known.
+ */
+static int
+sandbox_pred_descendant(struct proc *p, int locks, struct proc *ancestor,
+        int64_t *val)
+{
+    switch (locks) {
+    case SANDBOX_PRED_LOCKS_NONE:
+        mutex_enter(proc_lock);
+        break;
+    case SANDBOX_PRED_LOCKS_BOTH:
+        KASSERT(mutex_owned(proc_lock));
+        break;
+    default:
+        return (1);
+    }
+
+    while (p != ancestor && p->p_pid != 0)
+        p = p->p_pptr;
+    *val = (p == ancestor);
+
+    if (locks == SANDBOX_PRED_LOCKS_NONE)
+        mutex_exit(proc_lock);
+
+    return (0);
+}
+
+/* Sets *val to 1 if p has the root directory of the calling process.  The
+ * process's cwdinfo is read under its p_lock, and each root directory
+ * under its cwdinfo's lock.  Returns 1 if which locks the caller holds is
+ * not known.
+ */
+static int
+sandbox_pred_sameroot(struct proc *p, int locks, int64_t *val)
+{
+    struct cwdinfo *cwdi = NULL;
+    struct cwdinfo *mycwdi = curproc->p_cwdi;
+
+    switch (locks) {
+    case SANDBOX_PRED_LOCKS_NONE:
+        mutex_enter(p->p_lock);
+        break;
+    case SANDBOX_PRED_LOCKS_BOTH:
+        KASSERT(mutex_owned(p->p_lock));
+        break;
+    default:
+        return (1);
+    }
+
+    /* cwdi_rdir is NULL for a process that is not chrooted */
+    cwdi = p->p_cwdi;
+    if (cwdi == mycwdi) {
+        *val = 1;
+    } else {
+        /* a chroot() only ever holds the lock of its own cwdinfo */
+        rw_enter(&cwdi->cwdi_lock, RW_READER);
+        rw_enter(&mycwdi->cwdi_lock, RW_READER);
+        *val = (cwdi->cwdi_rdir == mycwdi->cwdi_rdir);
+        rw_exit(&mycwdi->cwdi_lock);
+        rw_exit(&cwdi->cwdi_lock);
+    }
+
+    if (locks == SANDBOX_PRED_LOCKS_NONE)
+        mutex_exit(p->p_lock);
+
+    return (0);
+}
+
+/* Sets *val to 1 if p is confined by at least the sandboxes of cred.  The
+ * process's credentials are read, and held if the caller does not hold
+ * p_lock, under its p_lock.  Returns 1 if which locks the caller holds is
+ * not known.
+ */
+static int
+sandbox_pred_samesandbox(struct proc *p, int locks, kauth_cred_t cred,
+        int64_t *val)
+{
+    kauth_cred_t pcred = NULL;
+
+    switch (locks) {
+    case SANDBOX_PRED_LOCKS_NONE:
+        mutex_enter(p->p_lock);
+        pcred = p->p_cred;
+        kauth_cred_hold(pcred);
+        mutex_exit(p->p_lock);
+        *val = sandbox_cred_inherits(pcred, cred);
+        kauth_cred_free(pcred);
+        break;
+    case SANDBOX_PRED_LOCKS_BOTH:
+        KASSERT(mutex_owned(p->p_lock));
+        *val = sandbox_cred_inherits(p->p_cred, cred);
+        break;
+    default:
+        return (1);
+    }
+
+    return (0);
+}
+
+/* returns 0 and sets *val on success, 1 if the request has no such operand */
+int
+sandbox_pred_operand_get(const struct sandbox_pred_operand *operand,
+        kauth_cred_t cred, const struct sandbox_pred_args *args, int64_t *val)
+{
+    int idx = 0;
+
+    switch (operand->field) {
+    case SANDBOX_PRED_FIELD_ARG:
+        idx = operand->argidx - 1;
+        if (idx < 0 || idx >= args->nargs || !args->isint[idx])
+            return (1);
+        *val = args->ints[idx];
+        break;
+    case SANDBOX_PRED_FIELD_CRED_UID:
+        *val = kauth_cred_getuid(cred);
+        break;
+    case SANDBOX_PRED_FIELD_CRED_EUID:
+        *val = kauth_cred_geteuid(cred);
+        break;
+    case SANDBOX_PRED_FIELD_CRED_SVUID:
+        *val = kauth_cred_getsvuid(cred);
+        break;
+    case SANDBOX_PRED_FIELD_CRED_GID:
+        *val = kauth_cred_getgid(cred);
+        break;
+    case SANDBOX_PRED_FIELD_CRED_EGID:
+        *val = kauth_cred_getegid(cred);
+        break;
+    case SANDBOX_PRED_FIELD_CRED_SVGID:
+        *val = kauth_cred_getsvgid(cred);
+        break;
+    case SANDBOX_PRED_FIELD_PROC_PID:
+        if (args->procp == NULL)
+            return (1);
+        *val = args->procp->p_pid;
+        break;
+    case SANDBOX_PRED_FIELD_PROC_PPID:
+        if (args->procp == NULL)
+            return (1);
+        *val = args->procp->p_ppid;
+        break;
+    case SANDBOX_PRED_FIELD_PROC_NICE:
+        if (args->procp == NULL)
+            return (1);
+        *val = args->procp->p_nice;
+        break;
+    case SANDBOX_PRED_FIELD_PROC_SAMEROOT:
+        if (args->procp == NULL)
+            return (1);
+        return (sandbox_pred_sameroot(args->procp, args->proclocks, val));
+    case SANDBOX_PRED_FIELD_PROC_SAMESANDBOX:
+        if (args->procp == NULL)
+            return (1);
+        return (sandbox_pred_samesandbox(args->procp, args->proclocks, cred,
+                val));
+    case SANDBOX_PRED_FIELD_PROC_DESCENDANT:
+        if (args->procp == NULL)
+            return (1);
+        return (sandbox_pred_descendant(args->procp, args->proclocks,
+                curproc, val));
+    default:
+        return (1);
+    }
+
+    return (0);
+}
+
+static bool
+sandbox_pred_term_eval(const struct sandbox_pred_term *term,
+        kauth_cred_t cred, const struct sandbox_pred_args *args)
+{
+    int64_t lhs = 0;
+    int64_t rhs = 0;
+    int i = 0;
+    bool found = false;
+
+    /* an operand that the request does not have fails the term */
+    if (sandbox_pred_operand_get(&term->lhs, cred, args, &lhs))
+        return (false);
+
+    if (term->rhs.field != SANDBOX_PRED_FIELD_NONE) {
+        if (sandbox_pred_operand_get(&term->rhs, cred, args, &rhs))
+            return (false);
+    } else {
+        if (term->op == SANDBOX_PRED_OP_IN || term->op == SANDBOX_PRED_OP_NOTIN) {
+            for (i = 0; i < term->nvalues; i++) {
+                if (lhs == term->values[i]) {
+                    found = true;
+                    break;
+                }
+            }
+            return (term->op == SANDBOX_PRED_OP_IN ? found : !found);
+        }
+        rhs = term->values[0];
+    }
+
+    switch (term->op) {
+    case SANDBOX_PRED_OP_IN:    return (lhs == rhs);
+    case SANDBOX_PRED_OP_NOTIN: return (lhs != rhs);
+    case SANDBOX_PRED_OP_LT:    return (lhs < rhs);
+    case SANDBOX_PRED_OP_LE:    return (lhs <= rhs);
+    case SANDBOX_PRED_OP_GT:    return (lhs > rhs);
+    case SANDBOX_PRED_OP_GE:    return (lhs >= rhs);
+    default:
+        return (false);
+    }
+}
+
+/* Each predicate on the list must hold; like a list of sandbox.on()
+ * functions, a single failing predicate denies the request.  If they all
+ * hold, the request is allowed if any of them is a sandbox.when(), and
+ * otherwise deferred.
+ */
+int
+sandbox_pred_list_veval(const struct sandbox_pred_list *pred_list,
+        kauth_cred_t cred, const char *fmt, va_list ap)
+{
+    int result = KAUTH_RESULT_DEFER;
+    int i = 0;
+    const struct sandbox_pred *pred = NULL;
+    struct sandbox_pred_args args;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    sandbox_pred_args_init(&args, fmt, ap);
+
+    SIMPLEQ_FOREACH(pred, pred_list, pred_next) {
+        for (i = 0; i < pred->nterms; i++) {
+            if (!sandbox_pred_term_eval(&pred->terms[i], cred, &args)) {
+                result = KAUTH_RESULT_DENY;
+                goto done;
+            }
+        }
+        if (pred->result == KAUTH_RESULT_ALLOW)
+            result = KAUTH_RESULT_ALLOW;
+    }
+
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (result);
+}
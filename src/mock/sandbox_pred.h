@@ -0,0 +1,152 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SANDBOX_PRED_H_
+#define _SANDBOX_PRED_H_
+
+#include <msys/systm.h>
+#include <msys/queue.h>
+#include <msys/kauth.h>
+#include <msys/proc.h>
+
+/* A predicate is the compiled form of a sandbox.when() or sandbox.require()
+ * table.  It is a conjunction of terms, each of which compares an operand
+ * taken from the request (a positional integer argument, a cred field, or
+ * a proc field) against either a set of constants or another operand.
+ * Predicates are fixed-size so that evaluating them never allocates or
+ * touches Lua.
+ */
+
+#define SANDBOX_PRED_MAXTERMS   8
+#define SANDBOX_PRED_MAXVALUES  8
+#define SANDBOX_PRED_MAXARGS    4
+
+/* operand fields */
+#define SANDBOX_PRED_FIELD_NONE         0
+#define SANDBOX_PRED_FIELD_ARG          1   /* integer argument 'argidx' */
+#define SANDBOX_PRED_FIELD_CRED_UID     2
+#define SANDBOX_PRED_FIELD_CRED_EUID    3
+#define SANDBOX_PRED_FIELD_CRED_SVUID   4
+#define SANDBOX_PRED_FIELD_CRED_GID     5
+#define SANDBOX_PRED_FIELD_CRED_EGID    6
+#define SANDBOX_PRED_FIELD_CRED_SVGID   7
+#define SANDBOX_PRED_FIELD_PROC_PID     8
+#define SANDBOX_PRED_FIELD_PROC_PPID    9
+#define SANDBOX_PRED_FIELD_PROC_NICE    10
+/* relations of the proc to the calling process; 1 if they hold, else 0 */
+#define SANDBOX_PRED_FIELD_PROC_SAMEROOT    11  /* same root directory */
+#define SANDBOX_PRED_FIELD_PROC_SAMESANDBOX 12  /* confined by at least the
+                                                   caller's sandboxes */
+#define SANDBOX_PRED_FIELD_PROC_DESCENDANT  13  /* the caller or one of its
+                                                   descendants */
+#define SANDBOX_PRED_NFIELDS            14
+
+/* term operators */
+#define SANDBOX_PRED_OP_IN      0   /* lhs equals one of values (or rhs) */
+#define SANDBOX_PRED_OP_NOTIN   1   /* lhs equals none of values (or rhs) */
+#define SANDBOX_PRED_OP_LT      2
+#define SANDBOX_PRED_OP_LE      3
+#define SANDBOX_PRED_OP_GT      4
+#define SANDBOX_PRED_OP_GE      5
+
+struct sandbox_pred_operand {
+    int field;      /* SANDBOX_PRED_FIELD_* */
+    int argidx;     /* 1-based; only for SANDBOX_PRED_FIELD_ARG */
+};
+
+struct sandbox_pred_term {
+    int op;
+    struct sandbox_pred_operand lhs;
+    /* if rhs.field is SANDBOX_PRED_FIELD_NONE, lhs is compared against
+     * values; otherwise, against rhs
+     */
+    struct sandbox_pred_operand rhs;
+    int nvalues;
+    int64_t values[SANDBOX_PRED_MAXVALUES];
+};
+
+struct sandbox_pred {
+    int result;     /* if every term holds: KAUTH_RESULT_ALLOW for
+                       sandbox.when(), KAUTH_RESULT_DEFER for
+                       sandbox.require() */
+    int nterms;
+    struct sandbox_pred_term terms[SANDBOX_PRED_MAXTERMS];
+    SIMPLEQ_ENTRY(sandbox_pred) pred_next;
+};
+
+/* The locks that the caller of a process-scope request holds on the
+ * process, passed after it for the 'p' format character.  The relations
+ * of the process to the caller read fields under proc_lock or its p_lock;
+ * they take the locks when the caller holds none, and are not operands of
+ * the request when which are held depends on the caller.
+ */
+#define SANDBOX_PRED_LOCKS_NONE     0   /* neither */
+#define SANDBOX_PRED_LOCKS_BOTH     1   /* proc_lock and p_lock */
+#define SANDBOX_PRED_LOCKS_UNKNOWN  2   /* either, or none */
+
+/* the request's arguments, unpacked once from the va_list */
+struct sandbox_pred_args {
+    int nargs;
+    int isint[SANDBOX_PRED_MAXARGS];
+    int64_t ints[SANDBOX_PRED_MAXARGS];
+    struct proc *procp;
+    int proclocks;  /* SANDBOX_PRED_LOCKS_* */
+    const struct sockaddr *sockaddr;
+};
+
+/* struct sandbox_pred_list { }; */
+SIMPLEQ_HEAD(sandbox_pred_list, sandbox_pred);
+
+struct sandbox_pred * sandbox_pred_create(int result);
+
+int sandbox_pred_lookupfield(const char *rulename, const char *name,
+        struct sandbox_pred_operand *operand);
+
+const char * sandbox_pred_argname(const char *rulename, int argidx);
+
+struct sandbox_pred_term * sandbox_pred_addterm(struct sandbox_pred *pred,
+        int op, const struct sandbox_pred_operand *lhs);
+
+int sandbox_pred_term_addvalue(struct sandbox_pred_term *term, int64_t value);
+
+void sandbox_pred_destroy(struct sandbox_pred *pred);
+
+/* does not destroy pred_list head, just the elements */
+void sandbox_pred_list_destroy(struct sandbox_pred_list *pred_list);
+
+void sandbox_pred_args_init(struct sandbox_pred_args *args, const char *fmt,
+        va_list ap);
+
+int sandbox_pred_operand_get(const struct sandbox_pred_operand *operand,
+        kauth_cred_t cred, const struct sandbox_pred_args *args, int64_t *val);
+
+int sandbox_pred_list_veval(const struct sandbox_pred_list *pred_list,
+        kauth_cred_t cred, const char *fmt, va_list ap);
+
+#endif /* !_SANDBOX_PRED_H_ */
@@ -30,7 +30,11 @@
 #include <msys/systm.h>
 #include <msys/queue.h>
 #include <msys/kmem.h>
+#include <msys/kauth.h>
+#include <msys/atomic.h>
+#include <msys/timevar.h>
 
+#include "sandbox_objcache.h"
 #include "sandbox_ref.h"
 #include "sandbox_log.h"
 
@@ -41,8 +45,10 @@ sandbox_ref_create(int value)
 
     SANDBOX_LOG_TRACE_ENTER;
 
-    ref = kmem_zalloc(sizeof(*ref), KM_SLEEP);
+    ref = sandbox_objcache_get(SANDBOX_OBJCACHE_REF);
     ref->value = value;
+    ref->nargs = SANDBOX_REF_NARGS_ALL;
+    SIMPLEQ_INIT(&ref->members);
 
     SANDBOX_LOG_TRACE_EXIT;
     return (ref);
@@ -55,7 +61,12 @@ sandbox_ref_destroy(struct sandbox_ref *ref)
 
     KASSERT(ref != NULL);
 
-    kmem_free(ref, sizeof(*ref));
+    if (ref->prog != NULL)
+        sandbox_expr_destroy(ref->prog);
+    if (ref->memo != NULL)
+        sandbox_memo_destroy(ref->memo);
+    sandbox_ref_list_destroy(&ref->members);
+    sandbox_objcache_put(SANDBOX_OBJCACHE_REF, ref);
 
     SANDBOX_LOG_TRACE_EXIT;
 }
@@ -76,3 +87,147 @@ sandbox_ref_list_destroy(struct sandbox_ref_list *ref_list)
 
     SANDBOX_LOG_TRACE_EXIT;
 }
+
+int sandbox_refstats = 0;
+
+/* monotonic time in nanoseconds */
+uint64_t
+sandbox_ref_clock(void)
+{
+    struct timespec ts;
+
+    nanouptime(&ts);
+    return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* counts one evaluation of ref that returned result and took nsecs */
+void
+sandbox_ref_record(struct sandbox_ref *ref, int result, uint64_t nsecs)
+{
+    atomic_inc_64(&ref->stats.nevals);
+    if (result == KAUTH_RESULT_DENY)
+        atomic_inc_64(&ref->stats.ndenies);
+    atomic_add_64(&ref->stats.nsecs, nsecs);
+}
+
+/*
+ * Reordering
+ *
+ * A dispatcher stops at the first function that denies, so the expected
+ * cost of an order is the sum over its functions of each one's mean cost
+ * times the chance that every function before it allowed.  Assuming the
+ * functions deny independently, that is least when they are sorted by
+ * cost / deny rate.  Deny rates are fixed point, out of
+ * SANDBOX_REF_RATEONE.
+ */
+
+#define SANDBOX_REF_RATEONE     1024
+#define SANDBOX_REF_MAXMEMBERS  32
+
+struct sandbox_ref_estimate {
+    struct sandbox_ref *ref;
+    uint64_t cost;          /* mean nsecs per evaluation */
+    uint64_t denyrate;
+};
+
+/* true if a should run before b */
+static int
+sandbox_ref_before(const struct sandbox_ref_estimate *a,
+        const struct sandbox_ref_estimate *b)
+{
+    /* a.cost / a.denyrate < b.cost / b.denyrate, where a function that
+     * never denies goes last
+     */
+    if (a->denyrate == 0 || b->denyrate == 0) {
+        if (a->denyrate != b->denyrate)
+            return (a->denyrate != 0);
+        return (a->cost < b->cost);
+    }
+    return (a->cost * b->denyrate < b->cost * a->denyrate);
+}
+
+static uint64_t
+sandbox_ref_expectedcost(struct sandbox_ref_estimate **order, int n)
+{
+    int i = 0;
+    uint64_t cost = 0;
+    uint64_t pass = SANDBOX_REF_RATEONE;
+
+    for (i = 0; i < n; i++) {
+        cost += order[i]->cost * pass / SANDBOX_REF_RATEONE;
+        pass = pass * (SANDBOX_REF_RATEONE - order[i]->denyrate) /
+            SANDBOX_REF_RATEONE;
+    }
+
+    return (cost);
+}
+
+/* Sorts the dispatcher's SANDBOX_REF_UNORDERED members by cost / deny rate.
+ * The other members keep their positions.  Also updates the dispatcher's
+ * estimate of the time the new order saves over the original one.  The
+ * caller must serialize this with evaluations of the dispatcher.
+ */
+void
+sandbox_ref_reorder(struct sandbox_ref *dispatcher)
+{
+    int i = 0;
+    int j = 0;
+    int n = 0;
+    struct sandbox_ref *ref = NULL;
+    struct sandbox_ref_estimate est[SANDBOX_REF_MAXMEMBERS];
+    struct sandbox_ref_estimate *cur[SANDBOX_REF_MAXMEMBERS];
+    struct sandbox_ref_estimate *orig[SANDBOX_REF_MAXMEMBERS];
+    struct sandbox_ref_estimate *tmp = NULL;
+    uint64_t origcost = 0;
+    uint64_t newcost = 0;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    SIMPLEQ_FOREACH(ref, &dispatcher->members, ref_next) {
+        /* too many to sort on the stack, or not enough data yet */
+        if (n == SANDBOX_REF_MAXMEMBERS || ref->stats.nevals == 0)
+            goto done;
+        est[n].ref = ref;
+        est[n].cost = ref->stats.nsecs / ref->stats.nevals;
+        est[n].denyrate = ref->stats.ndenies * SANDBOX_REF_RATEONE /
+            ref->stats.nevals;
+        cur[n] = &est[n];
+        orig[n] = &est[n];
+        n++;
+    }
+
+    /* insertion sort; an ordered member is never moved, nor moved past */
+    for (i = 1; i < n; i++) {
+        if (!(cur[i]->ref->flags & SANDBOX_REF_UNORDERED))
+            continue;
+        for (j = i; j > 0; j--) {
+            if (!(cur[j - 1]->ref->flags & SANDBOX_REF_UNORDERED) ||
+                    !sandbox_ref_before(cur[j], cur[j - 1]))
+                break;
+            tmp = cur[j - 1];
+            cur[j - 1] = cur[j];
+            cur[j] = tmp;
+        }
+    }
+
+    /* and by registration */
+    for (i = 1; i < n; i++) {
+        for (j = i; j > 0 && orig[j]->ref->index < orig[j - 1]->ref->index;
+                j--) {
+            tmp = orig[j - 1];
+            orig[j - 1] = orig[j];
+            orig[j] = tmp;
+        }
+    }
+
+    SIMPLEQ_INIT(&dispatcher->members);
+    for (i = 0; i < n; i++)
+        SIMPLEQ_INSERT_TAIL(&dispatcher->members, cur[i]->ref, ref_next);
+
+    origcost = sandbox_ref_expectedcost(orig, n);
+    newcost = sandbox_ref_expectedcost(cur, n);
+    dispatcher->saving = origcost > newcost ? origcost - newcost : 0;
+
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+}
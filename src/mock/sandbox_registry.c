@@ -0,0 +1,366 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <msys/systm.h>
+#include <msys/kmem.h>
+#include <msys/mutex.h>
+#include <msys/atomic.h>
+#include <msys/errno.h>
+
+#include "sandbox.h"
+#include "sandbox_registry.h"
+
+#include "sandbox_log.h"
+
+#define SANDBOX_REGISTRY_FNV_OFFSET 0xcbf29ce484222325ULL
+#define SANDBOX_REGISTRY_FNV_PRIME  0x100000001b3ULL
+
+LIST_HEAD(sandbox_regent_list, sandbox_regent);
+
+static struct {
+    kmutex_t lock;
+    struct sandbox_regent_list buckets[SANDBOX_REGISTRY_NBUCKETS];
+    uint64_t nhits;
+    uint64_t nmisses;
+} sandbox_registry;
+
+/* policies stacked on different sandboxes land in different buckets */
+static struct sandbox_regent_list *
+sandbox_registry_bucket(uint64_t id, const struct sandbox *below)
+{
+    uint64_t h = id ^ ((uint64_t)(uintptr_t)below * SANDBOX_REGISTRY_FNV_PRIME);
+
+    return (&sandbox_registry.buckets[(h ^ (h >> 32)) %
+            SANDBOX_REGISTRY_NBUCKETS]);
+}
+
+static int
+sandbox_registry_match(const struct sandbox_regent *regent, uint64_t id,
+        const char *script, const char *params, size_t paramslen, int flags,
+        const struct sandbox *below)
+{
+    return (regent->id == id && regent->flags == flags &&
+            SLIST_NEXT(regent->sandbox, sandbox_next) == below &&
+            strcmp(regent->script, script) == 0 &&
+            regent->paramslen == paramslen &&
+            (paramslen == 0 || memcmp(regent->params, params, paramslen) == 0));
+}
+
+static void
+sandbox_registry_freeregent(struct sandbox_regent *regent)
+{
+    kmem_free(regent->script, regent->scriptlen);
+    if (regent->params != NULL)
+        kmem_free(regent->params, regent->paramslen);
+    kmem_free(regent, sizeof(*regent));
+}
+
+void
+sandbox_registry_init(void)
+{
+    int i = 0;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    mutex_init(&sandbox_registry.lock, MUTEX_DEFAULT, IPL_NONE);
+    for (i = 0; i < SANDBOX_REGISTRY_NBUCKETS; i++)
+        LIST_INIT(&sandbox_registry.buckets[i]);
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+/* drops the pins; the sandboxes of processes still in them stay live */
+void
+sandbox_registry_fini(void)
+{
+    int i = 0;
+    struct sandbox_regent *regent = NULL;
+    struct sandbox *sandbox = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    for (i = 0; i < SANDBOX_REGISTRY_NBUCKETS; i++) {
+        do {
+            sandbox = NULL;
+            mutex_enter(&sandbox_registry.lock);
+            LIST_FOREACH(regent, &sandbox_registry.buckets[i], regent_next) {
+                if (regent->pinned) {
+                    regent->pinned = 0;
+                    sandbox = regent->sandbox;
+                    break;
+                }
+            }
+            mutex_exit(&sandbox_registry.lock);
+            if (sandbox != NULL)
+                sandbox_destroy(sandbox);
+        } while (sandbox != NULL);
+    }
+    mutex_destroy(&sandbox_registry.lock);
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+/* params, the packed parameters of a template, may be NULL */
+uint64_t
+sandbox_registry_id(const char *script, const char *params,
+        size_t paramslen, int flags)
+{
+    int b = 0;
+    size_t i = 0;
+    uint64_t h = SANDBOX_REGISTRY_FNV_OFFSET;
+    const char *c = NULL;
+
+    for (b = 0; b < (int)sizeof(flags); b++) {
+        h ^= ((u_int)flags >> (b * 8)) & 0xff;
+        h *= SANDBOX_REGISTRY_FNV_PRIME;
+    }
+    for (c = script; *c != '\0'; c++) {
+        h ^= (u_char)*c;
+        h *= SANDBOX_REGISTRY_FNV_PRIME;
+    }
+    for (i = 0; i < paramslen; i++) {
+        h ^= (u_char)params[i];
+        h *= SANDBOX_REGISTRY_FNV_PRIME;
+    }
+
+    return (h);
+}
+
+/* returns the live sandbox made from the policy on top of below, with a
+ * reference for the caller, or NULL if there is none
+ */
+struct sandbox *
+sandbox_registry_lookup(uint64_t id, const char *script,
+        const char *params, size_t paramslen, int flags,
+        const struct sandbox *below)
+{
+    struct sandbox_regent *regent = NULL;
+    struct sandbox *sandbox = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    mutex_enter(&sandbox_registry.lock);
+    LIST_FOREACH(regent, sandbox_registry_bucket(id, below), regent_next) {
+        if (sandbox_registry_match(regent, id, script, params, paramslen,
+                    flags, below)) {
+            sandbox = regent->sandbox;
+            sandbox_hold(sandbox);
+            break;
+        }
+    }
+    if (sandbox != NULL)
+        sandbox_registry.nhits++;
+    else
+        sandbox_registry.nmisses++;
+    mutex_exit(&sandbox_registry.lock);
+
+    SANDBOX_LOG_TRACE_EXIT;
+    return (sandbox);
+}
+
+/* Registers a sandbox just made from the policy; the sandbox's
+ * sandbox_next must already point to the sandbox it is stacked on.  If
+ * another process registered the same policy in the meantime, the new
+ * sandbox is destroyed and the other one returned, with a reference for
+ * the caller.
+ */
+struct sandbox *
+sandbox_registry_insert(struct sandbox *sandbox, uint64_t id,
+        const char *script, const char *params, size_t paramslen, int flags)
+{
+    const struct sandbox *below = SLIST_NEXT(sandbox, sandbox_next);
+    struct sandbox_regent_list *bucket = NULL;
+    struct sandbox_regent *regent = NULL;
+    struct sandbox_regent *other = NULL;
+    struct sandbox *shared = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    KASSERT(sandbox->regent == NULL);
+
+    regent = kmem_zalloc(sizeof(*regent), KM_SLEEP);
+    regent->id = id;
+    regent->flags = flags;
+    regent->scriptlen = strlen(script) + 1;
+    regent->script = kmem_alloc(regent->scriptlen, KM_SLEEP);
+    memcpy(regent->script, script, regent->scriptlen);
+    if (paramslen > 0) {
+        regent->params = kmem_alloc(paramslen, KM_SLEEP);
+        memcpy(regent->params, params, paramslen);
+        regent->paramslen = paramslen;
+    }
+    regent->sandbox = sandbox;
+
+    bucket = sandbox_registry_bucket(id, below);
+    mutex_enter(&sandbox_registry.lock);
+    LIST_FOREACH(other, bucket, regent_next) {
+        if (sandbox_registry_match(other, id, script, params, paramslen,
+                    flags, below))
+            break;
+    }
+    if (other == NULL) {
+        LIST_INSERT_HEAD(bucket, regent, regent_next);
+        sandbox->regent = regent;
+    } else {
+        shared = other->sandbox;
+        sandbox_hold(shared);
+    }
+    mutex_exit(&sandbox_registry.lock);
+
+    if (shared != NULL) {
+        SANDBOX_LOG_DEBUG("lost the race to register policy %016llx\n",
+                (unsigned long long)id);
+        sandbox_registry_freeregent(regent);
+        sandbox_destroy(sandbox);
+        sandbox = shared;
+    }
+
+    SANDBOX_LOG_TRACE_EXIT;
+    return (sandbox);
+}
+
+/* Drops a reference to a registered sandbox, as sandbox_destroy() does,
+ * and returns the number left.  The last one is dropped with the registry
+ * locked, so that a lookup cannot take a new reference to a sandbox that
+ * is being destroyed.
+ */
+u_int
+sandbox_registry_release(struct sandbox *sandbox)
+{
+    u_int refcnt = 0;
+    struct sandbox_regent *regent = sandbox->regent;
+
+    mutex_enter(&sandbox_registry.lock);
+    refcnt = atomic_dec_uint_nv(&sandbox->refcnt);
+    if (refcnt == 0) {
+        KASSERT(!regent->pinned);
+        LIST_REMOVE(regent, regent_next);
+        sandbox->regent = NULL;
+    }
+    mutex_exit(&sandbox_registry.lock);
+
+    if (refcnt == 0)
+        sandbox_registry_freeregent(regent);
+
+    return (refcnt);
+}
+
+/* Keeps a registered sandbox that is stacked on nothing live with a
+ * reference of the registry's own, so that sandbox_registry_lookupid()
+ * can find it.  Returns EEXIST if another policy with the same id is
+ * pinned; pinning a sandbox twice is not an error.
+ */
+int
+sandbox_registry_pin(struct sandbox *sandbox)
+{
+    int error = 0;
+    struct sandbox_regent *regent = sandbox->regent;
+    struct sandbox_regent *other = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    KASSERT(regent != NULL);
+    KASSERT(SLIST_NEXT(sandbox, sandbox_next) == NULL);
+
+    mutex_enter(&sandbox_registry.lock);
+    LIST_FOREACH(other, sandbox_registry_bucket(regent->id, NULL),
+            regent_next) {
+        if (other->id == regent->id && other->pinned)
+            break;
+    }
+    if (other == NULL) {
+        regent->pinned = 1;
+        sandbox_hold(sandbox);
+    } else if (other != regent) {
+        error = EEXIST;
+    }
+    mutex_exit(&sandbox_registry.lock);
+
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* drops the registry's reference to the sandbox pinned with the id;
+ * returns ENOENT if there is none
+ */
+int
+sandbox_registry_unpin(uint64_t id)
+{
+    struct sandbox_regent *regent = NULL;
+    struct sandbox *sandbox = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    mutex_enter(&sandbox_registry.lock);
+    LIST_FOREACH(regent, sandbox_registry_bucket(id, NULL), regent_next) {
+        if (regent->id == id && regent->pinned) {
+            regent->pinned = 0;
+            sandbox = regent->sandbox;
+            break;
+        }
+    }
+    mutex_exit(&sandbox_registry.lock);
+
+    if (sandbox != NULL)
+        sandbox_destroy(sandbox);
+
+    SANDBOX_LOG_TRACE_EXIT;
+    return (sandbox != NULL ? 0 : ENOENT);
+}
+
+/* returns the sandbox pinned with the id, with a reference for the caller,
+ * or NULL if there is none
+ */
+struct sandbox *
+sandbox_registry_lookupid(uint64_t id)
+{
+    struct sandbox_regent *regent = NULL;
+    struct sandbox *sandbox = NULL;
+
+    mutex_enter(&sandbox_registry.lock);
+    LIST_FOREACH(regent, sandbox_registry_bucket(id, NULL), regent_next) {
+        if (regent->id == id && regent->pinned) {
+            sandbox = regent->sandbox;
+            sandbox_hold(sandbox);
+            break;
+        }
+    }
+    mutex_exit(&sandbox_registry.lock);
+
+    return (sandbox);
+}
+
+void
+sandbox_registry_stats(uint64_t *nhits, uint64_t *nmisses)
+{
+    mutex_enter(&sandbox_registry.lock);
+    *nhits = sandbox_registry.nhits;
+    *nmisses = sandbox_registry.nmisses;
+    mutex_exit(&sandbox_registry.lock);
+}
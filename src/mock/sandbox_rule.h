@@ -51,6 +51,8 @@ struct sandbox_rule {
 int sandbox_rule_isvnode(const struct sandbox_rule *rule);
 int sandbox_rule_size(const struct sandbox_rule *rule);
 int sandbox_rule_initfromstring(const char *s, struct sandbox_rule *rule);
+int sandbox_rule_initfrombuf(const char *s, struct sandbox_rule *rule,
+        char (*buf)[SANDBOX_RULE_MAXNAMELEN]);
 void sandbox_rule_freenames(struct sandbox_rule *rule);
 
 #endif /* !_SANDBOX_RULE_H_*/
@@ -30,9 +30,13 @@
 #ifndef _SANDBOX_RULESET_H_
 #define _SANDBOX_RULESET_H_
 
+#include <msys/types.h>
 #include <msys/queue.h>
 
+#include "sandbox_addr.h"
+#include "sandbox_arena.h"
 #include "sandbox_path.h"
+#include "sandbox_pred.h"
 #include "sandbox_ref.h"
 #include "sandbox_rule.h"
 
@@ -44,6 +48,24 @@ TAILQ_HEAD(sandbox_rulelist, sandbox_rulenode);
 #define SANDBOX_RULETYPE_WHITELIST (1L << 1)
 #define SANDBOX_RULETYPE_BLACKLIST (1L << 2)
 #define SANDBOX_RULETYPE_FUNCTION  (1L << 3)
+#define SANDBOX_RULETYPE_PREDICATE (1L << 4)
+#define SANDBOX_RULETYPE_ADDRALLOW (1L << 5)
+#define SANDBOX_RULETYPE_ADDRDENY  (1L << 6)
+
+/* the kauth scopes that a ruleset decides requests in */
+#define SANDBOX_SCOPE_SYSTEM    (1 << 0)
+#define SANDBOX_SCOPE_PROCESS   (1 << 1)
+#define SANDBOX_SCOPE_NETWORK   (1 << 2)
+#define SANDBOX_SCOPE_MACHDEP   (1 << 3)
+#define SANDBOX_SCOPE_DEVICE    (1 << 4)
+#define SANDBOX_SCOPE_VNODE     (1 << 5)
+#define SANDBOX_NSCOPES         6
+#define SANDBOX_SCOPE_ALL       ((1 << SANDBOX_NSCOPES) - 1)
+
+/* a rulenode's sampling rate until its ruleset is sealed, when it takes its
+ * parent's
+ */
+#define SANDBOX_SAMPLE_INHERIT  (-1)
 
 struct sandbox_rulenode {
     char name[SANDBOX_RULE_MAXNAMELEN];
@@ -53,13 +75,56 @@ struct sandbox_rulenode {
     struct sandbox_path_list whitelist;
     struct sandbox_path_list blacklist;
     struct sandbox_ref_list     funclist;
+    struct sandbox_pred_list    predlist;
+    struct sandbox_addr_set     *addrallow;
+    struct sandbox_addr_set     *addrdeny;
+    int sampledeny;     /* of the requests the node decides, the event */
+    int sampleallow;    /* ring records 1 in sampledeny of those denied
+                           and 1 in sampleallow of those allowed; 0 for
+                           none */
+    uint32_t id;        /* the node's index, once the ruleset is sealed */
     TAILQ_ENTRY(sandbox_rulenode) node_next; /* link for sibling list; */
     struct sandbox_rulelist children;
 };
 
+/* The index of a sealed ruleset keeps what a search reads of each rulenode
+ * -- its name, type, value and children -- in a compact header, so that a
+ * search touches a few small arrays rather than the rulenodes themselves.
+ * Headers are stored breadth first, so a node's children are contiguous
+ * and, like the children lists, sorted by name; a search finds each child
+ * by binary search.  The names are packed, in the same order, into one
+ * string table.  hot[i] is the header of the rulenode cold[i].
+ */
+struct sandbox_rulehot {
+    uint32_t name;          /* offset of the name in names */
+    uint32_t children;      /* index of the first child */
+    uint32_t nchildren;
+    uint8_t type;
+    int8_t value;
+};
+
+struct sandbox_ruleindex {
+    struct sandbox_rulehot *hot;
+    struct sandbox_rulenode **cold;
+    size_t nnodes;
+    char *names;
+    size_t nameslen;
+};
+
+#define SANDBOX_RULESET_COLD(set, hotp) \
+    ((set)->index->cold[(hotp) - (set)->index->hot])
+
 struct sandbox_ruleset {
     /* TODO: include lock */
     struct sandbox_rulenode *root;
+    struct sandbox_arena nodes; /* every rulenode, the root first */
+    struct sandbox_ruleindex *index;    /* once sealed */
+};
+
+/* a rule for sandbox_ruleset_insertbulk() to allow or deny */
+struct sandbox_ruleentry {
+    struct sandbox_rule rule;
+    int value;      /* KAUTH_RESULT_{ALLOW,DENY,DEFER} */
 };
 
 struct sandbox_ruleset * sandbox_ruleset_create(int allow);
@@ -68,10 +133,46 @@ int sandbox_ruleset_insert(struct sandbox_ruleset *set,
         const struct sandbox_rule *rule, int type,
         int value, struct sandbox_path_list *paths);
 
+int sandbox_ruleset_insertref(struct sandbox_ruleset *set,
+        const struct sandbox_rule *rule, struct sandbox_ref *ref);
+
+int sandbox_ruleset_insertpred(struct sandbox_ruleset *set,
+        const struct sandbox_rule *rule, struct sandbox_pred *pred);
+
+int sandbox_ruleset_insertaddrs(struct sandbox_ruleset *set,
+        const struct sandbox_rule *rule, int type,
+        struct sandbox_addr_set *addrs);
+
+int sandbox_ruleset_insertsampling(struct sandbox_ruleset *set,
+        const struct sandbox_rule *rule, int deny, int allow);
+
+int sandbox_ruleset_insertbulk(struct sandbox_ruleset *set,
+        const struct sandbox_ruleentry *entries, size_t n);
+
+typedef void (*sandbox_ruleset_visit_t)(struct sandbox_rulenode *node,
+        const char *rulename, void *arg);
+
+void sandbox_ruleset_foreach(struct sandbox_ruleset *set,
+        sandbox_ruleset_visit_t visit, void *arg);
+
+void sandbox_rulenode_removeref(struct sandbox_rulenode *node,
+        struct sandbox_ref *ref);
+
+void sandbox_rulenode_demoteref(struct sandbox_rulenode *node,
+        struct sandbox_ref *ref, int value);
+
+int sandbox_ruleset_scopes(const struct sandbox_ruleset *set);
+
 const struct sandbox_rulenode *
 sandbox_ruleset_search(const struct sandbox_ruleset *set,
         const struct sandbox_rule *rule);
 
+void sandbox_ruleset_seal(struct sandbox_ruleset *set);
+
+const struct sandbox_rulehot *
+sandbox_ruleset_searchhot(const struct sandbox_ruleset *set,
+        const struct sandbox_rule *rule);
+
 void sandbox_ruleset_destroy(struct sandbox_ruleset *set);
 
 #endif /* !_SANDBOX_RULESET_H_ */
@@ -0,0 +1,325 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <msys/systm.h>
+#include <msys/atomic.h>
+#include <msys/errno.h>
+#include <msys/kmem.h>
+#include <msys/mutex.h>
+#include <msys/proc.h>
+#include <msys/timevar.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#include "sandbox_trace.h"
+
+#include "sandbox_log.h"
+
+#define SANDBOX_TRACE_MASK  (SANDBOX_TRACE_NRECS - 1)
+
+#define MIN(a, b)   (((a) < (b)) ? (a) : (b))
+
+/* the length modifiers of the conversions that log calls use */
+#define SANDBOX_TRACE_LMOD_INT      0
+#define SANDBOX_TRACE_LMOD_LONG     1
+#define SANDBOX_TRACE_LMOD_LLONG    2
+#define SANDBOX_TRACE_LMOD_SIZE     3
+#define SANDBOX_TRACE_LMOD_INTMAX   4
+
+struct sandbox_tracering {
+    volatile u_int head;    /* records ever written */
+    u_int tail;             /* records read or lost, under
+                               sandbox_tracelock */
+    struct sandbox_tracerec *recs;
+};
+
+int sandbox_tracelevels[SANDBOX_TRACE_NSUBSYS] = {
+    [SANDBOX_TRACE_CORE] = SANDBOX_LOG_LEVEL_WARN,
+    [SANDBOX_TRACE_SECMODEL] = SANDBOX_LOG_LEVEL_WARN,
+    [SANDBOX_TRACE_LUA] = SANDBOX_LOG_LEVEL_WARN,
+    [SANDBOX_TRACE_DEVICE] = SANDBOX_LOG_LEVEL_WARN,
+    [SANDBOX_TRACE_VNODE] = SANDBOX_LOG_LEVEL_WARN,
+};
+
+/* indexed by level */
+static const char sandbox_trace_levelchars[] = "-EWIDT";
+
+/* also print records to stdout */
+static int sandbox_traceconsole = 0;
+
+/* NULL until sandbox_trace_init() and after sandbox_trace_fini() */
+static struct sandbox_tracering *sandbox_tracering = NULL;
+static kmutex_t sandbox_tracelock;
+
+static struct sandbox_tracesite *sandbox_tracesites[SANDBOX_TRACE_MAXSITES];
+static u_int sandbox_tracensites = 0;
+
+/* gives the site an id, or 0 once the ids run out */
+static uint32_t
+sandbox_trace_register(struct sandbox_tracesite *site)
+{
+    u_int id = 0;
+
+    if (sandbox_tracensites >= SANDBOX_TRACE_MAXSITES - 1)
+        return (0);
+
+    id = atomic_inc_uint_nv(&sandbox_tracensites);
+    sandbox_tracesites[id] = site;
+    membar_producer();
+    (void)atomic_cas_32(&site->id, 0, id);
+    return (site->id);
+}
+
+static uint64_t
+sandbox_trace_arg(int lmod, int issigned, va_list *ap)
+{
+    switch (lmod) {
+    case SANDBOX_TRACE_LMOD_LONG:
+        return (issigned ? (uint64_t)va_arg(*ap, long) :
+                (uint64_t)va_arg(*ap, u_long));
+    case SANDBOX_TRACE_LMOD_LLONG:
+        return (issigned ? (uint64_t)va_arg(*ap, long long) :
+                (uint64_t)va_arg(*ap, unsigned long long));
+    case SANDBOX_TRACE_LMOD_SIZE:
+        return (issigned ? (uint64_t)va_arg(*ap, ssize_t) :
+                (uint64_t)va_arg(*ap, size_t));
+    case SANDBOX_TRACE_LMOD_INTMAX:
+        return (issigned ? (uint64_t)va_arg(*ap, intmax_t) :
+                (uint64_t)va_arg(*ap, uintmax_t));
+    default:
+        return (issigned ? (uint64_t)va_arg(*ap, int) :
+                (uint64_t)va_arg(*ap, u_int));
+    }
+}
+
+/* Copies the arguments of a log call into its record, by the conversions
+ * of its format.  Encoding stops at the first conversion that it does not
+ * know, which the reader does not know either.
+ */
+static void
+sandbox_trace_encode(struct sandbox_tracerec *rec, const char *fmt,
+        va_list ap)
+{
+    int n = 0;
+    int lmod = 0;
+    size_t len = 0;
+    size_t off = 0;
+    const char *c = NULL;
+    const char *str = NULL;
+    va_list aq;
+
+    /* ap may be an array, which cannot be passed by address */
+    va_copy(aq, ap);
+    for (c = fmt; *c != '\0' && n < SANDBOX_TRACE_MAXARGS; c++) {
+        if (*c != '%')
+            continue;
+
+        /* flags, width and precision */
+        for (c++; *c != '\0' && strchr("-+ #0123456789.", *c) != NULL; c++)
+            continue;
+
+        lmod = SANDBOX_TRACE_LMOD_INT;
+        for (;; c++) {
+            if (*c == 'l')
+                lmod = (lmod == SANDBOX_TRACE_LMOD_LONG) ?
+                    SANDBOX_TRACE_LMOD_LLONG : SANDBOX_TRACE_LMOD_LONG;
+            else if (*c == 'q')
+                lmod = SANDBOX_TRACE_LMOD_LLONG;
+            else if (*c == 'z')
+                lmod = SANDBOX_TRACE_LMOD_SIZE;
+            else if (*c == 'j')
+                lmod = SANDBOX_TRACE_LMOD_INTMAX;
+            else if (*c != 'h')
+                break;
+        }
+
+        switch (*c) {
+        case '%':
+            break;
+        case 's':
+            str = va_arg(aq, const char *);
+            if (str == NULL)
+                str = "(null)";
+            len = strnlen(str, SANDBOX_TRACE_STRLEN - 1 - off);
+            memcpy(rec->strs + off, str, len);
+            rec->strs[off + len] = '\0';
+            rec->args[n++] = off;
+            off = MIN(off + len + 1, SANDBOX_TRACE_STRLEN - 1);
+            break;
+        case 'p':
+            rec->args[n++] = (uintptr_t)va_arg(aq, void *);
+            break;
+        case 'c':
+        case 'd':
+        case 'i':
+            rec->args[n++] = sandbox_trace_arg(lmod, 1, &aq);
+            break;
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            rec->args[n++] = sandbox_trace_arg(lmod, 0, &aq);
+            break;
+        default:
+            goto done;
+        }
+    }
+
+done:
+    va_end(aq);
+}
+
+void
+sandbox_trace(struct sandbox_tracesite *site, int subsys, int level, ...)
+{
+    u_int head = 0;
+    uint32_t id = 0;
+    struct timespec ts;
+    struct sandbox_tracering *ring = sandbox_tracering;
+    struct sandbox_tracerec *rec = NULL;
+    va_list ap;
+
+    id = site->id;
+    if (id == 0)
+        id = sandbox_trace_register(site);
+
+    if (ring != NULL) {
+        nanouptime(&ts);
+        head = ring->head;
+        rec = &ring->recs[head & SANDBOX_TRACE_MASK];
+        memset(rec, 0, sizeof(*rec));
+        rec->nsecs = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        rec->fmtid = id;
+        rec->subsys = subsys;
+        rec->level = level;
+        rec->pid = (curproc != NULL) ? curproc->p_pid : 0;
+        va_start(ap, level);
+        sandbox_trace_encode(rec, site->format, ap);
+        va_end(ap);
+        membar_producer();
+        ring->head = head + 1;
+    }
+
+    if (sandbox_traceconsole) {
+        printf("%c %s:%d:%s ", sandbox_trace_levelchars[level], site->file,
+                site->line, site->func);
+        va_start(ap, level);
+        vprintf(site->format, ap);
+        va_end(ap);
+    }
+}
+
+/* Copies out the records that the ring holds, oldest first, and counts
+ * those that were overwritten before they could be read.  Nothing writes
+ * to the ring during the copy here, so unlike the kernel's, no copied
+ * record has to be dropped afterwards.
+ */
+int
+sandbox_trace_read(struct sandbox_trace *trace)
+{
+    u_int head = 0;
+    u_int start = 0;
+    size_t j = 0;
+    size_t max = 0;
+    size_t ncopy = 0;
+    struct sandbox_tracering *ring = sandbox_tracering;
+
+    trace->nlost = 0;
+    max = MIN(trace->nrecs, SANDBOX_TRACE_NRECS);
+    if (max == 0 || ring == NULL) {
+        trace->nrecs = 0;
+        return (0);
+    }
+
+    mutex_enter(&sandbox_tracelock);
+    head = ring->head;
+    membar_consumer();
+    if (head - ring->tail > SANDBOX_TRACE_NRECS) {
+        trace->nlost += head - SANDBOX_TRACE_NRECS - ring->tail;
+        ring->tail = head - SANDBOX_TRACE_NRECS;
+    }
+
+    start = ring->tail;
+    ncopy = MIN(head - start, max);
+    for (j = 0; j < ncopy; j++)
+        trace->recs[j] = ring->recs[(start + j) & SANDBOX_TRACE_MASK];
+    ring->tail = start + ncopy;
+    mutex_exit(&sandbox_tracelock);
+
+    trace->nrecs = ncopy;
+    return (0);
+}
+
+int
+sandbox_trace_getfmt(struct sandbox_tracefmt *tf)
+{
+    struct sandbox_tracesite *site = NULL;
+
+    if (tf->id == 0 || tf->id > MIN(sandbox_tracensites,
+                SANDBOX_TRACE_MAXSITES - 1))
+        return (ENOENT);
+
+    site = sandbox_tracesites[tf->id];
+    if (site == NULL)
+        return (ENOENT);
+
+    strncpy(tf->file, site->file, sizeof(tf->file) - 1);
+    strncpy(tf->func, site->func, sizeof(tf->func) - 1);
+    strncpy(tf->fmt, site->format, sizeof(tf->fmt) - 1);
+    tf->line = site->line;
+
+    return (0);
+}
+
+void
+sandbox_trace_init(void)
+{
+    struct sandbox_tracering *ring = NULL;
+
+    mutex_init(&sandbox_tracelock, MUTEX_DEFAULT, IPL_NONE);
+
+    ring = kmem_zalloc(sizeof(*ring), KM_SLEEP);
+    ring->recs = kmem_zalloc(SANDBOX_TRACE_NRECS * sizeof(*ring->recs),
+            KM_SLEEP);
+    membar_producer();
+    sandbox_tracering = ring;
+}
+
+void
+sandbox_trace_fini(void)
+{
+    struct sandbox_tracering *ring = sandbox_tracering;
+
+    sandbox_tracering = NULL;
+    kmem_free(ring->recs, SANDBOX_TRACE_NRECS * sizeof(*ring->recs));
+    kmem_free(ring, sizeof(*ring));
+
+    mutex_destroy(&sandbox_tracelock);
+}
@@ -0,0 +1,108 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SANDBOX_TRACE_H_
+#define _SANDBOX_TRACE_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* The trace ring of the kernel's sandbox_trace.c, without the sysctl
+ * nodes and with a single CPU.  The mock's log calls still go to stdio;
+ * only the tests write to the ring.  The record layout is that of the
+ * kernel's sandbox_spec.h.
+ */
+
+#define SANDBOX_TRACE_CORE          0
+#define SANDBOX_TRACE_SECMODEL      1
+#define SANDBOX_TRACE_LUA           2
+#define SANDBOX_TRACE_DEVICE        3
+#define SANDBOX_TRACE_VNODE         4
+#define SANDBOX_TRACE_NSUBSYS       5
+
+#define SANDBOX_TRACE_MAXARGS       6
+#define SANDBOX_TRACE_STRLEN        56
+
+struct sandbox_tracerec {
+    uint64_t    nsecs;      /* since boot */
+    uint32_t    fmtid;      /* 0 if the ids ran out */
+    uint16_t    cpu;
+    uint8_t     subsys;
+    uint8_t     level;
+    int32_t     pid;
+    int32_t     lid;
+    uint64_t    args[SANDBOX_TRACE_MAXARGS];
+    char        strs[SANDBOX_TRACE_STRLEN];
+};
+
+struct sandbox_trace {
+    struct sandbox_tracerec *recs;
+    size_t                  nrecs;  /* in: length of recs; out: number of
+                                       records, 0 once the ring is empty */
+    uint64_t                nlost;  /* out: records overwritten before they
+                                       were read, since the last read */
+};
+
+#define SANDBOX_TRACE_FILELEN       32
+#define SANDBOX_TRACE_FUNCLEN       48
+#define SANDBOX_TRACE_FMTLEN        128
+
+struct sandbox_tracefmt {
+    uint32_t    id;         /* in */
+    int         line;
+    char        file[SANDBOX_TRACE_FILELEN];
+    char        func[SANDBOX_TRACE_FUNCLEN];
+    char        fmt[SANDBOX_TRACE_FMTLEN];
+};
+
+#define SANDBOX_TRACE_NRECS     512     /* a power of two */
+#define SANDBOX_TRACE_MAXSITES  1024
+
+struct sandbox_tracesite {
+    const char *file;
+    const char *func;
+    const char *format;
+    int line;
+    uint32_t id;        /* 0 until the site is first recorded */
+};
+
+extern int sandbox_tracelevels[SANDBOX_TRACE_NSUBSYS];
+
+void sandbox_trace_init(void);
+
+void sandbox_trace_fini(void);
+
+void sandbox_trace(struct sandbox_tracesite *site, int subsys, int level,
+        ...);
+
+int sandbox_trace_read(struct sandbox_trace *trace);
+
+int sandbox_trace_getfmt(struct sandbox_tracefmt *tf);
+
+#endif /* !_SANDBOX_TRACE_H_ */
@@ -0,0 +1,254 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <CUnit/CUnit.h>
+#include "test_util.h"
+
+#include <msys/errno.h>
+#include <msys/kauth.h>
+
+#include "sandbox_event.h"
+#include "sandbox_log.h"
+#include "sandbox_rule.h"
+
+#define TEST_EVENT_NEVENTS  4
+
+/* starts the ring, if it is not already, and reads what the other tests
+ * left in it
+ */
+static struct sandbox_eventring *
+test_event_ring(void)
+{
+    int error = 0;
+    struct sandbox_events events = {.nevents = TEST_EVENT_NEVENTS};
+    struct sandbox_eventring *ring = NULL;
+
+    error = sandbox_event_start(&events);
+    CU_ASSERT_EQUAL(error, 0);
+    CU_ASSERT_EQUAL(events.nevents, TEST_EVENT_NEVENTS);
+
+    ring = sandbox_event_map();
+    CU_ASSERT_PTR_NOT_NULL(ring);
+    ring->tail = ring->head;
+    return (ring);
+}
+
+static const struct sandbox_event *
+test_event_at(const struct sandbox_eventring *ring, uint64_t pos)
+{
+    const struct sandbox_event *events = NULL;
+
+    events = (const struct sandbox_event *)((const char *)ring + ring->offset);
+    return (&events[pos & (ring->nevents - 1)]);
+}
+
+static void
+test_event_record(void)
+{
+    uint64_t head = 0;
+    kauth_cred_t cred = NULL;
+    struct sockaddr_in sin;
+    struct sandbox_rule rule;
+    struct sandbox_eventring *ring = NULL;
+    const struct sandbox_event *ev = NULL;
+
+    TEST_START;
+
+    cred = kauth_cred_alloc();
+    ring = test_event_ring();
+    head = ring->head;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(8080);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    SANDBOX_RULE_MAKE(&rule, "network", "bind", NULL);
+
+    sandbox_event_recordfor(42, 1, cred, 7, 2, SANDBOX_EVENT_DENY, &rule,
+            NULL, (const struct sockaddr *)&sin);
+    CU_ASSERT_EQUAL(ring->head, head + 1);
+    CU_ASSERT_TRUE(sandbox_event_pending());
+
+    ev = test_event_at(ring, head);
+    CU_ASSERT_EQUAL(ev->seq, head + 1);
+    CU_ASSERT_EQUAL(ev->pid, 42);
+    CU_ASSERT_EQUAL(ev->ruleid, 7);
+    CU_ASSERT_EQUAL(ev->level, 2);
+    CU_ASSERT_EQUAL(ev->result, SANDBOX_EVENT_DENY);
+    CU_ASSERT_STRING_EQUAL(ev->names[0], "network");
+    CU_ASSERT_STRING_EQUAL(ev->names[1], "bind");
+    CU_ASSERT_STRING_EQUAL(ev->names[2], "");
+    CU_ASSERT_EQUAL(ev->objtype, SANDBOX_EVENT_OBJ_SOCKADDR);
+    CU_ASSERT_EQUAL(ev->obj.sockaddr.family, AF_INET);
+    CU_ASSERT_EQUAL(ev->obj.sockaddr.port, 8080);
+    CU_ASSERT_EQUAL(memcmp(ev->obj.sockaddr.addr, &sin.sin_addr,
+                sizeof(sin.sin_addr)), 0);
+
+    ring->tail = head + 1;
+    CU_ASSERT_FALSE(sandbox_event_pending());
+
+    kauth_cred_free(cred);
+
+    TEST_END;
+}
+
+static void
+test_event_full(void)
+{
+    int i = 0;
+    uint64_t head = 0;
+    uint64_t ndropped = 0;
+    kauth_cred_t cred = NULL;
+    struct sandbox_rule rule;
+    struct sandbox_eventring *ring = NULL;
+
+    TEST_START;
+
+    cred = kauth_cred_alloc();
+    ring = test_event_ring();
+    head = ring->head;
+    ndropped = ring->ndropped;
+    SANDBOX_RULE_MAKE(&rule, "process", "nice", NULL);
+
+    for (i = 0; i < TEST_EVENT_NEVENTS + 1; i++)
+        sandbox_event_recordfor(42, 1, cred, i, 2, SANDBOX_EVENT_ALLOW,
+                &rule, NULL, NULL);
+    CU_ASSERT_EQUAL(ring->head, head + TEST_EVENT_NEVENTS);
+    CU_ASSERT_EQUAL(ring->ndropped, ndropped + 1);
+    CU_ASSERT_EQUAL(test_event_at(ring, head)->ruleid, 0);
+
+    /* reading one event makes room for one */
+    ring->tail = head + 1;
+    sandbox_event_recordfor(42, 1, cred, 99, 2, SANDBOX_EVENT_ALLOW, &rule,
+            NULL, NULL);
+    CU_ASSERT_EQUAL(ring->head, head + TEST_EVENT_NEVENTS + 1);
+    CU_ASSERT_EQUAL(ring->ndropped, ndropped + 1);
+    CU_ASSERT_EQUAL(test_event_at(ring, head + TEST_EVENT_NEVENTS)->ruleid,
+            99);
+
+    kauth_cred_free(cred);
+
+    TEST_END;
+}
+
+/* the reader can write anything to tail; the ring must neither overrun
+ * events it has not read nor jam
+ */
+static void
+test_event_badtail(void)
+{
+    uint64_t head = 0;
+    uint64_t ndropped = 0;
+    kauth_cred_t cred = NULL;
+    struct sandbox_rule rule;
+    struct sandbox_eventring *ring = NULL;
+
+    TEST_START;
+
+    cred = kauth_cred_alloc();
+    ring = test_event_ring();
+    SANDBOX_RULE_MAKE(&rule, "process", "nice", NULL);
+
+    /* a tail ahead of head is an empty ring */
+    head = ring->head;
+    ndropped = ring->ndropped;
+    ring->tail = head + 1000;
+    CU_ASSERT_FALSE(sandbox_event_pending());
+    sandbox_event_recordfor(42, 1, cred, 1, 2, SANDBOX_EVENT_ALLOW, &rule,
+            NULL, NULL);
+    CU_ASSERT_EQUAL(ring->head, head + 1);
+    CU_ASSERT_EQUAL(ring->ndropped, ndropped);
+
+    /* a tail more than the ring's length behind head is a full ring */
+    head = ring->head;
+    CU_ASSERT_TRUE(head > TEST_EVENT_NEVENTS);
+    ring->tail = 0;
+    CU_ASSERT_TRUE(sandbox_event_pending());
+    sandbox_event_recordfor(42, 1, cred, 2, 2, SANDBOX_EVENT_ALLOW, &rule,
+            NULL, NULL);
+    CU_ASSERT_EQUAL(ring->head, head);
+    CU_ASSERT_EQUAL(ring->ndropped, ndropped + 1);
+
+    ring->tail = head;
+    CU_ASSERT_FALSE(sandbox_event_pending());
+
+    kauth_cred_free(cred);
+
+    TEST_END;
+}
+
+static void
+test_event_badsize(void)
+{
+    int error = 0;
+    struct sandbox_events events = {.nevents = 3};
+
+    TEST_START;
+
+    error = sandbox_event_start(&events);
+    CU_ASSERT_EQUAL(error, EINVAL);
+
+    /* the ring keeps the length it was started with */
+    (void)test_event_ring();
+    events.nevents = TEST_EVENT_NEVENTS * 2;
+    error = sandbox_event_start(&events);
+    CU_ASSERT_EQUAL(error, EBUSY);
+    CU_ASSERT_EQUAL(events.nevents, TEST_EVENT_NEVENTS);
+
+    TEST_END;
+}
+
+static CU_TestInfo suite_tests[] = {
+    {"event record", test_event_record},
+    {"event ring full", test_event_full},
+    {"event bad tail", test_event_badtail},
+    {"event bad size", test_event_badsize},
+
+    CU_TEST_INFO_NULL
+};
+
+static CU_SuiteInfo suite_event = {
+    .pName = "sandbox_event suite",
+    .pInitFunc = NULL,
+    .pCleanupFunc = NULL,
+    .pSetUpFunc = NULL,
+    .pTearDownFunc = NULL,
+    .pTests = suite_tests
+};
+
+CU_SuiteInfo *
+suite_event_open(void)
+{
+    return (&suite_event);
+}
@@ -32,12 +32,14 @@
 #include <msys/queue.h>
 #include <msys/kauth.h>
 #include <msys/kmem.h>
+#include <msys/proc.h>
 
 #include <CUnit/CUnit.h>
 #include "test_util.h"
 
 #include "sandbox.h"
 #include "sandbox_lua.h"
+#include "sandbox_pred.h"
 #include "sandbox_rule.h"
 #include "sandbox_ruleset.h"
 
@@ -603,7 +605,7 @@ test_on_scope(void)
 
     TEST_START;
     
-    sandbox = sandbox_create("sandbox.on('network', function() end)", &error);
+    sandbox = sandbox_create("sandbox.on('network', function(req) return req end)", &error);
     CU_ASSERT_NOT_EQUAL(sandbox, NULL);
     CU_ASSERT_EQUAL(error, 0);
 
@@ -638,7 +640,7 @@ test_on_action(void)
 
     TEST_START;
     
-    sandbox = sandbox_create("sandbox.on('network.socket', function() end)", &error);
+    sandbox = sandbox_create("sandbox.on('network.socket', function(req) return req end)", &error);
     CU_ASSERT_NOT_EQUAL(sandbox, NULL);
     CU_ASSERT_EQUAL(error, 0);
 
@@ -679,7 +681,7 @@ test_on_subaction(void)
 
     TEST_START;
     
-    sandbox = sandbox_create("sandbox.on('network.socket.open', function() end)", &error);
+    sandbox = sandbox_create("sandbox.on('network.socket.open', function(req) return req end)", &error);
     CU_ASSERT_NOT_EQUAL(sandbox, NULL);
     CU_ASSERT_EQUAL(error, 0);
 
@@ -716,6 +718,328 @@ test_on_subaction(void)
     TEST_END;
 }
 
+static void
+test_on_arity(void)
+{
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", NULL}};
+    const struct sandbox_rulenode *node = NULL;
+    struct sandbox_ref *funcref = NULL;
+
+    TEST_START;
+    
+    sandbox = sandbox_create(
+            "sandbox.on('network', function(req, cred) return cred end)\n"
+            "sandbox.on('network.socket', function(req, cred, ...) return cred end)",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+
+    SANDBOX_RULE_MAKE(&rule, "network", NULL, NULL);
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_EQUAL(node->type, SANDBOX_RULETYPE_FUNCTION);
+    funcref = SIMPLEQ_FIRST(&node->funclist);
+    CU_ASSERT_EQUAL(funcref->nargs, 2);
+
+    /* variadic functions get every argument */
+    SANDBOX_RULE_MAKE(&rule, "network", "socket", NULL);
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_EQUAL(node->type, SANDBOX_RULETYPE_FUNCTION);
+    funcref = SIMPLEQ_FIRST(&node->funclist);
+    CU_ASSERT_EQUAL(funcref->nargs, SANDBOX_REF_NARGS_ALL);
+
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_on_expression(void)
+{
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"process", "nice", NULL}};
+    const struct sandbox_rulenode *node = NULL;
+    struct sandbox_ref *funcref = NULL;
+
+    TEST_START;
+    
+    sandbox = sandbox_create(
+            "sandbox.on('process.nice', 'n >= proc.nice and n < 40')\n"
+            "sandbox.on('process.nice', 'n >= 1.5')",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_EQUAL(node->type, SANDBOX_RULETYPE_FUNCTION);
+
+    /* compiled */
+    funcref = SIMPLEQ_FIRST(&node->funclist);
+    CU_ASSERT_NOT_EQUAL(funcref->prog, NULL);
+
+    /* floats are not supported, so this one falls back to Lua */
+    funcref = SIMPLEQ_NEXT(funcref, ref_next);
+    CU_ASSERT_EQUAL(funcref->prog, NULL);
+    CU_ASSERT_TRUE(funcref->value > 0);
+
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_on_constant(void)
+{
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", NULL}};
+    const struct sandbox_rulenode *node = NULL;
+
+    TEST_START;
+    
+    sandbox = sandbox_create(
+            "sandbox.on('network.socket', function(req, cred, ...) return true end)\n"
+            "sandbox.on('network.socket.open', function() end)\n"
+            "sandbox.on('process.nice', '1 < 2')\n"
+            "sandbox.deny('process.setrlimit')\n"
+            "sandbox.on('process.setrlimit', function() return 'yes' end)\n"
+            "local ok = true\n"
+            "sandbox.on('process.fork', function() return ok end)\n"
+            "sandbox.on('system', function(req) return req end)",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_EQUAL(node->type, SANDBOX_RULETYPE_TRILEAN);
+    CU_ASSERT_EQUAL(node->value, KAUTH_RESULT_ALLOW);
+    CU_ASSERT_TRUE(SIMPLEQ_EMPTY(&node->funclist));
+
+    SANDBOX_RULE_MAKE(&rule, "network", "socket", "open");
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_EQUAL(node->type, SANDBOX_RULETYPE_TRILEAN);
+    CU_ASSERT_EQUAL(node->value, KAUTH_RESULT_DENY);
+
+    /* expressions without fields */
+    SANDBOX_RULE_MAKE(&rule, "process", "nice", NULL);
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_EQUAL(node->type, SANDBOX_RULETYPE_TRILEAN);
+    CU_ASSERT_EQUAL(node->value, KAUTH_RESULT_ALLOW);
+
+    /* an allow does not override an existing deny */
+    SANDBOX_RULE_MAKE(&rule, "process", "setrlimit", NULL);
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_EQUAL(node->type, SANDBOX_RULETYPE_TRILEAN);
+    CU_ASSERT_EQUAL(node->value, KAUTH_RESULT_DENY);
+
+    /* a coroutine or the debug library could change the upvalue */
+    SANDBOX_RULE_MAKE(&rule, "process", "fork", NULL);
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_EQUAL(node->type, SANDBOX_RULETYPE_FUNCTION);
+
+    SANDBOX_RULE_MAKE(&rule, "system", NULL, NULL);
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_EQUAL(node->type, SANDBOX_RULETYPE_FUNCTION);
+
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_on_combined(void)
+{
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"process", "nice", NULL}};
+    const struct sandbox_rulenode *node = NULL;
+    struct sandbox_ref *funcref = NULL;
+
+    TEST_START;
+    
+    sandbox = sandbox_create(
+            "sandbox.on('process.nice', function(req) return req end)\n"
+            "sandbox.on('process.nice', 'n >= 0')\n"
+            "sandbox.on('process.nice', function(req, cred, p, n) return n end)\n"
+            "sandbox.on('process.nice', function(req, cred) return cred end)",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_EQUAL(node->type, SANDBOX_RULETYPE_FUNCTION);
+
+    /* one dispatcher for the Lua functions, wanting the most arguments */
+    funcref = SIMPLEQ_FIRST(&node->funclist);
+    CU_ASSERT_EQUAL(funcref->prog, NULL);
+    CU_ASSERT_EQUAL(funcref->nargs, 4);
+
+    funcref = SIMPLEQ_NEXT(funcref, ref_next);
+    CU_ASSERT_NOT_EQUAL(funcref->prog, NULL);
+
+    CU_ASSERT_EQUAL(SIMPLEQ_NEXT(funcref, ref_next), NULL);
+
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_on_pure(void)
+{
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", "open"}};
+    const struct sandbox_rulenode *node = NULL;
+    struct sandbox_ref *funcref = NULL;
+
+    TEST_START;
+    
+    sandbox = sandbox_create(
+            "sandbox.on('network.socket.open', function(req) return req end)\n"
+            "sandbox.on('network.socket.open', function(req, cred, domain)\n"
+            "    return domain == sandbox.AF_INET\n"
+            "end, {pure=true, key={'cred.uid', 'domain'}, ttl=1000, size=100})\n"
+            "sandbox.on('network.socket.open', function(req, cred) return cred end)",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+
+    /* the pure function is not folded into the dispatcher */
+    funcref = SIMPLEQ_FIRST(&node->funclist);
+    CU_ASSERT_EQUAL(funcref->memo, NULL);
+    CU_ASSERT_NOT_EQUAL(SIMPLEQ_FIRST(&funcref->members), NULL);
+
+    funcref = SIMPLEQ_NEXT(funcref, ref_next);
+    CU_ASSERT_NOT_EQUAL(funcref->memo, NULL);
+    CU_ASSERT_EQUAL(funcref->memo->nkeys, 2);
+    CU_ASSERT_EQUAL(funcref->memo->keys[0].field, SANDBOX_PRED_FIELD_CRED_UID);
+    CU_ASSERT_EQUAL(funcref->memo->keys[1].field, SANDBOX_PRED_FIELD_ARG);
+    CU_ASSERT_EQUAL(funcref->memo->keys[1].argidx, 1);
+    CU_ASSERT_EQUAL(funcref->memo->ttl, 1000000000);
+    CU_ASSERT_EQUAL(funcref->memo->size, 128);
+
+    CU_ASSERT_EQUAL(SIMPLEQ_NEXT(funcref, ref_next), NULL);
+
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_on_pure_bad_options(void)
+{
+    int i = 0;
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+    const char *scripts[] = {
+        "sandbox.on('network.socket.open', function() end, {pure=true})",
+        "sandbox.on('network.socket.open', function() end, {key={'domain'}})",
+        "sandbox.on('network.socket.open', function() end, {pure=true, key={}})",
+        "sandbox.on('network.socket.open', function() end, {pure=true, key={'foo'}})",
+        "sandbox.on('network.socket.open', function() end, {pure=true, key={1}})",
+        "sandbox.on('network.socket.open', function() end, "
+            "{pure=true, key={'arg1', 'arg2', 'arg3', 'arg4', 'cred.uid'}})",
+        "sandbox.on('network.socket.open', function() end, "
+            "{pure=true, key={'domain'}, ttl=-1})",
+        "sandbox.on('network.socket.open', function() end, "
+            "{pure=true, key={'domain'}, size=0})",
+        NULL
+    };
+
+    TEST_START;
+
+    for (i = 0; scripts[i] != NULL; i++) {
+        sandbox = sandbox_create(scripts[i], &error);
+        CU_ASSERT_EQUAL(sandbox, NULL);
+        CU_ASSERT_EQUAL(error, EINVAL);
+    }
+
+    TEST_END;
+}
+
+static void
+test_on_expression_syntax_error(void)
+{
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+
+    TEST_START;
+
+    sandbox = sandbox_create("sandbox.on('process.nice', 'n >=')", &error);
+    CU_ASSERT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, EINVAL);
+
+    TEST_END;
+}
+
+static void
+test_on_expression_fallback(void)
+{
+    int error = 0;
+    int result = KAUTH_RESULT_DENY;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"process", "nice", NULL}};
+    struct proc p;
+    kauth_cred_t cred;
+
+    TEST_START;
+
+    /* floats are not supported, so this one runs in Lua */
+    sandbox = sandbox_create(
+            "sandbox.on('process.nice', 'n >= 1.5 and proc.nice == 20')",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+
+    memset(&p, 0, sizeof(p));
+    p.p_nice = 20;
+    cred = kauth_cred_alloc();
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "pi", &p,
+            SANDBOX_PRED_LOCKS_BOTH, (lua_Integer)25);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "pi", &p,
+            SANDBOX_PRED_LOCKS_BOTH, (lua_Integer)1);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    /* the arguments of the last request are not left bound */
+    result = sandbox_eval(sandbox, cred, &rule, NULL, NULL);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    kauth_cred_free(cred);
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_on_expression_not_expression(void)
+{
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+
+    TEST_START;
+
+    sandbox = sandbox_create(
+            "sandbox.on('process.nice', "
+            "'n) or (function() return true end)(')", &error);
+    CU_ASSERT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, EINVAL);
+
+    sandbox = sandbox_create(
+            "sandbox.on('process.nice', "
+            "'n >= 1.5; sandbox.default(\\'allow\\')')", &error);
+    CU_ASSERT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, EINVAL);
+
+    TEST_END;
+}
+
 static void
 test_on_zero_args(void)
 {
@@ -866,6 +1190,176 @@ test_on_arg2_table(void)
     TEST_END;
 }
 
+static void
+test_when_unknown_field(void)
+{
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+
+    TEST_START;
+
+    sandbox = sandbox_create("sandbox.when('network.socket.open', {foo=1})",
+            &error);
+    CU_ASSERT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, EINVAL);
+
+    TEST_END;
+}
+
+static void
+test_when_unknown_const(void)
+{
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+
+    TEST_START;
+
+    sandbox = sandbox_create(
+            "sandbox.when('network.socket.open', {domain='AF_FOO'})", &error);
+    CU_ASSERT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, EINVAL);
+
+    TEST_END;
+}
+
+static void
+test_rules(void)
+{
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", "open"}};
+    const struct sandbox_rulenode *node = NULL;
+
+    TEST_START;
+
+    sandbox = sandbox_create(
+            "sandbox.rules{\n"
+            "    allow={'network.socket.open', 'system', 'process.nice'},\n"
+            "    deny={'network.bind', 'system'},\n"
+            "    on={{'process.nice', '1 < 2'},\n"
+            "        {'process.fork', function() return true end}},\n"
+            "}",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_STRING_EQUAL(node->name, "open");
+    CU_ASSERT_EQUAL(node->type, SANDBOX_RULETYPE_TRILEAN);
+    CU_ASSERT_EQUAL(node->value, KAUTH_RESULT_ALLOW);
+
+    SANDBOX_RULE_MAKE(&rule, "network", "bind", NULL);
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_STRING_EQUAL(node->name, "bind");
+    CU_ASSERT_EQUAL(node->value, KAUTH_RESULT_DENY);
+
+    /* a rule in both lists is denied */
+    SANDBOX_RULE_MAKE(&rule, "system", NULL, NULL);
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_STRING_EQUAL(node->name, "system");
+    CU_ASSERT_EQUAL(node->value, KAUTH_RESULT_DENY);
+
+    SANDBOX_RULE_MAKE(&rule, "process", "nice", NULL);
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_STRING_EQUAL(node->name, "nice");
+    CU_ASSERT_EQUAL(node->value, KAUTH_RESULT_ALLOW);
+
+    SANDBOX_RULE_MAKE(&rule, "process", "fork", NULL);
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_STRING_EQUAL(node->name, "fork");
+    CU_ASSERT_EQUAL(node->type, SANDBOX_RULETYPE_FUNCTION);
+    CU_ASSERT_FALSE(SIMPLEQ_EMPTY(&node->funclist));
+
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_rules_bad_entries(void)
+{
+    int i = 0;
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+    const char *scripts[] = {
+        "sandbox.rules()",
+        "sandbox.rules('network')",
+        "sandbox.rules{allow='network'}",
+        "sandbox.rules{allow={1}}",
+        "sandbox.rules{deny={''}}",
+        "sandbox.rules{deny={'a.b.c.d'}}",
+        "sandbox.rules{on={'network'}}",
+        "sandbox.rules{on={{'network'}}}",
+        NULL
+    };
+
+    TEST_START;
+
+    for (i = 0; scripts[i] != NULL; i++) {
+        sandbox = sandbox_create(scripts[i], &error);
+        CU_ASSERT_EQUAL(sandbox, NULL);
+        CU_ASSERT_EQUAL(error, EINVAL);
+    }
+
+    TEST_END;
+}
+
+static void
+test_audit(void)
+{
+    int i = 0;
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {NULL, NULL, NULL}};
+    const struct sandbox_rulenode *node = NULL;
+    const char *bad[] = {
+        "sandbox.audit('network')",
+        "sandbox.audit('network', 1)",
+        "sandbox.audit('network', {deny=-1})",
+        "sandbox.audit('network', {allow='x'})",
+        "sandbox.audit('a.b.c.d', {deny=1})",
+        NULL
+    };
+
+    TEST_START;
+
+    sandbox = sandbox_create(
+            "sandbox.default('allow')\n"
+            "sandbox.audit('', {allow=1000})\n"
+            "sandbox.deny('network')\n"
+            "sandbox.audit('network', {deny=0})\n"
+            "sandbox.deny('network.socket.open')\n"
+            "sandbox.audit('network.socket.open', {deny=10})\n",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+
+    SANDBOX_RULE_MAKE(&rule, "network", "socket", "open");
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_EQUAL(node->sampledeny, 10);
+    CU_ASSERT_EQUAL(node->sampleallow, 1000);
+
+    SANDBOX_RULE_MAKE(&rule, "network", "bind", NULL);
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_EQUAL(node->sampledeny, 0);
+    CU_ASSERT_EQUAL(node->sampleallow, 1000);
+
+    SANDBOX_RULE_MAKE(&rule, "vnode", NULL, NULL);
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    CU_ASSERT_EQUAL(node->sampledeny, 1);
+    CU_ASSERT_EQUAL(node->sampleallow, 1000);
+
+    sandbox_destroy(sandbox);
+
+    for (i = 0; bad[i] != NULL; i++) {
+        sandbox = sandbox_create(bad[i], &error);
+        CU_ASSERT_EQUAL(sandbox, NULL);
+        CU_ASSERT_EQUAL(error, EINVAL);
+    }
+
+    TEST_END;
+}
+
 static void
 test_paths_allow_action(void)
 {
@@ -1092,6 +1586,15 @@ static CU_TestInfo suite_tests[] = {
     {"on(scope)", test_on_scope},
     {"on(action)", test_on_action},
     {"on(subaction)", test_on_subaction},
+    {"on(arity)", test_on_arity},
+    {"on(expression)", test_on_expression},
+    {"on(expression syntax error)", test_on_expression_syntax_error},
+    {"on(expression fallback)", test_on_expression_fallback},
+    {"on(expression not an expression)", test_on_expression_not_expression},
+    {"on(constant)", test_on_constant},
+    {"on(combined)", test_on_combined},
+    {"on(pure)", test_on_pure},
+    {"on(pure bad options)", test_on_pure_bad_options},
 
     {"on(zero args)", test_on_zero_args},
     {"on(one arg)", test_on_one_arg},
@@ -1104,6 +1607,13 @@ static CU_TestInfo suite_tests[] = {
     {"on(arg2 number)", test_on_arg2_number},
     {"on(arg2 table)", test_on_arg2_table},
 
+    {"when(unknown field)", test_when_unknown_field},
+    {"when(unknown constant)", test_when_unknown_const},
+
+    {"rules", test_rules},
+    {"rules(bad entries)", test_rules_bad_entries},
+    {"audit", test_audit},
+
     {"paths_allow(action)", test_paths_allow_action},
     {"paths_deny(action)", test_paths_deny_action},
     /* TODO: add more paths_allow()/paths_deny() tests */
@@ -972,6 +972,277 @@ test_search_nonexistent_subaction(void)
 }
 
 
+static void
+test_arena(void)
+{
+    int i = 0;
+    int error = 0;
+    char names[40][8];
+    struct sandbox_ruleset *set = NULL;
+    const struct sandbox_rulenode *node = NULL;
+    const struct sandbox_rulenode *prev = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", NULL}};
+
+    TEST_START;
+
+    set = sandbox_ruleset_create(KAUTH_RESULT_DENY);
+    for (i = 0; i < 40; i++) {
+        snprintf(names[i], sizeof(names[i]), "sub%02d", i);
+        rule.names[2] = names[i];
+        error = sandbox_ruleset_insert(set, &rule, SANDBOX_RULETYPE_TRILEAN,
+                KAUTH_RESULT_ALLOW, NULL);
+        CU_ASSERT_EQUAL(error, 0);
+    }
+
+    /* the root, network, socket, and a node per subaction */
+    CU_ASSERT_EQUAL(set->nodes.nobjs, 43);
+    CU_ASSERT_EQUAL(set->nodes.nchunks, 2);
+
+    /* nodes made one after another are next to each other */
+    for (i = 0; i < 40; i++) {
+        rule.names[2] = names[i];
+        node = sandbox_ruleset_search(set, &rule);
+        CU_ASSERT_STRING_EQUAL(node->name, names[i]);
+        if (i > 0 && i < SANDBOX_ARENA_MINOBJS - 3)
+            CU_ASSERT_EQUAL((const char *)node,
+                    (const char *)prev + set->nodes.objsize);
+        prev = node;
+    }
+
+    sandbox_ruleset_destroy(set);
+
+    TEST_END;
+}
+
+static void
+test_seal(void)
+{
+    int i = 0;
+    int error = 0;
+    struct sandbox_ruleset *set = NULL;
+    const struct sandbox_rulenode *node = NULL;
+    const struct sandbox_rulehot *hot = NULL;
+    struct sandbox_rule rule = { .names = {NULL, NULL, NULL}};
+    const struct {
+        const char *names[3];
+        const char *found;  /* the name of the node that decides */
+    } searches[] = {
+        { {"network", "socket", "open"}, "open" },
+        { {"network", "socket", "close"}, "network" },
+        { {"network", "bind", NULL}, "bind" },
+        { {"network", "bind", "port"}, "bind" },
+        { {"vnode", "read_data", NULL}, "" },
+        { {"vnode", NULL, NULL}, "" },
+        { {"process", "signal", "kill"}, "kill" },
+        { {"system", NULL, NULL}, "" },
+    };
+
+    TEST_START;
+
+    set = sandbox_ruleset_create(KAUTH_RESULT_DENY);
+    SANDBOX_RULE_MAKE(&rule, "network", NULL, NULL);
+    error = sandbox_ruleset_insert(set, &rule, SANDBOX_RULETYPE_TRILEAN,
+            KAUTH_RESULT_ALLOW, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    SANDBOX_RULE_MAKE(&rule, "network", "socket", "open");
+    error = sandbox_ruleset_insert(set, &rule, SANDBOX_RULETYPE_TRILEAN,
+            KAUTH_RESULT_DENY, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    SANDBOX_RULE_MAKE(&rule, "network", "bind", NULL);
+    error = sandbox_ruleset_insert(set, &rule, SANDBOX_RULETYPE_FUNCTION,
+            KAUTH_RESULT_DEFER, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    SANDBOX_RULE_MAKE(&rule, "process", "signal", "kill");
+    error = sandbox_ruleset_insert(set, &rule, SANDBOX_RULETYPE_TRILEAN,
+            KAUTH_RESULT_DEFER, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+
+    sandbox_ruleset_seal(set);
+    CU_ASSERT_NOT_EQUAL(set->index, NULL);
+    CU_ASSERT_EQUAL(set->index->nnodes, set->nodes.nobjs);
+
+    /* the index finds the nodes that walking the children lists would */
+    for (i = 0; i < (int)(sizeof(searches) / sizeof(searches[0])); i++) {
+        SANDBOX_RULE_MAKE(&rule, searches[i].names[0], searches[i].names[1],
+                searches[i].names[2]);
+        node = sandbox_ruleset_search(set, &rule);
+        CU_ASSERT_STRING_EQUAL(node->name, searches[i].found);
+        hot = sandbox_ruleset_searchhot(set, &rule);
+        CU_ASSERT_EQUAL(SANDBOX_RULESET_COLD(set, hot), node);
+        CU_ASSERT_EQUAL(hot->type, node->type);
+        CU_ASSERT_EQUAL(hot->value, node->value);
+    }
+
+    /* a sealed ruleset takes no more rules */
+    SANDBOX_RULE_MAKE(&rule, "system", NULL, NULL);
+    error = sandbox_ruleset_insert(set, &rule, SANDBOX_RULETYPE_TRILEAN,
+            KAUTH_RESULT_ALLOW, NULL);
+    CU_ASSERT_NOT_EQUAL(error, 0);
+
+    sandbox_ruleset_destroy(set);
+
+    TEST_END;
+}
+
+static void
+test_sampling(void)
+{
+    int i = 0;
+    int error = 0;
+    struct sandbox_ruleset *set = NULL;
+    const struct sandbox_rulenode *node = NULL;
+    struct sandbox_rule rule = { .names = {NULL, NULL, NULL}};
+    const struct {
+        const char *names[3];
+        const char *found;
+        int deny;
+        int allow;
+    } searches[] = {
+        { {"network", "socket", "open"}, "open", 10, 0 },
+        { {"network", "bind", NULL}, "network", 0, 0 },
+        { {"vnode", "read_data", NULL}, "read_data", 1, 100 },
+        { {"vnode", "write_data", NULL}, "", 1, 0 },
+    };
+
+    TEST_START;
+
+    set = sandbox_ruleset_create(KAUTH_RESULT_ALLOW);
+    SANDBOX_RULE_MAKE(&rule, "network", NULL, NULL);
+    error = sandbox_ruleset_insert(set, &rule, SANDBOX_RULETYPE_TRILEAN,
+            KAUTH_RESULT_DENY, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    error = sandbox_ruleset_insertsampling(set, &rule, 0,
+            SANDBOX_SAMPLE_INHERIT);
+    CU_ASSERT_EQUAL(error, 0);
+    SANDBOX_RULE_MAKE(&rule, "network", "socket", "open");
+    error = sandbox_ruleset_insert(set, &rule, SANDBOX_RULETYPE_TRILEAN,
+            KAUTH_RESULT_ALLOW, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    /* a rate on a name without a rule passes to the rules beneath it */
+    SANDBOX_RULE_MAKE(&rule, "network", "socket", NULL);
+    error = sandbox_ruleset_insertsampling(set, &rule, 10,
+            SANDBOX_SAMPLE_INHERIT);
+    CU_ASSERT_EQUAL(error, 0);
+    SANDBOX_RULE_MAKE(&rule, "vnode", "read_data", NULL);
+    error = sandbox_ruleset_insertsampling(set, &rule,
+            SANDBOX_SAMPLE_INHERIT, 100);
+    CU_ASSERT_EQUAL(error, 0);
+    error = sandbox_ruleset_insert(set, &rule, SANDBOX_RULETYPE_TRILEAN,
+            KAUTH_RESULT_ALLOW, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+
+    sandbox_ruleset_seal(set);
+
+    for (i = 0; i < (int)(sizeof(searches) / sizeof(searches[0])); i++) {
+        SANDBOX_RULE_MAKE(&rule, searches[i].names[0], searches[i].names[1],
+                searches[i].names[2]);
+        node = sandbox_ruleset_search(set, &rule);
+        CU_ASSERT_STRING_EQUAL(node->name, searches[i].found);
+        CU_ASSERT_EQUAL(node->sampledeny, searches[i].deny);
+        CU_ASSERT_EQUAL(node->sampleallow, searches[i].allow);
+        CU_ASSERT_EQUAL(set->index->cold[node->id], node);
+    }
+
+    /* a sealed ruleset takes no more rates */
+    SANDBOX_RULE_MAKE(&rule, "system", NULL, NULL);
+    error = sandbox_ruleset_insertsampling(set, &rule, 1, 1);
+    CU_ASSERT_NOT_EQUAL(error, 0);
+
+    sandbox_ruleset_destroy(set);
+
+    TEST_END;
+}
+
+/* appends "rulename=type/value " to the string buffer at arg */
+static void
+test_insertbulk_visit(struct sandbox_rulenode *node, const char *rulename,
+        void *arg)
+{
+    char *buf = arg;
+
+    snprintf(buf + strlen(buf), 1024 - strlen(buf), "%s=%d/%d ", rulename,
+            node->type, node->value);
+}
+
+static void
+test_insertbulk(void)
+{
+    int i = 0;
+    int error = 0;
+    struct sandbox_ruleset *bulk = NULL;
+    struct sandbox_ruleset *set = NULL;
+    const struct sandbox_rulenode *node = NULL;
+    struct sandbox_rule rule = { .names = {NULL, NULL, NULL}};
+    char bulkbuf[1024] = { 0 };
+    char setbuf[1024] = { 0 };
+    const struct sandbox_ruleentry entries[] = {
+        { { {"vnode", "write_data", NULL} }, KAUTH_RESULT_DENY },
+        { { {"network", "socket", "open"} }, KAUTH_RESULT_ALLOW },
+        { { {"network", NULL, NULL} }, KAUTH_RESULT_DENY },
+        { { {"system", "time", "adjtime"} }, KAUTH_RESULT_ALLOW },
+        { { {"network", "bind", NULL} }, KAUTH_RESULT_ALLOW },
+        { { {"network", "socket", "open"} }, KAUTH_RESULT_DENY },
+        { { {"process", NULL, NULL} }, KAUTH_RESULT_ALLOW },
+        { { {"network", "socket", "drop"} }, KAUTH_RESULT_ALLOW },
+        { { {"vnode", "read_data", NULL} }, KAUTH_RESULT_ALLOW },
+    };
+    const int n = sizeof(entries) / sizeof(entries[0]);
+
+    TEST_START;
+
+    /* a ruleset with some rules already in it */
+    bulk = sandbox_ruleset_create(KAUTH_RESULT_DENY);
+    set = sandbox_ruleset_create(KAUTH_RESULT_DENY);
+    SANDBOX_RULE_MAKE(&rule, "network", "socket", NULL);
+    error = sandbox_ruleset_insert(bulk, &rule, SANDBOX_RULETYPE_TRILEAN,
+            KAUTH_RESULT_ALLOW, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    error = sandbox_ruleset_insert(set, &rule, SANDBOX_RULETYPE_TRILEAN,
+            KAUTH_RESULT_ALLOW, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    SANDBOX_RULE_MAKE(&rule, "system", NULL, NULL);
+    error = sandbox_ruleset_insert(bulk, &rule, SANDBOX_RULETYPE_TRILEAN,
+            KAUTH_RESULT_ALLOW, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    error = sandbox_ruleset_insert(set, &rule, SANDBOX_RULETYPE_TRILEAN,
+            KAUTH_RESULT_ALLOW, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+
+    /* the bulk build makes the trie that inserting one by one does */
+    error = sandbox_ruleset_insertbulk(bulk, entries, n);
+    CU_ASSERT_EQUAL(error, 0);
+    for (i = 0; i < n; i++) {
+        error = sandbox_ruleset_insert(set, &entries[i].rule,
+                SANDBOX_RULETYPE_TRILEAN, entries[i].value, NULL);
+        CU_ASSERT_EQUAL(error, 0);
+    }
+    CU_ASSERT_EQUAL(bulk->nodes.nobjs, set->nodes.nobjs);
+    sandbox_ruleset_foreach(bulk, test_insertbulk_visit, bulkbuf);
+    sandbox_ruleset_foreach(set, test_insertbulk_visit, setbuf);
+    CU_ASSERT_STRING_EQUAL(bulkbuf, setbuf);
+
+    /* children stay sorted */
+    SANDBOX_RULE_MAKE(&rule, "network", "socket", NULL);
+    node = sandbox_ruleset_search(bulk, &rule);
+    CU_ASSERT_STRING_EQUAL(node->name, "socket");
+    node = TAILQ_FIRST(&node->children);
+    CU_ASSERT_STRING_EQUAL(node->name, "drop");
+    node = TAILQ_NEXT(node, node_next);
+    CU_ASSERT_STRING_EQUAL(node->name, "open");
+    /* of entries for the same rule, the last wins */
+    CU_ASSERT_EQUAL(node->value, KAUTH_RESULT_DENY);
+
+    /* a sealed ruleset takes no more rules */
+    sandbox_ruleset_seal(bulk);
+    error = sandbox_ruleset_insertbulk(bulk, entries, n);
+    CU_ASSERT_NOT_EQUAL(error, 0);
+
+    sandbox_ruleset_destroy(bulk);
+    sandbox_ruleset_destroy(set);
+
+    TEST_END;
+}
+
 static CU_TestInfo suite_tests[] = {
     {"insert default (bool)", test_insert_default_bool},
     {"insert default (func)", test_insert_default_func},
@@ -1003,6 +1274,11 @@ static CU_TestInfo suite_tests[] = {
     {"search for nonexistent action", test_search_nonexistent_action},
     {"search for nonexistent subaction", test_search_nonexistent_subaction},
 
+    {"arena", test_arena},
+    {"seal", test_seal},
+    {"sampling", test_sampling},
+    {"insert bulk", test_insertbulk},
+
     CU_TEST_INFO_NULL
 };
 
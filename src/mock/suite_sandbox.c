@@ -27,16 +27,38 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <msys/errno.h>
+#include <msys/filedesc.h>
 #include <msys/kauth.h>
+#include <msys/mutex.h>
+#include <msys/proc.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <lua.h>
+#include <lauxlib.h>
 
 #include <CUnit/CUnit.h>
 #include "test_util.h"
 
 #include "sandbox.h"
+#include "sandbox_chunkcache.h"
+#include "sandbox_lua.h"
+#include "sandbox_objcache.h"
+#include "sandbox_permissive.h"
+#include "sandbox_pred.h"
+#include "sandbox_registry.h"
 #include "sandbox_rule.h"
+#include "sandbox_ruleset.h"
 
 #include "sandbox_log.h"
 
+/* twice the states the pool is prefilled with */
+#define TEST_POOL_NCYCLES   8
+
 static void
 test_allow_action(void)
 {
@@ -162,6 +184,1128 @@ test_eval_subaction_for_default_rule(void)
     TEST_END;
 }
 
+static void
+test_when_set(void)
+{
+    int error = 0;
+    int result = KAUTH_RESULT_DENY;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", "open"}};
+    kauth_cred_t cred;
+
+    TEST_START;
+    
+    sandbox = sandbox_create(
+            "sandbox.when('network.socket.open', "
+            "{domain={'AF_INET', 'AF_INET6'}, type=sandbox.SOCK_STREAM})",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    
+    cred = kauth_cred_alloc();
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET6, (lua_Integer)SOCK_STREAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_UNIX, (lua_Integer)SOCK_STREAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET, (lua_Integer)SOCK_DGRAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    kauth_cred_free(cred);
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_when_compare_field(void)
+{
+    int error = 0;
+    int result = KAUTH_RESULT_DENY;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"process", "nice", NULL}};
+    struct proc p;
+    kauth_cred_t cred;
+
+    TEST_START;
+    
+    sandbox = sandbox_create(
+            "sandbox.when('process.nice', {n={ge='proc.nice', lt=40}})",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    
+    memset(&p, 0, sizeof(p));
+    p.p_nice = 20;
+    cred = kauth_cred_alloc();
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "pi", &p,
+            SANDBOX_PRED_LOCKS_BOTH, (lua_Integer)25);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "pi", &p,
+            SANDBOX_PRED_LOCKS_BOTH, (lua_Integer)10);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "pi", &p,
+            SANDBOX_PRED_LOCKS_BOTH, (lua_Integer)40);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    /* a request without the argument fails the predicate */
+    result = sandbox_eval(sandbox, cred, &rule, NULL, NULL);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    kauth_cred_free(cred);
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_require_relations(void)
+{
+    int error = 0;
+    int result = KAUTH_RESULT_DENY;
+    struct sandbox *sandbox = NULL;
+    struct sandbox *shared = NULL;
+    struct sandbox_list *list = NULL;
+    struct sandbox_list *childlist = NULL;
+    struct sandbox_rule rule = { .names = {"process", "signal", NULL}};
+    struct proc proc0, parent, child, other;
+    kmutex_t parentlock, childlock, otherlock;
+    struct cwdinfo jail, root;
+    kauth_cred_t cred;
+    kauth_cred_t childcred;
+
+    TEST_START;
+
+    sandbox = sandbox_create(
+            "sandbox.require('process.signal', {['proc.sameroot']=true,\n"
+            "        ['proc.descendant']=true, ['proc.samesandbox']=1})",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+
+    /* the caller and its child are in the jail; other is not */
+    memset(&jail, 0, sizeof(jail));
+    jail.cwdi_rdir = (struct vnode *)&jail;
+    memset(&root, 0, sizeof(root));
+    mutex_init(&parentlock, MUTEX_DEFAULT, IPL_NONE);
+    mutex_init(&childlock, MUTEX_DEFAULT, IPL_NONE);
+    mutex_init(&otherlock, MUTEX_DEFAULT, IPL_NONE);
+    memset(&proc0, 0, sizeof(proc0));
+    memset(&parent, 0, sizeof(parent));
+    parent.p_lock = &parentlock;
+    parent.p_pid = 2;
+    parent.p_pptr = &proc0;
+    parent.p_cwdi = &jail;
+    child = parent;
+    child.p_lock = &childlock;
+    child.p_pid = 3;
+    child.p_pptr = &parent;
+    other = parent;
+    other.p_lock = &otherlock;
+    other.p_pid = 4;
+    other.p_cwdi = &root;
+    curproc = &parent;
+
+    cred = kauth_cred_alloc();
+    list = sandbox_list_create();
+    SLIST_INSERT_HEAD(&list->head, sandbox, sandbox_next);
+    kauth_cred_setdata(cred, secmodel_sandbox_key, list);
+    parent.p_cred = cred;
+
+    /* the child is not yet in the caller's sandbox */
+    childcred = kauth_cred_alloc();
+    child.p_cred = childcred;
+    other.p_cred = childcred;
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "p", &child,
+            SANDBOX_PRED_LOCKS_NONE);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    shared = sandbox;
+    sandbox_hold(shared);
+    childlist = sandbox_list_create();
+    SLIST_INSERT_HEAD(&childlist->head, shared, sandbox_next);
+    kauth_cred_setdata(childcred, secmodel_sandbox_key, childlist);
+
+    /* a match defers rather than allows; the locks that the caller does
+     * not hold are taken and dropped again
+     */
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "p", &child,
+            SANDBOX_PRED_LOCKS_NONE);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DEFER);
+    CU_ASSERT_FALSE(mutex_owned(proc_lock));
+    CU_ASSERT_FALSE(mutex_owned(&childlock));
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "p", &parent,
+            SANDBOX_PRED_LOCKS_NONE);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DEFER);
+
+    /* outside the jail, and not a descendant */
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "p", &other,
+            SANDBOX_PRED_LOCKS_NONE);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+    other.p_cwdi = &jail;
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "p", &other,
+            SANDBOX_PRED_LOCKS_NONE);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    /* the locks that the caller already holds are used as they are */
+    mutex_enter(proc_lock);
+    mutex_enter(&childlock);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "p", &child,
+            SANDBOX_PRED_LOCKS_BOTH);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DEFER);
+    CU_ASSERT_TRUE(mutex_owned(proc_lock));
+    CU_ASSERT_TRUE(mutex_owned(&childlock));
+    mutex_exit(&childlock);
+    mutex_exit(proc_lock);
+
+    /* the relations are not operands of a request whose callers differ
+     * in the locks they hold
+     */
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "p", &child,
+            SANDBOX_PRED_LOCKS_UNKNOWN);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    curproc = NULL;
+    sandbox_list_destroy(childlist);
+    sandbox_list_destroy(list);
+    kauth_cred_free(childcred);
+    kauth_cred_free(cred);
+    mutex_destroy(&otherlock);
+    mutex_destroy(&childlock);
+    mutex_destroy(&parentlock);
+
+    TEST_END;
+}
+
+static void
+test_bind_addresses(void)
+{
+    int error = 0;
+    int result = KAUTH_RESULT_DEFER;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "bind", "port"}};
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+    struct sockaddr_un sun;
+    kauth_cred_t cred;
+
+    TEST_START;
+
+    sandbox = sandbox_create(
+            "sandbox.bind_allow{'10.0.0.0/8:8000-8999', '[::1]:*', "
+            "'unix:/tmp/app-*'}\n"
+            "sandbox.bind_deny{'10.0.0.1'}",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+
+    cred = kauth_cred_alloc();
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr("10.1.2.3");
+    sin.sin_port = htons(8080);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "oa", NULL, &sin);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+
+    sin.sin_port = htons(9000);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "oa", NULL, &sin);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    sin.sin_addr.s_addr = inet_addr("11.1.2.3");
+    sin.sin_port = htons(8080);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "oa", NULL, &sin);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    /* the deny set wins over the allow set */
+    sin.sin_addr.s_addr = inet_addr("10.0.0.1");
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "oa", NULL, &sin);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_addr.s6_addr[15] = 1;
+    sin6.sin6_port = htons(22);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "oa", NULL, &sin6);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+
+    sin6.sin6_addr.s6_addr[15] = 2;
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "oa", NULL, &sin6);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_LOCAL;
+    strcpy(sun.sun_path, "/tmp/app-1.sock");
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "oa", NULL, &sun);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+
+    strcpy(sun.sun_path, "/tmp/other.sock");
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "oa", NULL, &sun);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    kauth_cred_free(cred);
+    sandbox_destroy(sandbox);
+
+    /* malformed entries are errors when the script loads */
+    sandbox = sandbox_create("sandbox.bind_allow{'10.0.0.0/33'}", &error);
+    CU_ASSERT_EQUAL(sandbox, NULL);
+    CU_ASSERT_NOT_EQUAL(error, 0);
+
+    TEST_END;
+}
+
+static void
+test_on_expression(void)
+{
+    int error = 0;
+    int result = KAUTH_RESULT_DENY;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", "open"}};
+    kauth_cred_t cred;
+
+    TEST_START;
+    
+    sandbox = sandbox_create(
+            "sandbox.on('network.socket.open', "
+            "'domain == sandbox.AF_INET and (type == sandbox.SOCK_STREAM "
+            "or protocol % 2 == 1)')",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    
+    cred = kauth_cred_alloc();
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET, (lua_Integer)SOCK_STREAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET, (lua_Integer)SOCK_DGRAM, (lua_Integer)17);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET, (lua_Integer)SOCK_DGRAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET6, (lua_Integer)SOCK_STREAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    kauth_cred_free(cred);
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_on_combined(void)
+{
+    int error = 0;
+    int result = KAUTH_RESULT_DENY;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", "open"}};
+    kauth_cred_t cred;
+
+    TEST_START;
+    
+    sandbox = sandbox_create(
+            "calls = 0\n"
+            "sandbox.on('network.socket.open', function(req, cred, domain)\n"
+            "    calls = calls + 1\n"
+            "    return domain == sandbox.AF_INET\n"
+            "end)\n"
+            "sandbox.on('network.socket.open', function(req, cred, domain, type)\n"
+            "    calls = calls + 1\n"
+            "    return type == sandbox.SOCK_STREAM\n"
+            "end)\n"
+            "sandbox.on('network.socket.open', function(req, cred, domain, type, protocol)\n"
+            "    if protocol == 1 then error('bad protocol') end\n"
+            "    return true\n"
+            "end)",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    
+    cred = kauth_cred_alloc();
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET, (lua_Integer)SOCK_STREAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET, (lua_Integer)SOCK_DGRAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    /* the first deny skips the remaining functions */
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET6, (lua_Integer)SOCK_STREAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    lua_getglobal(sandbox->K->L, "calls");
+    CU_ASSERT_EQUAL(lua_tointeger(sandbox->K->L, -1), 5);
+    lua_pop(sandbox->K->L, 1);
+
+    /* an error in any function denies */
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET, (lua_Integer)SOCK_STREAM, (lua_Integer)1);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    kauth_cred_free(cred);
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_on_reorder(void)
+{
+    int i = 0;
+    int error = 0;
+    int result = KAUTH_RESULT_ALLOW;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", "open"}};
+    const struct sandbox_rulenode *node = NULL;
+    struct sandbox_ref *dispatcher = NULL;
+    struct sandbox_ref *ref = NULL;
+    kauth_cred_t cred;
+
+    TEST_START;
+    
+    sandbox = sandbox_create(
+            "sandbox.on('network.socket.open', function(req, cred, domain)\n"
+            "    return true\n"
+            "end)\n"
+            "sandbox.on('network.socket.open', function(req, cred, domain)\n"
+            "    local n = 0\n"
+            "    for i = 1, 5000 do n = n + i end\n"
+            "    return n > 0\n"
+            "end, {unordered=true})\n"
+            "sandbox.on('network.socket.open', function(req, cred, domain, type)\n"
+            "    return type == sandbox.SOCK_STREAM\n"
+            "end, {unordered=true})",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    sandbox->flags |= SANDBOX_REORDER;
+
+    cred = kauth_cred_alloc();
+    for (i = 0; i < 2 * SANDBOX_REF_REORDER_PERIOD; i++) {
+        result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+                (lua_Integer)AF_INET, (lua_Integer)SOCK_DGRAM, (lua_Integer)0);
+        CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+    }
+
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    dispatcher = SIMPLEQ_FIRST(&node->funclist);
+    CU_ASSERT_EQUAL(dispatcher->stats.nevals, 2 * SANDBOX_REF_REORDER_PERIOD);
+    CU_ASSERT_EQUAL(dispatcher->stats.ndenies, 2 * SANDBOX_REF_REORDER_PERIOD);
+
+    /* the cheap function that denies now runs before the costly one, but
+     * not before the function that was not marked unordered
+     */
+    ref = SIMPLEQ_FIRST(&dispatcher->members);
+    CU_ASSERT_EQUAL(ref->index, 0);
+    ref = SIMPLEQ_NEXT(ref, ref_next);
+    CU_ASSERT_EQUAL(ref->index, 2);
+    CU_ASSERT_EQUAL(ref->stats.ndenies, ref->stats.nevals);
+    ref = SIMPLEQ_NEXT(ref, ref_next);
+    CU_ASSERT_EQUAL(ref->index, 1);
+    CU_ASSERT(ref->stats.nevals < SANDBOX_REF_REORDER_PERIOD + 1);
+    CU_ASSERT(dispatcher->savednsecs > 0);
+
+    kauth_cred_free(cred);
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_on_pure(void)
+{
+    int error = 0;
+    int result = KAUTH_RESULT_DENY;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", "open"}};
+    const struct sandbox_rulenode *node = NULL;
+    struct sandbox_ref *ref = NULL;
+    kauth_cred_t cred;
+    lua_State *L = NULL;
+
+    TEST_START;
+    
+    sandbox = sandbox_create(
+            "calls = 0\n"
+            "sandbox.on('network.socket.open', function(req, cred, domain)\n"
+            "    calls = calls + 1\n"
+            "    return domain == sandbox.AF_INET\n"
+            "end, {pure=true, key={'domain'}})",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    L = sandbox->K->L;
+    /* the evaluations are only counted for the stats */
+    sandbox_refstats = 1;
+    
+    cred = kauth_cred_alloc();
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET, (lua_Integer)SOCK_STREAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET, (lua_Integer)SOCK_DGRAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET6, (lua_Integer)SOCK_STREAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET6, (lua_Integer)SOCK_DGRAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    /* once per domain */
+    lua_getglobal(L, "calls");
+    CU_ASSERT_EQUAL(lua_tointeger(L, -1), 2);
+    lua_pop(L, 1);
+
+    node = sandbox_ruleset_search(sandbox->ruleset, &rule);
+    ref = SIMPLEQ_FIRST(&node->funclist);
+    CU_ASSERT_EQUAL(ref->memo->nhits, 2);
+    CU_ASSERT_EQUAL(ref->memo->nmisses, 2);
+    CU_ASSERT_EQUAL(ref->stats.nevals, 4);
+    sandbox_refstats = 0;
+
+    /* sandbox.invalidate() discards the cached verdicts */
+    CU_ASSERT_EQUAL(luaL_dostring(L, "sandbox.invalidate()"), 0);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET, (lua_Integer)SOCK_STREAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+    lua_getglobal(L, "calls");
+    CU_ASSERT_EQUAL(lua_tointeger(L, -1), 3);
+    lua_pop(L, 1);
+    /* and without the stats, the evaluation is not counted */
+    CU_ASSERT_EQUAL(ref->stats.nevals, 4);
+
+    kauth_cred_free(cred);
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_declarative_closes_lua(void)
+{
+    int error = 0;
+    int result = KAUTH_RESULT_DEFER;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", "open"}};
+    kauth_cred_t cred;
+
+    TEST_START;
+
+    /* the function is constant, and so is demoted to a trilean rule */
+    sandbox = sandbox_create(
+            "sandbox.default('allow')\n"
+            "sandbox.deny('network')\n"
+            "sandbox.when('process.nice', {n={ge=0}})\n"
+            "sandbox.on('network.socket.open', function() return false end)",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    CU_ASSERT_EQUAL(sandbox->K, NULL);
+
+    cred = kauth_cred_alloc();
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET, (lua_Integer)SOCK_STREAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+    kauth_cred_free(cred);
+    sandbox_destroy(sandbox);
+
+    sandbox = sandbox_create(
+            "sandbox.on('network.socket.open', function(req) return req end)",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_NOT_EQUAL(sandbox->K, NULL);
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_lua_state_pool(void)
+{
+    int i = 0;
+    int error = 0;
+    int nfree = 0;
+    uint64_t nhits = 0;
+    uint64_t nmisses = 0;
+    uint64_t nhits2 = 0;
+    uint64_t nmisses2 = 0;
+    struct sandbox *sandbox = NULL;
+
+    TEST_START;
+
+    nfree = sandbox_lua_poolfree();
+    CU_ASSERT(nfree > 0);
+    sandbox_lua_poolstats(&nhits, &nmisses);
+
+    /* more attaches than the pool was prefilled with, each leaving
+     * globals, a string metatable change and a grown registry behind; the
+     * state must go back to the pool every time
+     */
+    for (i = 0; i < TEST_POOL_NCYCLES; i++) {
+        sandbox = sandbox_create(
+                "leak = {}\n"
+                "for i = 1, 64 do leak['k' .. i] = i end\n"
+                "getmetatable('').__index = {}\n"
+                "sandbox.on('network.socket.open', function(req) return req end)",
+                &error);
+        CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+        CU_ASSERT_EQUAL(error, 0);
+        sandbox_destroy(sandbox);
+        CU_ASSERT_EQUAL(sandbox_lua_poolfree(), nfree);
+    }
+
+    /* a pooled state comes without the old script's globals or
+     * metatables
+     */
+    sandbox = sandbox_create(
+            "assert(leak == nil)\n"
+            "assert(getmetatable('').__index == string)\n"
+            "assert(('x'):upper() == 'X')\n"
+            "sandbox.on('network.socket.open', function(req) return req end)",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    sandbox_destroy(sandbox);
+    CU_ASSERT_EQUAL(sandbox_lua_poolfree(), nfree);
+
+    sandbox_lua_poolstats(&nhits2, &nmisses2);
+    CU_ASSERT_EQUAL(nhits2, nhits + TEST_POOL_NCYCLES + 1);
+    CU_ASSERT_EQUAL(nmisses2, nmisses);
+
+    TEST_END;
+}
+
+static void
+test_lua_state_pool_finalizer(void)
+{
+    int error = 0;
+    int result = KAUTH_RESULT_DEFER;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", "open"}};
+    kauth_cred_t cred;
+
+    TEST_START;
+
+    /* an object whose finalizer re-arms itself survives the reset */
+    sandbox = sandbox_create(
+            "local function arm()\n"
+            "    setmetatable({}, {__gc = function()\n"
+            "        arm()\n"
+            "        sandbox.allow('network.socket.open')\n"
+            "    end})\n"
+            "end\n"
+            "arm()\n"
+            "sandbox.default('deny')",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    sandbox_destroy(sandbox);
+
+    /* but it never runs against a later sandbox */
+    sandbox = sandbox_create(
+            "sandbox.default('deny')\n"
+            "collectgarbage()\n"
+            "collectgarbage()",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+
+    cred = kauth_cred_alloc();
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "");
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+    kauth_cred_free(cred);
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_library_profiles(void)
+{
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+
+    TEST_START;
+
+    /* the minimal libraries are there from the start, others on first use */
+    sandbox = sandbox_create(
+            "assert(rawget(_G, 'string') and rawget(_G, 'table'))\n"
+            "assert(rawget(_G, 'coroutine') == nil)\n"
+            "assert(coroutine.running())\n"
+            "assert(rawget(_G, 'coroutine') == coroutine)\n"
+            "coroutine = nil\n"
+            "assert(coroutine == nil)\n"
+            "assert(nosuchglobal == nil)\n"
+            "sandbox.on('network.socket.open', function(req) return req end)",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    CU_ASSERT_FALSE(sandbox->flags & SANDBOX_FULLLIBS);
+    sandbox_destroy(sandbox);
+
+    sandbox = sandbox_create(
+            "--! libs=full\n"
+            "assert(rawget(_G, 'coroutine'))\n"
+            "sandbox.on('network.socket.open', function(req) return req end)",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    CU_ASSERT_TRUE(sandbox->flags & SANDBOX_FULLLIBS);
+    sandbox_destroy(sandbox);
+
+    /* load() takes source but never bytecode */
+    sandbox = sandbox_create(
+            "assert(load('return 1')() == 1)\n"
+            "assert(load(string.dump(function() end)) == nil)\n"
+            "assert(load(string.dump(function() end), 'f', 'b') == nil)\n"
+            "assert(load('return x', 'f', 'bt', {x = 2})() == 2)\n"
+            "sandbox.on('network.socket.open', function(req) return req end)",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    sandbox_destroy(sandbox);
+
+    CU_ASSERT_EQUAL(sandbox_lua_pragmas("--! libs=full\r\n", 0),
+            SANDBOX_FULLLIBS);
+    CU_ASSERT_EQUAL(sandbox_lua_pragmas("--! libs=full\n--! libs=minimal",
+            SANDBOX_REORDER), SANDBOX_REORDER);
+    CU_ASSERT_EQUAL(sandbox_lua_pragmas("\n--! libs=full\n", 0), 0);
+    CU_ASSERT_EQUAL(sandbox_lua_pragmas("--! mode=permissive\n", 0),
+            SANDBOX_PERMISSIVE);
+    CU_ASSERT_EQUAL(sandbox_lua_pragmas(
+            "--! mode=permissive\n--! libs=full\n--! mode=enforcing\n", 0),
+            SANDBOX_FULLLIBS);
+
+    TEST_END;
+}
+
+static void
+test_registry(void)
+{
+    int error = 0;
+    uint64_t id = 0;
+    const char *script =
+        "sandbox.on('network.socket.open', function(req) return req end)";
+    struct sandbox *sandbox = NULL;
+    struct sandbox *other = NULL;
+
+    TEST_START;
+
+    id = sandbox_registry_id(script, NULL, 0, 0);
+    CU_ASSERT_EQUAL(sandbox_registry_lookup(id, script, NULL, 0, 0, NULL),
+            NULL);
+
+    sandbox = sandbox_create(script, &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(sandbox_registry_insert(sandbox, id, script, NULL, 0, 0),
+            sandbox);
+
+    /* only the same policy on the same stack is shared */
+    other = sandbox_registry_lookup(id, script, NULL, 0, 0, NULL);
+    CU_ASSERT_EQUAL(other, sandbox);
+    CU_ASSERT_EQUAL(sandbox->refcnt, 2);
+    sandbox_destroy(other);
+    CU_ASSERT_EQUAL(sandbox_registry_lookup(id, script, NULL, 0,
+            SANDBOX_REORDER, NULL), NULL);
+    CU_ASSERT_EQUAL(sandbox_registry_lookup(id, script, NULL, 0, 0, sandbox),
+            NULL);
+    CU_ASSERT_EQUAL(sandbox_registry_lookup(id, "", NULL, 0, 0, NULL), NULL);
+    CU_ASSERT_EQUAL(sandbox_registry_lookup(id, script, "a\0b", 4, 0, NULL),
+            NULL);
+
+    /* a pinned sandbox outlives its last user */
+    CU_ASSERT_EQUAL(sandbox_registry_pin(sandbox), 0);
+    sandbox_destroy(sandbox);
+    other = sandbox_registry_lookupid(id);
+    CU_ASSERT_EQUAL(other, sandbox);
+    sandbox_destroy(other);
+
+    CU_ASSERT_EQUAL(sandbox_registry_unpin(id), 0);
+    CU_ASSERT_EQUAL(sandbox_registry_unpin(id), ENOENT);
+    CU_ASSERT_EQUAL(sandbox_registry_lookupid(id), NULL);
+    CU_ASSERT_EQUAL(sandbox_registry_lookup(id, script, NULL, 0, 0, NULL),
+            NULL);
+
+    TEST_END;
+}
+
+static void
+test_chunk_cache(void)
+{
+    int i = 0;
+    int error = 0;
+    int result = KAUTH_RESULT_DEFER;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", "open"}};
+    struct sandbox_chunkcache_stats before;
+    struct sandbox_chunkcache_stats after;
+    kauth_cred_t cred;
+
+    TEST_START;
+
+    sandbox_chunkcache_stats(&before);
+
+    /* parsed the first time, loaded from the cache the second */
+    cred = kauth_cred_alloc();
+    for (i = 0; i < 2; i++) {
+        sandbox = sandbox_create(
+                "-- test_chunk_cache\n"
+                "local calls = 0\n"
+                "sandbox.on('network.socket.open', function()\n"
+                "    calls = calls + 1\n"
+                "    return calls == 1\n"
+                "end)",
+                &error);
+        CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+        CU_ASSERT_EQUAL(error, 0);
+        result = sandbox_eval(sandbox, cred, &rule, NULL, "");
+        CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+        result = sandbox_eval(sandbox, cred, &rule, NULL, "");
+        CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+        sandbox_destroy(sandbox);
+    }
+    kauth_cred_free(cred);
+
+    sandbox_chunkcache_stats(&after);
+    CU_ASSERT_EQUAL(after.nmisses, before.nmisses + 1);
+    CU_ASSERT_EQUAL(after.nhits, before.nhits + 1);
+
+    /* binary chunks are only ever loaded from the cache */
+    sandbox = sandbox_create("\033Lua", &error);
+    CU_ASSERT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, EINVAL);
+
+    TEST_END;
+}
+
+static void
+test_template(void)
+{
+    int i = 0;
+    int error = 0;
+    int result = KAUTH_RESULT_DEFER;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", "open"}};
+    struct sandbox_chunkcache_stats before;
+    struct sandbox_chunkcache_stats after;
+    const char *script =
+        "-- test_template\n"
+        "local allow = sandbox.params.allow\n"
+        "sandbox.on('network.socket.open', function()\n"
+        "    return allow == 'yes'\n"
+        "end)";
+    /* the instances are bound to different parameters */
+    const struct {
+        const char *params;
+        size_t paramslen;
+        int result;
+    } instances[] = {
+        { "allow\0yes\0", sizeof("allow\0yes\0"), KAUTH_RESULT_ALLOW },
+        { "allow\0no\0", sizeof("allow\0no\0"), KAUTH_RESULT_DENY },
+        { NULL, 0, KAUTH_RESULT_DENY },
+    };
+    kauth_cred_t cred;
+
+    TEST_START;
+
+    sandbox_chunkcache_stats(&before);
+
+    cred = kauth_cred_alloc();
+    for (i = 0; i < (int)(sizeof(instances) / sizeof(instances[0])); i++) {
+        sandbox = sandbox_create_template(script, instances[i].params,
+                instances[i].paramslen, &error);
+        CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+        CU_ASSERT_EQUAL(error, 0);
+        result = sandbox_eval(sandbox, cred, &rule, NULL, "");
+        CU_ASSERT_EQUAL(result, instances[i].result);
+        sandbox_destroy(sandbox);
+    }
+    kauth_cred_free(cred);
+
+    /* the template is compiled once for all of its instances */
+    sandbox_chunkcache_stats(&after);
+    CU_ASSERT_EQUAL(after.nmisses, before.nmisses + 1);
+    CU_ASSERT_EQUAL(after.nhits, before.nhits + 2);
+
+    TEST_END;
+}
+
+static void
+test_scopes(void)
+{
+    int i = 0;
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+    const struct {
+        const char *script;
+        int scopes;
+    } policies[] = {
+        { "sandbox.allow('network.socket')", SANDBOX_SCOPE_ALL },
+        { "sandbox.default('defer')", 0 },
+        { "sandbox.default('defer')\n"
+          "sandbox.allow('network.socket')\n"
+          "sandbox.deny('vnode.write_data')",
+          SANDBOX_SCOPE_NETWORK | SANDBOX_SCOPE_VNODE },
+        { "sandbox.default('defer')\n"
+          "sandbox.on('process.signal', function() return false end)",
+          SANDBOX_SCOPE_PROCESS },
+    };
+
+    TEST_START;
+
+    /* only these scopes' listeners are needed for the sandboxes */
+    for (i = 0; i < (int)(sizeof(policies) / sizeof(policies[0])); i++) {
+        sandbox = sandbox_create(policies[i].script, &error);
+        CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+        CU_ASSERT_EQUAL(error, 0);
+        CU_ASSERT_EQUAL(sandbox->scopes, policies[i].scopes);
+        sandbox_destroy(sandbox);
+    }
+
+    TEST_END;
+}
+
+static void
+test_object_caches(void)
+{
+    int i = 0;
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_list *sandbox_list = NULL;
+    struct sandbox_objcache_stats before[SANDBOX_OBJCACHE_NTYPES];
+    struct sandbox_objcache_stats after[SANDBOX_OBJCACHE_NTYPES];
+
+    TEST_START;
+
+    sandbox_objcache_stats(before);
+
+    sandbox_list = sandbox_list_create();
+    sandbox = sandbox_create(
+            "sandbox.default('defer')\n"
+            "sandbox.allow('network.socket')\n"
+            "sandbox.on('process.signal', function() return false end)",
+            &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    SLIST_INSERT_HEAD(&sandbox_list->head, sandbox, sandbox_next);
+
+    sandbox_objcache_stats(after);
+    CU_ASSERT_EQUAL(after[SANDBOX_OBJCACHE_LIST].nallocs,
+            before[SANDBOX_OBJCACHE_LIST].nallocs + 1);
+    CU_ASSERT_EQUAL(after[SANDBOX_OBJCACHE_SANDBOX].nallocs,
+            before[SANDBOX_OBJCACHE_SANDBOX].nallocs + 1);
+    CU_ASSERT_EQUAL(after[SANDBOX_OBJCACHE_RULESET].nallocs,
+            before[SANDBOX_OBJCACHE_RULESET].nallocs + 1);
+    CU_ASSERT(after[SANDBOX_OBJCACHE_REF].nallocs >
+            before[SANDBOX_OBJCACHE_REF].nallocs);
+
+    /* every object goes back to its cache */
+    sandbox_list_destroy(sandbox_list);
+    sandbox_objcache_stats(after);
+    for (i = 0; i < SANDBOX_OBJCACHE_NTYPES; i++)
+        CU_ASSERT_EQUAL(after[i].nallocs - before[i].nallocs,
+                after[i].nfrees - before[i].nfrees);
+
+    TEST_END;
+}
+
+static void
+test_reload(void)
+{
+    int i = 0;
+    int error = 0;
+    int result = KAUTH_RESULT_DENY;
+    uint64_t id = 0;
+    const char *script = "sandbox.allow('network.socket')";
+    struct sandbox *sandbox = NULL;
+    struct sandbox *live = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", "open"}};
+    struct sandbox_objcache_stats before[SANDBOX_OBJCACHE_NTYPES];
+    struct sandbox_objcache_stats after[SANDBOX_OBJCACHE_NTYPES];
+    kauth_cred_t cred;
+
+    TEST_START;
+
+    sandbox_objcache_stats(before);
+    cred = kauth_cred_alloc();
+
+    sandbox = sandbox_create(script, &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(sandbox->live, sandbox);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, NULL);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+
+    /* the sandbox's own policy is released once the first version is live */
+    error = sandbox_reload(sandbox, "sandbox.deny('network.socket')", NULL, 0);
+    CU_ASSERT_EQUAL(error, 0);
+    CU_ASSERT_NOT_EQUAL(sandbox->live, sandbox);
+    CU_ASSERT_EQUAL(sandbox->ruleset, NULL);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, NULL);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    /* a version with functions replaces a declarative one */
+    live = sandbox->live;
+    error = sandbox_reload(sandbox,
+            "sandbox.on('network.socket', function() return true end)",
+            NULL, 0);
+    CU_ASSERT_EQUAL(error, 0);
+    CU_ASSERT_NOT_EQUAL(sandbox->live, live);
+    CU_ASSERT_NOT_EQUAL(sandbox->live->K, NULL);
+    CU_ASSERT_EQUAL(sandbox->live->nevals, 0);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, NULL);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+    CU_ASSERT_EQUAL(sandbox->live->nevals, 0);
+
+    /* a script that does not load leaves the live version in place */
+    live = sandbox->live;
+    error = sandbox_reload(sandbox, "sandbox.allow(", NULL, 0);
+    CU_ASSERT_NOT_EQUAL(error, 0);
+    CU_ASSERT_EQUAL(sandbox->live, live);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, NULL);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_ALLOW);
+
+    /* every version goes back to its cache */
+    kauth_cred_free(cred);
+    sandbox_destroy(sandbox);
+    sandbox_objcache_stats(after);
+    CU_ASSERT_EQUAL(after[SANDBOX_OBJCACHE_SANDBOX].nallocs,
+            before[SANDBOX_OBJCACHE_SANDBOX].nallocs + 4);
+
+    /* a registered sandbox stands for its script */
+    id = sandbox_registry_id(script, NULL, 0, 0);
+    sandbox = sandbox_create(script, &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(sandbox_registry_insert(sandbox, id, script, NULL, 0, 0),
+            sandbox);
+    error = sandbox_reload(sandbox, "sandbox.deny('network')", NULL, 0);
+    CU_ASSERT_EQUAL(error, EBUSY);
+    CU_ASSERT_EQUAL(sandbox->live, sandbox);
+    sandbox_destroy(sandbox);
+
+    sandbox_objcache_stats(after);
+    for (i = 0; i < SANDBOX_OBJCACHE_NTYPES; i++)
+        CU_ASSERT_EQUAL(after[i].nallocs - before[i].nallocs,
+                after[i].nfrees - before[i].nfrees);
+
+    TEST_END;
+}
+
+static void
+test_reloadable(void)
+{
+    int i = 0;
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+    const struct {
+        const char *script;
+        int reloadable;
+    } policies[] = {
+        { "sandbox.default('allow')", 0 },
+        { "sandbox.allow('sandbox')", 0 },
+        { "sandbox.default('allow')\n"
+          "sandbox.on('sandbox.reload', function() return true end)", 0 },
+        { "sandbox.allow('sandbox.reload')", 1 },
+    };
+
+    TEST_START;
+
+    /* only a rule on sandbox.reload itself lets a process reload */
+    for (i = 0; i < (int)(sizeof(policies) / sizeof(policies[0])); i++) {
+        sandbox = sandbox_create(policies[i].script, &error);
+        CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+        CU_ASSERT_EQUAL(error, 0);
+        CU_ASSERT_EQUAL(sandbox_reloadable(sandbox), policies[i].reloadable);
+        sandbox_destroy(sandbox);
+    }
+
+    /* and the rule is read from the live version */
+    sandbox = sandbox_create("sandbox.allow('sandbox.reload')", &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    error = sandbox_reload(sandbox, "sandbox.default('allow')", NULL, 0);
+    CU_ASSERT_EQUAL(error, 0);
+    CU_ASSERT_FALSE(sandbox_reloadable(sandbox));
+    sandbox_destroy(sandbox);
+
+    TEST_END;
+}
+
+static void
+test_permissive(void)
+{
+    int error = 0;
+    int result = KAUTH_RESULT_ALLOW;
+    uint64_t queued = 0, dropped = 0, denies = 0;
+    uint64_t queued0 = 0, dropped0 = 0, denies0 = 0;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {"network", "socket", "open"}};
+    kauth_cred_t cred;
+    const char *script =
+        "sandbox.on('network.socket.open', function(req, cred, domain)\n"
+        "    local n = 0\n"
+        "    for i = 1, 3 do n = n + i end\n"
+        "    return n < 0\n"
+        "end)";
+    char permissive[256];
+
+    TEST_START;
+
+    cred = kauth_cred_alloc();
+
+    /* enforcing, the function denies */
+    sandbox = sandbox_create(script, &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET, (lua_Integer)SOCK_STREAM, (lua_Integer)0);
+    CU_ASSERT_EQUAL(result, KAUTH_RESULT_DENY);
+    sandbox_destroy(sandbox);
+
+    /* permissive, the request goes through, and the function only runs
+     * once the queue is drained
+     */
+    snprintf(permissive, sizeof(permissive), "--! mode=permissive\n%s",
+            script);
+    sandbox = sandbox_create(permissive, &error);
+    CU_ASSERT_NOT_EQUAL(sandbox, NULL);
+    CU_ASSERT_EQUAL(error, 0);
+    CU_ASSERT_TRUE(sandbox->flags & SANDBOX_PERMISSIVE);
+
+    sandbox_permissive_stats(&queued0, &dropped0, &denies0);
+    result = sandbox_eval(sandbox, cred, &rule, NULL, "iii",
+            (lua_Integer)AF_INET, (lua_Integer)SOCK_STREAM, (lua_Integer)0);
+    CU_ASSERT_NOT_EQUAL(result, KAUTH_RESULT_DENY);
+
+    sandbox_permissive_stats(&queued, &dropped, &denies);
+    CU_ASSERT_EQUAL(queued, queued0 + 1);
+    CU_ASSERT_EQUAL(dropped, dropped0);
+    CU_ASSERT_EQUAL(denies, denies0);
+    CU_ASSERT_EQUAL(sandbox->nevals, 1);
+
+    sandbox_permissive_drain();
+    sandbox_permissive_stats(&queued, &dropped, &denies);
+    CU_ASSERT_EQUAL(queued, queued0);
+    CU_ASSERT_EQUAL(dropped, dropped0);
+    CU_ASSERT_EQUAL(denies, denies0 + 1);
+    CU_ASSERT_EQUAL(sandbox->nevals, 0);
+
+    sandbox_destroy(sandbox);
+    kauth_cred_free(cred);
+
+    TEST_END;
+}
+
 static CU_TestInfo suite_tests[] = {
     {"allow action", test_allow_action},
     {"deny action", test_deny_action},
@@ -170,6 +1314,29 @@ static CU_TestInfo suite_tests[] = {
     {"eval subaction for scope rule", test_eval_subaction_for_scope_rule},
     {"eval subaction for default rule", test_eval_subaction_for_default_rule},
 
+    {"when set", test_when_set},
+    {"when compare field", test_when_compare_field},
+    {"require relations", test_require_relations},
+    {"bind addresses", test_bind_addresses},
+
+    {"on expression", test_on_expression},
+    {"on combined", test_on_combined},
+    {"on reorder", test_on_reorder},
+    {"on pure", test_on_pure},
+
+    {"declarative closes lua", test_declarative_closes_lua},
+    {"lua state pool", test_lua_state_pool},
+    {"lua state pool finalizer", test_lua_state_pool_finalizer},
+    {"library profiles", test_library_profiles},
+    {"registry", test_registry},
+    {"chunk cache", test_chunk_cache},
+    {"template", test_template},
+    {"scopes", test_scopes},
+    {"object caches", test_object_caches},
+    {"reload", test_reload},
+    {"reloadable", test_reloadable},
+    {"permissive", test_permissive},
+
     CU_TEST_INFO_NULL
 };
 
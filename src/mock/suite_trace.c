@@ -0,0 +1,195 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include <CUnit/CUnit.h>
+#include "test_util.h"
+
+#include "sandbox_log.h"
+#include "sandbox_trace.h"
+
+#define TEST_TRACE_SITE(fmt) \
+    { .file = __FILE__, .func = __func__, .format = (fmt), .line = __LINE__ }
+
+static struct sandbox_tracerec test_trace_recs[SANDBOX_TRACE_NRECS];
+
+/* reads up to nrecs records into test_trace_recs */
+static void
+test_trace_read(struct sandbox_trace *trace, size_t nrecs)
+{
+    int error = 0;
+
+    memset(trace, 0, sizeof(*trace));
+    trace->recs = test_trace_recs;
+    trace->nrecs = nrecs;
+    error = sandbox_trace_read(trace);
+    CU_ASSERT_EQUAL(error, 0);
+}
+
+/* empties the ring of whatever the other tests left in it */
+static void
+test_trace_drain(void)
+{
+    struct sandbox_trace trace;
+
+    do {
+        test_trace_read(&trace, SANDBOX_TRACE_NRECS);
+    } while (trace.nrecs != 0);
+}
+
+static void
+test_trace_roundtrip(void)
+{
+    int error = 0;
+    struct sandbox_tracesite site = TEST_TRACE_SITE("%s has %d rules (%lu)\n");
+    struct sandbox_tracefmt tf;
+    struct sandbox_trace trace;
+    struct sandbox_tracerec *rec = &test_trace_recs[0];
+
+    TEST_START;
+
+    test_trace_drain();
+
+    sandbox_trace(&site, SANDBOX_TRACE_LUA, SANDBOX_LOG_LEVEL_INFO,
+            "policy", -3, 1UL << 40);
+    CU_ASSERT_NOT_EQUAL(site.id, 0);
+
+    test_trace_read(&trace, SANDBOX_TRACE_NRECS);
+    CU_ASSERT_EQUAL(trace.nrecs, 1);
+    CU_ASSERT_EQUAL(trace.nlost, 0);
+    CU_ASSERT_EQUAL(rec->fmtid, site.id);
+    CU_ASSERT_EQUAL(rec->subsys, SANDBOX_TRACE_LUA);
+    CU_ASSERT_EQUAL(rec->level, SANDBOX_LOG_LEVEL_INFO);
+    CU_ASSERT_STRING_EQUAL(rec->strs + rec->args[0], "policy");
+    CU_ASSERT_EQUAL((int)rec->args[1], -3);
+    CU_ASSERT_EQUAL(rec->args[2], 1UL << 40);
+
+    memset(&tf, 0, sizeof(tf));
+    tf.id = rec->fmtid;
+    error = sandbox_trace_getfmt(&tf);
+    CU_ASSERT_EQUAL(error, 0);
+    CU_ASSERT_STRING_EQUAL(tf.fmt, site.format);
+    CU_ASSERT_STRING_EQUAL(tf.func, "test_trace_roundtrip");
+    CU_ASSERT_EQUAL(tf.line, site.line);
+
+    /* a record is read only once */
+    test_trace_read(&trace, SANDBOX_TRACE_NRECS);
+    CU_ASSERT_EQUAL(trace.nrecs, 0);
+
+    TEST_END;
+}
+
+static void
+test_trace_partial(void)
+{
+    int i = 0;
+    struct sandbox_tracesite site = TEST_TRACE_SITE("%d\n");
+    struct sandbox_trace trace;
+
+    TEST_START;
+
+    test_trace_drain();
+
+    for (i = 0; i < 3; i++)
+        sandbox_trace(&site, SANDBOX_TRACE_CORE, SANDBOX_LOG_LEVEL_WARN, i);
+
+    /* a short buffer leaves the rest for the next read */
+    test_trace_read(&trace, 2);
+    CU_ASSERT_EQUAL(trace.nrecs, 2);
+    CU_ASSERT_EQUAL(test_trace_recs[0].args[0], 0);
+    CU_ASSERT_EQUAL(test_trace_recs[1].args[0], 1);
+
+    test_trace_read(&trace, SANDBOX_TRACE_NRECS);
+    CU_ASSERT_EQUAL(trace.nrecs, 1);
+    CU_ASSERT_EQUAL(trace.nlost, 0);
+    CU_ASSERT_EQUAL(test_trace_recs[0].args[0], 2);
+
+    TEST_END;
+}
+
+static void
+test_trace_wraparound(void)
+{
+    int i = 0;
+    int nextra = 37;
+    size_t j = 0;
+    struct sandbox_tracesite site = TEST_TRACE_SITE("%d\n");
+    struct sandbox_trace trace;
+
+    TEST_START;
+
+    test_trace_drain();
+
+    /* the oldest nextra records are overwritten before they are read */
+    for (i = 0; i < SANDBOX_TRACE_NRECS + nextra; i++)
+        sandbox_trace(&site, SANDBOX_TRACE_CORE, SANDBOX_LOG_LEVEL_WARN, i);
+
+    test_trace_read(&trace, SANDBOX_TRACE_NRECS);
+    CU_ASSERT_EQUAL(trace.nrecs, SANDBOX_TRACE_NRECS);
+    CU_ASSERT_EQUAL(trace.nlost, nextra);
+    for (j = 0; j < trace.nrecs; j++) {
+        if (test_trace_recs[j].args[0] != nextra + j) {
+            CU_FAIL("records out of order");
+            break;
+        }
+    }
+
+    /* the loss is reported once */
+    sandbox_trace(&site, SANDBOX_TRACE_CORE, SANDBOX_LOG_LEVEL_WARN, -1);
+    test_trace_read(&trace, SANDBOX_TRACE_NRECS);
+    CU_ASSERT_EQUAL(trace.nrecs, 1);
+    CU_ASSERT_EQUAL(trace.nlost, 0);
+    CU_ASSERT_EQUAL((int)test_trace_recs[0].args[0], -1);
+
+    TEST_END;
+}
+
+static CU_TestInfo suite_tests[] = {
+    {"trace roundtrip", test_trace_roundtrip},
+    {"trace partial read", test_trace_partial},
+    {"trace wraparound", test_trace_wraparound},
+
+    CU_TEST_INFO_NULL
+};
+
+static CU_SuiteInfo suite_trace = {
+    .pName = "sandbox_trace suite",
+    .pInitFunc = NULL,
+    .pCleanupFunc = NULL,
+    .pSetUpFunc = NULL,
+    .pTearDownFunc = NULL,
+    .pTests = suite_tests
+};
+
+CU_SuiteInfo *
+suite_trace_open(void)
+{
+    return (&suite_trace);
+}
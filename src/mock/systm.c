@@ -29,6 +29,7 @@
  */
 
 #include <msys/systm.h>
+#include <msys/timevar.h>
 
 /* Copies a NUL-terminated string, at most len bytes long,
  * from kernel-space address kfaddr to kernel-space address
@@ -49,3 +50,20 @@ copystr(const void *kfaddr, void *kdaddr, size_t len, size_t *done)
 		*done = len;
 	return 0;
 }
+
+/* sleeps for timo ticks, here milliseconds */
+int
+kpause(const char *wmesg, bool intr, int timo, void *mtx)
+{
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = timo * 1000000L };
+
+	nanosleep(&ts, NULL);
+	return 0;
+}
+
+/* the time since boot; here, since an arbitrary fixed point */
+void
+nanouptime(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
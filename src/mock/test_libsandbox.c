@@ -34,12 +34,21 @@
 #include <CUnit/Basic.h>
 #include <CUnit/Console.h>
 
+#include "sandbox_chunkcache.h"
+#include "sandbox_event.h"
 #include "sandbox_log.h"
+#include "sandbox_lua.h"
+#include "sandbox_objcache.h"
+#include "sandbox_permissive.h"
+#include "sandbox_registry.h"
+#include "sandbox_trace.h"
 
 #include "suite_rule.h"
 #include "suite_ruleset.h"
 #include "suite_lua.h"
 #include "suite_sandbox.h"
+#include "suite_trace.h"
+#include "suite_event.h"
 
 #define ADD_SUITE(name) \
     do { \
@@ -98,10 +107,21 @@ int main(int argc, char *argv[])
         goto done;
     }
 
+    sandbox_trace_init();
+    sandbox_event_init();
+    sandbox_objcache_init();
+    sandbox_chunkcache_init();
+    sandbox_lua_init();
+    sandbox_registry_init();
+    sandbox_init();
+    sandbox_permissive_init();
+
     ADD_SUITE(suite_rule);
     ADD_SUITE(suite_ruleset);
     ADD_SUITE(suite_lua);
     ADD_SUITE(suite_sandbox);
+    ADD_SUITE(suite_trace);
+    ADD_SUITE(suite_event);
 
     CU_basic_set_mode(CU_BRM_VERBOSE);  /* CU_BRM_NORMAL */
     CU_set_error_action(CUEA_ABORT);
@@ -110,6 +130,15 @@ int main(int argc, char *argv[])
     else
         CU_basic_run_tests();
 
+    sandbox_permissive_fini();
+    sandbox_fini();
+    sandbox_registry_fini();
+    sandbox_lua_fini();
+    sandbox_chunkcache_fini();
+    sandbox_objcache_fini();
+    sandbox_event_fini();
+    sandbox_trace_fini();
+
 done:
     CU_cleanup_registry();
     return (result);
@@ -0,0 +1,82 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <msys/types.h>
+#include <msys/kmem.h>
+#include <msys/queue.h>
+#include <msys/systm.h>
+#include <msys/workqueue.h>
+
+struct workqueue {
+    SIMPLEQ_HEAD(, work) wq_queue;
+    void (*wq_func)(struct work *, void *);
+    void *wq_arg;
+};
+
+int
+workqueue_create(struct workqueue **wqp, const char *name,
+        void (*func)(struct work *, void *), void *arg, int prio, int ipl,
+        int flags)
+{
+    struct workqueue *wq = NULL;
+
+    wq = kmem_zalloc(sizeof(*wq), KM_SLEEP);
+    SIMPLEQ_INIT(&wq->wq_queue);
+    wq->wq_func = func;
+    wq->wq_arg = arg;
+
+    *wqp = wq;
+    return (0);
+}
+
+/* the caller has drained the queue, as the kernel's waits for its thread */
+void
+workqueue_destroy(struct workqueue *wq)
+{
+    KASSERT(SIMPLEQ_EMPTY(&wq->wq_queue));
+    kmem_free(wq, sizeof(*wq));
+}
+
+void
+workqueue_enqueue(struct workqueue *wq, struct work *wk, struct cpu_info *ci)
+{
+    SIMPLEQ_INSERT_TAIL(&wq->wq_queue, wk, wk_entry);
+}
+
+/* runs the queued work, and any that it queues, in order */
+void
+workqueue_drain(struct workqueue *wq)
+{
+    struct work *wk = NULL;
+
+    while ((wk = SIMPLEQ_FIRST(&wq->wq_queue)) != NULL) {
+        SIMPLEQ_REMOVE_HEAD(&wq->wq_queue, wk_entry);
+        wq->wq_func(wk, wq->wq_arg);
+    }
+}
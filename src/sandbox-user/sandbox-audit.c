@@ -0,0 +1,247 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/atomic.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sandbox.h"
+
+#define NEVENTS         65536
+#define SEQSPINS        1024    /* reads of an unwritten event's seq
+                                   before sleeping between them */
+
+static void 
+usage(void)
+{
+    fprintf(stderr, 
+            "usage: sandbox-audit [OPTION]\n"
+            "\n"
+            "  Starts recording the requests that sandboxes decide, as\n"
+            "  sampled by their policies' sandbox.audit() rates, and prints\n"
+            "  them from the kernel's event ring until interrupted.\n"
+            "\n"
+            "  options:\n"
+            "    -n NEVENTS\n"
+            "      the length of the ring, a power of two, if it is not yet\n"
+            "      allocated (default: %d)\n"
+            "    -h\n"
+            "      display this help message\n", NEVENTS);
+    exit(1);
+}
+
+static void
+print_obj(const struct sandbox_event *ev)
+{
+    char buf[INET6_ADDRSTRLEN];
+
+    switch (ev->objtype) {
+    case SANDBOX_EVENT_OBJ_VNODE:
+        printf(" fsid=%" PRIx64 " fileid=%" PRIu64,
+                ev->obj.vnode.fsid, ev->obj.vnode.fileid);
+        break;
+    case SANDBOX_EVENT_OBJ_SOCKADDR:
+        switch (ev->obj.sockaddr.family) {
+        case AF_INET:
+        case AF_INET6:
+            if (inet_ntop(ev->obj.sockaddr.family, ev->obj.sockaddr.addr,
+                        buf, sizeof(buf)) == NULL)
+                strcpy(buf, "?");
+            printf(ev->obj.sockaddr.family == AF_INET ? " %s:%u" :
+                    " [%s]:%u", buf, (unsigned int)ev->obj.sockaddr.port);
+            break;
+        case AF_LOCAL:
+            printf(" unix:%.*s", SANDBOX_EVENT_PATHLEN,
+                    ev->obj.sockaddr.path);
+            break;
+        default:
+            printf(" family=%u", (unsigned int)ev->obj.sockaddr.family);
+            break;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static const char *
+resultname(int result)
+{
+    switch (result) {
+    case SANDBOX_EVENT_ALLOW:
+        return ("allow");
+    case SANDBOX_EVENT_DENY:
+        return ("deny ");
+    case SANDBOX_EVENT_WOULDDENY:
+        return ("would-deny");
+    default:
+        return ("?");
+    }
+}
+
+static void
+print_event(const struct sandbox_event *ev)
+{
+    int i = 0;
+
+    printf("%" PRIu64 ".%09" PRIu64 " %d.%d uid=%u %s ",
+            ev->nsecs / 1000000000, ev->nsecs % 1000000000,
+            (int)ev->pid, (int)ev->lid, (unsigned int)ev->uid,
+            resultname(ev->result));
+
+    for (i = 0; i < 3 && ev->names[i][0] != '\0'; i++)
+        printf("%s%.*s", i > 0 ? "." : "", SANDBOX_EVENT_NAMELEN,
+                ev->names[i]);
+    printf(" rule=%" PRIu32 "/%u", ev->ruleid, (unsigned int)ev->level);
+    print_obj(ev);
+    putchar('\n');
+}
+
+/* Consumes the ring from its tail.  The kernel reserves an event before it
+ * writes it, so an event between tail and head may not be written yet;
+ * its seq says when it is.  The writer may be preempted in between, so
+ * after SEQSPINS reads the wait sleeps a millisecond at a time: poll() on
+ * the device would not sleep, since the reserved event counts as pending.
+ */
+static void
+consume(int fd, struct sandbox_eventring *ring)
+{
+    int spins = 0;
+    uint64_t tail = 0;
+    uint64_t dropped = 0;
+    struct pollfd pfd;
+    const struct sandbox_event *ev = NULL;
+    const struct sandbox_event *events = NULL;
+
+    events = (const struct sandbox_event *)((char *)ring + ring->offset);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    for (;;) {
+        tail = ring->tail;
+        if (tail == ring->head) {
+            fflush(stdout);
+            (void)poll(&pfd, 1, -1);
+            continue;
+        }
+
+        ev = &events[tail & (ring->nevents - 1)];
+        /* seq is volatile, so each test loads it anew; the barrier orders
+         * the loads of the event's other fields after the last one
+         */
+        for (spins = 0; ev->seq != tail + 1; spins++) {
+            if (spins == SEQSPINS) {
+                (void)poll(NULL, 0, 1);
+                spins = 0;
+            }
+        }
+        membar_consumer();
+        print_event(ev);
+        membar_exit();
+        ring->tail = tail + 1;
+
+        if (ring->ndropped != dropped) {
+            printf("-- %" PRIu64 " events dropped\n",
+                    ring->ndropped - dropped);
+            dropped = ring->ndropped;
+        }
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    int c = 0;
+    int fd = -1;
+    struct sandbox_events events;
+    struct sandbox_eventring *ring = NULL;
+
+    events.nevents = NEVENTS;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "n:h")) != -1) {
+        switch (c) {
+        case 'n':
+            events.nevents = strtoul(optarg, NULL, 0);
+            if (events.nevents == 0)
+                usage();
+            break;
+        case 'h':
+            usage();
+        case '?':
+            fprintf(stderr, "unknown option '%c'\n", (char)optopt);
+            exit(1);
+        default:
+            usage();
+        }
+    }
+
+    fd = open(SANDBOX_DEVICE, O_RDWR);
+    if (fd == -1) {
+        fprintf(stderr, "can't open %s: '%s'\n", SANDBOX_DEVICE,
+                strerror(errno));
+        return (1);
+    }
+
+    if (ioctl(fd, SANDBOX_IOC_EVENTS, &events) == -1) {
+        fprintf(stderr, "SANDBOX_IOC_EVENTS failed: '%s'%s\n",
+                strerror(errno), errno == EBUSY ?
+                " (the ring was allocated with another length)" : "");
+        goto fail;
+    }
+
+    ring = mmap(NULL, events.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+            0);
+    if (ring == MAP_FAILED) {
+        fprintf(stderr, "mmap() failed: '%s'\n", strerror(errno));
+        goto fail;
+    }
+
+    if (ring->eventsize != sizeof(struct sandbox_event)) {
+        fprintf(stderr, "the kernel's event ring is of another version\n");
+        goto fail;
+    }
+
+    consume(fd, ring);
+
+fail:
+    (void)close(fd);
+    return (1);
+}
@@ -28,6 +28,7 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,12 +41,21 @@ usage(void)
 {
     fprintf(stderr, 
             "usage: sandbox-exec [OPTION] script prog prog-args...\n"
+            "       sandbox-exec -i id prog prog-args...\n"
             "\n"
             "  options:\n"
             "    -h\n"
             "      display this help message\n"
+            "    -i id\n"
+            "      attach the policy preloaded with sandbox-preload as id\n"
             "    -k\n"
-            "      if process attempts a denied operation, kill the process\n");
+            "      if process attempts a denied operation, kill the process\n"
+            "    -l\n"
+            "      open every Lua library when the sandbox is created, rather\n"
+            "      than when the script first uses it\n"
+            "    -p\n"
+            "      decide by the script's native rules only, and run its\n"
+            "      functions afterwards to record what they would deny\n");
     exit(1);
 }
 
@@ -55,13 +65,26 @@ main(int argc, char *argv[])
     int error = 0;
     int c = 0;
     int flags = 0;
+    int useid = 0;
+    uint64_t id = 0;
+    char **prog = NULL;
 
     opterr = 0;
-    while ((c = getopt(argc, argv, "hk")) != -1) {
+    while ((c = getopt(argc, argv, "hi:klp")) != -1) {
         switch (c) {
+        case 'i':
+            useid = 1;
+            id = strtoull(optarg, NULL, 16);
+            break;
         case 'k':
             flags |= SANDBOX_ON_DENY_KILL;
             break;
+        case 'l':
+            flags |= SANDBOX_FULLLIBS;
+            break;
+        case 'p':
+            flags |= SANDBOX_PERMISSIVE;
+            break;
         case 'h':
             usage();
         case '?':
@@ -74,19 +97,33 @@ main(int argc, char *argv[])
     argc -= optind;
     argv += optind;
 
-    if (argc < 2)
-        usage();
+    if (useid) {
+        if (argc < 1)
+            usage();
 
-    error = sandbox_from_file(argv[0], flags);
-    if (error == -1) {
-        fprintf(stderr, "sandbox_from_file('%s') failed: '%s'\n", argv[0], strerror(errno));
-        error = 1;
-        goto fail;
+        error = sandbox_attach_id(id);
+        if (error == -1) {
+            fprintf(stderr, "sandbox_attach_id(%016" PRIx64 ") failed: '%s'\n", id, strerror(errno));
+            error = 1;
+            goto fail;
+        }
+        prog = argv;
+    } else {
+        if (argc < 2)
+            usage();
+
+        error = sandbox_from_file(argv[0], flags);
+        if (error == -1) {
+            fprintf(stderr, "sandbox_from_file('%s') failed: '%s'\n", argv[0], strerror(errno));
+            error = 1;
+            goto fail;
+        }
+        prog = &argv[1];
     }
 
-    error = execv(argv[1], &argv[1]);
+    error = execv(prog[0], prog);
     if (error == -1) {
-        fprintf(stderr, "execv('%s', ...) failed: '%s'\n", argv[1], strerror(errno));
+        fprintf(stderr, "execv('%s', ...) failed: '%s'\n", prog[0], strerror(errno));
         error = 1;
         goto fail;
     }
@@ -0,0 +1,125 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sandbox.h"
+
+static void 
+usage(void)
+{
+    fprintf(stderr, 
+            "usage: sandbox-preload [OPTION] script\n"
+            "       sandbox-preload -u id\n"
+            "\n"
+            "  Makes the policy into a sandbox that outlives this process and\n"
+            "  prints its id, for sandbox-exec -i.\n"
+            "\n"
+            "  options:\n"
+            "    -h\n"
+            "      display this help message\n"
+            "    -k\n"
+            "      if process attempts a denied operation, kill the process\n"
+            "    -l\n"
+            "      open every Lua library when the sandbox is created, rather\n"
+            "      than when the script first uses it\n"
+            "    -p\n"
+            "      decide by the script's native rules only, and run its\n"
+            "      functions afterwards to record what they would deny\n"
+            "    -u id\n"
+            "      unload the policy preloaded as id; processes already in it\n"
+            "      keep it\n");
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int error = 0;
+    int c = 0;
+    int flags = 0;
+    int unload = 0;
+    uint64_t id = 0;
+
+    opterr = 0;
+    while ((c = getopt(argc, argv, "hklpu:")) != -1) {
+        switch (c) {
+        case 'k':
+            flags |= SANDBOX_ON_DENY_KILL;
+            break;
+        case 'l':
+            flags |= SANDBOX_FULLLIBS;
+            break;
+        case 'p':
+            flags |= SANDBOX_PERMISSIVE;
+            break;
+        case 'u':
+            unload = 1;
+            id = strtoull(optarg, NULL, 16);
+            break;
+        case 'h':
+            usage();
+        case '?':
+            fprintf(stderr, "unknown option '%c'\n", (char)optopt);
+            exit(1);
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (unload) {
+        error = sandbox_unload(id);
+        if (error == -1) {
+            fprintf(stderr, "sandbox_unload(%016" PRIx64 ") failed: '%s'\n", id, strerror(errno));
+            error = 1;
+        }
+        goto done;
+    }
+
+    if (argc != 1)
+        usage();
+
+    error = sandbox_preload_file(argv[0], flags, &id);
+    if (error == -1) {
+        fprintf(stderr, "sandbox_preload_file('%s') failed: '%s'\n", argv[0], strerror(errno));
+        error = 1;
+        goto done;
+    }
+    printf("%016" PRIx64 "\n", id);
+
+done:
+    return (error);
+}
@@ -30,17 +30,144 @@
 #include <sys/ioctl.h>
 
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "sandbox.h"
 
+static const char *
+kindname(int kind)
+{
+    switch (kind) {
+    case SANDBOX_FUNCSTAT_LUA:          return "lua";
+    case SANDBOX_FUNCSTAT_EXPR:         return "expr";
+    case SANDBOX_FUNCSTAT_DISPATCHER:   return "dispatch";
+    case SANDBOX_FUNCSTAT_MEMBER:       return "  lua";
+    default:                            return "?";
+    }
+}
+
+static const char *objstat_names[SANDBOX_OBJSTAT_NTYPES] = {
+    [SANDBOX_OBJSTAT_LIST] = "sandbox_list",
+    [SANDBOX_OBJSTAT_SANDBOX] = "sandbox",
+    [SANDBOX_OBJSTAT_RULESET] = "ruleset",
+    [SANDBOX_OBJSTAT_PATH] = "path",
+    [SANDBOX_OBJSTAT_REF] = "ref",
+};
+
+/* prints the sandbox.on() functions of a process, each with its mean cost
+ * and deny rate, and for pure functions, the rate of cache hits
+ */
+static int
+print_funcs(int fd, pid_t pid)
+{
+    int error = 0;
+    size_t i = 0;
+    size_t n = 0;
+    uint64_t saved = 0;
+    struct sandbox_stats stats;
+    struct sandbox_funcstat *fs = NULL;
+
+    stats.pid = pid;
+    stats.funcs = NULL;
+    stats.nfuncs = 0;
+
+    /* the first call counts the functions */
+    error = ioctl(fd, SANDBOX_IOC_STATS, &stats);
+    if (error == -1)
+        goto fail;
+
+    printf("attaches=%" PRIu64 ", mean attach latency=%" PRIu64 " ns\n",
+            stats.nattaches,
+            stats.nattaches ? stats.attachnsecs / stats.nattaches : 0);
+    printf("lua state pool: hits=%" PRIu64 ", misses=%" PRIu64
+            ", hit rate=%.1f%%\n", stats.poolhits, stats.poolmisses,
+            stats.poolhits + stats.poolmisses ?
+            100.0 * stats.poolhits / (stats.poolhits + stats.poolmisses) :
+            0.0);
+    printf("sandbox registry: hits=%" PRIu64 ", misses=%" PRIu64
+            ", hit rate=%.1f%%\n", stats.registryhits, stats.registrymisses,
+            stats.registryhits + stats.registrymisses ?
+            100.0 * stats.registryhits /
+                (stats.registryhits + stats.registrymisses) :
+            0.0);
+    printf("chunk cache: hits=%" PRIu64 ", misses=%" PRIu64
+            ", evictions=%" PRIu64 ", hit rate=%.1f%%\n", stats.chunkhits,
+            stats.chunkmisses, stats.chunkevictions,
+            stats.chunkhits + stats.chunkmisses ?
+            100.0 * stats.chunkhits / (stats.chunkhits + stats.chunkmisses) :
+            0.0);
+    printf("object caches:");
+    for (i = 0; i < SANDBOX_OBJSTAT_NTYPES; i++)
+        printf(" %s=%" PRIu64 "/%" PRIu64, objstat_names[i],
+                stats.objs[i].nallocs - stats.objs[i].nfrees,
+                stats.objs[i].nallocs);
+    printf(" (live/allocated)\n");
+    printf("permissive: queued=%" PRIu64 ", dropped=%" PRIu64
+            ", would-be denies=%" PRIu64 "\n", stats.permqueued,
+            stats.permdropped, stats.permdenies);
+
+    if (stats.nfuncs == 0)
+        goto succeed;
+
+    n = stats.nfuncs;
+    stats.funcs = calloc(n, sizeof(*stats.funcs));
+    if (stats.funcs == NULL)
+        goto fail;
+
+    error = ioctl(fd, SANDBOX_IOC_STATS, &stats);
+    if (error == -1)
+        goto fail;
+    /* the process may have attached more sandboxes in between */
+    if (stats.nfuncs > n)
+        stats.nfuncs = n;
+
+    printf("%-3s %-32s %-9s %5s %10s %6s %10s %6s\n", "sb", "rule", "kind",
+            "order", "evals", "deny%", "mean(ns)", "hit%");
+    for (i = 0; i < stats.nfuncs; i++) {
+        fs = &stats.funcs[i];
+        printf("%-3d %-32s %-9s", fs->sandbox, fs->rule, kindname(fs->kind));
+        if (fs->kind == SANDBOX_FUNCSTAT_MEMBER)
+            printf(" %4d%c", fs->index,
+                    fs->flags & SANDBOX_FUNCSTAT_UNORDERED ? '*' : ' ');
+        else
+            printf(" %5s", "");
+        printf(" %10" PRIu64 " %6.1f %10" PRIu64, fs->nevals,
+                fs->nevals ? 100.0 * fs->ndenies / fs->nevals : 0.0,
+                fs->nevals ? fs->nsecs / fs->nevals : 0);
+        if (fs->flags & SANDBOX_FUNCSTAT_PURE)
+            printf(" %6.1f", fs->nhits + fs->nmisses ?
+                    100.0 * fs->nhits / (fs->nhits + fs->nmisses) : 0.0);
+        printf("\n");
+        saved += fs->savednsecs;
+    }
+    printf("estimated time saved by reordering: %" PRIu64 " ns\n", saved);
+
+    goto succeed;
+
+fail:
+    error = 1;
+succeed:
+    free(stats.funcs);
+    return (error);
+}
+
 int main(int argc, char *argv[])
 {
     int error = 0;
     int fd = -1;
     int version = 0;
     int nlists = 0;
+    pid_t pid = 0;
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: sandbox-stats [pid]\n");
+        goto fail;
+    }
+    if (argc == 2)
+        pid = (pid_t)atoi(argv[1]);
 
     fd = open("/dev/sandbox", O_RDWR);
     if (fd == - 1)
@@ -56,6 +183,10 @@ int main(int argc, char *argv[])
 
     printf("version=%d, nlists=%d\n", version, nlists);
 
+    error = print_funcs(fd, pid);
+    if (error != 0)
+        goto fail;
+
     (void)close(fd);
 
     goto succeed;
@@ -65,4 +196,3 @@ fail:
 succeed:
     return (error);
 }
-
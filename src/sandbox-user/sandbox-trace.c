@@ -0,0 +1,318 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/ioctl.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sandbox.h"
+
+#define NRECS           512
+#define MAXFMTS         1024
+#define FOLLOW_USECS    100000
+
+/* the length modifiers of the conversions that the kernel records */
+#define LMOD_INT        0
+#define LMOD_LONG       1
+#define LMOD_LLONG      2
+#define LMOD_SIZE       3
+#define LMOD_INTMAX     4
+
+static const char *subsys_names[SANDBOX_TRACE_NSUBSYS] = {
+    [SANDBOX_TRACE_CORE] = "core",
+    [SANDBOX_TRACE_SECMODEL] = "secmodel",
+    [SANDBOX_TRACE_LUA] = "lua",
+    [SANDBOX_TRACE_DEVICE] = "device",
+    [SANDBOX_TRACE_VNODE] = "vnode",
+};
+
+/* indexed by level */
+static const char level_chars[] = "-EWIDT";
+
+/* the formats fetched so far, by id */
+static struct sandbox_tracefmt *fmts[MAXFMTS];
+
+static void 
+usage(void)
+{
+    fprintf(stderr, 
+            "usage: sandbox-trace [OPTION]\n"
+            "\n"
+            "  Drains the kernel's sandbox trace rings and prints their\n"
+            "  records.  Subsystems are traced at the levels set under\n"
+            "  security.models.sandbox.trace.\n"
+            "\n"
+            "  options:\n"
+            "    -f\n"
+            "      keep on draining until interrupted\n"
+            "    -h\n"
+            "      display this help message\n");
+    exit(1);
+}
+
+static const struct sandbox_tracefmt *
+getfmt(int fd, uint32_t id)
+{
+    struct sandbox_tracefmt *tf = NULL;
+
+    if (id == 0 || id >= MAXFMTS)
+        return (NULL);
+    if (fmts[id] != NULL)
+        return (fmts[id]);
+
+    tf = calloc(1, sizeof(*tf));
+    if (tf == NULL)
+        return (NULL);
+    tf->id = id;
+    if (ioctl(fd, SANDBOX_IOC_TRACEFMT, tf) == -1) {
+        free(tf);
+        return (NULL);
+    }
+    fmts[id] = tf;
+    return (tf);
+}
+
+static int
+cmprecs(const void *a, const void *b)
+{
+    const struct sandbox_tracerec *ra = a;
+    const struct sandbox_tracerec *rb = b;
+
+    if (ra->nsecs != rb->nsecs)
+        return (ra->nsecs < rb->nsecs ? -1 : 1);
+    return (0);
+}
+
+/* prints the record's arguments by the conversions of its format, as the
+ * kernel encoded them (see sandbox_trace.c)
+ */
+static void
+print_args(const struct sandbox_tracerec *rec, const char *fmt)
+{
+    int n = 0;
+    int lmod = 0;
+    size_t len = 0;
+    uint64_t arg = 0;
+    const char *c = NULL;
+    const char *spec = NULL;
+    char conv[16];
+
+    for (c = fmt; *c != '\0'; c++) {
+        if (*c != '%') {
+            putchar(*c);
+            continue;
+        }
+
+        spec = c;
+        for (c++; *c != '\0' && strchr("-+ #0123456789.", *c) != NULL; c++)
+            continue;
+
+        lmod = LMOD_INT;
+        for (;; c++) {
+            if (*c == 'l')
+                lmod = (lmod == LMOD_LONG) ? LMOD_LLONG : LMOD_LONG;
+            else if (*c == 'q')
+                lmod = LMOD_LLONG;
+            else if (*c == 'z')
+                lmod = LMOD_SIZE;
+            else if (*c == 'j')
+                lmod = LMOD_INTMAX;
+            else if (*c != 'h')
+                break;
+        }
+
+        if (*c == '%') {
+            putchar('%');
+            continue;
+        }
+
+        /* the kernel stopped encoding here; print the rest as is */
+        len = c - spec + 1;
+        if (*c == '\0' || strchr("spcdiouxX", *c) == NULL ||
+                n == SANDBOX_TRACE_MAXARGS || len >= sizeof(conv)) {
+            fputs(spec, stdout);
+            return;
+        }
+
+        memcpy(conv, spec, len);
+        conv[len] = '\0';
+        arg = rec->args[n++];
+
+        switch (*c) {
+        case 's':
+            printf(conv, rec->strs + (arg < SANDBOX_TRACE_STRLEN ?
+                        arg : SANDBOX_TRACE_STRLEN - 1));
+            break;
+        case 'p':
+            printf(conv, (void *)(uintptr_t)arg);
+            break;
+        case 'c':
+        case 'd':
+        case 'i':
+            switch (lmod) {
+            case LMOD_LONG:     printf(conv, (long)arg); break;
+            case LMOD_LLONG:    printf(conv, (long long)arg); break;
+            case LMOD_SIZE:     printf(conv, (ssize_t)arg); break;
+            case LMOD_INTMAX:   printf(conv, (intmax_t)arg); break;
+            default:            printf(conv, (int)arg); break;
+            }
+            break;
+        default:
+            switch (lmod) {
+            case LMOD_LONG:     printf(conv, (unsigned long)arg); break;
+            case LMOD_LLONG:    printf(conv, (unsigned long long)arg); break;
+            case LMOD_SIZE:     printf(conv, (size_t)arg); break;
+            case LMOD_INTMAX:   printf(conv, (uintmax_t)arg); break;
+            default:            printf(conv, (unsigned int)arg); break;
+            }
+            break;
+        }
+    }
+}
+
+static void
+print_rec(int fd, struct sandbox_tracerec *rec)
+{
+    const struct sandbox_tracefmt *tf = NULL;
+
+    /* the kernel terminates strs, but the record came through a copy */
+    rec->strs[SANDBOX_TRACE_STRLEN - 1] = '\0';
+
+    printf("%" PRIu64 ".%09" PRIu64 " cpu%u %d.%d %c %s ",
+            rec->nsecs / 1000000000, rec->nsecs % 1000000000,
+            (unsigned int)rec->cpu, (int)rec->pid, (int)rec->lid,
+            rec->level < sizeof(level_chars) - 1 ?
+                level_chars[rec->level] : '?',
+            rec->subsys < SANDBOX_TRACE_NSUBSYS ?
+                subsys_names[rec->subsys] : "?");
+
+    tf = getfmt(fd, rec->fmtid);
+    if (tf == NULL) {
+        printf("(unknown format %" PRIu32 ")\n", rec->fmtid);
+        return;
+    }
+
+    printf("%s:%d:%s ", tf->file, tf->line, tf->func);
+    print_args(rec, tf->fmt);
+}
+
+/* Drains the rings until they are empty, or forever if follow is set.
+ * Each read holds records from every CPU, so they are put in time order
+ * before they are printed.
+ */
+static int
+drain(int fd, int follow)
+{
+    int error = 0;
+    size_t i = 0;
+    struct sandbox_trace trace;
+    struct sandbox_tracerec *recs = NULL;
+
+    recs = calloc(NRECS, sizeof(*recs));
+    if (recs == NULL)
+        goto fail;
+
+    for (;;) {
+        trace.recs = recs;
+        trace.nrecs = NRECS;
+        trace.nlost = 0;
+        error = ioctl(fd, SANDBOX_IOC_TRACEREAD, &trace);
+        if (error == -1) {
+            fprintf(stderr, "SANDBOX_IOC_TRACEREAD failed: '%s'\n",
+                    strerror(errno));
+            goto fail;
+        }
+
+        if (trace.nlost > 0)
+            printf("-- %" PRIu64 " records lost\n", trace.nlost);
+
+        qsort(recs, trace.nrecs, sizeof(*recs), cmprecs);
+        for (i = 0; i < trace.nrecs; i++)
+            print_rec(fd, &recs[i]);
+        fflush(stdout);
+
+        if (trace.nrecs == 0) {
+            if (!follow)
+                break;
+            usleep(FOLLOW_USECS);
+        }
+    }
+
+    error = 0;
+    goto succeed;
+
+fail:
+    error = 1;
+succeed:
+    free(recs);
+    return (error);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int error = 0;
+    int c = 0;
+    int fd = -1;
+    int follow = 0;
+
+    opterr = 0;
+    while ((c = getopt(argc, argv, "fh")) != -1) {
+        switch (c) {
+        case 'f':
+            follow = 1;
+            break;
+        case 'h':
+            usage();
+        case '?':
+            fprintf(stderr, "unknown option '%c'\n", (char)optopt);
+            exit(1);
+        default:
+            usage();
+        }
+    }
+
+    fd = open(SANDBOX_DEVICE, O_RDWR);
+    if (fd == -1) {
+        fprintf(stderr, "can't open %s: '%s'\n", SANDBOX_DEVICE,
+                strerror(errno));
+        return (1);
+    }
+
+    error = drain(fd, follow);
+
+    (void)close(fd);
+    return (error);
+}
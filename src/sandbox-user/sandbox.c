@@ -31,10 +31,9 @@
 #include <sys/ioctl.h>  /* ioctl */
 #include <sys/stat.h>   /* stat */
 
+#include <errno.h>      /* errno */
 #include <fcntl.h>      /* open */
-#include <stdarg.h>     /* va_start, va_end, va_end */
 #include <stdbool.h>    /* false, true */
-#include <stdio.h>      /* vsnprintf */
 #include <stdlib.h>     /* calloc, realpath, free */
 #include <string.h>     /* strdup, strlen, strtok_r */
 #include <unistd.h>     /* chroot, close, read */
@@ -47,9 +46,10 @@ struct sandbox_pledge_req {
 };
 
 /* FORWARD DECLARATIONS */
-static char * sandbox_sprintf(const char *fmt, ...);
+static int sandbox_packparams(const char *params[],
+        struct sandbox_template *tmpl);
 static int sandbox_readspec(const char *path, struct sandbox_spec *spec);
-static int sandbox_setspec(struct sandbox_spec *spec);
+static int sandbox_ioctl(unsigned long cmd, void *arg);
 
 /* TODO: 
  *
@@ -814,7 +814,10 @@ static struct sandbox_pledge_req sandbox_pledge_reqs[] = {
 };
 
 /* TODO: rawio_spec */
-static char *sandbox_securechroot_script_template =
+/* declarative, so that checks like process.signal, which run whenever
+ * ps(1) does, never enter Lua
+ */
+static const char *sandbox_securechroot_script =
     "sandbox.default('defer')\n" \
     "sandbox.deny('system.chroot')\n" \
     "sandbox.deny('system.debug')\n" \
@@ -832,24 +835,12 @@ static char *sandbox_securechroot_script_template =
     "sandbox.deny('system.mount.umap')\n" \
     "sandbox.deny('system.mount.device')\n" \
     "sandbox.deny('system.sysctl')\n" \
-    "sandbox.on('process.ptrace', function(rule, cred, proc, req)\n" \
-    "  if proc.rootdir != '%s' then return false else return nil end\n" \
-    "end)\n" \
-    "sandbox.on('process.ktrace', function(rule, cred, proc)\n" \
-    "  if proc.rootdir != '%s' then return false else return nil end\n" \
-    "end)\n" \
-    "sandbox.on('process.procfs', function(rule, cred, proc)\n" \
-    "   if proc.rootdir != '%s' then return false else return nil end\n" \
-    "end)\n" \
-    "sandbox.on('process.signal', function(rule, cred, proc, signo)\n" \
-    "   if proc.rootdir != '%s' then return false else return nil end\n" 
-    "end)\n" \
-    "sandbox.on('process.cansee', function(rule, cred, proc)\n" \
-    "   if proc.rootdir != '%s' then return false else return nil end\n" \
-    "end)\n" \
-    "sandbox.on('process.nice', function(rule, cred, proc, nice)\n" \
-    "  if nice < proc.nice then return false else return nil end\n" \
-    "end)\n" \
+    "sandbox.require('process.ptrace', {['proc.sameroot']=true})\n" \
+    "sandbox.require('process.ktrace', {['proc.sameroot']=true})\n" \
+    "sandbox.require('process.procfs', {['proc.sameroot']=true})\n" \
+    "sandbox.require('process.signal', {['proc.sameroot']=true})\n" \
+    "sandbox.require('process.cansee', {['proc.sameroot']=true})\n" \
+    "sandbox.require('process.nice', {n={ge='proc.nice'}})\n" \
     "sandbox.deny('process.scheduler.setaffinity')\n" \
     "sandbox.deny('process.scheduler.setparam')\n" \
     "sandbox.deny('process.corename.set')\n" \
@@ -877,34 +868,42 @@ static char *sandbox_securechroot_script_template =
     "sandbox.deny('device.rawio_passthru')\n" \
     "sandbox.deny('device.bluetooth_bcsp.add')\n";
 
-static char *
-sandbox_sprintf(const char *fmt, ...)
+/* Packs the NULL-terminated list of parameter names and values into the
+ * "name\0value\0" form of struct sandbox_template.
+ *
+ * on success, returns 0
+ * on failure, returns -1, errno has error value
+ */
+static int
+sandbox_packparams(const char *params[], struct sandbox_template *tmpl)
 {
-    va_list args;
-    va_list args2;
-    int needed = 0;
-    int written = 0;
-    char *out = NULL;
-
-    va_start(args, fmt);
-    va_copy(args2, args);
-    needed = snprintf(NULL, 0, fmt, args);
-    va_end(args);
-
-    out = calloc(1, needed + 1);
-    if (out == NULL)
-        goto done;
-
-    written = vsnprintf(out, needed + 1, fmt, args2);
-    va_end(args2);
-
-    if (written != needed) {
-        free(out);
-        out = NULL;
+    int i = 0;
+    size_t len = 0;
+    size_t n = 0;
+    char *buf = NULL;
+
+    if (params == NULL || params[0] == NULL)
+        return (0);
+
+    for (i = 0; params[i] != NULL; i++)
+        len += strlen(params[i]) + 1;
+    if (i % 2 != 0) {
+        errno = EINVAL;
+        return (-1);
     }
 
-done:
-    return (out);
+    buf = calloc(1, len);
+    if (buf == NULL)
+        return (-1);
+
+    for (i = 0; params[i] != NULL; i++) {
+        n = strlen(params[i]) + 1;
+        memcpy(buf + tmpl->params_len, params[i], n);
+        tmpl->params_len += n;
+    }
+    tmpl->params = buf;
+
+    return (0);
 }
 
 /* on success, returns 0
@@ -959,7 +958,7 @@ succeed:
  * return -1 on error; errno has error value
  */
 static int
-sandbox_setspec(struct sandbox_spec *spec)
+sandbox_ioctl(unsigned long cmd, void *arg)
 {
     int error = 0;
     int fd = -1;
@@ -968,7 +967,7 @@ sandbox_setspec(struct sandbox_spec *spec)
     if (fd == - 1)
         goto fail;
 
-    error = ioctl(fd, SANDBOX_IOC_SETSPEC, spec);
+    error = ioctl(fd, cmd, arg);
     if (error == -1)
         goto fail;
 
@@ -999,7 +998,7 @@ sandbox(const char *script, int flags)
     spec.script_len = strlen(script) + 1;
     spec.flags = flags;
 
-    error = sandbox_setspec(&spec);
+    error = sandbox_ioctl(SANDBOX_IOC_SETSPEC, &spec);
 
     return (error);
 }
@@ -1018,7 +1017,7 @@ sandbox_from_file(const char *path, int flags)
     if (error)
         goto fail;
 
-    error = sandbox_setspec(&spec);
+    error = sandbox_ioctl(SANDBOX_IOC_SETSPEC, &spec);
 
 fail:
     if (spec.script != NULL)
@@ -1026,11 +1025,157 @@ fail:
     return (error);
 }
 
+/* Replaces the policy of the caller's most recently attached sandbox,
+ * which must have been attached with SANDBOX_PRIVATE and whose policy
+ * must allow the rule 'sandbox.reload' by name; a default of 'allow' is
+ * not enough.  The parent and children that share the sandbox get the new
+ * policy too.
+ *
+ * return 0 on suceess
+ * return -1 on error; errno has error value
+ */
+int
+sandbox_reload(const char *script, int flags)
+{
+    struct sandbox_spec spec = { .script = NULL, .script_len = 0 };
+
+    spec.script = (char *)script;
+    spec.script_len = strlen(script) + 1;
+    spec.flags = flags;
+
+    return (sandbox_ioctl(SANDBOX_IOC_RELOAD, &spec));
+}
+
+/* Makes the policy into a sandbox that outlives the caller, for processes
+ * to attach with sandbox_attach_id().  Only the superuser may preload.
+ *
+ * return 0 on success and sets *id
+ * return -1 on error; errno has error value
+ */
+int
+sandbox_preload(const char *script, int flags, uint64_t *id)
+{
+    int error = 0;
+    struct sandbox_preload preload;
+
+    memset(&preload, 0, sizeof(preload));
+    preload.spec.script = (char *)script;
+    preload.spec.script_len = strlen(script) + 1;
+    preload.spec.flags = flags;
+
+    error = sandbox_ioctl(SANDBOX_IOC_PRELOAD, &preload);
+    if (error == 0)
+        *id = preload.id;
+
+    return (error);
+}
+
+/* return 0 on success and sets *id
+ * return -1 on error; errno has error value
+ */
+int
+sandbox_preload_file(const char *path, int flags, uint64_t *id)
+{
+    int error = 0;
+    struct sandbox_preload preload;
+
+    memset(&preload, 0, sizeof(preload));
+    preload.spec.flags = flags;
+    error = sandbox_readspec(path, &preload.spec);
+    if (error)
+        goto fail;
+
+    error = sandbox_ioctl(SANDBOX_IOC_PRELOAD, &preload);
+    if (error == 0)
+        *id = preload.id;
+
+fail:
+    if (preload.spec.script != NULL)
+        free(preload.spec.script);
+    return (error);
+}
+
+/* return 0 on suceess
+ * return -1 on error; errno has error value
+ */
+int
+sandbox_attach_id(uint64_t id)
+{
+    return (sandbox_ioctl(SANDBOX_IOC_ATTACHID, &id));
+}
+
+/* processes already attached to the policy keep it
+ *
+ * return 0 on suceess
+ * return -1 on error; errno has error value
+ */
+int
+sandbox_unload(uint64_t id)
+{
+    return (sandbox_ioctl(SANDBOX_IOC_UNLOAD, &id));
+}
+
+/* Attaches the policy template bound to params, a NULL-terminated list of
+ * name/value pairs that the script reads from sandbox.params.  The values
+ * are never spliced into the script, which the kernel compiles once for
+ * all of its instances.
+ *
+ * return 0 on suceess
+ * return -1 on error; errno has error value
+ */
+int
+sandbox_template(const char *script, const char *params[], int flags)
+{
+    int error = 0;
+    struct sandbox_template tmpl;
+
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.spec.script = (char *)script;
+    tmpl.spec.script_len = strlen(script) + 1;
+    tmpl.spec.flags = flags;
+
+    error = sandbox_packparams(params, &tmpl);
+    if (error)
+        goto fail;
+
+    error = sandbox_ioctl(SANDBOX_IOC_SETTMPL, &tmpl);
+
+fail:
+    if (tmpl.params != NULL)
+        free(tmpl.params);
+    return (error);
+}
+
+/* attaches the template preloaded with the id, bound to params
+ *
+ * return 0 on suceess
+ * return -1 on error; errno has error value
+ */
+int
+sandbox_template_attach(uint64_t id, const char *params[])
+{
+    int error = 0;
+    struct sandbox_template tmpl;
+
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.id = id;
+
+    error = sandbox_packparams(params, &tmpl);
+    if (error)
+        goto fail;
+
+    error = sandbox_ioctl(SANDBOX_IOC_ATTACHTMPL, &tmpl);
+
+fail:
+    if (tmpl.params != NULL)
+        free(tmpl.params);
+    return (error);
+}
+
 int
 sandbox_securechroot(const char *dirpath)
 {
     int error = 0;
-    char *script = NULL;
     char canonpath[MAXPATHLEN] = { 0 };
 
     if (realpath(dirpath, canonpath) == NULL) {
@@ -1038,25 +1183,13 @@ sandbox_securechroot(const char *dirpath)
         goto fail;
     }
 
-    /* TODO: sanitize the string:
-     *  -escaping bad characters, like a single quote
-     */
-    script = sandbox_sprintf(sandbox_securechroot_script_template,
-            canonpath, canonpath, canonpath, canonpath, canonpath);
-    if (script == NULL) {
-        error = -1;
-        goto fail;
-    }
-
     error = chroot(canonpath);
     if (error == -1)
         goto fail;
 
-    error = sandbox(script, 0);
+    error = sandbox(sandbox_securechroot_script, 0);
 
 fail:
-    if (script != NULL)
-        free(script);
     return (error);
 }
 
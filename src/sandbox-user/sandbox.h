@@ -30,21 +30,213 @@
 #ifndef _SANDBOX_H_
 #define _SANDBOX_H_
 
+#include <sys/types.h>
+#include <stdint.h>
+
 #define SANDBOX_DEVICE "/dev/sandbox"
 
 #define SANDBOX_ON_DENY_KILL  (1 << 0)
+#define SANDBOX_REORDER       (1 << 1)
+#define SANDBOX_FULLLIBS      (1 << 2)
+#define SANDBOX_PRIVATE       (1 << 3)
+#define SANDBOX_PERMISSIVE    (1 << 4)
 
 struct sandbox_spec {
     char *script;
     size_t script_len;
     int flags;
 };
+
+#define SANDBOX_FUNCSTAT_LUA        0
+#define SANDBOX_FUNCSTAT_EXPR       1
+#define SANDBOX_FUNCSTAT_DISPATCHER 2
+#define SANDBOX_FUNCSTAT_MEMBER     3
+
+#define SANDBOX_FUNCSTAT_UNORDERED  (1 << 0)
+#define SANDBOX_FUNCSTAT_PURE       (1 << 1)
+
+#define SANDBOX_FUNCSTAT_RULELEN    64
+
+struct sandbox_funcstat {
+    char rule[SANDBOX_FUNCSTAT_RULELEN];
+    int sandbox;
+    int kind;
+    int index;
+    int flags;
+    uint64_t nevals;
+    uint64_t ndenies;
+    uint64_t nsecs;
+    uint64_t savednsecs;
+    uint64_t nhits;
+    uint64_t nmisses;
+};
+
+#define SANDBOX_OBJSTAT_LIST        0
+#define SANDBOX_OBJSTAT_SANDBOX     1
+#define SANDBOX_OBJSTAT_RULESET     2
+#define SANDBOX_OBJSTAT_PATH        3
+#define SANDBOX_OBJSTAT_REF         4
+#define SANDBOX_OBJSTAT_NTYPES      5
+
+struct sandbox_objstat {
+    uint64_t nallocs;
+    uint64_t nfrees;
+};
+
+struct sandbox_stats {
+    pid_t pid;
+    struct sandbox_funcstat *funcs;
+    size_t nfuncs;
+    uint64_t nattaches;
+    uint64_t attachnsecs;
+    uint64_t poolhits;
+    uint64_t poolmisses;
+    uint64_t registryhits;
+    uint64_t registrymisses;
+    uint64_t chunkhits;
+    uint64_t chunkmisses;
+    uint64_t chunkevictions;
+    struct sandbox_objstat objs[SANDBOX_OBJSTAT_NTYPES];
+    uint64_t permqueued;
+    uint64_t permdropped;
+    uint64_t permdenies;
+};
+
+struct sandbox_preload {
+    struct sandbox_spec spec;
+    uint64_t id;
+};
+
+struct sandbox_template {
+    struct sandbox_spec spec;
+    uint64_t id;
+    char *params;
+    size_t params_len;
+};
+
+#define SANDBOX_TRACE_CORE          0
+#define SANDBOX_TRACE_SECMODEL      1
+#define SANDBOX_TRACE_LUA           2
+#define SANDBOX_TRACE_DEVICE        3
+#define SANDBOX_TRACE_VNODE         4
+#define SANDBOX_TRACE_NSUBSYS       5
+
+#define SANDBOX_TRACE_MAXARGS       6
+#define SANDBOX_TRACE_STRLEN        56
+
+struct sandbox_tracerec {
+    uint64_t nsecs;
+    uint32_t fmtid;
+    uint16_t cpu;
+    uint8_t subsys;
+    uint8_t level;
+    int32_t pid;
+    int32_t lid;
+    uint64_t args[SANDBOX_TRACE_MAXARGS];
+    char strs[SANDBOX_TRACE_STRLEN];
+};
+
+struct sandbox_trace {
+    struct sandbox_tracerec *recs;
+    size_t nrecs;
+    uint64_t nlost;
+};
+
+#define SANDBOX_TRACE_FILELEN       32
+#define SANDBOX_TRACE_FUNCLEN       48
+#define SANDBOX_TRACE_FMTLEN        128
+
+struct sandbox_tracefmt {
+    uint32_t id;
+    int line;
+    char file[SANDBOX_TRACE_FILELEN];
+    char func[SANDBOX_TRACE_FUNCLEN];
+    char fmt[SANDBOX_TRACE_FMTLEN];
+};
+
+#define SANDBOX_EVENT_MAXEVENTS     (1 << 18)
+
+#define SANDBOX_EVENT_ALLOW         0
+#define SANDBOX_EVENT_DENY          1
+#define SANDBOX_EVENT_WOULDDENY     2
+
+#define SANDBOX_EVENT_OBJ_NONE      0
+#define SANDBOX_EVENT_OBJ_VNODE     1
+#define SANDBOX_EVENT_OBJ_SOCKADDR  2
+
+#define SANDBOX_EVENT_NAMELEN       32
+#define SANDBOX_EVENT_PATHLEN       32
+
+struct sandbox_event {
+    volatile uint64_t seq;
+    uint64_t nsecs;
+    uint32_t ruleid;
+    int32_t pid;
+    int32_t lid;
+    uint32_t uid;
+    uint8_t result;
+    uint8_t level;
+    uint8_t objtype;
+    uint8_t pad[5];
+    char names[3][SANDBOX_EVENT_NAMELEN];
+    union {
+        struct {
+            uint64_t fsid;
+            uint64_t fileid;
+            uint32_t type;
+        } vnode;
+        struct {
+            uint8_t family;
+            uint8_t pad;
+            uint16_t port;
+            uint8_t pad2[4];
+            uint8_t addr[16];
+            char path[SANDBOX_EVENT_PATHLEN];
+        } sockaddr;
+    } obj;
+};
+
+struct sandbox_eventring {
+    uint32_t version;
+    uint32_t eventsize;
+    uint64_t nevents;
+    uint64_t offset;
+    volatile uint64_t head;
+    volatile uint64_t ndropped;
+    uint64_t pad[3];
+    volatile uint64_t tail;
+};
+
+struct sandbox_events {
+    size_t nevents;
+    size_t size;
+};
+
 #define SANDBOX_IOC_VERSION  _IOR('S', 0, int)
 #define SANDBOX_IOC_SETSPEC  _IOW('S', 1, struct sandbox_spec)
 #define SANDBOX_IOC_NLISTS   _IOR('S', 2, int)
+#define SANDBOX_IOC_STATS    _IOWR('S', 3, struct sandbox_stats)
+#define SANDBOX_IOC_PRELOAD  _IOWR('S', 4, struct sandbox_preload)
+#define SANDBOX_IOC_ATTACHID _IOW('S', 5, uint64_t)
+#define SANDBOX_IOC_UNLOAD   _IOW('S', 6, uint64_t)
+#define SANDBOX_IOC_SETTMPL  _IOW('S', 7, struct sandbox_template)
+#define SANDBOX_IOC_ATTACHTMPL _IOW('S', 8, struct sandbox_template)
+#define SANDBOX_IOC_RELOAD   _IOW('S', 9, struct sandbox_spec)
+#define SANDBOX_IOC_TRACEREAD _IOWR('S', 10, struct sandbox_trace)
+#define SANDBOX_IOC_TRACEFMT _IOWR('S', 11, struct sandbox_tracefmt)
+#define SANDBOX_IOC_EVENTS   _IOWR('S', 12, struct sandbox_events)
 
 int sandbox(const char *script, int flags);
 int sandbox_from_file(const char *path, int flags);
+int sandbox_reload(const char *script, int flags);
+
+int sandbox_preload(const char *script, int flags, uint64_t *id);
+int sandbox_preload_file(const char *path, int flags, uint64_t *id);
+int sandbox_attach_id(uint64_t id);
+int sandbox_unload(uint64_t id);
+
+int sandbox_template(const char *script, const char *params[], int flags);
+int sandbox_template_attach(uint64_t id, const char *params[]);
 
 int sandbox_securechroot(const char *dirname);
 int sanddbox_pledge(const char *promises, const char *paths[]);
@@ -28,6 +28,7 @@
  */
 
 #include <sys/param.h>
+#include <sys/systm.h>
 #include <sys/queue.h>
 #include <sys/signalvar.h>
 
@@ -41,14 +42,26 @@
 #include <sys/filedesc.h>
 #include <sys/lua.h>
 #include <sys/atomic.h>
+#include <sys/cprng.h>
+#include <sys/mutex.h>
+#include <sys/pserialize.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
 #include "sandbox.h"
+#include "sandbox_addr.h"
+#include "sandbox_chunkcache.h"
+#include "sandbox_event.h"
+#include "sandbox_expr.h"
 #include "sandbox_lua.h"
+#include "sandbox_memo.h"
+#include "sandbox_objcache.h"
 #include "sandbox_path.h"
+#include "sandbox_permissive.h"
+#include "sandbox_pred.h"
+#include "sandbox_registry.h"
 #include "sandbox_rule.h"
 #include "sandbox_ruleset.h"
 #include "sandbox_spec.h"
@@ -62,8 +75,18 @@
 
 int sandbox_nlists = 0;
 
+/* for SANDBOX_IOC_STATS */
+static uint64_t sandbox_nattaches = 0;
+static uint64_t sandbox_attachnsecs = 0;
+
 static int sandbox_serial = 0;
 
+/* serializes sandbox_reload(); requests read sandbox->live in sandbox_psz
+ * read sections
+ */
+static kmutex_t sandbox_reloadlock;
+static pserialize_t sandbox_psz;
+
 /* sandbox_system_strmap[KAUTH_SYSTEM_ACCOUNTING] -> "accounting" */
 static const char * sandbox_system_strmap[] = {
     NULL,
@@ -333,20 +356,95 @@ static const char *sandbox_vnode_strmap[] = {
     NULL
 };
 
+/* Evaluates one of a rule's functions.  If the function is pure, its
+ * verdict is looked up in, or else added to, its memo.
+ */
 static int
-sandbox_veval(struct sandbox *sandbox, kauth_cred_t cred,
-        const struct sandbox_rule *rule, struct vnode *vp, const char *fmt, va_list ap)
+sandbox_funcref_veval(struct sandbox *sandbox, struct sandbox_ref *ref,
+        kauth_cred_t cred, const struct sandbox_rule *rule, const char *fmt,
+        va_list ap, uint64_t now)
+{
+    int result = KAUTH_RESULT_DEFER;
+    int cacheable = 0;
+    uint64_t gen = 0;
+    int64_t keys[SANDBOX_MEMO_MAXKEYS];
+    struct sandbox_pred_args args;
+    va_list apsave;
+
+    if (ref->memo != NULL) {
+        va_copy(apsave, ap);
+        sandbox_pred_args_init(&args, fmt, apsave);
+        va_end(apsave);
+        gen = sandbox->generation;
+        if (sandbox_memo_getkeys(ref->memo, cred, &args, keys) == 0) {
+            if (sandbox_memo_lookup(ref->memo, gen, now, keys, &result) == 0)
+                return (result);
+            cacheable = 1;
+        }
+    }
+
+    if (ref->prog != NULL)
+        result = sandbox_expr_veval(ref->prog, cred, fmt, ap);
+    else
+        result = sandbox_lua_veval(sandbox->K, ref, cred, rule, fmt, ap);
+
+    if (cacheable)
+        sandbox_memo_insert(ref->memo, gen, now, keys, result);
+
+    return (result);
+}
+
+/* returns the sockaddr argument of a request, or NULL if it has none */
+static const struct sockaddr *
+sandbox_vsockaddr(const char *fmt, va_list ap)
+{
+    struct sandbox_pred_args args;
+    va_list apsave;
+
+    va_copy(apsave, ap);
+    sandbox_pred_args_init(&args, fmt, apsave);
+    va_end(apsave);
+
+    return (args.sockaddr);
+}
+
+/* Decides a request by one version of a sandbox's policy.  If nodep is not
+ * NULL, it is set to the rulenode that decided the request.  A
+ * SANDBOX_PERMISSIVE version leaves its Lua functions out of the decision,
+ * and queues them to run later on a snapshot of the request.
+ */
+static int
+sandbox_veval_live(struct sandbox *sandbox, kauth_cred_t cred,
+        const struct sandbox_rule *rule, struct vnode *vp, const char *fmt, va_list ap,
+        const struct sandbox_rulenode **nodep)
 {
     int result = KAUTH_RESULT_DEFER;
     int has_allow = 0;
+    int deferred = 0;
+    int counted = 0;
+    uint64_t start = 0;
+    const struct sandbox_rulehot *hot = NULL;
     const struct sandbox_rulenode *node = NULL;
     struct sandbox_ref *ref = NULL;
+    const struct sockaddr *sa = NULL;
     va_list apsave;
 
     SANDBOX_LOG_DEBUG("searching for rule: %s.%s.%s\n", SANDBOX_RULE_SCOPE(rule),
         SANDBOX_RULE_ACTION(rule), SANDBOX_RULE_SUBACTION(rule));
 
-    node = sandbox_ruleset_search(sandbox->ruleset, rule);
+    if (sandbox->ruleset->index != NULL) {
+        hot = sandbox_ruleset_searchhot(sandbox->ruleset, rule);
+        /* a plain allow, deny or defer is decided without the rulenode */
+        if (hot->type == SANDBOX_RULETYPE_TRILEAN) {
+            result = hot->value;
+            if (nodep != NULL)
+                node = SANDBOX_RULESET_COLD(sandbox->ruleset, hot);
+            goto done;
+        }
+        node = SANDBOX_RULESET_COLD(sandbox->ruleset, hot);
+    } else {
+        node = sandbox_ruleset_search(sandbox->ruleset, rule);
+    }
     SANDBOX_LOG_DEBUG("found rule '%s'\n", node->name);
     
     if (node->type & SANDBOX_RULETYPE_TRILEAN) {
@@ -371,10 +469,56 @@ sandbox_veval(struct sandbox *sandbox, kauth_cred_t cred,
         }
     }
 
+    /* like the path lists, address sets are matched without entering Lua.
+     * A request is denied if its address is in the deny set or missing from
+     * the allow set.
+     */
+    if (node->type & (SANDBOX_RULETYPE_ADDRALLOW | SANDBOX_RULETYPE_ADDRDENY))
+        sa = sandbox_vsockaddr(fmt, ap);
+
+    if ((node->type & SANDBOX_RULETYPE_ADDRDENY) &&
+            sandbox_addr_set_contains(node->addrdeny, sa)) {
+        result = KAUTH_RESULT_DENY;
+        goto done;
+    }
+
+    if (node->type & SANDBOX_RULETYPE_ADDRALLOW) {
+        if (!sandbox_addr_set_contains(node->addrallow, sa)) {
+            result = KAUTH_RESULT_DENY;
+            goto done;
+        }
+        has_allow = 1;
+    }
+
+    /* predicates are cheap and lock-free, so check them before calling
+     * into Lua
+     */
+    if (node->type & SANDBOX_RULETYPE_PREDICATE) {
+        va_copy(apsave, ap);
+        result = sandbox_pred_list_veval(&node->predlist, cred, fmt, apsave);
+        va_end(apsave);
+        if (result == KAUTH_RESULT_DENY)
+            goto done;
+
+        if (result == KAUTH_RESULT_ALLOW)
+            has_allow = 1;
+    }
+
     if (node->type & SANDBOX_RULETYPE_FUNCTION) {
+        counted = (sandbox->flags & SANDBOX_REORDER) || sandbox_refstats;
         SIMPLEQ_FOREACH(ref, &node->funclist, ref_next) {
+            /* compiled expressions never enter Lua, so they still decide */
+            if ((sandbox->flags & SANDBOX_PERMISSIVE) && ref->prog == NULL) {
+                deferred = 1;
+                continue;
+            }
+            /* a pure function's memo needs the time regardless */
             va_copy(apsave, ap);
-            result = sandbox_lua_veval(sandbox->K, ref->value, cred, rule, fmt, apsave);
+            start = (counted || ref->memo != NULL) ? sandbox_ref_clock() : 0;
+            result = sandbox_funcref_veval(sandbox, ref, cred, rule, fmt,
+                    apsave, start);
+            if (counted)
+                sandbox_ref_record(ref, result, sandbox_ref_clock() - start);
             va_end(apsave);
             if (result == KAUTH_RESULT_DENY)
                 goto done;
@@ -382,6 +526,12 @@ sandbox_veval(struct sandbox *sandbox, kauth_cred_t cred,
             if (result == KAUTH_RESULT_ALLOW)
                 has_allow = 1;
         }
+        if (deferred) {
+            va_copy(apsave, ap);
+            sandbox_permissive_enqueue(sandbox, node, cred, rule, fmt,
+                    apsave);
+            va_end(apsave);
+        }
     }
 
     if (node->type & SANDBOX_RULETYPE_WHITELIST) {
@@ -403,11 +553,88 @@ sandbox_veval(struct sandbox *sandbox, kauth_cred_t cred,
     result = has_allow ? KAUTH_RESULT_ALLOW : KAUTH_RESULT_DEFER;
 
 done:
-    if (result == KAUTH_RESULT_DENY && 
-            (sandbox->flags & SANDBOX_ON_DENY_ABORT)) {
-        sigexit(curlwp, SIGILL);
+    if (nodep != NULL)
+        *nodep = node;
+    return (result);
+}
+
+/* whether the event ring records a request that node decided with result;
+ * see sandbox.audit()
+ */
+static int
+sandbox_sampled(const struct sandbox_rulenode *node, int result)
+{
+    int rate = 0;
+
+    if (result == KAUTH_RESULT_DENY)
+        rate = node->sampledeny;
+    else if (result == KAUTH_RESULT_ALLOW)
+        rate = node->sampleallow;
+
+    if (rate <= 0)
+        return (0);
+
+    return (rate == 1 || cprng_fast32() % rate == 0);
+}
+
+/* Decides a request by the live version of the sandbox's policy, which
+ * sandbox_reload() may replace at any time.  A version without Lua
+ * functions never sleeps, so the request is decided within the pserialize
+ * read section; otherwise, the version is held by its nevals count, which
+ * sandbox_reload() waits to drain before reclaiming it.
+ */
+static int
+sandbox_veval(struct sandbox *sandbox, kauth_cred_t cred,
+        const struct sandbox_rule *rule, struct vnode *vp, const char *fmt, va_list ap)
+{
+    int result = KAUTH_RESULT_DEFER;
+    int flags = 0;
+    int s = 0;
+    int sampled = 0;
+    int level = 0;
+    uint32_t ruleid = 0;
+    struct sandbox *live = NULL;
+    const struct sandbox_rulenode *node = NULL;
+    const struct sandbox_rulenode **nodep = NULL;
+
+    /* the deciding rulenode is only wanted for its sampling rates, and
+     * only read while the version is held
+     */
+    if (__predict_false(sandbox_eventson))
+        nodep = &node;
+
+    s = pserialize_read_enter();
+    live = sandbox->live;
+    membar_datadep_consumer();
+    flags = live->flags;
+    if (live->K == NULL) {
+        result = sandbox_veval_live(live, cred, rule, vp, fmt, ap, nodep);
+        if (node != NULL && sandbox_sampled(node, result)) {
+            sampled = 1;
+            ruleid = node->id;
+            level = node->level;
+        }
+        pserialize_read_exit(s);
+    } else {
+        atomic_inc_uint(&live->nevals);
+        pserialize_read_exit(s);
+        result = sandbox_veval_live(live, cred, rule, vp, fmt, ap, nodep);
+        if (node != NULL && sandbox_sampled(node, result)) {
+            sampled = 1;
+            ruleid = node->id;
+            level = node->level;
+        }
+        membar_exit();
+        atomic_dec_uint(&live->nevals);
     }
 
+    if (sampled)
+        sandbox_event_record(cred, ruleid, level, result, rule, vp,
+                (fmt != NULL) ? sandbox_vsockaddr(fmt, ap) : NULL);
+
+    if (result == KAUTH_RESULT_DENY && (flags & SANDBOX_ON_DENY_ABORT))
+        sigexit(curlwp, SIGILL);
+
     return (result);
 }
 
@@ -442,36 +669,83 @@ done:
     return (result);
 }
 
+/* decides a request by a single sandbox */
+static int
+sandbox_eval(struct sandbox *sandbox, kauth_cred_t cred,
+        const struct sandbox_rule *rule, struct vnode *vp, const char *fmt, ...)
+{
+    int result = KAUTH_RESULT_DEFER;
+    va_list ap;
+
+    if (fmt != NULL)
+        va_start(ap, fmt);
+
+    result = sandbox_veval(sandbox, cred, rule, vp, fmt, ap);
+
+    if (fmt != NULL)
+        va_end(ap);
+    return (result);
+}
+
 #define SANDBOX_LIST_EVAL_NOARGS(sandbox_list, cred, rule) \
     sandbox_list_eval(sandbox_list, cred, rule, NULL, NULL)
 
-#define SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, rule, proc) \
-    sandbox_list_eval(sandbox_list, cred, rule, NULL, "p", proc)
+#define SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, rule, proc, locks) \
+    sandbox_list_eval(sandbox_list, cred, rule, NULL, "p", proc, locks)
 
 #define SANDBOX_LIST_EVAL_VNODE(sandbox_list, cred, rule, vp) \
     sandbox_list_eval(sandbox_list, cred, rule, vp, "v", vp)
 
+static void
+sandbox_countfuncs(struct sandbox_rulenode *node, const char *rulename,
+        void *arg)
+{
+    int *nfuncs = arg;
+
+    if (node->type & SANDBOX_RULETYPE_FUNCTION)
+        (*nfuncs)++;
+}
+
+/* params are the packed parameters of a template (see struct
+ * sandbox_template), or NULL
+ */
 struct sandbox *
-sandbox_create(const char *script, int flags, int *error)
+sandbox_create(const char *script, const char *params, size_t paramslen,
+        int flags, int *error)
 {
     int result = 0;
+    int nfuncs = 0;
     struct sandbox *sandbox = NULL;
 
     SANDBOX_LOG_TRACE_ENTER;
 
     SANDBOX_LOG_DEBUG("creating new sandbox\n");
 
-    sandbox = kmem_zalloc(sizeof(*sandbox), KM_SLEEP);
+    sandbox = sandbox_objcache_get(SANDBOX_OBJCACHE_SANDBOX);
     sandbox->refcnt = 1;
-    sandbox->flags = flags;
+    sandbox->live = sandbox;
+    sandbox->generation = 1;
+    sandbox->flags = sandbox_lua_pragmas(script, flags);
     sandbox->ruleset = sandbox_ruleset_create(KAUTH_RESULT_DENY);
     sandbox_lua_newstate(sandbox); /* sets sandbox->K */
 
-    result = sandbox_lua_load(sandbox->K, script);
+    result = sandbox_lua_load(sandbox->K, script, params, paramslen);
     if (result != 0) {
         sandbox_destroy(sandbox);
         sandbox = NULL;
-    } 
+    } else {
+        sandbox_lua_seal(sandbox);
+        sandbox_ruleset_seal(sandbox->ruleset);
+        sandbox->scopes = sandbox_ruleset_scopes(sandbox->ruleset);
+        secmodel_sandbox_holdscopes(sandbox->scopes);
+        sandbox_ruleset_foreach(sandbox->ruleset, sandbox_countfuncs,
+                &nfuncs);
+        if (nfuncs == 0) {
+            /* the policy is declarative, so Lua is never entered again */
+            SANDBOX_LOG_DEBUG("no function rules; releasing Lua state\n");
+            sandbox_lua_closestate(sandbox);
+        }
+    }
 
     if (error != NULL)
         *error = result;
@@ -490,107 +764,525 @@ sandbox_hold(struct sandbox *sandbox)
     atomic_inc_uint(&sandbox->refcnt);
 }
 
+/* releases the policy that the sandbox was created with, but not the
+ * sandbox itself
+ */
+static void
+sandbox_releasepolicy(struct sandbox *sandbox)
+{
+    secmodel_sandbox_releasescopes(sandbox->scopes);
+    sandbox->scopes = 0;
+    if (sandbox->ruleset != NULL) {
+        sandbox_ruleset_destroy(sandbox->ruleset);
+        sandbox->ruleset = NULL;
+    }
+    if (sandbox->K != NULL)
+        sandbox_lua_closestate(sandbox);
+}
+
 void
 sandbox_destroy(struct sandbox *sandbox)
 {
+    u_int refcnt = 0;
+
     KASSERT(sandbox != NULL);
     KASSERT(sandbox->refcnt > 0);
 
     SANDBOX_LOG_DEBUG("sandbox refcnt %u -> %u\n", sandbox->refcnt, sandbox->refcnt - 1);
 
-    if (atomic_dec_uint_nv(&sandbox->refcnt) > 0)
+    if (sandbox->regent != NULL)
+        refcnt = sandbox_registry_release(sandbox);
+    else
+        refcnt = atomic_dec_uint_nv(&sandbox->refcnt);
+    if (refcnt > 0)
         return;
 
     SANDBOX_LOG_DEBUG("destroying sandbox\n");
-    sandbox_ruleset_destroy(sandbox->ruleset);
-    klua_close(sandbox->K);
-    kmem_free(sandbox, sizeof(*sandbox));
+    if (sandbox->live != sandbox)
+        sandbox_destroy(sandbox->live);
+    sandbox_releasepolicy(sandbox);
+    sandbox_objcache_put(SANDBOX_OBJCACHE_SANDBOX, sandbox);
+}
+
+/* Returns a sandbox made from the policy and stacked on below: a live one
+ * from the registry if there is one, or else a new one, which is
+ * registered unless the policy is SANDBOX_PRIVATE.  The caller gets a
+ * reference.
+ */
+static struct sandbox *
+sandbox_get(const char *script, const char *params, size_t paramslen,
+        int flags, struct sandbox *below, int *error)
+{
+    uint64_t id = 0;
+    struct sandbox *sandbox = NULL;
+
+    if (!(flags & SANDBOX_PRIVATE)) {
+        id = sandbox_registry_id(script, params, paramslen, flags);
+        sandbox = sandbox_registry_lookup(id, script, params, paramslen,
+                flags, below);
+        if (sandbox != NULL) {
+            SANDBOX_LOG_DEBUG("sharing sandbox for policy %016llx\n",
+                    (unsigned long long)id);
+            *error = 0;
+            return (sandbox);
+        }
+    }
+
+    sandbox = sandbox_create(script, params, paramslen, flags, error);
+    if (sandbox == NULL)
+        return (NULL);
+    SLIST_NEXT(sandbox, sandbox_next) = below;
+
+    if (!(flags & SANDBOX_PRIVATE))
+        sandbox = sandbox_registry_insert(sandbox, id, script, params,
+                paramslen, flags);
+
+    return (sandbox);
 }
 
 int
-sandbox_attach(const char *script, int flags)
+sandbox_attach(const char *script, const char *params, size_t paramslen,
+        int flags)
 {
     int error = 0;
-    int is_new_list = 0;
+    uint64_t start = 0;
     kauth_cred_t cred;
     struct sandbox_list *sandbox_list = NULL;
     struct sandbox *sandbox = NULL;
 
     SANDBOX_LOG_TRACE_ENTER;
 
+    start = sandbox_ref_clock();
     cred = kauth_cred_get();
 
     sandbox_list = kauth_cred_getdata(cred, secmodel_sandbox_key);
-    if (sandbox_list == NULL) {
-        is_new_list = 1;
-        sandbox_list = sandbox_list_create();
+    sandbox = sandbox_get(script, params, paramslen, flags,
+            sandbox_list != NULL ? SLIST_FIRST(&sandbox_list->head) : NULL,
+            &error);
+    if (sandbox == NULL)
+        goto fail;
+
+    /* the cred, and so the list, may be shared with the process's parent
+     * and children, so the process gets a cred and list of its own
+     */
+    error = secmodel_sandbox_attachcurproc(sandbox);
+    if (error != 0) {
+        sandbox_destroy(sandbox);
+        goto fail;
+    }
+
+    atomic_inc_64(&sandbox_nattaches);
+    atomic_add_64(&sandbox_attachnsecs, sandbox_ref_clock() - start);
+
+fail:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* Makes a sandbox from the policy, stacked on nothing, and pins it in the
+ * registry so that processes can attach it by the id returned.  A template
+ * is loaded with an empty sandbox.params, and so must tolerate missing
+ * parameters.
+ */
+int
+sandbox_preload(const char *script, int flags, uint64_t *id)
+{
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    if (flags & SANDBOX_PRIVATE) {
+        error = EINVAL;
+        goto fail;
     }
 
-    sandbox = sandbox_create(script, flags, &error);
+    sandbox = sandbox_get(script, NULL, 0, flags, NULL, &error);
     if (sandbox == NULL)
         goto fail;
 
-    SLIST_INSERT_HEAD(&sandbox_list->head, sandbox, sandbox_next);
+    error = sandbox_registry_pin(sandbox);
+    if (error == 0)
+        *id = sandbox->regent->id;
+    sandbox_destroy(sandbox);
+
+fail:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* Attaches the preloaded policy with the id to the calling process.  For
+ * a process with no sandbox this shares the preloaded sandbox itself.
+ */
+int
+sandbox_attach_id(uint64_t id)
+{
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
 
-    if (is_new_list)
-        secmodel_sandbox_attachcurproc(sandbox_list);
-    else 
-        kauth_cred_setdata(cred, secmodel_sandbox_key, sandbox_list);
+    sandbox = sandbox_registry_lookupid(id);
+    if (sandbox == NULL) {
+        error = ENOENT;
+        goto fail;
+    }
+
+    /* the reference keeps the registry entry, and so the script, alive */
+    error = sandbox_attach(sandbox->regent->script, sandbox->regent->params,
+            sandbox->regent->paramslen, sandbox->regent->flags);
+    sandbox_destroy(sandbox);
 
 fail:
     SANDBOX_LOG_TRACE_EXIT;
     return (error);
 }
 
-struct sandbox_list *
-sandbox_list_create(void)
+/* Attaches an instance of the preloaded template with the id, bound to
+ * params, to the calling process.  The template's chunk is in the chunk
+ * cache, so only the instance's rules are built; instances with the same
+ * params are shared like any other policy.
+ */
+int
+sandbox_attach_template(uint64_t id, const char *params, size_t paramslen)
 {
+    int error = 0;
+    struct sandbox *sandbox = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    sandbox = sandbox_registry_lookupid(id);
+    if (sandbox == NULL) {
+        error = ENOENT;
+        goto fail;
+    }
+
+    error = sandbox_attach(sandbox->regent->script, params, paramslen,
+            sandbox->regent->flags);
+    sandbox_destroy(sandbox);
+
+fail:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* unpins a preloaded policy; processes attached to it keep their sandbox */
+int
+sandbox_unload(uint64_t id)
+{
+    return (sandbox_registry_unpin(id));
+}
+
+/* Replaces the policy of the sandbox with one made from script, without
+ * blocking the requests that the sandbox decides meanwhile.  The new
+ * version is built aside, with a ruleset and Lua state of its own, and
+ * published by a single store to sandbox->live; each request sees the one
+ * version or the other.  The old version is reclaimed once a pserialize
+ * grace period has passed and no request still runs its functions.
+ *
+ * A sandbox shared through the registry stands for its script, and so is
+ * never reloaded.
+ */
+int
+sandbox_reload(struct sandbox *sandbox, const char *script,
+        const char *params, size_t paramslen, int flags)
+{
+    int error = 0;
+    struct sandbox *old = NULL;
+    struct sandbox *version = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    if (sandbox->regent != NULL) {
+        error = EBUSY;
+        goto fail;
+    }
+
+    version = sandbox_create(script, params, paramslen, flags, &error);
+    if (version == NULL)
+        goto fail;
+
+    mutex_enter(&sandbox_reloadlock);
+    old = sandbox->live;
+    membar_producer();
+    sandbox->live = version;
+    pserialize_perform(sandbox_psz);
+    while (old->nevals != 0)
+        kpause("sbreload", false, 1, NULL);
+    membar_sync();
+    if (old == sandbox)
+        sandbox_releasepolicy(sandbox);
+    else
+        sandbox_destroy(old);
+    mutex_exit(&sandbox_reloadlock);
+
+fail:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* Reloads the calling process's most recently attached sandbox, if its
+ * policy allows sandbox.reload by name (see sandbox_reloadable()).  The
+ * sandbox may be shared with the process's parent and children, which see
+ * the new policy too.
+ */
+int
+sandbox_reload_curproc(const char *script, int flags)
+{
+    int error = 0;
+    kauth_cred_t cred;
     struct sandbox_list *sandbox_list = NULL;
+    struct sandbox *sandbox = NULL;
 
     SANDBOX_LOG_TRACE_ENTER;
 
-    sandbox_list = kmem_zalloc(sizeof(*sandbox_list), KM_SLEEP);
-    SLIST_INIT(&sandbox_list->head);
-    sandbox_list->serial = ++sandbox_serial;
-    //secmodel_sandbox_addsandboxlist(sandbox_list);
-    /* TODO: updating sandbox_nlists should be atomic */
-    sandbox_nlists++;
-    SANDBOX_LOG_INFO("creating sandbox_list %d\n", sandbox_list->serial);
+    cred = kauth_cred_get();
+    sandbox_list = kauth_cred_getdata(cred, secmodel_sandbox_key);
+    if (sandbox_list == NULL || SLIST_EMPTY(&sandbox_list->head)) {
+        error = ENOENT;
+        goto fail;
+    }
 
+    /* the cred, and so the list, lives as long as the calling lwp */
+    sandbox = SLIST_FIRST(&sandbox_list->head);
+    if (!sandbox_reloadable(sandbox)) {
+        error = EPERM;
+        goto fail;
+    }
+
+    sandbox_hold(sandbox);
+    error = sandbox_reload(sandbox, script, NULL, 0, flags);
+    sandbox_destroy(sandbox);
+
+fail:
     SANDBOX_LOG_TRACE_EXIT;
-    return (sandbox_list);
+    return (error);
 }
 
-/* cred is parent's cred; sandbox_list is parent's sandbox_list */
-void
-sandbox_list_fork(struct proc *parent, struct proc *child, kauth_cred_t cred) 
+struct sandbox_statsctx {
+    struct sandbox_funcstat *funcs;
+    size_t maxfuncs;
+    size_t nfuncs;      /* may exceed maxfuncs */
+    int sandbox;
+};
+
+static void
+sandbox_stats_add(struct sandbox_statsctx *ctx, const char *rulename,
+        const struct sandbox_ref *ref, int kind)
 {
-    kauth_cred_t childcred;
-   
+    struct sandbox_funcstat *fs = NULL;
+
+    if (ctx->nfuncs < ctx->maxfuncs) {
+        fs = &ctx->funcs[ctx->nfuncs];
+        strlcpy(fs->rule, rulename, sizeof(fs->rule));
+        fs->sandbox = ctx->sandbox;
+        fs->kind = kind;
+        fs->index = ref->index;
+        if (ref->flags & SANDBOX_REF_UNORDERED)
+            fs->flags |= SANDBOX_FUNCSTAT_UNORDERED;
+        fs->nevals = ref->stats.nevals;
+        fs->ndenies = ref->stats.ndenies;
+        fs->nsecs = ref->stats.nsecs;
+        fs->savednsecs = ref->savednsecs;
+        if (ref->memo != NULL) {
+            fs->flags |= SANDBOX_FUNCSTAT_PURE;
+            fs->nhits = ref->memo->nhits;
+            fs->nmisses = ref->memo->nmisses;
+        }
+    }
+    ctx->nfuncs++;
+}
+
+static void
+sandbox_stats_visit(struct sandbox_rulenode *node, const char *rulename,
+        void *arg)
+{
+    struct sandbox_statsctx *ctx = arg;
+    struct sandbox_ref *ref = NULL;
+    struct sandbox_ref *member = NULL;
+
+    if (!(node->type & SANDBOX_RULETYPE_FUNCTION))
+        return;
+
+    SIMPLEQ_FOREACH(ref, &node->funclist, ref_next) {
+        if (ref->prog != NULL) {
+            sandbox_stats_add(ctx, rulename, ref, SANDBOX_FUNCSTAT_EXPR);
+        } else if (SIMPLEQ_EMPTY(&ref->members)) {
+            sandbox_stats_add(ctx, rulename, ref, SANDBOX_FUNCSTAT_LUA);
+        } else {
+            sandbox_stats_add(ctx, rulename, ref,
+                    SANDBOX_FUNCSTAT_DISPATCHER);
+            /* in their current order */
+            SIMPLEQ_FOREACH(member, &ref->members, ref_next)
+                sandbox_stats_add(ctx, rulename, member,
+                        SANDBOX_FUNCSTAT_MEMBER);
+        }
+    }
+}
+
+/* the object cache types are the sandbox_stats.objs types */
+CTASSERT(SANDBOX_OBJCACHE_NTYPES == SANDBOX_OBJSTAT_NTYPES);
+
+/* Copies out the runtime stats of the sandbox.on() functions of process
+ * stats->pid, which the caller must be able to see.  The Lua lock keeps a
+ * dispatcher from reordering its members while they are read.
+ */
+int
+sandbox_stats(struct sandbox_stats *stats)
+{
+    int error = 0;
+    int i = 0;
+    int s = 0;
+    struct proc *p = NULL;
+    kauth_cred_t cred = NULL;
+    struct sandbox_list *sandbox_list = NULL;
+    struct sandbox *sandbox = NULL;
+    struct sandbox *live = NULL;
+    struct sandbox_statsctx ctx;
+    struct sandbox_chunkcache_stats chunkstats;
+    struct sandbox_objcache_stats objstats[SANDBOX_OBJCACHE_NTYPES];
+
     SANDBOX_LOG_TRACE_ENTER;
 
-    SANDBOX_LOG_DEBUG("fork (%lu -> %lu)\n", (unsigned long)parent->p_pid, (unsigned long)child->p_pid);
+    memset(&ctx, 0, sizeof(ctx));
+
+    if (stats->pid == 0) {
+        cred = kauth_cred_get();
+        kauth_cred_hold(cred);
+    } else {
+        mutex_enter(proc_lock);
+        p = proc_find(stats->pid);
+        if (p == NULL) {
+            mutex_exit(proc_lock);
+            error = ESRCH;
+            goto fail;
+        }
+        mutex_enter(p->p_lock);
+        error = kauth_authorize_process(kauth_cred_get(),
+                KAUTH_PROCESS_CANSEE, p,
+                KAUTH_ARG(KAUTH_REQ_PROCESS_CANSEE_ENTRY), NULL, NULL);
+        if (error == 0) {
+            cred = p->p_cred;
+            kauth_cred_hold(cred);
+        }
+        mutex_exit(p->p_lock);
+        mutex_exit(proc_lock);
+        if (error != 0)
+            goto fail;
+    }
 
-    /* see sys/kern/kauth_kauth.c::kauth_cred_dup()
-     *
-     * kauth_cred_dup() generates a KAUTH_CRED_COPY hook, 
-     * which is where we create the child's own sandbox_list;
-     */
-    childcred = kauth_cred_dup(cred);
-    child->p_cred = childcred;
+    ctx.maxfuncs = MIN(stats->nfuncs, SANDBOX_STATS_MAXFUNCS);
+    if (ctx.maxfuncs > 0)
+        ctx.funcs = kmem_zalloc(ctx.maxfuncs * sizeof(*ctx.funcs), KM_SLEEP);
 
-    /* see sys/kern/kern_kauth.c::kauth_cred_fork()
-     *
-     * kauth_cred_fork() sets the childs cred to that of the parent, and
-     * increments the refcnt on the cred.  Since we are giving the child a new
-     * cred, we must decrement the parent cred's refcount by calling
-     * kauth_cred_free().
-     */
-	mutex_enter(parent->p_lock);
-	kauth_cred_free(parent->p_cred);
-	mutex_exit(parent->p_lock);
+    sandbox_list = kauth_cred_getdata(cred, secmodel_sandbox_key);
+    if (sandbox_list != NULL) {
+        SLIST_FOREACH(sandbox, &sandbox_list->head, sandbox_next) {
+            s = pserialize_read_enter();
+            live = sandbox->live;
+            membar_datadep_consumer();
+            atomic_inc_uint(&live->nevals);
+            pserialize_read_exit(s);
+            /* a sandbox without a Lua state has no functions */
+            if (live->K != NULL) {
+                klua_lock(live->K);
+                sandbox_ruleset_foreach(live->ruleset,
+                        sandbox_stats_visit, &ctx);
+                klua_unlock(live->K);
+            }
+            membar_exit();
+            atomic_dec_uint(&live->nevals);
+            ctx.sandbox++;
+        }
+    }
+    kauth_cred_free(cred);
+
+    if (ctx.maxfuncs > 0) {
+        error = copyout(ctx.funcs, stats->funcs,
+                MIN(ctx.nfuncs, ctx.maxfuncs) * sizeof(*ctx.funcs));
+        kmem_free(ctx.funcs, ctx.maxfuncs * sizeof(*ctx.funcs));
+    }
+    stats->nfuncs = ctx.nfuncs;
+    stats->nattaches = sandbox_nattaches;
+    stats->attachnsecs = sandbox_attachnsecs;
+    sandbox_lua_poolstats(&stats->poolhits, &stats->poolmisses);
+    sandbox_registry_stats(&stats->registryhits, &stats->registrymisses);
+    sandbox_chunkcache_stats(&chunkstats);
+    stats->chunkhits = chunkstats.nhits;
+    stats->chunkmisses = chunkstats.nmisses;
+    stats->chunkevictions = chunkstats.nevictions;
+    sandbox_objcache_stats(objstats);
+    for (i = 0; i < SANDBOX_OBJCACHE_NTYPES; i++) {
+        stats->objs[i].nallocs = objstats[i].nallocs;
+        stats->objs[i].nfrees = objstats[i].nfrees;
+    }
+    sandbox_permissive_stats(&stats->permqueued, &stats->permdropped,
+            &stats->permdenies);
+
+fail:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* True if the live version of the sandbox's policy has a rule of its own
+ * on sandbox.reload, and that rule just allows.  Neither a default nor a
+ * rule on 'sandbox' lets a process replace its policy: the policy must
+ * name the rule.
+ */
+int
+sandbox_reloadable(struct sandbox *sandbox)
+{
+    int s = 0;
+    int reloadable = 0;
+    struct sandbox *live = NULL;
+    const struct sandbox_rulenode *node = NULL;
+    struct sandbox_rule rule = { .names = {NULL, NULL, NULL }};
+
+    SANDBOX_RULE_MAKE(&rule, "sandbox", "reload", NULL);
+
+    s = pserialize_read_enter();
+    live = sandbox->live;
+    membar_datadep_consumer();
+    node = sandbox_ruleset_search(live->ruleset, &rule);
+    reloadable = node->level == sandbox_rule_size(&rule) &&
+        node->type == SANDBOX_RULETYPE_TRILEAN &&
+        node->value == KAUTH_RESULT_ALLOW;
+    pserialize_read_exit(s);
+
+    return (reloadable);
+}
+
+void
+sandbox_init(void)
+{
+    mutex_init(&sandbox_reloadlock, MUTEX_DEFAULT, IPL_NONE);
+    sandbox_psz = pserialize_create();
+}
+
+void
+sandbox_fini(void)
+{
+    pserialize_destroy(sandbox_psz);
+    mutex_destroy(&sandbox_reloadlock);
+}
+
+struct sandbox_list *
+sandbox_list_create(void)
+{
+    struct sandbox_list *sandbox_list = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    sandbox_list = sandbox_objcache_get(SANDBOX_OBJCACHE_LIST);
+    SLIST_INIT(&sandbox_list->head);
+    sandbox_list->serial = ++sandbox_serial;
+    //secmodel_sandbox_addsandboxlist(sandbox_list);
+    /* TODO: updating sandbox_nlists should be atomic */
+    sandbox_nlists++;
+    SANDBOX_LOG_INFO("creating sandbox_list %d\n", sandbox_list->serial);
 
     SANDBOX_LOG_TRACE_EXIT;
+    return (sandbox_list);
 }
 
 /* cred is the newly created credential; sandbox_list belongs to some other
@@ -645,7 +1337,7 @@ sandbox_list_destroy(struct sandbox_list *sandbox_list)
         sandbox_destroy(sandbox);
     }
 
-    kmem_free(sandbox_list, sizeof(*sandbox_list));
+    sandbox_objcache_put(SANDBOX_OBJCACHE_LIST, sandbox_list);
     /* TODO: remove from secmodel_sandbox_lists? */
 
     /* TODO: decrementing sandbox_nlists must be atomic */
@@ -654,6 +1346,35 @@ sandbox_list_destroy(struct sandbox_list *sandbox_list)
     SANDBOX_LOG_TRACE_EXIT;
 }
 
+/* Returns 1 if the process with cred is confined by every sandbox that
+ * the process with ancestor is -- having inherited them across fork, or
+ * attached the same policies, which the registry shares -- and 0
+ * otherwise.  A sandbox list holds the whole chain below its head, so it
+ * is enough to look for ancestor's topmost sandbox.
+ */
+int
+sandbox_cred_inherits(kauth_cred_t cred, kauth_cred_t ancestor)
+{
+    struct sandbox_list *sandbox_list = NULL;
+    struct sandbox *top = NULL;
+    struct sandbox *sandbox = NULL;
+
+    sandbox_list = kauth_cred_getdata(ancestor, secmodel_sandbox_key);
+    if (sandbox_list == NULL || SLIST_EMPTY(&sandbox_list->head))
+        return (1);
+    top = SLIST_FIRST(&sandbox_list->head);
+
+    sandbox_list = kauth_cred_getdata(cred, secmodel_sandbox_key);
+    if (sandbox_list == NULL)
+        return (0);
+    SLIST_FOREACH(sandbox, &sandbox_list->head, sandbox_next) {
+        if (sandbox == top)
+            return (1);
+    }
+
+    return (0);
+}
+
 int
 sandbox_list_evalsystem(struct sandbox_list *sandbox_list, kauth_cred_t cred,
        kauth_action_t action, enum kauth_system_req req, void *arg1,
@@ -862,12 +1583,38 @@ sandbox_list_evalsystem(struct sandbox_list *sandbox_list, kauth_cred_t cred,
     return (result);
 } 
 
+/* the locks on the process that the callers of a process-scope action
+ * hold (see SANDBOX_PRED_LOCKS_NONE)
+ */
+static int
+sandbox_process_locks(kauth_action_t action)
+{
+    switch (action) {
+    case KAUTH_PROCESS_NICE:
+    case KAUTH_PROCESS_PTRACE:
+    case KAUTH_PROCESS_SIGNAL:
+        /* donice(), do_ptrace() and kill1() find the process under
+         * proc_lock and lock it
+         */
+        return (SANDBOX_PRED_LOCKS_BOTH);
+    case KAUTH_PROCESS_FORK:
+        /* fork1() asks about the parent before it takes any lock */
+        return (SANDBOX_PRED_LOCKS_NONE);
+    default:
+        /* KAUTH_PROCESS_CANSEE, for one, comes both with and without
+         * p_lock held
+         */
+        return (SANDBOX_PRED_LOCKS_UNKNOWN);
+    }
+}
+
 int
 sandbox_list_evalprocess(struct sandbox_list *sandbox_list, kauth_cred_t cred,
        kauth_action_t action, struct proc *p, void *arg1, void *arg2, 
        void *arg3)
 {
     int result = KAUTH_RESULT_DEFER;
+    int locks = sandbox_process_locks(action);
     struct sandbox_rule rule = {{ "process", NULL, NULL }};
     enum kauth_process_req req = 0;
 
@@ -881,13 +1628,15 @@ sandbox_list_evalprocess(struct sandbox_list *sandbox_list, kauth_cred_t cred,
     case KAUTH_PROCESS_SCHEDULER_GETPARAM:
     case KAUTH_PROCESS_SETID:
         /* arg1=NULL, arg2=NULL, arg3=NULL */
-        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p);
+        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p,
+                locks);
         break;
     case KAUTH_PROCESS_CANSEE:
         /* arg1=req, arg2=NULL, arg3=NULL */
         req = (enum kauth_process_req)arg1;
         SANDBOX_RULE_SUBACTION(&rule) = SANDBOX_ARRAY_GET(sandbox_process_req_strmap, req);
-        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p);
+        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p,
+                locks);
         break;
     case KAUTH_PROCESS_CORENAME:
         req = (enum kauth_process_req)arg1;
@@ -895,12 +1644,14 @@ sandbox_list_evalprocess(struct sandbox_list *sandbox_list, kauth_cred_t cred,
         case KAUTH_REQ_PROCESS_CORENAME_GET:
             /* arg1=req, arg2=NULL, arg3=NULL */
             SANDBOX_RULE_SUBACTION(&rule) = SANDBOX_ARRAY_GET(sandbox_process_req_strmap, req);
-            result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p);
+            result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p,
+                    locks);
             break;
         case KAUTH_REQ_PROCESS_CORENAME_SET:
             /* arg1=req, arg2=char *cnbuf, arg3=NULL */
             SANDBOX_RULE_SUBACTION(&rule) = SANDBOX_ARRAY_GET(sandbox_process_req_strmap, req);
-            result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p);
+            result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p,
+                    locks);
             break;
         default:
             SANDBOX_LOG_WARN("unknown subaction (%u) for rule: %s.%s\n", req,
@@ -915,21 +1666,24 @@ sandbox_list_evalprocess(struct sandbox_list *sandbox_list, kauth_cred_t cred,
     case KAUTH_PROCESS_STOPFLAG:
         /* arg1=int n, arg2=NULL, arg3=NULL */
         result = sandbox_list_eval(sandbox_list, cred, &rule, NULL, "pi", p,
-                SANDBOX_CAST_PVOID_TO_LUA_INTEGER(arg1));
+                locks, SANDBOX_CAST_PVOID_TO_LUA_INTEGER(arg1));
         break;
     case KAUTH_PROCESS_PROCFS:
         /* arg1=struct pfsnode *pfs, arg2=req, arg3=NULL */
         SANDBOX_RULE_SUBACTION(&rule) = SANDBOX_ARRAY_GET(sandbox_process_req_strmap, (unsigned long)arg2);
-        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p);
+        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p,
+                locks);
         break;
     case KAUTH_PROCESS_RLIMIT:
         /* arg1=req, arg2=struct rlimit *alimit, arg3=int which */
         SANDBOX_RULE_SUBACTION(&rule) = SANDBOX_ARRAY_GET(sandbox_process_req_strmap, (unsigned long)arg1);
-        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p);
+        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p,
+                locks);
         break;
     case KAUTH_PROCESS_SCHEDULER_SETPARAM:
         /* arg1=struct lwp *t, arg2=int lpolicy, arg3=pri_t kpir */
-        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p);
+        result = SANDBOX_LIST_EVAL_PROCESS(sandbox_list, cred, &rule, p,
+                locks);
         break;
     default:
         SANDBOX_LOG_WARN("unknown action (%u) for rule: %s\n", action,
@@ -53,28 +53,51 @@ struct sandbox_list {
 };
 
 struct sandbox {
-    klua_State  *K;
+    klua_State  *K;         /* NULL if the policy has no functions */
     struct sandbox_ruleset *ruleset;
     int flags;
+    int scopes;             /* SANDBOX_SCOPE_* flags; see the ruleset */
+    uint64_t generation;    /* of the cached verdicts of pure functions */
     u_int refcnt;
+    struct sandbox_regent *regent;  /* NULL if not in the registry */
+    struct sandbox *live;   /* the version of the policy that decides
+                               requests: the sandbox itself until it is
+                               reloaded; see sandbox_reload() */
+    u_int nevals;           /* requests running this version's functions */
     SLIST_ENTRY(sandbox) sandbox_next;
 };
 
-struct sandbox * sandbox_create(const char *script, int flags, int *error);
+struct sandbox * sandbox_create(const char *script, const char *params,
+        size_t paramslen, int flags, int *error);
 void sandbox_hold(struct sandbox *sandbox);
 void sandbox_destroy(struct sandbox *sandbox);
-int sandbox_attach(const char *script, int flags);
+int sandbox_attach(const char *script, const char *params, size_t paramslen,
+        int flags);
+int sandbox_preload(const char *script, int flags, uint64_t *id);
+int sandbox_attach_id(uint64_t id);
+int sandbox_attach_template(uint64_t id, const char *params,
+        size_t paramslen);
+int sandbox_unload(uint64_t id);
+int sandbox_reload(struct sandbox *sandbox, const char *script,
+        const char *params, size_t paramslen, int flags);
+int sandbox_reloadable(struct sandbox *sandbox);
+int sandbox_reload_curproc(const char *script, int flags);
+
+void sandbox_init(void);
+void sandbox_fini(void);
+
+struct sandbox_stats;
+int sandbox_stats(struct sandbox_stats *stats);
 
 struct sandbox_list * sandbox_list_create(void);
 
-void sandbox_list_fork(struct proc *parent, struct proc *child, 
-        kauth_cred_t cred);
-
 void sandbox_list_copy(const struct sandbox_list *sandbox_list, 
         kauth_cred_t cred);
 
 void sandbox_list_destroy(struct sandbox_list *sandbox_list);
 
+int sandbox_cred_inherits(kauth_cred_t cred, kauth_cred_t ancestor);
+
 int sandbox_list_evalsystem(struct sandbox_list *sandbox_list,
         kauth_cred_t cred, kauth_action_t action, enum kauth_system_req req,
         void *arg1, void *arg2, void *arg3);
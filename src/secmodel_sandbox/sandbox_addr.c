@@ -0,0 +1,566 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/kmem.h>
+#include <sys/errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+
+#include "sandbox_addr.h"
+
+#include "sandbox_log.h"
+
+/* the length of a sockaddr, on systems where it carries one */
+#ifdef SIN6_LEN
+#define SANDBOX_ADDR_SALEN(sa)  ((size_t)(sa)->sa_len)
+#else
+#define SANDBOX_ADDR_SALEN(sa)  sizeof(struct sockaddr_storage)
+#endif
+
+#define SANDBOX_ADDR_BIT(addr, i) (((addr)[(i) / 8] >> (7 - (i) % 8)) & 1)
+
+/*
+ * Port ranges
+ */
+
+/* adds [lo, hi] to the node's ranges, coalescing the ranges it overlaps or
+ * abuts
+ */
+static void
+sandbox_addr_node_addrange(struct sandbox_addr_node *node, int lo, int hi)
+{
+    int i = 0;
+    int j = 0;
+    int n = node->nranges;
+    int maxranges = 0;
+    struct sandbox_addr_range *ranges = NULL;
+
+    for (i = 0; i < n && node->ranges[i].hi + 1 < lo; i++)
+        continue;
+    for (j = i; j < n && node->ranges[j].lo <= hi + 1; j++) {
+        lo = MIN(lo, node->ranges[j].lo);
+        hi = MAX(hi, node->ranges[j].hi);
+    }
+
+    /* ranges [i, j) become one */
+    if (i == j && n == node->maxranges) {
+        maxranges = node->maxranges == 0 ? 2 : node->maxranges * 2;
+        ranges = kmem_alloc(maxranges * sizeof(*ranges), KM_SLEEP);
+        if (n > 0) {
+            memcpy(ranges, node->ranges, n * sizeof(*ranges));
+            kmem_free(node->ranges, node->maxranges * sizeof(*ranges));
+        }
+        node->ranges = ranges;
+        node->maxranges = maxranges;
+    }
+    memmove(&node->ranges[i + 1], &node->ranges[j],
+            (n - j) * sizeof(*node->ranges));
+    node->ranges[i].lo = lo;
+    node->ranges[i].hi = hi;
+    node->nranges = n - (j - i) + 1;
+}
+
+static bool
+sandbox_addr_node_hasport(const struct sandbox_addr_node *node, int port)
+{
+    int lo = 0;
+    int hi = node->nranges - 1;
+    int mid = 0;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (port < node->ranges[mid].lo)
+            hi = mid - 1;
+        else if (port > node->ranges[mid].hi)
+            lo = mid + 1;
+        else
+            return (true);
+    }
+
+    return (false);
+}
+
+/*
+ * Tries
+ */
+
+static struct sandbox_addr_node *
+sandbox_addr_node_create(struct sandbox_addr_set *set)
+{
+    set->nnodes++;
+    return (kmem_zalloc(sizeof(struct sandbox_addr_node), KM_SLEEP));
+}
+
+static void
+sandbox_addr_node_destroy(struct sandbox_addr_node *node)
+{
+    if (node == NULL)
+        return;
+
+    sandbox_addr_node_destroy(node->child[0]);
+    sandbox_addr_node_destroy(node->child[1]);
+    if (node->ranges != NULL)
+        kmem_free(node->ranges, node->maxranges * sizeof(*node->ranges));
+    kmem_free(node, sizeof(*node));
+}
+
+static void
+sandbox_addr_insert(struct sandbox_addr_set *set,
+        struct sandbox_addr_node **rootp, const uint8_t *addr, int plen,
+        int lo, int hi)
+{
+    int i = 0;
+    struct sandbox_addr_node **nodep = rootp;
+
+    for (i = 0; ; i++) {
+        if (*nodep == NULL)
+            *nodep = sandbox_addr_node_create(set);
+        if (i == plen)
+            break;
+        nodep = &(*nodep)->child[SANDBOX_ADDR_BIT(addr, i)];
+    }
+
+    sandbox_addr_node_addrange(*nodep, lo, hi);
+}
+
+static bool
+sandbox_addr_lookup(const struct sandbox_addr_node *node,
+        const uint8_t *addr, int nbits, int port)
+{
+    int i = 0;
+
+    for (i = 0; node != NULL; i++) {
+        if (node->nranges > 0 && sandbox_addr_node_hasport(node, port))
+            return (true);
+        if (i == nbits)
+            break;
+        node = node->child[SANDBOX_ADDR_BIT(addr, i)];
+    }
+
+    return (false);
+}
+
+static void
+sandbox_addr_node_merge(struct sandbox_addr_set *set,
+        struct sandbox_addr_node **top, const struct sandbox_addr_node *from)
+{
+    int i = 0;
+
+    if (from == NULL)
+        return;
+
+    if (*top == NULL)
+        *top = sandbox_addr_node_create(set);
+    for (i = 0; i < from->nranges; i++)
+        sandbox_addr_node_addrange(*top, from->ranges[i].lo,
+                from->ranges[i].hi);
+    sandbox_addr_node_merge(set, &(*top)->child[0], from->child[0]);
+    sandbox_addr_node_merge(set, &(*top)->child[1], from->child[1]);
+}
+
+/*
+ * Parsing
+ */
+
+/* parses a decimal number of at most max from s[0..len) */
+static int
+sandbox_addr_parsedec(const char *s, size_t len, u_long max, u_long *val)
+{
+    size_t i = 0;
+
+    if (len == 0)
+        return (EINVAL);
+
+    *val = 0;
+    for (i = 0; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9')
+            return (EINVAL);
+        *val = *val * 10 + (s[i] - '0');
+        if (*val > max)
+            return (EINVAL);
+    }
+
+    return (0);
+}
+
+/* '*', 'N' or 'N-M' */
+static int
+sandbox_addr_parseports(const char *s, size_t len, int *lo, int *hi)
+{
+    u_long a = 0;
+    u_long b = 0;
+    const char *dash = NULL;
+
+    if (len == 1 && s[0] == '*') {
+        *lo = 0;
+        *hi = 65535;
+        return (0);
+    }
+
+    dash = memchr(s, '-', len);
+    if (dash == NULL) {
+        if (sandbox_addr_parsedec(s, len, 65535, &a) != 0)
+            return (EINVAL);
+        b = a;
+    } else {
+        if (sandbox_addr_parsedec(s, dash - s, 65535, &a) != 0 ||
+                sandbox_addr_parsedec(dash + 1, len - (dash - s) - 1, 65535,
+                    &b) != 0 || a > b)
+            return (EINVAL);
+    }
+
+    *lo = a;
+    *hi = b;
+    return (0);
+}
+
+static int
+sandbox_addr_parseinet(const char *s, size_t len, uint8_t *addr)
+{
+    int i = 0;
+    u_long octet = 0;
+    const char *end = s + len;
+    const char *dot = NULL;
+
+    for (i = 0; i < 4; i++) {
+        dot = memchr(s, '.', end - s);
+        if ((i < 3) != (dot != NULL))
+            return (EINVAL);
+        if (dot == NULL)
+            dot = end;
+        if (sandbox_addr_parsedec(s, dot - s, 255, &octet) != 0)
+            return (EINVAL);
+        addr[i] = octet;
+        s = dot + 1;
+    }
+
+    return (0);
+}
+
+static int
+sandbox_addr_hexdigit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return (c - '0');
+    if (c >= 'a' && c <= 'f')
+        return (c - 'a' + 10);
+    if (c >= 'A' && c <= 'F')
+        return (c - 'A' + 10);
+    return (-1);
+}
+
+/* colon-separated groups of up to four hex digits, at most one run of
+ * which may be elided with '::'
+ */
+static int
+sandbox_addr_parseinet6(const char *s, size_t len, uint8_t *addr)
+{
+    int ngroups = 0;
+    int gap = -1;           /* the group at which '::' was */
+    int ndigits = 0;
+    int d = 0;
+    u_int group = 0;
+    uint16_t groups[8];
+    size_t i = 0;
+
+    memset(addr, 0, 16);
+
+    if (len >= 2 && s[0] == ':' && s[1] == ':') {
+        gap = 0;
+        i = 2;
+    } else if (len >= 1 && s[0] == ':') {
+        return (EINVAL);
+    }
+
+    for (; i <= len; i++) {
+        if (i < len && (d = sandbox_addr_hexdigit(s[i])) >= 0) {
+            if (++ndigits > 4)
+                return (EINVAL);
+            group = (group << 4) | d;
+            continue;
+        }
+        if (i < len && s[i] != ':')
+            return (EINVAL);
+
+        /* the end of a group */
+        if (ndigits == 0) {
+            /* only '::' at the very end leaves an empty last group */
+            if (i == len && gap == ngroups && i >= 2)
+                break;
+            return (EINVAL);
+        }
+        if (ngroups == 8)
+            return (EINVAL);
+        groups[ngroups++] = group;
+        group = 0;
+        ndigits = 0;
+
+        if (i + 1 < len && s[i + 1] == ':') {
+            if (gap >= 0)
+                return (EINVAL);
+            gap = ngroups;
+            i++;
+        }
+    }
+
+    if (gap < 0 ? ngroups != 8 : ngroups == 8)
+        return (EINVAL);
+
+    for (i = 0; i < (size_t)ngroups; i++) {
+        d = (gap >= 0 && (int)i >= gap) ? i + 8 - ngroups : i;
+        addr[2 * d] = groups[i] >> 8;
+        addr[2 * d + 1] = groups[i] & 0xff;
+    }
+
+    return (0);
+}
+
+static int
+sandbox_addr_addlocal(struct sandbox_addr_set *set, const char *path)
+{
+    struct sandbox_addr_local *local = NULL;
+    size_t len = strlen(path);
+
+    if (len == 0)
+        return (EINVAL);
+
+    local = kmem_zalloc(sizeof(*local), KM_SLEEP);
+    local->path = kmem_alloc(len + 1, KM_SLEEP);
+    memcpy(local->path, path, len + 1);
+    local->len = len;
+    if (path[len - 1] == '*') {
+        local->prefix = 1;
+        local->len--;
+    }
+    SIMPLEQ_INSERT_TAIL(&set->locals, local, local_next);
+
+    return (0);
+}
+
+/*
+ * API
+ */
+
+struct sandbox_addr_set *
+sandbox_addr_set_create(void)
+{
+    struct sandbox_addr_set *set = NULL;
+
+    set = kmem_zalloc(sizeof(*set), KM_SLEEP);
+    SIMPLEQ_INIT(&set->locals);
+
+    return (set);
+}
+
+/* Adds an entry of the form
+ *
+ *  ADDR[/LEN][:PORTS]      an IPv4 address or prefix
+ *  [ADDR6][/LEN][:PORTS]   an IPv6 address or prefix
+ *  *[:PORTS]               any IPv4 or IPv6 address
+ *  unix:PATH               a local-domain path, or prefix if it ends in '*'
+ *
+ * where PORTS is '*', 'N', or 'N-M' and defaults to '*'.  Returns 0 on
+ * success and EINVAL if the entry is malformed.
+ */
+int
+sandbox_addr_set_add(struct sandbox_addr_set *set, const char *spec)
+{
+    int error = 0;
+    int lo = 0;
+    int hi = 65535;
+    int nbits = 32;
+    u_long plen = 0;
+    size_t len = 0;
+    const char *addr = spec;
+    size_t addrlen = 0;
+    const char *end = NULL;
+    const char *p = NULL;
+    const char *q = NULL;
+    uint8_t bytes[16];
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    len = strlen(spec);
+    if (len == 0 || len > SANDBOX_ADDR_MAXSPECLEN) {
+        error = EINVAL;
+        goto done;
+    }
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        error = sandbox_addr_addlocal(set, spec + 5);
+        goto done;
+    }
+
+    end = spec + len;
+    if (spec[0] == '*') {
+        nbits = 0;
+        p = spec + 1;
+    } else if (spec[0] == '[') {
+        nbits = 128;
+        addr = spec + 1;
+        p = memchr(addr, ']', end - addr);
+        if (p == NULL) {
+            error = EINVAL;
+            goto done;
+        }
+        addrlen = p - addr;
+        p++;
+    } else {
+        for (p = spec; p < end && *p != '/' && *p != ':'; p++)
+            continue;
+        addrlen = p - addr;
+    }
+
+    plen = nbits;
+    if (p < end && *p == '/' && nbits > 0) {
+        q = ++p;
+        while (p < end && *p != ':')
+            p++;
+        if (sandbox_addr_parsedec(q, p - q, nbits, &plen) != 0) {
+            error = EINVAL;
+            goto done;
+        }
+    }
+
+    if (p < end) {
+        if (*p != ':' || sandbox_addr_parseports(p + 1, end - p - 1, &lo,
+                    &hi) != 0) {
+            error = EINVAL;
+            goto done;
+        }
+    }
+
+    switch (nbits) {
+    case 0:
+        memset(bytes, 0, sizeof(bytes));
+        sandbox_addr_insert(set, &set->inet, bytes, 0, lo, hi);
+        sandbox_addr_insert(set, &set->inet6, bytes, 0, lo, hi);
+        break;
+    case 32:
+        error = sandbox_addr_parseinet(addr, addrlen, bytes);
+        if (error == 0)
+            sandbox_addr_insert(set, &set->inet, bytes, plen, lo, hi);
+        break;
+    case 128:
+        error = sandbox_addr_parseinet6(addr, addrlen, bytes);
+        if (error == 0)
+            sandbox_addr_insert(set, &set->inet6, bytes, plen, lo, hi);
+        break;
+    }
+
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* adds the entries of from to to */
+void
+sandbox_addr_set_merge(struct sandbox_addr_set *to,
+        const struct sandbox_addr_set *from)
+{
+    struct sandbox_addr_local *local = NULL;
+
+    sandbox_addr_node_merge(to, &to->inet, from->inet);
+    sandbox_addr_node_merge(to, &to->inet6, from->inet6);
+    SIMPLEQ_FOREACH(local, &from->locals, local_next)
+        (void)sandbox_addr_addlocal(to, local->path);
+}
+
+bool
+sandbox_addr_set_contains(const struct sandbox_addr_set *set,
+        const struct sockaddr *sa)
+{
+    size_t salen = 0;
+    size_t pathlen = 0;
+    const struct sockaddr_in *sin = NULL;
+    const struct sockaddr_in6 *sin6 = NULL;
+    const struct sockaddr_un *sun = NULL;
+    const struct sandbox_addr_local *local = NULL;
+
+    if (sa == NULL)
+        return (false);
+
+    salen = SANDBOX_ADDR_SALEN(sa);
+
+    switch (sa->sa_family) {
+    case AF_INET:
+        if (salen < sizeof(*sin))
+            return (false);
+        sin = (const struct sockaddr_in *)sa;
+        return (sandbox_addr_lookup(set->inet,
+                    (const uint8_t *)&sin->sin_addr, 32,
+                    ntohs(sin->sin_port)));
+    case AF_INET6:
+        if (salen < sizeof(*sin6))
+            return (false);
+        sin6 = (const struct sockaddr_in6 *)sa;
+        return (sandbox_addr_lookup(set->inet6,
+                    (const uint8_t *)&sin6->sin6_addr, 128,
+                    ntohs(sin6->sin6_port)));
+    case AF_LOCAL:
+        if (salen <= offsetof(struct sockaddr_un, sun_path))
+            return (false);
+        sun = (const struct sockaddr_un *)sa;
+        pathlen = strnlen(sun->sun_path, MIN(sizeof(sun->sun_path),
+                    salen - offsetof(struct sockaddr_un, sun_path)));
+        SIMPLEQ_FOREACH(local, &set->locals, local_next) {
+            if (local->prefix ? pathlen >= local->len :
+                    pathlen == local->len) {
+                if (memcmp(sun->sun_path, local->path, local->len) == 0)
+                    return (true);
+            }
+        }
+        return (false);
+    default:
+        return (false);
+    }
+}
+
+void
+sandbox_addr_set_destroy(struct sandbox_addr_set *set)
+{
+    struct sandbox_addr_local *local = NULL;
+
+    KASSERT(set != NULL);
+
+    sandbox_addr_node_destroy(set->inet);
+    sandbox_addr_node_destroy(set->inet6);
+    while (!SIMPLEQ_EMPTY(&set->locals)) {
+        local = SIMPLEQ_FIRST(&set->locals);
+        SIMPLEQ_REMOVE_HEAD(&set->locals, local_next);
+        kmem_free(local->path, strlen(local->path) + 1);
+        kmem_free(local, sizeof(*local));
+    }
+    kmem_free(set, sizeof(*set));
+}
@@ -0,0 +1,92 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SANDBOX_ADDR_H_
+#define _SANDBOX_ADDR_H_
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+/* An address set is the compiled form of a list like
+ *
+ *  { '10.0.0.0/8:8000-8999', '127.0.0.1', '[::1]:*', '*:80',
+ *    'unix:/var/run/app.sock', 'unix:/tmp/app-*' }
+ *
+ * as given to sandbox.bind_allow() and sandbox.bind_deny().  Each family
+ * of IP addresses is a binary trie, one level per bit of the address; the
+ * node at the end of an entry's prefix holds the entry's ports as a
+ * sorted list of disjoint ranges.  A sockaddr is in the set if any node
+ * on its address's path has a range with its port, so matching never
+ * allocates and costs at most one step per address bit.  Local-domain
+ * entries are paths, which are matched exactly or, if they end in '*',
+ * as a prefix.
+ */
+
+#define SANDBOX_ADDR_MAXSPECLEN     128
+
+struct sandbox_addr_range {
+    uint16_t lo;
+    uint16_t hi;
+};
+
+struct sandbox_addr_node {
+    struct sandbox_addr_node *child[2];
+    int nranges;
+    int maxranges;
+    struct sandbox_addr_range *ranges;  /* sorted, disjoint */
+};
+
+struct sandbox_addr_local {
+    char *path;
+    size_t len;         /* not counting the NUL or a trailing '*' */
+    int prefix;         /* the entry ended in '*' */
+    SIMPLEQ_ENTRY(sandbox_addr_local) local_next;
+};
+
+struct sandbox_addr_set {
+    struct sandbox_addr_node *inet;     /* NULL if there are no entries */
+    struct sandbox_addr_node *inet6;
+    SIMPLEQ_HEAD(, sandbox_addr_local) locals;
+    u_int nnodes;
+};
+
+struct sandbox_addr_set * sandbox_addr_set_create(void);
+
+int sandbox_addr_set_add(struct sandbox_addr_set *set, const char *spec);
+
+void sandbox_addr_set_merge(struct sandbox_addr_set *to,
+        const struct sandbox_addr_set *from);
+
+bool sandbox_addr_set_contains(const struct sandbox_addr_set *set,
+        const struct sockaddr *sa);
+
+void sandbox_addr_set_destroy(struct sandbox_addr_set *set);
+
+#endif /* !_SANDBOX_ADDR_H_ */
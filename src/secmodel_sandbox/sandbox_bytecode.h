@@ -0,0 +1,57 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SANDBOX_BYTECODE_H_
+#define _SANDBOX_BYTECODE_H_
+
+#include <sys/types.h>
+
+/* A reader for the binary chunks that lua_dump() produces.  It knows just
+ * enough of the Lua 5.3 chunk format and instruction set to tell whether a
+ * function's result can depend on its arguments.  Chunks in any other
+ * format are rejected, and callers treat them as not constant.
+ */
+
+/* what the outermost function of a chunk returns */
+#define SANDBOX_BYTECODE_VARIES 0   /* not known until the function runs */
+#define SANDBOX_BYTECODE_TRUE   1   /* always a true value */
+#define SANDBOX_BYTECODE_FALSE  2   /* always false, nil, or nothing */
+#define SANDBOX_BYTECODE_UPVAL  3   /* always the value of upvalue upidx */
+
+struct sandbox_bytecode_info {
+    int result;     /* SANDBOX_BYTECODE_* */
+    int upidx;      /* for SANDBOX_BYTECODE_UPVAL; 1-based, as for
+                       lua_getupvalue() */
+    int setupval;   /* some function in the chunk assigns to an upvalue */
+};
+
+int sandbox_bytecode_analyze(const void *chunk, size_t len,
+        struct sandbox_bytecode_info *info);
+
+#endif /* !_SANDBOX_BYTECODE_H_ */
@@ -32,16 +32,23 @@
 #include <sys/conf.h>
 
 #include <sys/kmem.h>
+#include <sys/kauth.h>
 
 #include "sandbox.h"
 #include "sandbox_device.h"
+#include "sandbox_event.h"
 #include "sandbox_spec.h"
+#include "sandbox_trace.h"
 
+#define SANDBOX_LOG_SUBSYS SANDBOX_TRACE_DEVICE
 #include "sandbox_log.h"
 
 static dev_type_open(sandbox_device_open);
 static dev_type_close(sandbox_device_close);
 static dev_type_ioctl(sandbox_device_ioctl);
+static dev_type_poll(sandbox_device_poll);
+static dev_type_mmap(sandbox_device_mmap);
+static dev_type_kqfilter(sandbox_device_kqfilter);
 
 static const struct cdevsw sandbox_cdevsw = {
     .d_open     = sandbox_device_open,
@@ -51,9 +58,9 @@ static const struct cdevsw sandbox_cdevsw = {
     .d_ioctl    = sandbox_device_ioctl,
     .d_stop     = nostop,
     .d_tty      = notty,
-    .d_poll     = nopoll,
-    .d_mmap     = nommap,
-    .d_kqfilter = nokqfilter,
+    .d_poll     = sandbox_device_poll,
+    .d_mmap     = sandbox_device_mmap,
+    .d_kqfilter = sandbox_device_kqfilter,
     .d_discard  = nodiscard,
     .d_flag     = D_OTHER
 };
@@ -68,6 +75,119 @@ sandbox_device_setspec(struct sandbox_spec *spec)
 
     KASSERT(spec != NULL);
 
+    if (spec->script_len == 0 || spec->script_len > SANDBOX_SCRIPT_MAXLEN) {
+        error = EINVAL;
+        goto done;
+    }
+
+    script = kmem_zalloc(spec->script_len, KM_SLEEP);
+    error = copyinstr(spec->script, script, spec->script_len, NULL);
+    if (error != 0) {
+        SANDBOX_LOG_ERROR("copyinstr() failed\n");
+        goto fail;
+    }
+
+    error = sandbox_attach(script, NULL, 0, spec->flags);
+
+fail:
+    kmem_free(script, spec->script_len);
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* replaces the policy of the caller's most recently attached sandbox */
+static int
+sandbox_device_reload(struct sandbox_spec *spec)
+{
+    int error = 0;
+    char *script = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    KASSERT(spec != NULL);
+
+    if (spec->script_len == 0 || spec->script_len > SANDBOX_SCRIPT_MAXLEN) {
+        error = EINVAL;
+        goto done;
+    }
+
+    script = kmem_zalloc(spec->script_len, KM_SLEEP);
+    error = copyinstr(spec->script, script, spec->script_len, NULL);
+    if (error != 0) {
+        SANDBOX_LOG_ERROR("copyinstr() failed\n");
+        goto fail;
+    }
+
+    error = sandbox_reload_curproc(script, spec->flags);
+
+fail:
+    kmem_free(script, spec->script_len);
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* copies in the packed parameters of a template and checks that they are
+ * a whole number of NUL-terminated name/value pairs
+ */
+static int
+sandbox_device_copyinparams(const struct sandbox_template *tmpl,
+        char **params)
+{
+    int error = 0;
+    int nstrings = 0;
+    size_t i = 0;
+    char *buf = NULL;
+
+    *params = NULL;
+    if (tmpl->params_len == 0)
+        return (0);
+    if (tmpl->params_len > SANDBOX_PARAMS_MAXLEN)
+        return (E2BIG);
+
+    buf = kmem_alloc(tmpl->params_len, KM_SLEEP);
+    error = copyin(tmpl->params, buf, tmpl->params_len);
+    if (error != 0) {
+        SANDBOX_LOG_ERROR("copyin() failed\n");
+        goto fail;
+    }
+
+    for (i = 0; i < tmpl->params_len; i++) {
+        if (buf[i] == '\0')
+            nstrings++;
+    }
+    if (buf[tmpl->params_len - 1] != '\0' || nstrings % 2 != 0) {
+        error = EINVAL;
+        goto fail;
+    }
+
+    *params = buf;
+    return (0);
+
+fail:
+    kmem_free(buf, tmpl->params_len);
+    return (error);
+}
+
+static int
+sandbox_device_settmpl(struct sandbox_template *tmpl)
+{
+    int error = 0;
+    char *script = NULL;
+    char *params = NULL;
+    struct sandbox_spec *spec = &tmpl->spec;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    if (spec->script_len == 0 || spec->script_len > SANDBOX_SCRIPT_MAXLEN) {
+        error = EINVAL;
+        goto done;
+    }
+    error = sandbox_device_copyinparams(tmpl, &params);
+    if (error != 0)
+        goto done;
+
     script = kmem_zalloc(spec->script_len, KM_SLEEP);
     error = copyinstr(spec->script, script, spec->script_len, NULL);
     if (error != 0) {
@@ -75,10 +195,70 @@ sandbox_device_setspec(struct sandbox_spec *spec)
         goto fail;
     }
 
-    error = sandbox_attach(script, spec->flags);
+    error = sandbox_attach(script, params, tmpl->params_len, spec->flags);
 
 fail:
     kmem_free(script, spec->script_len);
+    if (params != NULL)
+        kmem_free(params, tmpl->params_len);
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+static int
+sandbox_device_attachtmpl(struct sandbox_template *tmpl)
+{
+    int error = 0;
+    char *params = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    error = sandbox_device_copyinparams(tmpl, &params);
+    if (error != 0)
+        goto done;
+
+    error = sandbox_attach_template(tmpl->id, params, tmpl->params_len);
+
+    if (params != NULL)
+        kmem_free(params, tmpl->params_len);
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* preloaded policies outlive their process, so only the superuser may
+ * publish or withdraw them
+ */
+static int
+sandbox_device_preload(struct sandbox_preload *preload, struct lwp *l)
+{
+    int error = 0;
+    char *script = NULL;
+    struct sandbox_spec *spec = &preload->spec;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    error = kauth_authorize_generic(l->l_cred, KAUTH_GENERIC_ISSUSER, NULL);
+    if (error != 0)
+        goto done;
+    if (spec->script_len == 0 || spec->script_len > SANDBOX_SCRIPT_MAXLEN) {
+        error = EINVAL;
+        goto done;
+    }
+
+    script = kmem_zalloc(spec->script_len, KM_SLEEP);
+    error = copyinstr(spec->script, script, spec->script_len, NULL);
+    if (error != 0) {
+        SANDBOX_LOG_ERROR("copyinstr() failed\n");
+        goto fail;
+    }
+
+    error = sandbox_preload(script, spec->flags, &preload->id);
+
+fail:
+    kmem_free(script, spec->script_len);
+done:
     SANDBOX_LOG_TRACE_EXIT;
     return (error);
 }
@@ -87,6 +267,7 @@ static int
 sandbox_device_open(dev_t dev, int flag, int mode, struct lwp *l)
 {
     SANDBOX_LOG_TRACE_ENTER;
+    sandbox_event_open();
     SANDBOX_LOG_TRACE_EXIT;
     return (0);
 }
@@ -95,6 +276,7 @@ static int
 sandbox_device_close(dev_t dev, int flag, int mode, struct lwp *l)
 {
     SANDBOX_LOG_TRACE_ENTER;
+    sandbox_event_close();
     SANDBOX_LOG_TRACE_EXIT;
     return (0);
 }
@@ -118,6 +300,47 @@ sandbox_device_ioctl(dev_t dev, u_long cmd, void *data, int flag, struct lwp *l)
     case SANDBOX_IOC_NLISTS:
         *((int *)data) = sandbox_nlists;
         break;
+    case SANDBOX_IOC_STATS:
+        error = sandbox_stats((struct sandbox_stats *)data);
+        break;
+    case SANDBOX_IOC_PRELOAD:
+        error = sandbox_device_preload((struct sandbox_preload *)data, l);
+        break;
+    case SANDBOX_IOC_ATTACHID:
+        error = sandbox_attach_id(*((uint64_t *)data));
+        break;
+    case SANDBOX_IOC_UNLOAD:
+        error = kauth_authorize_generic(l->l_cred, KAUTH_GENERIC_ISSUSER,
+                NULL);
+        if (error == 0)
+            error = sandbox_unload(*((uint64_t *)data));
+        break;
+    case SANDBOX_IOC_SETTMPL:
+        error = sandbox_device_settmpl((struct sandbox_template *)data);
+        break;
+    case SANDBOX_IOC_ATTACHTMPL:
+        error = sandbox_device_attachtmpl((struct sandbox_template *)data);
+        break;
+    case SANDBOX_IOC_RELOAD:
+        error = sandbox_device_reload((struct sandbox_spec *)data);
+        break;
+    case SANDBOX_IOC_TRACEREAD:
+        /* traces are of every process */
+        error = kauth_authorize_generic(l->l_cred, KAUTH_GENERIC_ISSUSER,
+                NULL);
+        if (error == 0)
+            error = sandbox_trace_read((struct sandbox_trace *)data);
+        break;
+    case SANDBOX_IOC_TRACEFMT:
+        error = sandbox_trace_getfmt((struct sandbox_tracefmt *)data);
+        break;
+    case SANDBOX_IOC_EVENTS:
+        /* events are of every process */
+        error = kauth_authorize_generic(l->l_cred, KAUTH_GENERIC_ISSUSER,
+                NULL);
+        if (error == 0)
+            error = sandbox_event_start((struct sandbox_events *)data);
+        break;
     default:
         error = ENOTTY;
     }
@@ -126,6 +349,25 @@ sandbox_device_ioctl(dev_t dev, u_long cmd, void *data, int flag, struct lwp *l)
     return (error);
 }
 
+/* the device is readable while the event ring holds events */
+static int
+sandbox_device_poll(dev_t dev, int events, struct lwp *l)
+{
+    return (sandbox_event_poll(events, l));
+}
+
+static paddr_t
+sandbox_device_mmap(dev_t dev, off_t off, int prot)
+{
+    return (sandbox_event_mmap(off, prot));
+}
+
+static int
+sandbox_device_kqfilter(dev_t dev, struct knote *kn)
+{
+    return (sandbox_event_kqfilter(kn));
+}
+
 int
 sandbox_device_init(void)
 {
@@ -0,0 +1,474 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/atomic.h>
+#include <sys/event.h>
+#include <sys/intr.h>
+#include <sys/kauth.h>
+#include <sys/lwp.h>
+#include <sys/mount.h>
+#include <sys/mutex.h>
+#include <sys/poll.h>
+#include <sys/proc.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/vnode.h>
+
+#include <netinet/in.h>
+
+#include <uvm/uvm_extern.h>
+
+#include "sandbox_event.h"
+#include "sandbox_spec.h"
+#include "sandbox_vnode.h"
+
+#define SANDBOX_LOG_SUBSYS SANDBOX_TRACE_DEVICE
+#include "sandbox_log.h"
+
+int sandbox_eventson = 0;
+
+/* The ring is allocated by the first SANDBOX_IOC_EVENTS that starts it, and
+ * is only freed with the module, so that a mapping of it stays valid.  What
+ * the kernel needs to know of the ring is kept here rather than in the
+ * mapped header, which the reader may scribble on.
+ */
+static struct sandbox_eventring *sandbox_eventring = NULL;
+static struct sandbox_event *sandbox_eventbuf = NULL;
+static uint64_t sandbox_eventmask = 0;
+static size_t sandbox_eventsize = 0;     /* of the mapping */
+
+/* The users that keep the module from being unloaded (see
+ * sandbox_event_busy()).  The device's close entry is only called on the
+ * last close, which so ends every open.  The module is not told when a
+ * mapping goes away, which may be long after the close, so once the ring
+ * has been mapped it stays in use.
+ */
+static u_int sandbox_eventnopens = 0;
+static bool sandbox_eventmapped = false;
+
+/* a reader waits under sandbox_eventlock; writers only schedule the wakeup
+ * if one of sandbox_eventpolled or sandbox_eventnknotes is set
+ */
+static kmutex_t sandbox_eventlock;
+static struct selinfo sandbox_eventsel;
+static void *sandbox_eventsih = NULL;
+static volatile u_int sandbox_eventpolled = 0;
+static volatile u_int sandbox_eventnknotes = 0;
+
+/* The reader maps the ring and may write anything to its tail, so the
+ * kernel only uses a tail that it has clamped to [head - nslots, head]:
+ * one too far behind makes the ring full, one ahead of head makes it empty.
+ */
+static uint64_t
+sandbox_event_tail(const struct sandbox_eventring *ring, uint64_t head)
+{
+    uint64_t tail = ring->tail;
+
+    if (tail > head)
+        return (head);
+    if (head - tail > sandbox_eventmask + 1)
+        return (head - (sandbox_eventmask + 1));
+    return (tail);
+}
+
+static bool
+sandbox_event_pending(void)
+{
+    uint64_t head = 0;
+    struct sandbox_eventring *ring = sandbox_eventring;
+
+    if (ring == NULL)
+        return (false);
+
+    head = ring->head;
+    return (sandbox_event_tail(ring, head) != head);
+}
+
+static void
+sandbox_event_wakeup(void *arg)
+{
+    mutex_enter(&sandbox_eventlock);
+    sandbox_eventpolled = 0;
+    selnotify(&sandbox_eventsel, POLLIN | POLLRDNORM, NOTE_SUBMIT);
+    mutex_exit(&sandbox_eventlock);
+}
+
+/* The file id needs the vnode's lock.  VOP_ISLOCKED() cannot say whether
+ * this lwp holds it, so the lock is taken here, without waiting; if it is
+ * not free, which it is not when the request itself holds it exclusively,
+ * the event goes without the file id.
+ */
+static void
+sandbox_event_vnode(struct sandbox_event *ev, struct vnode *vp,
+        kauth_cred_t cred)
+{
+    ev->objtype = SANDBOX_EVENT_OBJ_VNODE;
+    ev->obj.vnode.type = vp->v_type;
+    if (vp->v_mount != NULL)
+        ev->obj.vnode.fsid = vp->v_mount->mnt_stat.f_fsid;
+
+    if (vn_lock(vp, LK_SHARED | LK_NOWAIT) == 0) {
+        ev->obj.vnode.fileid = sandbox_vnode_getfileid(vp, cred);
+        VOP_UNLOCK(vp);
+    }
+}
+
+static void
+sandbox_event_sockaddr(struct sandbox_event *ev, const struct sockaddr *sa)
+{
+    size_t len = 0;
+    const struct sockaddr_in *sin = NULL;
+    const struct sockaddr_in6 *sin6 = NULL;
+    const struct sockaddr_un *sun = NULL;
+
+    ev->objtype = SANDBOX_EVENT_OBJ_SOCKADDR;
+    ev->obj.sockaddr.family = sa->sa_family;
+
+    switch (sa->sa_family) {
+    case AF_INET:
+        if (sa->sa_len < sizeof(*sin))
+            break;
+        sin = (const struct sockaddr_in *)sa;
+        ev->obj.sockaddr.port = ntohs(sin->sin_port);
+        memcpy(ev->obj.sockaddr.addr, &sin->sin_addr, sizeof(sin->sin_addr));
+        break;
+    case AF_INET6:
+        if (sa->sa_len < sizeof(*sin6))
+            break;
+        sin6 = (const struct sockaddr_in6 *)sa;
+        ev->obj.sockaddr.port = ntohs(sin6->sin6_port);
+        memcpy(ev->obj.sockaddr.addr, &sin6->sin6_addr,
+                sizeof(sin6->sin6_addr));
+        break;
+    case AF_LOCAL:
+        if (sa->sa_len <= offsetof(struct sockaddr_un, sun_path))
+            break;
+        sun = (const struct sockaddr_un *)sa;
+        len = strnlen(sun->sun_path, MIN(sizeof(sun->sun_path),
+                    sa->sa_len - offsetof(struct sockaddr_un, sun_path)));
+        memcpy(ev->obj.sockaddr.path, sun->sun_path,
+                MIN(len, SANDBOX_EVENT_PATHLEN - 1));
+        break;
+    default:
+        break;
+    }
+}
+
+/* Records that the rule with ruleid, level names deep, decided the request
+ * with result; vp and sa, if not NULL, are the request's vnode and
+ * sockaddr.  If the ring is full, the event is dropped.
+ */
+void
+sandbox_event_record(kauth_cred_t cred, uint32_t ruleid, int level,
+        int result, const struct sandbox_rule *rule, struct vnode *vp,
+        const struct sockaddr *sa)
+{
+    sandbox_event_recordfor(curproc->p_pid, curlwp->l_lid, cred, ruleid,
+            level, (result == KAUTH_RESULT_DENY) ? SANDBOX_EVENT_DENY :
+            SANDBOX_EVENT_ALLOW, rule, vp, sa);
+}
+
+/* records a request that the lwp lid of process pid made, as
+ * sandbox_event_record() does; result is a SANDBOX_EVENT_* result
+ */
+void
+sandbox_event_recordfor(pid_t pid, lwpid_t lid, kauth_cred_t cred,
+        uint32_t ruleid, int level, int result,
+        const struct sandbox_rule *rule, struct vnode *vp,
+        const struct sockaddr *sa)
+{
+    int i = 0;
+    uint64_t head = 0;
+    struct timespec ts;
+    struct sandbox_eventring *ring = sandbox_eventring;
+    struct sandbox_event *ev = NULL;
+
+    if (ring == NULL)
+        return;
+
+    do {
+        head = ring->head;
+        if (head - sandbox_event_tail(ring, head) > sandbox_eventmask) {
+            atomic_inc_64(&ring->ndropped);
+            return;
+        }
+    } while (atomic_cas_64(&ring->head, head, head + 1) != head);
+
+    ev = &sandbox_eventbuf[head & sandbox_eventmask];
+    memset(ev, 0, sizeof(*ev));
+    nanouptime(&ts);
+    ev->nsecs = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    ev->ruleid = ruleid;
+    ev->pid = pid;
+    ev->lid = lid;
+    ev->uid = kauth_cred_geteuid(cred);
+    ev->result = result;
+    ev->level = level;
+    for (i = 0; i < SANDBOX_RULE_MAXNAMES && rule->names[i] != NULL; i++)
+        strlcpy(ev->names[i], rule->names[i], SANDBOX_EVENT_NAMELEN);
+
+    if (vp != NULL)
+        sandbox_event_vnode(ev, vp, cred);
+    else if (sa != NULL)
+        sandbox_event_sockaddr(ev, sa);
+
+    membar_producer();
+    ev->seq = head + 1;
+
+    /* pairs with the barrier in sandbox_event_poll(): either the reader
+     * sees the event, or the event sees the reader waiting
+     */
+    membar_sync();
+    if (sandbox_eventpolled || sandbox_eventnknotes) {
+        kpreempt_disable();
+        softint_schedule(sandbox_eventsih);
+        kpreempt_enable();
+    }
+}
+
+int
+sandbox_event_start(struct sandbox_events *events)
+{
+    int error = 0;
+    size_t offset = 0;
+    size_t size = 0;
+    vaddr_t va = 0;
+    struct sandbox_eventring *ring = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    if (events->nevents > SANDBOX_EVENT_MAXEVENTS ||
+            (events->nevents & (events->nevents - 1)) != 0) {
+        error = EINVAL;
+        goto done;
+    }
+
+    mutex_enter(&sandbox_eventlock);
+    if (events->nevents == 0) {
+        sandbox_eventson = 0;
+        goto out;
+    }
+
+    if (sandbox_eventring == NULL) {
+        offset = round_page(sizeof(*ring));
+        size = offset + round_page(events->nevents *
+                sizeof(struct sandbox_event));
+        va = uvm_km_alloc(kernel_map, size, 0,
+                UVM_KMF_WIRED | UVM_KMF_ZERO);
+        if (va == 0) {
+            error = ENOMEM;
+            goto out;
+        }
+        ring = (struct sandbox_eventring *)va;
+        ring->version = SANDBOX_VERSION;
+        ring->eventsize = sizeof(struct sandbox_event);
+        ring->nevents = events->nevents;
+        ring->offset = offset;
+
+        sandbox_eventbuf = (struct sandbox_event *)(va + offset);
+        sandbox_eventmask = events->nevents - 1;
+        sandbox_eventsize = size;
+        membar_producer();
+        sandbox_eventring = ring;
+        SANDBOX_LOG_INFO("allocated a ring of %zu events\n", events->nevents);
+    } else if (events->nevents != sandbox_eventmask + 1) {
+        error = EBUSY;
+        goto out;
+    }
+    sandbox_eventson = 1;
+
+out:
+    events->nevents = (sandbox_eventring != NULL) ? sandbox_eventmask + 1 : 0;
+    events->size = sandbox_eventsize;
+    mutex_exit(&sandbox_eventlock);
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+int
+sandbox_event_poll(int events, struct lwp *l)
+{
+    int revents = 0;
+
+    if ((events & (POLLIN | POLLRDNORM)) == 0)
+        return (0);
+
+    mutex_enter(&sandbox_eventlock);
+    sandbox_eventpolled = 1;
+    membar_sync();
+    if (sandbox_event_pending())
+        revents = events & (POLLIN | POLLRDNORM);
+    else
+        selrecord(l, &sandbox_eventsel);
+    mutex_exit(&sandbox_eventlock);
+
+    return (revents);
+}
+
+static void
+sandbox_event_filtdetach(struct knote *kn)
+{
+    mutex_enter(&sandbox_eventlock);
+    SLIST_REMOVE(&sandbox_eventsel.sel_klist, kn, knote, kn_selnext);
+    sandbox_eventnknotes--;
+    mutex_exit(&sandbox_eventlock);
+}
+
+static int
+sandbox_event_filtread(struct knote *kn, long hint)
+{
+    uint64_t head = 0;
+    struct sandbox_eventring *ring = sandbox_eventring;
+
+    if (ring == NULL)
+        return (0);
+
+    head = ring->head;
+    kn->kn_data = head - sandbox_event_tail(ring, head);
+    return (kn->kn_data > 0);
+}
+
+static const struct filterops sandbox_event_filtops = {
+    .f_isfd = 1,
+    .f_attach = NULL,
+    .f_detach = sandbox_event_filtdetach,
+    .f_event = sandbox_event_filtread,
+};
+
+int
+sandbox_event_kqfilter(struct knote *kn)
+{
+    if (kn->kn_filter != EVFILT_READ)
+        return (EINVAL);
+
+    kn->kn_fop = &sandbox_event_filtops;
+    kn->kn_hook = NULL;
+
+    mutex_enter(&sandbox_eventlock);
+    SLIST_INSERT_HEAD(&sandbox_eventsel.sel_klist, kn, kn_selnext);
+    sandbox_eventnknotes++;
+    membar_sync();
+    mutex_exit(&sandbox_eventlock);
+
+    return (0);
+}
+
+/* the ring records requests of every process, so only the superuser may
+ * map it
+ */
+paddr_t
+sandbox_event_mmap(off_t off, int prot)
+{
+    paddr_t pa = 0;
+    struct sandbox_eventring *ring = sandbox_eventring;
+
+    if (kauth_authorize_generic(kauth_cred_get(), KAUTH_GENERIC_ISSUSER,
+                NULL) != 0)
+        return ((paddr_t)-1);
+
+    if (ring == NULL || off < 0 || (size_t)off >= sandbox_eventsize)
+        return ((paddr_t)-1);
+
+    if (!pmap_extract(pmap_kernel(), (vaddr_t)ring + off, &pa))
+        return ((paddr_t)-1);
+
+    mutex_enter(&sandbox_eventlock);
+    sandbox_eventmapped = true;
+    mutex_exit(&sandbox_eventlock);
+
+    return (atop(pa));
+}
+
+void
+sandbox_event_open(void)
+{
+    mutex_enter(&sandbox_eventlock);
+    sandbox_eventnopens++;
+    mutex_exit(&sandbox_eventlock);
+}
+
+/* called on the last close of the device */
+void
+sandbox_event_close(void)
+{
+    mutex_enter(&sandbox_eventlock);
+    sandbox_eventnopens = 0;
+    mutex_exit(&sandbox_eventlock);
+}
+
+/* true if the device is open or the ring has ever been mapped, when
+ * sandbox_event_fini() must not be called
+ */
+bool
+sandbox_event_busy(void)
+{
+    bool busy = false;
+
+    mutex_enter(&sandbox_eventlock);
+    busy = sandbox_eventnopens > 0 || sandbox_eventmapped;
+    mutex_exit(&sandbox_eventlock);
+
+    return (busy);
+}
+
+void
+sandbox_event_init(void)
+{
+    mutex_init(&sandbox_eventlock, MUTEX_DEFAULT, IPL_NONE);
+    selinit(&sandbox_eventsel);
+    sandbox_eventsih = softint_establish(SOFTINT_CLOCK | SOFTINT_MPSAFE,
+            sandbox_event_wakeup, NULL);
+}
+
+/* called once the scope listeners are gone, when nothing records events,
+ * and only if sandbox_event_busy() is false
+ */
+void
+sandbox_event_fini(void)
+{
+    sandbox_eventson = 0;
+
+    softint_disestablish(sandbox_eventsih);
+    seldestroy(&sandbox_eventsel);
+
+    if (sandbox_eventring != NULL) {
+        uvm_km_free(kernel_map, (vaddr_t)sandbox_eventring,
+                sandbox_eventsize, UVM_KMF_WIRED);
+        sandbox_eventring = NULL;
+        sandbox_eventbuf = NULL;
+        sandbox_eventsize = 0;
+    }
+
+    mutex_destroy(&sandbox_eventlock);
+}
@@ -0,0 +1,81 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SANDBOX_EVENT_H_
+#define _SANDBOX_EVENT_H_
+
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/kauth.h>
+#include <sys/socket.h>
+#include <sys/vnode.h>
+
+#include "sandbox_rule.h"
+#include "sandbox_spec.h"
+
+/* The event ring records the requests that sandboxes decide, as sampled by
+ * their rules' rates (see sandbox.audit()), and those that the functions
+ * of SANDBOX_PERMISSIVE sandboxes would have denied, for an auditor that
+ * maps it from /dev/sandbox.  Writers reserve an event by advancing the ring's
+ * head and take no locks; a reader that polls or waits on a kevent is
+ * woken from a soft interrupt, and only when it is waiting, so writers
+ * otherwise never touch anything but the ring.
+ */
+
+/* nonzero while events are recorded; see SANDBOX_IOC_EVENTS */
+extern int sandbox_eventson;
+
+void sandbox_event_init(void);
+
+void sandbox_event_fini(void);
+
+int sandbox_event_start(struct sandbox_events *events);
+
+void sandbox_event_record(kauth_cred_t cred, uint32_t ruleid, int level,
+        int result, const struct sandbox_rule *rule, struct vnode *vp,
+        const struct sockaddr *sa);
+
+void sandbox_event_recordfor(pid_t pid, lwpid_t lid, kauth_cred_t cred,
+        uint32_t ruleid, int level, int result,
+        const struct sandbox_rule *rule, struct vnode *vp,
+        const struct sockaddr *sa);
+
+int sandbox_event_poll(int events, struct lwp *l);
+
+int sandbox_event_kqfilter(struct knote *kn);
+
+paddr_t sandbox_event_mmap(off_t off, int prot);
+
+void sandbox_event_open(void);
+
+void sandbox_event_close(void);
+
+bool sandbox_event_busy(void);
+
+#endif /* !_SANDBOX_EVENT_H_ */
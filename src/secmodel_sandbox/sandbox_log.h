@@ -32,6 +32,9 @@
 
 #include <sys/systm.h>
 
+#include "sandbox_spec.h"
+#include "sandbox_trace.h"
+
 #define SANDBOX_LOG_LEVEL_NONE     0
 #define SANDBOX_LOG_LEVEL_ERROR    1
 #define SANDBOX_LOG_LEVEL_WARN     2
@@ -39,42 +42,65 @@
 #define SANDBOX_LOG_LEVEL_DEBUG    4
 #define SANDBOX_LOG_LEVEL_TRACE    5
 
-#define SANDBOX_LOG_LEVEL SANDBOX_LOG_LEVEL_INFO
-#define SANDBOX_PRINTF printf
+/* Log calls are recorded in the trace rings (see sandbox_trace.h) if the
+ * runtime level of their subsystem, set by sysctl, is at least theirs, and
+ * otherwise cost one branch.  SANDBOX_LOG_LEVEL compiles in every level,
+ * so that debugging output and function entry and exit can be turned on by
+ * sysctl without rebuilding the module.
+ *
+ * A file names its subsystem by defining SANDBOX_LOG_SUBSYS before it
+ * includes this header.
+ */
+#define SANDBOX_LOG_LEVEL SANDBOX_LOG_LEVEL_TRACE
+
+#ifndef SANDBOX_LOG_SUBSYS
+#define SANDBOX_LOG_SUBSYS SANDBOX_TRACE_CORE
+#endif
+
+#define SANDBOX_LOG(level, fmt, ...) \
+    do { \
+        if (__predict_false(sandbox_tracelevels[SANDBOX_LOG_SUBSYS] >= \
+                    (level))) { \
+            static struct sandbox_tracesite _site = { \
+                .file = __FILE__, .func = __func__, .line = __LINE__, \
+                .format = fmt }; \
+            sandbox_trace(&_site, SANDBOX_LOG_SUBSYS, (level),##__VA_ARGS__); \
+        } \
+    } while (0)
 
 #if SANDBOX_LOG_LEVEL >= SANDBOX_LOG_LEVEL_ERROR
     #define SANDBOX_LOG_ERROR(fmt, ...) \
-        SANDBOX_PRINTF("E %s:%d:%s " fmt, strrchr(__FILE__, '/') + 1, __LINE__, __func__,##__VA_ARGS__)
+        SANDBOX_LOG(SANDBOX_LOG_LEVEL_ERROR, fmt,##__VA_ARGS__)
 #else
     #define SANDBOX_LOG_ERROR(fmt, ...) ((void) 0)
 #endif
 
 #if SANDBOX_LOG_LEVEL >= SANDBOX_LOG_LEVEL_WARN
     #define SANDBOX_LOG_WARN(fmt, ...) \
-        SANDBOX_PRINTF("W %s:%d:%s " fmt, strrchr(__FILE__, '/') + 1,  __LINE__, __func__,##__VA_ARGS__)
+        SANDBOX_LOG(SANDBOX_LOG_LEVEL_WARN, fmt,##__VA_ARGS__)
 #else
     #define SANDBOX_LOG_WARN(fmt, ...) ((void) 0)
 #endif
 
 #if SANDBOX_LOG_LEVEL >= SANDBOX_LOG_LEVEL_INFO
     #define SANDBOX_LOG_INFO(fmt, ...) \
-        SANDBOX_PRINTF("I %s:%d:%s " fmt, strrchr(__FILE__, '/') + 1, __LINE__, __func__,##__VA_ARGS__)
+        SANDBOX_LOG(SANDBOX_LOG_LEVEL_INFO, fmt,##__VA_ARGS__)
 #else
     #define SANDBOX_LOG_INFO(fmt, ...) ((void) 0)
 #endif
 
 #if SANDBOX_LOG_LEVEL >= SANDBOX_LOG_LEVEL_DEBUG
     #define SANDBOX_LOG_DEBUG(fmt, ...) \
-        SANDBOX_PRINTF("D %s:%d:%s " fmt, strrchr(__FILE__, '/') + 1 ,__LINE__, __func__,##__VA_ARGS__)
+        SANDBOX_LOG(SANDBOX_LOG_LEVEL_DEBUG, fmt,##__VA_ARGS__)
 #else
     #define SANDBOX_LOG_DEBUG(fmt, ...) ((void) 0)
 #endif
 
 #if SANDBOX_LOG_LEVEL >= SANDBOX_LOG_LEVEL_TRACE
     #define SANDBOX_LOG_TRACE_ENTER \
-        SANDBOX_PRINTF("> %s\n", __func__)
+        SANDBOX_LOG(SANDBOX_LOG_LEVEL_TRACE, ">\n")
     #define SANDBOX_LOG_TRACE_EXIT \
-        SANDBOX_PRINTF("< %s\n", __func__)
+        SANDBOX_LOG(SANDBOX_LOG_LEVEL_TRACE, "<\n")
 #else
     #define SANDBOX_LOG_TRACE_ENTER ((void) 0)
     #define SANDBOX_LOG_TRACE_EXIT  ((void) 0)
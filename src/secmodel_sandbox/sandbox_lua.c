@@ -29,6 +29,7 @@
 
 #include <sys/cdefs.h>
 #include <sys/param.h>  /* MAX/MIN macros */
+#include <sys/systm.h>
 #include <sys/types.h>
 #include <sys/queue.h>
 #include <sys/namei.h>
@@ -37,8 +38,10 @@
 #include <sys/proc.h>
 #include <sys/uio.h>
 #include <sys/kmem.h>
+#include <sys/mutex.h>
 #include <sys/kauth.h>
 #include <sys/lua.h>
+#include <sys/atomic.h>
 #include <sys/endian.h>
 
 #include <sys/socketvar.h>
@@ -52,13 +55,22 @@
 #include <lualib.h>
 
 #include "sandbox.h"
+#include "sandbox_addr.h"
+#include "sandbox_bytecode.h"
+#include "sandbox_chunkcache.h"
+#include "sandbox_expr.h"
 #include "sandbox_lua.h"
+#include "sandbox_memo.h"
 #include "sandbox_path.h"
+#include "sandbox_permissive.h"
+#include "sandbox_pred.h"
 #include "sandbox_rule.h"
 #include "sandbox_ruleset.h"
+#include "sandbox_spec.h"
 #include "sandbox_vnode.h"
 #include "secmodel_sandbox.h"
 
+#define SANDBOX_LOG_SUBSYS SANDBOX_TRACE_LUA
 #include "sandbox_log.h"
 
 struct sandbox_lua_const {
@@ -69,6 +81,12 @@ struct sandbox_lua_const {
 #define SANDBOX_LUA_CONST(konst)    {konst, #konst}
 #define SANDBOX_LUA_CONST_SENTINEL    {0, NULL}
 
+/* registry key; true if the script's upvalues cannot change after it runs */
+#define SANDBOX_LUA_UPVALSFIXED "sandbox.upvalsfixed"
+
+/* registry key; the sandbox that holds the state, as a light userdata */
+#define SANDBOX_LUA_SANDBOX "sandbox.sandbox"
+
 static struct sandbox_lua_const sandbox_lua_consts[] = {
     /* 
      * sys/socket.h 
@@ -404,30 +422,36 @@ sandbox_lua_pushvnode(lua_State *L, struct vnode *vp)
  * TODO: add more fields, as needed.
  */
 static void
-sandbox_lua_pushproc(lua_State *L,  struct proc *p)
+sandbox_lua_pushprocinfo(lua_State *L, pid_t pid, pid_t ppid, int nice,
+        const char *comm)
 {
     lua_newtable(L);
     /* stack: -1=proc */
-    lua_pushinteger(L, p->p_pid);
+    lua_pushinteger(L, pid);
     /* stack: -2=proc, -1=pid */
     lua_setfield(L, -2, "pid");
     /* stack: -1=proc */
-    lua_pushinteger(L, p->p_ppid);
+    lua_pushinteger(L, ppid);
     /* stack: -2=proc, -1=ppid */
     lua_setfield(L, -2, "ppid");
     /* stack: -1=proc */
-
-#if 0
-    mutex_enter(p->p_lock);
-#endif
-    lua_pushinteger(L, p->p_nice);
+    lua_pushinteger(L, nice);
     /* stack: -2=proc, -1=nice */
     lua_setfield(L, -2, "nice");
     /* stack: -1=proc */
-    lua_pushstring(L, p->p_comm);
+    lua_pushstring(L, comm);
     /* stack: -2=proc, -1=comm */
     lua_setfield(L, -2, "comm");
     /* stack: -1=proc */
+}
+
+static void
+sandbox_lua_pushproc(lua_State *L,  struct proc *p)
+{
+#if 0
+    mutex_enter(p->p_lock);
+#endif
+    sandbox_lua_pushprocinfo(L, p->p_pid, p->p_ppid, p->p_nice, p->p_comm);
 #if 0
     mutex_exit(p->p_lock);
 #endif
@@ -463,15 +487,28 @@ sandbox_lua_pushsockaddr_in(lua_State *L, struct sockaddr_in *s)
     lua_setfield(L, -2, "address"); 
 }
 
+/* the address is pushed as eight uncompressed groups, in the form that
+ * sandbox.bind_allow() accepts
+ */
 static void
 sandbox_lua_pushsockaddr_in6(lua_State *L, struct sockaddr_in6 *s)
 {
+    unsigned char *ip = NULL;
+    char buf[40];
+
+    ip = (unsigned char *)&s->sin6_addr;
+
     lua_newtable(L);
     lua_pushinteger(L, s->sin6_family);
     lua_setfield(L, -2, "family");
     lua_pushinteger(L, ntohs(s->sin6_port));
     lua_setfield(L, -2, "port");
-    /* TODO: push s->sin6_addr: might have to use parts of inet_ntop.c */
+    snprintf(buf, sizeof(buf), "%x:%x:%x:%x:%x:%x:%x:%x",
+            ip[0] << 8 | ip[1], ip[2] << 8 | ip[3], ip[4] << 8 | ip[5],
+            ip[6] << 8 | ip[7], ip[8] << 8 | ip[9], ip[10] << 8 | ip[11],
+            ip[12] << 8 | ip[13], ip[14] << 8 | ip[15]);
+    lua_pushstring(L, buf);
+    lua_setfield(L, -2, "address");
 }
 
 static void
@@ -508,6 +545,23 @@ sandbox_lua_pushsockaddr(lua_State *L, struct sockaddr *sa)
     }
 }
 
+/* returns the sandbox that holds the state, or raises an error if there is
+ * none (see sandbox_lua_open())
+ */
+static struct sandbox *
+sandbox_lua_checksandbox(lua_State *L)
+{
+    struct sandbox *sandbox = NULL;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, SANDBOX_LUA_SANDBOX);
+    sandbox = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (sandbox == NULL)
+        luaL_error(L, "internal error -- sandbox not found");
+
+    return (sandbox);
+}
+
 /* TODO: consider allowing default to be a function
  * sandbox.default('allow' | 'deny' | 'defer')
  */
@@ -515,7 +569,6 @@ static int
 sandbox_lua_default(lua_State *L)
 {
     int nargs = 0;
-    int idx = 0;
     int error = 0;
     const char *sval = NULL;
     int val = 0;
@@ -539,13 +592,7 @@ sandbox_lua_default(lua_State *L)
     else
         return luaL_error(L, "value must be 'allow', 'deny', 'defer'");
 
-    idx = lua_upvalueindex(1);
-    if (lua_isnone(L, idx))
-        return luaL_error(L, "internal error -- sandbox not found");
-
-    sandbox = (struct sandbox*)lua_touserdata(L, idx);
-    if (sandbox == NULL)
-        return luaL_error(L, "internal error -- invalid sandbox");
+    sandbox = sandbox_lua_checksandbox(L);
     
     SANDBOX_RULE_MAKE(&rule, NULL, NULL, NULL);
     error = sandbox_ruleset_insert(sandbox->ruleset, &rule, 
@@ -563,7 +610,6 @@ sandbox_lua_allow(lua_State *L)
 {
     int nargs = 0;
     int error = 0;
-    int idx = 0;
     size_t len = 0;
     struct sandbox *sandbox = NULL;
     const char *rulename = NULL;
@@ -580,13 +626,7 @@ sandbox_lua_allow(lua_State *L)
     if (len == 0)
         return luaL_error(L, "name must have length > 0");
     
-    idx = lua_upvalueindex(1);
-    if (lua_isnone(L, idx))
-        return luaL_error(L, "internal error -- sandbox not found");
-
-    sandbox = (struct sandbox*)lua_touserdata(L, idx);
-    if (sandbox == NULL)
-        return luaL_error(L, "internal error -- invalid sandbox");
+    sandbox = sandbox_lua_checksandbox(L);
 
     error = sandbox_rule_initfromstring(rulename, &rule);
     if (error)
@@ -612,7 +652,6 @@ sandbox_lua_deny(lua_State *L)
     int nargs = 0;
     int error = 0;
     size_t len = 0;
-    int idx = 0;
     struct sandbox *sandbox = NULL;
     const char *rulename = NULL;
     struct sandbox_rule rule = { .names = {NULL, NULL, NULL }};
@@ -628,13 +667,7 @@ sandbox_lua_deny(lua_State *L)
     if (len == 0)
         return luaL_error(L, "name must have length > 0");
     
-    idx = lua_upvalueindex(1);
-    if (lua_isnone(L, idx))
-        return luaL_error(L, "internal error -- sandbox not found");
-
-    sandbox = (struct sandbox*)lua_touserdata(L, idx);
-    if (sandbox == NULL)
-        return luaL_error(L, "internal error -- invalid sandbox");
+    sandbox = sandbox_lua_checksandbox(L);
 
     error = sandbox_rule_initfromstring(rulename, &rule);
     if (error)
@@ -650,23 +683,242 @@ sandbox_lua_deny(lua_State *L)
     return (0);
 }
 
-/* sandbox.on('foo.bar.baz', function(cred, rule, arg1, arg2, arg3) ... end) */
+/* resolves the name of a constant in sandbox_lua_consts */
+static int
+sandbox_lua_lookupconst(const char *name, int64_t *value)
+{
+    const struct sandbox_lua_const *konst = NULL;
+
+    for (konst = sandbox_lua_consts; konst->name != NULL; konst++) {
+        if (strcmp(konst->name, name) == 0) {
+            *value = konst->value;
+            return (0);
+        }
+    }
+
+    return (1);
+}
+
+/* Calls the expression chunk in upvalue 1 with the request's arguments
+ * bound in its environment, upvalue 2: rule, cred, arg1, arg2, ..., and
+ * the names in upvalue 3, which maps each to the index of its argument.
+ * Every name is rebound on each call, so that one request never sees the
+ * arguments of another.
+ */
+static int
+sandbox_lua_callexpr(lua_State *L)
+{
+    int argidx = 0;
+    int env = lua_upvalueindex(2);
+
+    /* stack: 1=rule, 2=cred, 3=arg1, ..., 2+SANDBOX_PRED_MAXARGS=argN */
+    lua_settop(L, 2 + SANDBOX_PRED_MAXARGS);
+    lua_pushvalue(L, 1);
+    lua_setfield(L, env, "rule");
+    lua_pushvalue(L, 2);
+    lua_setfield(L, env, "cred");
+    for (argidx = 1; argidx <= SANDBOX_PRED_MAXARGS; argidx++) {
+        lua_pushfstring(L, "arg%d", argidx);
+        lua_pushvalue(L, 2 + argidx);
+        lua_rawset(L, env);
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, lua_upvalueindex(3)) != 0) {
+        /* stack: -2=name, -1=argidx */
+        argidx = (int)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushvalue(L, 2 + argidx);
+        lua_rawset(L, env);
+        /* stack: -1=name */
+    }
+
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_call(L, 0, 1);
+    return (1);
+}
+
+/* Loads expression s as a Lua function for the rule.  This is the fallback
+ * for sandbox.on() expressions that sandbox_expr_compile() rejects, so the
+ * function binds the same names the compiler accepts: arg1, arg2, ..., the
+ * rule's argument names (see sandbox_pred_argname()), and, for process
+ * rules, proc.
+ *
+ * s is parsed on its own, as the chunk "return s".  A chunk ends with its
+ * return statement, so s can only be the expressions returned; it cannot
+ * close the statement and run code of its own.  The names are bound in the
+ * chunk's environment rather than by source, which a global table behind
+ * it lets the expression read through.
+ */
+static void
+sandbox_lua_loadexpr(lua_State *L, const char *rulename, const char *s)
+{
+    int argidx = 0;
+    int error = 0;
+    size_t len = 0;
+    const char *argname = NULL;
+    const char *chunk = NULL;
+
+    lua_pushfstring(L, "return %s", s);
+    /* stack: -1=source */
+    chunk = lua_tolstring(L, -1, &len);
+    error = luaL_loadbufferx(L, chunk, len, "=sandbox.on", "t");
+    if (error != LUA_OK)
+        lua_error(L);
+    /* stack: -2=source, -1=chunk */
+    lua_remove(L, -2);
+    /* stack: -1=chunk */
+
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushglobaltable(L);
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+    /* stack: -2=chunk, -1=env */
+    lua_pushvalue(L, -1);
+    lua_setupvalue(L, -3, 1);   /* the chunk's only upvalue is _ENV */
+    /* stack: -2=chunk, -1=env */
+
+    lua_newtable(L);
+    for (argidx = 1; argidx <= SANDBOX_PRED_MAXARGS; argidx++) {
+        argname = sandbox_pred_argname(rulename, argidx);
+        if (argname == NULL)
+            continue;
+        lua_pushinteger(L, argidx);
+        lua_setfield(L, -2, argname);
+    }
+    if (strncmp(rulename, "process", 7) == 0 &&
+            (rulename[7] == '\0' || rulename[7] == '.')) {
+        lua_pushinteger(L, 1);
+        lua_setfield(L, -2, "proc");
+    }
+    /* stack: -3=chunk, -2=env, -1=names */
+
+    lua_pushcclosure(L, sandbox_lua_callexpr, 3);
+    /* stack: -1=func */
+}
+
+/* Creates the memo for the sandbox.on() options table at idx, or sets *memop
+ * to NULL if the options do not declare the function pure.  Errors are
+ * reported through *msg, as in sandbox_lua_setpredvalue().
+ */
+static int
+sandbox_lua_getmemo(lua_State *L, int idx, const char *rulename,
+        struct sandbox_memo **memop, const char **msg)
+{
+    int pure = 0;
+    lua_Integer ttl = 0;
+    lua_Integer size = 0;
+    lua_Integer i = 0;
+    lua_Integer nkeys = 0;
+    struct sandbox_pred_operand key;
+    struct sandbox_memo *memo = NULL;
+
+    *memop = NULL;
+
+    lua_getfield(L, idx, "pure");
+    pure = lua_toboolean(L, -1);
+    lua_getfield(L, idx, "ttl");
+    lua_getfield(L, idx, "size");
+    lua_getfield(L, idx, "key");
+    /* stack: -4=pure, -3=ttl, -2=size, -1=key */
+
+    if (!pure) {
+        if (!lua_isnil(L, -3) || !lua_isnil(L, -2) || !lua_isnil(L, -1)) {
+            *msg = "key, ttl, and size require pure=true";
+            return (1);
+        }
+        lua_pop(L, 4);
+        return (0);
+    }
+
+    if (!lua_isnil(L, -3)) {
+        ttl = lua_isinteger(L, -3) ? lua_tointeger(L, -3) : -1;
+        if (ttl < 0) {
+            *msg = "ttl must be a non-negative integer";
+            return (1);
+        }
+    }
+
+    if (!lua_isnil(L, -2)) {
+        size = lua_isinteger(L, -2) ? lua_tointeger(L, -2) : 0;
+        if (size <= 0 || size > SANDBOX_MEMO_MAXSIZE) {
+            *msg = "size must be a positive integer no greater than 4096";
+            return (1);
+        }
+    }
+
+    if (!lua_istable(L, -1)) {
+        *msg = "a pure function needs a key";
+        return (1);
+    }
+    nkeys = lua_rawlen(L, -1);
+    if (nkeys < 1 || nkeys > SANDBOX_MEMO_MAXKEYS) {
+        *msg = "a key must have between 1 and 4 fields";
+        return (1);
+    }
+
+    memo = sandbox_memo_create(size, (uint64_t)ttl * 1000000);
+    for (i = 1; i <= nkeys; i++) {
+        lua_rawgeti(L, -1, i);
+        /* stack: -2=key, -1=key[i] */
+        if (lua_type(L, -1) != LUA_TSTRING ||
+                sandbox_pred_lookupfield(rulename, lua_tostring(L, -1),
+                    &key) != 0) {
+            sandbox_memo_destroy(memo);
+            *msg = "unknown key field";
+            return (1);
+        }
+        (void)sandbox_memo_addkey(memo, &key);
+        lua_pop(L, 1);
+        /* stack: -1=key */
+    }
+    lua_pop(L, 4);
+    /* stack: */
+
+    *memop = memo;
+    return (0);
+}
+
+/* sandbox.on('foo.bar.baz', function(rule, cred, arg1, arg2, arg3) ... end)
+ * sandbox.on('foo.bar.baz', 'arg1 >= 0 and cred.uid ~= 0')
+ * sandbox.on('foo.bar.baz', function(...) ... end, {unordered=true})
+ *
+ * An expression string is compiled for the sandbox_expr interpreter when it
+ * is in the supported subset, and is otherwise run as a Lua chunk.
+ *
+ * The optional table sets the function's options:
+ *   unordered  the function neither depends on nor affects the functions
+ *              registered before it on the rule, so that a sandbox created
+ *              with SANDBOX_REORDER may run it earlier than them.
+ *   pure       the function's verdict depends only on the fields listed in
+ *              key (e.g., {'cred.uid', 'arg1'}), so it may be cached (see
+ *              sandbox_memo.h).  ttl, in milliseconds, bounds how long a
+ *              verdict is kept, and size how many are kept.
+ */
 static int
 sandbox_lua_on(lua_State *L)
 {
     int nargs = 0;
     int error = 0;
     size_t len = 0;
-    int idx = 0;
     int ref = 0;
+    int flags = 0;
+    lua_Debug ar;
+    struct sandbox_ref *funcref = NULL;
+    struct sandbox_expr *prog = NULL;
+    struct sandbox_memo *memo = NULL;
+    const char *msg = NULL;
     struct sandbox *sandbox = NULL;
     const char *rulename = NULL;
+    const char *expr = NULL;
     struct sandbox_rule rule = { .names = {NULL, NULL, NULL }};
     
     SANDBOX_LOG_TRACE_ENTER;
 
     nargs = lua_gettop(L);
-    if (nargs != 2)
+    if (nargs != 2 && nargs != 3)
         return luaL_error(L, "wrong number of arguments");
 
     luaL_checktype(L, 1, LUA_TSTRING);
@@ -674,31 +926,216 @@ sandbox_lua_on(lua_State *L)
     if (len == 0)
         return luaL_error(L, "name must have length > 0");
 
-    luaL_checktype(L, 2, LUA_TFUNCTION);
+    if (lua_type(L, 2) != LUA_TSTRING)
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    if (nargs == 3) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_getfield(L, 3, "unordered");
+        /* stack: 1=rule, 2=func, 3=opts, 4=opts.unordered */
+        if (lua_toboolean(L, -1))
+            flags |= SANDBOX_REF_UNORDERED;
+        lua_pop(L, 1);
+        /* stack: 1=rule, 2=func, 3=opts */
+    }
     
-    idx = lua_upvalueindex(1);
-    if (lua_isnone(L, idx))
-        return luaL_error(L, "internal error -- sandbox not found");
+    sandbox = sandbox_lua_checksandbox(L);
+
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        expr = lua_tostring(L, 2);
+        prog = sandbox_expr_compile(rulename, expr, sandbox_lua_lookupconst);
+        if (prog == NULL) {
+            sandbox_lua_loadexpr(L, rulename, expr);
+            /* stack: 1=rule, 2=expr, [3=opts,] -1=func */
+            lua_replace(L, 2);
+            /* stack: 1=rule, 2=func, [3=opts] */
+        }
+    }
 
-    sandbox = (struct sandbox*)lua_touserdata(L, idx);
-    if (sandbox == NULL)
-        return luaL_error(L, "internal error -- invalid sandbox");
+    if (nargs == 3 &&
+            sandbox_lua_getmemo(L, 3, rulename, &memo, &msg) != 0) {
+        if (prog != NULL)
+            sandbox_expr_destroy(prog);
+        return luaL_error(L, "%s", msg);
+    }
 
     error = sandbox_rule_initfromstring(rulename, &rule);
-    if (error)
+    if (error) {
+        if (prog != NULL)
+            sandbox_expr_destroy(prog);
+        if (memo != NULL)
+            sandbox_memo_destroy(memo);
         return luaL_argerror(L, 1, "invalid rule name");
+    }
+
+    if (prog != NULL) {
+        funcref = sandbox_ref_create(LUA_NOREF);
+        funcref->prog = prog;
+        funcref->memo = memo;
+        funcref->flags = flags;
+        goto insert;
+    }
+
+    /* record the function's arity so that sandbox_lua_veval() can skip
+     * marshalling arguments the function never sees.
+     */
+    lua_pushvalue(L, 2);
+    /* stack: -1=func */
+    lua_getinfo(L, ">u", &ar);
+    /* stack: */
 
-    /* TODO: add function to registry */
     lua_pushvalue(L, 2);
     /* stack: -1=func */
     ref = luaL_ref(L, LUA_REGISTRYINDEX);
     /* stack: */
-    error = sandbox_ruleset_insert(sandbox->ruleset, &rule, 
-            SANDBOX_RULETYPE_FUNCTION, ref, NULL);
+    funcref = sandbox_ref_create(ref);
+    funcref->memo = memo;
+    funcref->flags = flags;
+    if (!ar.isvararg)
+        funcref->nargs = ar.nparams;
+    SANDBOX_LOG_DEBUG("function for '%s' takes %d args\n", rulename,
+            funcref->nargs);
+
+insert:
+    error = sandbox_ruleset_insertref(sandbox->ruleset, &rule, funcref);
     sandbox_rule_freenames(&rule);
+    if (error) {
+        sandbox_ref_destroy(funcref);
+        return luaL_error(L,  "internal error -- unknown");
+    }
+
+    SANDBOX_LOG_TRACE_EXIT;
+    return (0);
+}
+
+/* sandbox.rules{
+ *     allow = {'network.socket', 'system.time', ...},
+ *     deny = {'process.fork', ...},
+ *     on = {{'process.nice', '1 < 2'}, {'vnode', func, {pure=true}}, ...},
+ * }
+ *
+ * Registers many rules at once.  The allow and deny rules are inserted with
+ * one sorted build of the ruleset (see sandbox_ruleset_insertbulk()), which,
+ * for generated policies of thousands of rules, is far cheaper than as many
+ * sandbox.allow() and sandbox.deny() calls.  A rule in both lists is denied.
+ * Each on entry holds the arguments of a sandbox.on() call; they are
+ * registered in order, after the allow and deny rules.
+ */
+static int
+sandbox_lua_rules(lua_State *L)
+{
+    static const struct {
+        const char *field;
+        int value;
+    } lists[] = {
+        { "allow", KAUTH_RESULT_ALLOW },
+        { "deny", KAUTH_RESULT_DENY },
+        { NULL, 0 }     /* sentinel */
+    };
+    int nargs = 0;
+    int error = 0;
+    int argidx = 0;
+    int nonargs = 0;
+    size_t i = 0;
+    size_t n = 0;
+    size_t nentries = 0;
+    lua_Integer tidx = 0;
+    lua_Integer tlen = 0;
+    const char *rulename = NULL;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_ruleentry *entries = NULL;
+    char (*names)[SANDBOX_RULE_MAXNAMES][SANDBOX_RULE_MAXNAMELEN] = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    nargs = lua_gettop(L);
+    if (nargs != 1)
+        return luaL_error(L, "wrong number of arguments");
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    sandbox = sandbox_lua_checksandbox(L);
+
+    for (i = 0; lists[i].field != NULL; i++) {
+        lua_getfield(L, 1, lists[i].field);
+        /* stack: 1=tbl, 2=tbl[field] */
+        if (!lua_isnil(L, 2)) {
+            if (lua_type(L, 2) != LUA_TTABLE)
+                return luaL_error(L, "'%s' must be a table", lists[i].field);
+            nentries += lua_rawlen(L, 2);
+        }
+        lua_pop(L, 1);
+        /* stack: 1=tbl */
+    }
+
+    /* The entries, and the names that they point to, live in a userdata,
+     * so that one allocation serves every rule and that the garbage
+     * collector frees it even if we raise an error.
+     */
+    entries = lua_newuserdata(L,
+            nentries * (sizeof(*entries) + sizeof(*names)));
+    /* stack: 1=tbl, 2=entries */
+    names = (void *)(entries + nentries);
+
+    for (i = 0; lists[i].field != NULL; i++) {
+        lua_getfield(L, 1, lists[i].field);
+        /* stack: 1=tbl, 2=entries, 3=list */
+        tlen = lua_isnil(L, 3) ? 0 : (lua_Integer)lua_rawlen(L, 3);
+        for (tidx = 1; tidx <= tlen; tidx++) {
+            lua_rawgeti(L, 3, tidx);
+            /* stack: 1=tbl, 2=entries, 3=list, 4=list[tidx] */
+            if (lua_type(L, 4) != LUA_TSTRING)
+                return luaL_error(L, "'%s' rules must be strings",
+                        lists[i].field);
+            if (n == nentries)
+                return luaL_error(L, "'%s' changed while being read",
+                        lists[i].field);
+            rulename = lua_tostring(L, 4);
+            error = sandbox_rule_initfrombuf(rulename, &entries[n].rule,
+                    names[n]);
+            if (error)
+                return luaL_error(L, "invalid rule name '%s'", rulename);
+            entries[n].value = lists[i].value;
+            n++;
+            lua_pop(L, 1);
+            /* stack: 1=tbl, 2=entries, 3=list */
+        }
+        lua_pop(L, 1);
+        /* stack: 1=tbl, 2=entries */
+    }
+
+    error = sandbox_ruleset_insertbulk(sandbox->ruleset, entries, n);
     if (error)
         return luaL_error(L,  "internal error -- unknown");
 
+    lua_pop(L, 1);
+    /* stack: 1=tbl */
+
+    lua_getfield(L, 1, "on");
+    /* stack: 1=tbl, 2=on */
+    if (lua_isnil(L, 2))
+        goto done;
+    if (lua_type(L, 2) != LUA_TTABLE)
+        return luaL_error(L, "'on' must be a table");
+
+    tlen = lua_rawlen(L, 2);
+    for (tidx = 1; tidx <= tlen; tidx++) {
+        lua_pushcfunction(L, sandbox_lua_on);
+        /* stack: 1=tbl, 2=on, 3=sandbox.on */
+        lua_rawgeti(L, 2, tidx);
+        /* stack: 1=tbl, 2=on, 3=sandbox.on, 4=on[tidx] */
+        if (lua_type(L, 4) != LUA_TTABLE)
+            return luaL_error(L, "'on' entries must be tables");
+        nonargs = lua_rawlen(L, 4);
+        for (argidx = 1; argidx <= nonargs; argidx++)
+            lua_rawgeti(L, 4, argidx);
+        lua_remove(L, 4);
+        /* stack: 1=tbl, 2=on, 3=sandbox.on, 4...=on[tidx][1...] */
+        lua_call(L, nonargs, 0);
+        /* stack: 1=tbl, 2=on */
+    }
+
+done:
     SANDBOX_LOG_TRACE_EXIT;
     return (0);
 }
@@ -709,7 +1146,6 @@ sandbox_lua_paths_allow(lua_State *L)
     int error = 0;
     int nargs = 0;
     size_t len = 0;
-    int idx = 0;
     struct sandbox_rule rule = { .names = {NULL, NULL, NULL }};
     const char *actionname = NULL;
     const char *pathname = NULL;
@@ -734,13 +1170,7 @@ sandbox_lua_paths_allow(lua_State *L)
 
     luaL_checktype(L, 2, LUA_TTABLE);
 
-    idx = lua_upvalueindex(1);
-    if (lua_isnone(L, idx))
-        return luaL_error(L, "internal error -- sandbox not found");
-
-    sandbox = (struct sandbox*)lua_touserdata(L, idx);
-    if (sandbox == NULL)
-        return luaL_error(L, "internal error -- invalid sandbox");
+    sandbox = sandbox_lua_checksandbox(L);
 
     /* TODO_ check for zero-length path */
     lua_len(L, 2);
@@ -776,7 +1206,6 @@ sandbox_lua_paths_deny(lua_State *L)
     int error = 0;
     int nargs = 0;
     size_t len = 0;
-    int idx = 0;
     struct sandbox_rule rule = { .names = {NULL, NULL, NULL }};
     const char *actionname = NULL;
     const char *pathname = NULL;
@@ -801,13 +1230,7 @@ sandbox_lua_paths_deny(lua_State *L)
 
     luaL_checktype(L, 2, LUA_TTABLE);
 
-    idx = lua_upvalueindex(1);
-    if (lua_isnone(L, idx))
-        return luaL_error(L, "internal error -- sandbox not found");
-
-    sandbox = (struct sandbox*)lua_touserdata(L, idx);
-    if (sandbox == NULL)
-        return luaL_error(L, "internal error -- invalid sandbox");
+    sandbox = sandbox_lua_checksandbox(L);
 
     /* TODO_ check for zero-length path */
     lua_len(L, 2);
@@ -837,95 +1260,696 @@ sandbox_lua_paths_deny(lua_State *L)
     return (0);
 }
 
-static const struct luaL_Reg sandbox_lua_funcs[] = {
-    {"default", sandbox_lua_default},
-    {"allow", sandbox_lua_allow},
-    {"deny", sandbox_lua_deny},
-    {"on", sandbox_lua_on},
-    {"paths_allow", sandbox_lua_paths_allow},
-    {"paths_deny", sandbox_lua_paths_deny},
-    {NULL, NULL}    /* sentinel */
+static const struct {
+    const char *name;
+    int op;
+} sandbox_lua_predops[] = {
+    { "eq", SANDBOX_PRED_OP_IN },
+    { "ne", SANDBOX_PRED_OP_NOTIN },
+    { "lt", SANDBOX_PRED_OP_LT },
+    { "le", SANDBOX_PRED_OP_LE },
+    { "gt", SANDBOX_PRED_OP_GT },
+    { "ge", SANDBOX_PRED_OP_GE },
+    { NULL, 0 }
 };
 
-static void
-sandbox_lua_open(struct sandbox *sandbox)
+/* Sets the right-hand side of term from the Lua value at idx, which is
+ * either an integer, a boolean (for relations like 'proc.sameroot'), the
+ * name of a sandbox constant (e.g., 'AF_INET'), or, if allowfield is set,
+ * the name of a field (e.g., 'proc.nice').
+ *
+ * These helpers report errors through *msg rather than raising them so that
+ * sandbox_lua_addpred() can free the predicate before calling luaL_error().
+ */
+static int
+sandbox_lua_setpredvalue(lua_State *L, int idx, const char *rulename,
+        struct sandbox_pred_term *term, bool allowfield, const char **msg)
 {
-    lua_State *L = NULL;
+    int64_t value = 0;
+    const char *name = NULL;
+    struct sandbox_pred_operand rhs;
+
+    if (term->rhs.field != SANDBOX_PRED_FIELD_NONE)
+        goto mixed;
+
+    if (lua_isinteger(L, idx)) {
+        value = lua_tointeger(L, idx);
+    } else if (lua_isboolean(L, idx)) {
+        value = lua_toboolean(L, idx);
+    } else if (lua_type(L, idx) == LUA_TSTRING) {
+        name = lua_tostring(L, idx);
+        if (sandbox_lua_lookupconst(name, &value) != 0) {
+            if (!allowfield ||
+                    sandbox_pred_lookupfield(rulename, name, &rhs) != 0) {
+                *msg = "unknown constant or field in predicate";
+                return (1);
+            }
+            if (term->nvalues != 0)
+                goto mixed;
+            term->rhs = rhs;
+            return (0);
+        }
+    } else {
+        *msg = "predicate values must be integers, booleans, or names";
+        return (1);
+    }
 
-    L = sandbox->K->L;
+    if (sandbox_pred_term_addvalue(term, value) != 0) {
+        *msg = "too many values in predicate";
+        return (1);
+    }
+    return (0);
 
-    luaL_newlibtable(L, sandbox_lua_funcs);
-    /* stack: -1 = libtbl */
-    /* sandbox is an upvalue of all library functions */
-    lua_pushlightuserdata(L, (void *)sandbox);
-    /* stack: -2 = libtbl, -1=sandbox */
-    luaL_setfuncs(L, sandbox_lua_funcs, 1);
-    /* stack: -1 = libtbl */
-    sandbox_lua_pushconsts(L, sandbox_lua_consts);
-    /* stack: -1 = libtbl  */
-    lua_setglobal(L, "sandbox");
-    /* stack: */
+mixed:
+    *msg = "a predicate cannot compare against both a field and values";
+    return (1);
 }
 
-int
-sandbox_lua_veval(klua_State *K, int funcref, kauth_cred_t cred, 
-        const struct sandbox_rule *rule, const char *fmt, va_list ap)
+/* a list of values; the term holds if lhs equals (or for 'ne', does not
+ * equal) any of them
+ */
+static int
+sandbox_lua_setpredset(lua_State *L, int idx, const char *rulename,
+        struct sandbox_pred_term *term, const char **msg)
 {
-    lua_State *L = NULL;
-    int result = KAUTH_RESULT_DENY;
-    int type = LUA_TNIL;
+    lua_Integer tlen = 0;
+    lua_Integer tidx = 0;
     int error = 0;
-    int bret = 0;
-    const char *msg = NULL;
-    int stacksize = 0;
-    int nargs = 0;
-    const char *c = NULL;
-    struct vnode *vp = NULL;
-    struct proc *procp = NULL;
 
-    SANDBOX_LOG_TRACE_ENTER;
+    tlen = lua_rawlen(L, idx);
+    for (tidx = 1; tidx <= tlen; tidx++) {
+        lua_rawgeti(L, idx, tidx);
+        /* stack: -1=value */
+        error = sandbox_lua_setpredvalue(L, lua_gettop(L), rulename, term,
+                false, msg);
+        lua_pop(L, 1);
+        if (error)
+            break;
+    }
 
-    klua_lock(K);
+    return (error);
+}
 
-    L = K->L;
+/* Compiles the value of one field of a sandbox.when() or sandbox.require()
+ * table:
+ *
+ *  field = 1                       -- equals
+ *  field = {1, 2}                  -- equals any
+ *  field = {ge=0, lt='proc.nice'}  -- each comparison must hold
+ *  field = {ne={1, 2}}             -- equals none
+ */
+static int
+sandbox_lua_addpredterms(lua_State *L, int idx, const char *rulename,
+        struct sandbox_pred *pred, const struct sandbox_pred_operand *lhs,
+        const char **msg)
+{
+    int error = 0;
+    int i = 0;
+    const char *opname = NULL;
+    struct sandbox_pred_term *term = NULL;
+
+    if (lua_type(L, idx) != LUA_TTABLE) {
+        term = sandbox_pred_addterm(pred, SANDBOX_PRED_OP_IN, lhs);
+        if (term == NULL)
+            goto full;
+        return (sandbox_lua_setpredvalue(L, idx, rulename, term, true, msg));
+    }
 
-    type = lua_rawgeti(L, LUA_REGISTRYINDEX, funcref); stacksize++;
-    /* stack: -1 = function */
-    if (type != LUA_TFUNCTION) {
-        SANDBOX_LOG_ERROR("expected a reference to a Lua function but got type=%s\n", 
-                lua_typename(L, type));
-        goto fail;
+    if (lua_rawlen(L, idx) > 0) {
+        term = sandbox_pred_addterm(pred, SANDBOX_PRED_OP_IN, lhs);
+        if (term == NULL)
+            goto full;
+        return (sandbox_lua_setpredset(L, idx, rulename, term, msg));
     }
 
-    sandbox_lua_pushrule(L, rule); stacksize++; nargs++;
-    /* stack: -2=func, -1=rule{} */
-    sandbox_lua_pushcred(L, cred); stacksize++; nargs++;
-    /* stack: -3=func, -2=rule{}, -1=cred{} */
+    lua_pushnil(L);
+    /* stack: -1=nil */
+    while (lua_next(L, idx) != 0) {
+        /* stack: -2=op, -1=value */
+        if (lua_type(L, -2) != LUA_TSTRING)
+            goto badop;
+        opname = lua_tostring(L, -2);
+        for (i = 0; sandbox_lua_predops[i].name != NULL; i++) {
+            if (strcmp(sandbox_lua_predops[i].name, opname) == 0)
+                break;
+        }
+        if (sandbox_lua_predops[i].name == NULL)
+            goto badop;
 
-    c = fmt;
-    while (*c != '\0') {
-        switch (*c) {
-        case 'v':
-            vp = va_arg(ap, struct vnode *);
-            sandbox_lua_pushvnode(L, vp);
-            stacksize++;
-            nargs++;
-            break;
-        case 'p':
-            procp = va_arg(ap, struct proc *);
-            sandbox_lua_pushproc(L, procp);
-            stacksize++;
-            nargs++;
-            break;
-        case 'i':
-            lua_pushinteger(L, va_arg(ap, lua_Integer));
-            stacksize++;
-            nargs++;
-            break;
-        case 'o':
-            sandbox_lua_pushsocket(L, va_arg(ap, struct socket *));
-            stacksize++;
-            nargs++;
+        term = sandbox_pred_addterm(pred, sandbox_lua_predops[i].op, lhs);
+        if (term == NULL) {
+            lua_pop(L, 2);
+            goto full;
+        }
+
+        if (lua_type(L, -1) == LUA_TTABLE) {
+            if (term->op != SANDBOX_PRED_OP_IN &&
+                    term->op != SANDBOX_PRED_OP_NOTIN) {
+                *msg = "only 'eq' and 'ne' take a list of values";
+                error = 1;
+            } else {
+                error = sandbox_lua_setpredset(L, lua_gettop(L), rulename,
+                        term, msg);
+            }
+        } else {
+            error = sandbox_lua_setpredvalue(L, lua_gettop(L), rulename,
+                    term, true, msg);
+        }
+        if (error) {
+            lua_pop(L, 2);
+            return (error);
+        }
+        lua_pop(L, 1);
+        /* stack: -1=op */
+    }
+
+    return (0);
+
+badop:
+    lua_pop(L, 2);
+    *msg = "unknown predicate operator";
+    return (1);
+
+full:
+    *msg = "too many terms in predicate";
+    return (1);
+}
+
+/* The table is compiled into a sandbox_pred that is evaluated without
+ * entering Lua.  A request that fails any field is denied; one that
+ * matches every field gets result.
+ */
+static int
+sandbox_lua_addpred(lua_State *L, int result)
+{
+    int nargs = 0;
+    int error = 0;
+    size_t len = 0;
+    const char *msg = NULL;
+    const char *rulename = NULL;
+    const char *fieldname = NULL;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_pred *pred = NULL;
+    struct sandbox_pred_operand lhs;
+    struct sandbox_rule rule = { .names = {NULL, NULL, NULL }};
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    nargs = lua_gettop(L);
+    if (nargs != 2)
+        return luaL_error(L, "wrong number of arguments");
+
+    luaL_checktype(L, 1, LUA_TSTRING);
+    rulename = lua_tolstring(L, 1, &len);
+    if (len == 0)
+        return luaL_error(L, "name must have length > 0");
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    sandbox = sandbox_lua_checksandbox(L);
+
+    error = sandbox_rule_initfromstring(rulename, &rule);
+    if (error)
+        return luaL_argerror(L, 1, "invalid rule name");
+
+    pred = sandbox_pred_create(result);
+
+    lua_pushnil(L);
+    /* stack: 1=rule, 2=table, 3=nil */
+    while (lua_next(L, 2) != 0) {
+        /* stack: 1=rule, 2=table, 3=field, 4=value */
+        if (lua_type(L, 3) != LUA_TSTRING) {
+            msg = "predicate keys must be field names";
+            lua_pop(L, 2);
+            goto fail;
+        }
+        fieldname = lua_tostring(L, 3);
+        if (sandbox_pred_lookupfield(rulename, fieldname, &lhs) != 0) {
+            msg = "unknown field in predicate";
+            lua_pop(L, 2);
+            goto fail;
+        }
+        error = sandbox_lua_addpredterms(L, 4, rulename, pred, &lhs, &msg);
+        if (error) {
+            lua_pop(L, 2);
+            goto fail;
+        }
+        lua_pop(L, 1);
+        /* stack: 1=rule, 2=table, 3=field */
+    }
+
+    SANDBOX_LOG_DEBUG("predicate for '%s' has %d terms\n", rulename,
+            pred->nterms);
+
+    error = sandbox_ruleset_insertpred(sandbox->ruleset, &rule, pred);
+    sandbox_rule_freenames(&rule);
+    if (error) {
+        sandbox_pred_destroy(pred);
+        return luaL_error(L,  "internal error -- unknown");
+    }
+
+    SANDBOX_LOG_TRACE_EXIT;
+    return (0);
+
+fail:
+    sandbox_pred_destroy(pred);
+    sandbox_rule_freenames(&rule);
+    return luaL_error(L, "%s", msg);
+}
+
+/* sandbox.when('network.socket.open', {domain={'AF_INET', 'AF_INET6'},
+ *         type=sandbox.SOCK_STREAM})
+ *
+ * Allows the requests that match the table.
+ */
+static int
+sandbox_lua_when(lua_State *L)
+{
+    return (sandbox_lua_addpred(L, KAUTH_RESULT_ALLOW));
+}
+
+/* sandbox.require('process.signal', {['proc.sameroot']=true})
+ *
+ * Denies the requests that do not match the table, and leaves the rest to
+ * the other rules.
+ */
+static int
+sandbox_lua_require(lua_State *L)
+{
+    return (sandbox_lua_addpred(L, KAUTH_RESULT_DEFER));
+}
+
+/* The table's entries are compiled into a sandbox_addr_set, which is
+ * matched against the request's sockaddr without entering Lua.
+ */
+static int
+sandbox_lua_addaddrs(lua_State *L, int type)
+{
+    int error = 0;
+    lua_Integer tlen = 0;
+    lua_Integer tidx = 0;
+    const char *spec = NULL;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_addr_set *addrs = NULL;
+    struct sandbox_rule rule = { .names = {NULL, NULL, NULL }};
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    if (lua_gettop(L) != 1)
+        return luaL_error(L, "wrong number of arguments");
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    sandbox = sandbox_lua_checksandbox(L);
+
+    lua_len(L, 1);
+    /* stack: 1=table, 2=table_len */
+    tlen = lua_tointeger(L, 2);
+    lua_pop(L, 1);
+    /* stack: 1=table */
+
+    addrs = sandbox_addr_set_create();
+    for (tidx = 1; tidx <= tlen; tidx++) {
+        lua_geti(L, 1, tidx);
+        /* stack: 1=table, 2=table[tidx] */
+        if (lua_type(L, 2) != LUA_TSTRING) {
+            sandbox_addr_set_destroy(addrs);
+            return luaL_error(L, "addresses must be strings");
+        }
+        spec = lua_tostring(L, 2);
+        if (sandbox_addr_set_add(addrs, spec) != 0) {
+            sandbox_addr_set_destroy(addrs);
+            return luaL_error(L, "invalid address '%s'", spec);
+        }
+        lua_pop(L, 1);
+        /* stack: 1=table */
+    }
+
+    SANDBOX_RULE_MAKE(&rule, "network", "bind", NULL);
+    error = sandbox_ruleset_insertaddrs(sandbox->ruleset, &rule, type, addrs);
+    if (error) {
+        sandbox_addr_set_destroy(addrs);
+        return luaL_error(L,  "internal error -- unknown");
+    }
+
+    SANDBOX_LOG_TRACE_EXIT;
+    return (0);
+}
+
+/* sandbox.bind_allow{'10.0.0.0/8:8000-8999', '[::1]:*', 'unix:/tmp/app-*'}
+ *
+ * Denies binding to any address that is not in the table.  See
+ * sandbox_addr_set_add() for the form of the entries.
+ */
+static int
+sandbox_lua_bind_allow(lua_State *L)
+{
+    return (sandbox_lua_addaddrs(L, SANDBOX_RULETYPE_ADDRALLOW));
+}
+
+/* sandbox.bind_deny{'*:0-1023'}
+ *
+ * Denies binding to the addresses in the table.
+ */
+static int
+sandbox_lua_bind_deny(lua_State *L)
+{
+    return (sandbox_lua_addaddrs(L, SANDBOX_RULETYPE_ADDRDENY));
+}
+
+/* sandbox.invalidate()
+ *
+ * Discards the cached verdicts of the sandbox's pure functions, for a
+ * script that changes state that they read.
+ */
+static int
+sandbox_lua_invalidate(lua_State *L)
+{
+    struct sandbox *sandbox = NULL;
+
+    sandbox = sandbox_lua_checksandbox(L);
+
+    atomic_inc_64(&sandbox->generation);
+    return (0);
+}
+
+/* reads the sampling rate opts[field] for sandbox.audit() */
+static int
+sandbox_lua_auditrate(lua_State *L, const char *field)
+{
+    int isnum = 0;
+    lua_Integer rate = 0;
+
+    lua_getfield(L, 2, field);
+    /* stack: 1=rule, 2=opts, 3=opts[field] */
+    if (lua_isnil(L, 3)) {
+        lua_pop(L, 1);
+        return (SANDBOX_SAMPLE_INHERIT);
+    }
+
+    rate = lua_tointegerx(L, 3, &isnum);
+    if (!isnum || rate < 0 || rate > INT32_MAX)
+        return luaL_error(L, "'%s' must be a non-negative integer", field);
+    lua_pop(L, 1);
+    /* stack: 1=rule, 2=opts */
+
+    return ((int)rate);
+}
+
+/* sandbox.audit('vnode', {deny=1, allow=1000})
+ *
+ * Sets the rates at which the event ring records the requests that the
+ * rule and the rules beneath it decide: 1 in deny of the denied requests
+ * and 1 in allow of the allowed ones, or none for a rate of 0.  A rate
+ * that is left out is inherited from the rule above; the default rule, ''
+ * here, records every deny and no allow.
+ */
+static int
+sandbox_lua_audit(lua_State *L)
+{
+    int error = 0;
+    int deny = 0;
+    int allow = 0;
+    size_t len = 0;
+    const char *rulename = NULL;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_rule rule = { .names = {NULL, NULL, NULL }};
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    if (lua_gettop(L) != 2)
+        return luaL_error(L, "wrong number of arguments");
+
+    luaL_checktype(L, 1, LUA_TSTRING);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    rulename = lua_tolstring(L, 1, &len);
+
+    deny = sandbox_lua_auditrate(L, "deny");
+    allow = sandbox_lua_auditrate(L, "allow");
+
+    sandbox = sandbox_lua_checksandbox(L);
+
+    if (len > 0) {
+        error = sandbox_rule_initfromstring(rulename, &rule);
+        if (error)
+            return luaL_argerror(L, 1, "invalid rule name");
+    }
+
+    error = sandbox_ruleset_insertsampling(sandbox->ruleset, &rule, deny,
+            allow);
+    sandbox_rule_freenames(&rule);
+    if (error)
+        return luaL_error(L,  "internal error");
+
+    SANDBOX_LOG_TRACE_EXIT;
+    return (0);
+}
+
+static const struct luaL_Reg sandbox_lua_funcs[] = {
+    {"default", sandbox_lua_default},
+    {"allow", sandbox_lua_allow},
+    {"deny", sandbox_lua_deny},
+    {"on", sandbox_lua_on},
+    {"rules", sandbox_lua_rules},
+    {"when", sandbox_lua_when},
+    {"require", sandbox_lua_require},
+    {"invalidate", sandbox_lua_invalidate},
+    {"paths_allow", sandbox_lua_paths_allow},
+    {"paths_deny", sandbox_lua_paths_deny},
+    {"bind_allow", sandbox_lua_bind_allow},
+    {"bind_deny", sandbox_lua_bind_deny},
+    {"audit", sandbox_lua_audit},
+    {NULL, NULL}    /* sentinel */
+};
+
+static void
+sandbox_lua_open(struct sandbox *sandbox)
+{
+    lua_State *L = NULL;
+
+    L = sandbox->K->L;
+
+    /* the library functions find the sandbox in the registry rather than
+     * in an upvalue, so that a closure that outlives the sandbox -- a
+     * finalizer, say -- finds none once the state is reset
+     */
+    lua_pushlightuserdata(L, (void *)sandbox);
+    lua_setfield(L, LUA_REGISTRYINDEX, SANDBOX_LUA_SANDBOX);
+
+    luaL_newlibtable(L, sandbox_lua_funcs);
+    /* stack: -1 = libtbl */
+    luaL_setfuncs(L, sandbox_lua_funcs, 0);
+    /* stack: -1 = libtbl */
+    sandbox_lua_pushconsts(L, sandbox_lua_consts);
+    /* stack: -1 = libtbl  */
+    lua_setglobal(L, "sandbox");
+    /* stack: */
+}
+
+static int
+sandbox_lua_dumpwriter(lua_State *L, const void *p, size_t sz, void *ud)
+{
+    luaL_addlstring((luaL_Buffer *)ud, (const char *)p, sz);
+    return (0);
+}
+
+/* runs sandbox_bytecode_analyze() on the Lua function at the top of the
+ * stack; returns 0 on success
+ */
+static int
+sandbox_lua_analyze(lua_State *L, struct sandbox_bytecode_info *info)
+{
+    int error = 0;
+    size_t len = 0;
+    const char *chunk = NULL;
+    luaL_Buffer b;
+
+    /* stack: -1=func */
+    luaL_buffinit(L, &b);
+    error = lua_dump(L, sandbox_lua_dumpwriter, &b, /*strip*/ 1);
+    luaL_pushresult(&b);
+    /* stack: -2=func, -1=chunk */
+    if (error == 0) {
+        chunk = lua_tolstring(L, -1, &len);
+        error = sandbox_bytecode_analyze(chunk, len, info);
+    }
+    lua_pop(L, 1);
+    /* stack: -1=func */
+
+    return (error);
+}
+
+/* reads a cached chunk for lua_load() in one piece */
+struct sandbox_lua_chunkreader {
+    const void *chunk;
+    size_t len;
+};
+
+static const char *
+sandbox_lua_chunkread(lua_State *L, void *ud, size_t *size)
+{
+    struct sandbox_lua_chunkreader *r = ud;
+    const char *p = r->chunk;
+
+    *size = r->len;
+    r->chunk = NULL;
+    r->len = 0;
+    return (p);
+}
+
+/* Pushes the function compiled from the script, and fills in info from
+ * its analysis.  A script that was compiled before is loaded from its
+ * chunk in the chunk cache.  Otherwise it is parsed, as text only, and its
+ * chunk cached; so the only binary chunks ever loaded are those dumped
+ * here.  Returns a lua_load() status.
+ */
+static int
+sandbox_lua_compile(lua_State *L, const char *script,
+        struct sandbox_bytecode_info *info)
+{
+    int error = 0;
+    size_t len = 0;
+    const char *dump = NULL;
+    struct sandbox_chunk *chunk = NULL;
+    struct sandbox_lua_chunkreader r;
+    luaL_Buffer b;
+
+    chunk = sandbox_chunkcache_lookup(script);
+    if (chunk != NULL) {
+        r.chunk = chunk->chunk;
+        r.len = chunk->chunklen;
+        error = lua_load(L, sandbox_lua_chunkread, &r, script, "b");
+        *info = chunk->info;
+        sandbox_chunkcache_release(chunk);
+        return (error);
+    }
+
+    error = luaL_loadbufferx(L, script, strlen(script), script, "t");
+    if (error != LUA_OK)
+        return (error);
+
+    /* stack: -1=func */
+    luaL_buffinit(L, &b);
+    /* not stripped, so that errors raised by the policy keep their line
+     * numbers when it is loaded from the cache
+     */
+    error = lua_dump(L, sandbox_lua_dumpwriter, &b, /*strip*/ 0);
+    luaL_pushresult(&b);
+    /* stack: -2=func, -1=chunk */
+    if (error == 0) {
+        dump = lua_tolstring(L, -1, &len);
+        if (sandbox_bytecode_analyze(dump, len, info) != 0)
+            info->setupval = 1;
+        sandbox_chunkcache_insert(script, dump, len, info);
+    } else {
+        info->setupval = 1;
+    }
+    lua_pop(L, 1);
+    /* stack: -1=func */
+
+    return (LUA_OK);
+}
+
+/* Calls the function below its nargs arguments on the stack, and pops them
+ * and its result; a function that fails denies
+ */
+static int
+sandbox_lua_pcallverdict(lua_State *L, int nargs)
+{
+    int result = KAUTH_RESULT_DENY;
+    int error = 0;
+    int bret = 0;
+    const char *msg = NULL;
+
+    error = lua_pcall(L, nargs, /*nresults*/ 1, /*msgh*/ 0);
+    /* stack: -1=result/error
+     * lua_pcall() pops the function and the function arguments, and pushes 
+     * either a single result or an error
+     */
+    if (error == LUA_OK) {
+        bret = lua_toboolean(L, -1);    /* TODO: should we check that the type is actually boolean? */
+        result = bret == 1 ? KAUTH_RESULT_ALLOW : KAUTH_RESULT_DENY;
+    } else {
+        msg = lua_tostring(L, -1);
+        SANDBOX_LOG_ERROR("Lua function failed; %s\n", msg);
+    }
+    lua_pop(L, 1);
+
+    return (result);
+}
+
+/* true if a function described by ref wants an argument at (0-based)
+ * position n
+ */
+#define SANDBOX_LUA_WANTARG(ref, n) \
+    ((ref)->nargs == SANDBOX_REF_NARGS_ALL || (n) < (ref)->nargs)
+
+int
+sandbox_lua_veval(klua_State *K, const struct sandbox_ref *funcref,
+        kauth_cred_t cred, const struct sandbox_rule *rule, const char *fmt,
+        va_list ap)
+{
+    lua_State *L = NULL;
+    int result = KAUTH_RESULT_DENY;
+    int type = LUA_TNIL;
+    int stacksize = 0;
+    int nargs = 0;
+    const char *c = NULL;
+    struct vnode *vp = NULL;
+    struct proc *procp = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    klua_lock(K);
+
+    L = K->L;
+
+    type = lua_rawgeti(L, LUA_REGISTRYINDEX, funcref->value); stacksize++;
+    /* stack: -1 = function */
+    if (type != LUA_TFUNCTION) {
+        SANDBOX_LOG_ERROR("expected a reference to a Lua function but got type=%s\n", 
+                lua_typename(L, type));
+        goto fail;
+    }
+
+    /* Arguments are positional, so once the function's arity is reached,
+     * none of the remaining arguments need to be built.
+     */
+    if (SANDBOX_LUA_WANTARG(funcref, nargs)) {
+        sandbox_lua_pushrule(L, rule); stacksize++; nargs++;
+        /* stack: -2=func, -1=rule{} */
+    }
+    if (SANDBOX_LUA_WANTARG(funcref, nargs)) {
+        sandbox_lua_pushcred(L, cred); stacksize++; nargs++;
+        /* stack: -3=func, -2=rule{}, -1=cred{} */
+    }
+
+    c = fmt;
+    while (c != NULL && *c != '\0' && SANDBOX_LUA_WANTARG(funcref, nargs)) {
+        switch (*c) {
+        case 'v':
+            vp = va_arg(ap, struct vnode *);
+            sandbox_lua_pushvnode(L, vp);
+            stacksize++;
+            nargs++;
+            break;
+        case 'p':
+            procp = va_arg(ap, struct proc *);
+            /* the locks the caller holds on it */
+            (void)va_arg(ap, int);
+            sandbox_lua_pushproc(L, procp);
+            stacksize++;
+            nargs++;
+            break;
+        case 'i':
+            lua_pushinteger(L, va_arg(ap, lua_Integer));
+            stacksize++;
+            nargs++;
+            break;
+        case 'o':
+            sandbox_lua_pushsocket(L, va_arg(ap, struct socket *));
+            stacksize++;
+            nargs++;
             break;
         case 'a':
             sandbox_lua_pushsockaddr(L, va_arg(ap, struct sockaddr *));
@@ -940,19 +1964,78 @@ sandbox_lua_veval(klua_State *K, int funcref, kauth_cred_t cred,
         c++;
     }
 
-    error = lua_pcall(L, nargs, /*nresults*/ 1, /*msgh*/ 0);
-    /* stack: -1=result/error
-     * lua_pcall() pops the function and the function arguments, and pushes 
-     * either a single result or an error
-     */
-    stacksize = 1; 
-    if (error == LUA_OK) {
-        bret = lua_toboolean(L, -1);    /* TODO: should we check that the type is actually boolean? */
-        result = bret == 1 ? KAUTH_RESULT_ALLOW : KAUTH_RESULT_DENY;
-    } else {
-        msg = lua_tostring(L, -1);
-        SANDBOX_LOG_ERROR("Lua function failed; %s\n", msg);
-    }
+    result = sandbox_lua_pcallverdict(L, nargs);
+    stacksize = 0;
+
+fail:
+    lua_pop(L, stacksize);
+    klua_unlock(K);
+    SANDBOX_LOG_TRACE_EXIT;
+    return (result);
+}
+
+/* Evaluates a function on a snapshot of a request's arguments, as
+ * sandbox_lua_veval() does on the request's own; the caller holds the
+ * snapshot's vnode, if any, locked.
+ */
+int
+sandbox_lua_evalsnapshot(klua_State *K, const struct sandbox_ref *funcref,
+        const struct sandbox_snapshot *snap)
+{
+    lua_State *L = NULL;
+    int result = KAUTH_RESULT_DENY;
+    int type = LUA_TNIL;
+    int stacksize = 0;
+    int nargs = 0;
+    int i = 0;
+    const struct sandbox_snaparg *arg = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    klua_lock(K);
+
+    L = K->L;
+
+    type = lua_rawgeti(L, LUA_REGISTRYINDEX, funcref->value); stacksize++;
+    if (type != LUA_TFUNCTION) {
+        SANDBOX_LOG_ERROR("expected a reference to a Lua function but got type=%s\n", 
+                lua_typename(L, type));
+        goto fail;
+    }
+
+    if (SANDBOX_LUA_WANTARG(funcref, nargs)) {
+        sandbox_lua_pushrule(L, &snap->rule); stacksize++; nargs++;
+    }
+    if (SANDBOX_LUA_WANTARG(funcref, nargs)) {
+        sandbox_lua_pushcred(L, snap->cred); stacksize++; nargs++;
+    }
+
+    for (i = 0; i < snap->nargs && SANDBOX_LUA_WANTARG(funcref, nargs); i++) {
+        arg = &snap->args[i];
+        switch (arg->type) {
+        case 'v':
+            sandbox_lua_pushvnode(L, arg->u.vp);
+            break;
+        case 'p':
+            sandbox_lua_pushprocinfo(L, arg->u.proc.pid, arg->u.proc.ppid,
+                    arg->u.proc.nice, arg->u.proc.comm);
+            break;
+        case 'i':
+            lua_pushinteger(L, arg->u.i);
+            break;
+        case 'o':
+            sandbox_lua_pushsocket(L, NULL);
+            break;
+        case 'a':
+            sandbox_lua_pushsockaddr(L, __UNCONST(&arg->u.sa));
+            break;
+        }
+        stacksize++;
+        nargs++;
+    }
+
+    result = sandbox_lua_pcallverdict(L, nargs);
+    stacksize = 0;
 
 fail:
     lua_pop(L, stacksize);
@@ -961,27 +2044,65 @@ fail:
     return (result);
 }
 
+/* sets sandbox.params to a table of the template parameters, which come
+ * packed as "name\0value\0..." (see struct sandbox_tmplspec)
+ */
+static void
+sandbox_lua_setparams(lua_State *L, const char *params, size_t len)
+{
+    const char *name = NULL;
+    const char *end = params + len;
+
+    lua_getglobal(L, "sandbox");
+    lua_newtable(L);
+    /* stack: -2=libtbl, -1=params */
+    while (params != NULL && params < end) {
+        name = params;
+        params += strlen(params) + 1;
+        KASSERT(params < end);
+        lua_pushstring(L, params);
+        lua_setfield(L, -2, name);
+        params += strlen(params) + 1;
+    }
+    lua_setfield(L, -2, "params");
+    lua_pop(L, 1);
+    /* stack: */
+}
+
+/* params are the template parameters, or NULL if the script is not a
+ * template
+ */
 int 
-sandbox_lua_load(klua_State *K, const char *script)
+sandbox_lua_load(klua_State *K, const char *script, const char *params,
+        size_t paramslen)
 {
     int error = 0;
     const char *msg = NULL;
     lua_State *L = K->L;
+    struct sandbox_bytecode_info info;
 
     SANDBOX_LOG_TRACE_ENTER;
 
     klua_lock(K);
 
-    error = luaL_loadstring(L, script);
+    sandbox_lua_setparams(L, params, paramslen);
+
+    error = sandbox_lua_compile(L, script, &info);
     if (error != LUA_OK) {
         /* stack: -1 = errmsg */
         msg = lua_tostring(L, -1);
-        SANDBOX_LOG_ERROR("luaL_loadstring() failed; %s\n", msg);
+        SANDBOX_LOG_ERROR("failed to load script; %s\n", msg);
         lua_pop(L, 1);
         error = error == LUA_ERRMEM ? ENOMEM : EINVAL;
         goto fail;
     }
     /* stack: -1 = chunk */
+    /* the chunk holds every function the script can define, so if none of
+     * them assigns to an upvalue, upvalues keep the values they have when
+     * the script finishes (see sandbox_lua_seal())
+     */
+    lua_pushboolean(L, !info.setupval);
+    lua_setfield(L, LUA_REGISTRYINDEX, SANDBOX_LUA_UPVALSFIXED);
     error = lua_pcall(L, 0, 0, 0);
     if (error != LUA_OK)  {
         /* stack: - 1 = errmsg */
@@ -998,6 +2119,624 @@ fail:
     return (error);
 }
 
+static bool sandbox_lua_libloadable(const char *name);
+
+struct sandbox_lua_sealctx {
+    struct sandbox *sandbox;
+    lua_State *L;
+    int upvalsfixed;
+    int ndemoted;
+    int ncombined;
+};
+
+static void
+sandbox_lua_demote(struct sandbox_rulenode *node, const char *rulename,
+        void *arg)
+{
+    int error = 0;
+    int value = 0;
+    struct sandbox_lua_sealctx *ctx = arg;
+    lua_State *L = ctx->L;
+    struct sandbox_ref *ref = NULL;
+    struct sandbox_ref *tmp = NULL;
+    struct sandbox_bytecode_info info;
+
+    if (!(node->type & SANDBOX_RULETYPE_FUNCTION))
+        return;
+
+    SIMPLEQ_FOREACH_SAFE(ref, &node->funclist, ref_next, tmp) {
+        if (ref->prog != NULL) {
+            if (sandbox_expr_constant(ref->prog, &value) != 0)
+                continue;
+            goto demote;
+        }
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ref->value);
+        /* stack: -1=func */
+        error = sandbox_lua_analyze(L, &info);
+        if (error == 0 && info.result == SANDBOX_BYTECODE_UPVAL &&
+                ctx->upvalsfixed &&
+                lua_getupvalue(L, -1, info.upidx) != NULL) {
+            /* stack: -2=func, -1=upvalue */
+            info.result = lua_toboolean(L, -1) ? SANDBOX_BYTECODE_TRUE :
+                SANDBOX_BYTECODE_FALSE;
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+        /* stack: */
+
+        if (error != 0 || (info.result != SANDBOX_BYTECODE_TRUE &&
+                    info.result != SANDBOX_BYTECODE_FALSE))
+            continue;
+
+        value = info.result == SANDBOX_BYTECODE_TRUE ?
+            KAUTH_RESULT_ALLOW : KAUTH_RESULT_DENY;
+        luaL_unref(L, LUA_REGISTRYINDEX, ref->value);
+
+demote:
+        SANDBOX_LOG_INFO("rule '%s': demoted constant function to %s\n",
+                rulename, value == KAUTH_RESULT_ALLOW ? "allow" : "deny");
+        sandbox_rulenode_demoteref(node, ref, value);
+        ctx->ndemoted++;
+    }
+}
+
+/* The dispatcher that sandbox_lua_combine() installs for a rule with several
+ * Lua functions.  Upvalue 1 is the dispatcher's sandbox_ref, whose members
+ * are the functions.  Each is called in turn with
+ * the dispatcher's arguments, and the first false result is returned without
+ * calling the rest.  An error propagates to the lua_pcall() in
+ * sandbox_lua_veval(), which denies, just as if the function had been called
+ * on its own.
+ *
+ * Each call is timed for the member's stats if anything reads them (see
+ * sandbox_refstats).  With SANDBOX_REORDER, the members are re-sorted
+ * every SANDBOX_REF_REORDER_PERIOD calls (see sandbox_ref_reorder()); the
+ * caller holds the sandbox's Lua lock, so that cannot race another
+ * evaluation.
+ */
+static int
+sandbox_lua_dispatch(lua_State *L)
+{
+    int nargs = 0;
+    int idx = 0;
+    int result = 0;
+    int counted = 0;
+    uint64_t start = 0;
+    struct sandbox *sandbox = NULL;
+    struct sandbox_ref *dispatcher = NULL;
+    struct sandbox_ref *ref = NULL;
+
+    sandbox = sandbox_lua_checksandbox(L);
+    dispatcher = lua_touserdata(L, lua_upvalueindex(1));
+
+    nargs = lua_gettop(L);
+    luaL_checkstack(L, nargs + 1, "too many arguments");
+
+    counted = (sandbox->flags & SANDBOX_REORDER) || sandbox_refstats;
+
+    if ((sandbox->flags & SANDBOX_REORDER) &&
+            ++dispatcher->nsincereorder >= SANDBOX_REF_REORDER_PERIOD) {
+        sandbox_ref_reorder(dispatcher);
+        dispatcher->nsincereorder = 0;
+    }
+    dispatcher->savednsecs += dispatcher->saving;
+
+    SIMPLEQ_FOREACH(ref, &dispatcher->members, ref_next) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ref->value);
+        /* stack: 1..nargs=args, -1=func */
+        for (idx = 1; idx <= nargs; idx++)
+            lua_pushvalue(L, idx);
+        if (counted)
+            start = sandbox_ref_clock();
+        lua_call(L, nargs, 1);
+        /* stack: 1..nargs=args, -1=result */
+        result = lua_toboolean(L, -1) ?
+            KAUTH_RESULT_ALLOW : KAUTH_RESULT_DENY;
+        if (counted)
+            sandbox_ref_record(ref, result, sandbox_ref_clock() - start);
+        if (result == KAUTH_RESULT_DENY) {
+            lua_pushboolean(L, 0);
+            return (1);
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_pushboolean(L, 1);
+    return (1);
+}
+
+/* Folds the Lua functions of a rule into one sandbox_lua_dispatch() closure,
+ * so that evaluating the rule takes the lock, marshals the arguments, and
+ * calls lua_pcall() once rather than once per function.  The functions move,
+ * in order, to the members of a new ref for the closure, which takes the
+ * place of the first one; compiled expressions and pure functions keep
+ * their own refs, the latter so that their verdicts can be cached.  Neither
+ * has side effects, so it does not matter that one registered between two
+ * Lua functions now runs after both.
+ */
+static void
+sandbox_lua_combine(struct sandbox_rulenode *node, const char *rulename,
+        void *arg)
+{
+    int n = 0;
+    struct sandbox_lua_sealctx *ctx = arg;
+    lua_State *L = ctx->L;
+    struct sandbox_ref *ref = NULL;
+    struct sandbox_ref *tmp = NULL;
+    struct sandbox_ref *dispatcher = NULL;
+    struct sandbox_ref_list funclist;
+
+    if (!(node->type & SANDBOX_RULETYPE_FUNCTION))
+        return;
+
+    SIMPLEQ_FOREACH(ref, &node->funclist, ref_next) {
+        if (ref->prog == NULL && ref->memo == NULL)
+            n++;
+    }
+    if (n < 2)
+        return;
+
+    dispatcher = sandbox_ref_create(LUA_NOREF);
+    dispatcher->nargs = 0;
+
+    funclist = node->funclist;
+    SIMPLEQ_INIT(&node->funclist);
+    n = 0;
+    SIMPLEQ_FOREACH_SAFE(ref, &funclist, ref_next, tmp) {
+        if (ref->prog != NULL || ref->memo != NULL) {
+            SIMPLEQ_INSERT_TAIL(&node->funclist, ref, ref_next);
+            continue;
+        }
+
+        if (n == 0)
+            SIMPLEQ_INSERT_TAIL(&node->funclist, dispatcher, ref_next);
+        ref->index = n++;
+        SIMPLEQ_INSERT_TAIL(&dispatcher->members, ref, ref_next);
+
+        /* the dispatcher passes on as many arguments as any function
+         * wants
+         */
+        if (dispatcher->nargs != SANDBOX_REF_NARGS_ALL &&
+                (ref->nargs == SANDBOX_REF_NARGS_ALL ||
+                 ref->nargs > dispatcher->nargs))
+            dispatcher->nargs = ref->nargs;
+    }
+
+    lua_pushlightuserdata(L, dispatcher);
+    lua_pushcclosure(L, sandbox_lua_dispatch, 1);
+    /* stack: -1=dispatcher */
+    dispatcher->value = luaL_ref(L, LUA_REGISTRYINDEX);
+    /* stack: */
+
+    SANDBOX_LOG_DEBUG("rule '%s': combined %d functions\n", rulename, n);
+    ctx->ncombined++;
+}
+
+/* Called once the script has run.  Functions whose result cannot depend on
+ * their arguments -- they return a constant, or an upvalue that nothing can
+ * reassign -- are replaced by the equivalent trilean rule, so that checking
+ * them no longer enters Lua.  Upvalues are fixed only if no function in the
+ * script assigns to one and neither the coroutine library nor the debug
+ * library, whose setupvalue() could, can be loaded.  The Lua functions that
+ * remain on each rule are then combined into one dispatcher (see
+ * sandbox_lua_combine()).
+ *
+ * Returns the number of functions demoted; each one is logged.
+ */
+int
+sandbox_lua_seal(struct sandbox *sandbox)
+{
+    struct sandbox_lua_sealctx ctx;
+    lua_State *L = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    klua_lock(sandbox->K);
+
+    L = sandbox->K->L;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.sandbox = sandbox;
+    ctx.L = L;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, SANDBOX_LUA_UPVALSFIXED);
+    ctx.upvalsfixed = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    /* a coroutine suspended inside a function still has that function's
+     * locals as open upvalues, and a plain store to the local changes them
+     * without any SETUPVAL
+     */
+    if (sandbox_lua_libloadable(LUA_COLIBNAME))
+        ctx.upvalsfixed = 0;
+    /* nor can debug.setupvalue() be ruled out once the script has run,
+     * since a function can still open the library on first use
+     */
+    if (sandbox_lua_libloadable(LUA_DBLIBNAME))
+        ctx.upvalsfixed = 0;
+
+    sandbox_ruleset_foreach(sandbox->ruleset, sandbox_lua_demote, &ctx);
+    sandbox_ruleset_foreach(sandbox->ruleset, sandbox_lua_combine, &ctx);
+    SANDBOX_LOG_DEBUG("demoted %d functions; combined functions on %d rules\n",
+            ctx.ndemoted, ctx.ncombined);
+
+    klua_unlock(sandbox->K);
+
+    SANDBOX_LOG_TRACE_EXIT;
+    return (ctx.ndemoted);
+}
+
+/*
+ * Library profiles
+ *
+ * Policies mostly need the sandbox library and string handling, so a state
+ * opens only the libraries in sandbox_lua_minlibs.  Those in
+ * sandbox_lua_optlibs are opened when a script first reads their global,
+ * unless the sandbox has SANDBOX_FULLLIBS, in which case they are opened
+ * when the sandbox takes the state.
+ */
+
+/* load() with the mode always "t": a binary chunk is bytecode that is
+ * never verified, so a script may only load source; upvalue 1 is the base
+ * library's load()
+ */
+static int
+sandbox_lua_loadsource(lua_State *L)
+{
+    bool hasenv = !lua_isnone(L, 4);
+
+    /* the base load() sets the environment only if a fourth argument is
+     * there at all, even a nil one
+     */
+    lua_settop(L, 4);
+    lua_pushliteral(L, "t");
+    lua_replace(L, 3);
+    if (!hasenv)
+        lua_settop(L, 3);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+
+    return (lua_gettop(L));
+}
+
+/* the base library, with load() confined to source chunks */
+static int
+sandbox_lua_openbase(lua_State *L)
+{
+    luaopen_base(L);
+    /* stack: -1=_G */
+    lua_getfield(L, -1, "load");
+    /* stack: -2=_G, -1=load */
+    lua_pushcclosure(L, sandbox_lua_loadsource, 1);
+    /* stack: -2=_G, -1=sandbox_lua_loadsource */
+    lua_setfield(L, -2, "load");
+    /* stack: -1=_G */
+
+    return (1);
+}
+
+static const luaL_Reg sandbox_lua_minlibs[] = {
+    {"_G", sandbox_lua_openbase},
+    {LUA_STRLIBNAME, luaopen_string},
+    {LUA_TABLIBNAME, luaopen_table},
+    {NULL, NULL}    /* sentinel */
+};
+
+static const luaL_Reg sandbox_lua_optlibs[] = {
+    {LUA_COLIBNAME, luaopen_coroutine},
+    {LUA_UTF8LIBNAME, luaopen_utf8},
+    {NULL, NULL}    /* sentinel */
+};
+
+/* whether a script can open the library called name */
+static bool
+sandbox_lua_libloadable(const char *name)
+{
+    const luaL_Reg *lib = NULL;
+
+    for (lib = sandbox_lua_minlibs; lib->name != NULL; lib++) {
+        if (strcmp(lib->name, name) == 0)
+            return (true);
+    }
+    for (lib = sandbox_lua_optlibs; lib->name != NULL; lib++) {
+        if (strcmp(lib->name, name) == 0)
+            return (true);
+    }
+
+    return (false);
+}
+
+/* a script's leading lines of the form "--! pragma" */
+#define SANDBOX_LUA_PRAGMA  "--!"
+
+static const struct {
+    const char *pragma;
+    int set;
+    int clear;
+} sandbox_lua_pragmatab[] = {
+    {"libs=full", SANDBOX_FULLLIBS, 0},
+    {"libs=minimal", 0, SANDBOX_FULLLIBS},
+    {"mode=permissive", SANDBOX_PERMISSIVE, 0},
+    {"mode=enforcing", 0, SANDBOX_PERMISSIVE},
+    {NULL, 0, 0}    /* sentinel */
+};
+
+/* returns the sandbox flags with those set or cleared by the script's
+ * pragmas applied; unknown pragmas are ignored
+ */
+int
+sandbox_lua_pragmas(const char *script, int flags)
+{
+    const char *s = script;
+    const char *eol = NULL;
+    size_t len = 0;
+    int i = 0;
+
+    while (strncmp(s, SANDBOX_LUA_PRAGMA, strlen(SANDBOX_LUA_PRAGMA)) == 0) {
+        s += strlen(SANDBOX_LUA_PRAGMA);
+        while (*s == ' ' || *s == '\t')
+            s++;
+        eol = strchr(s, '\n');
+        len = eol != NULL ? (size_t)(eol - s) : strlen(s);
+        while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t' ||
+                    s[len - 1] == '\r'))
+            len--;
+
+        for (i = 0; sandbox_lua_pragmatab[i].pragma != NULL; i++) {
+            if (strlen(sandbox_lua_pragmatab[i].pragma) == len &&
+                    strncmp(s, sandbox_lua_pragmatab[i].pragma, len) == 0) {
+                flags |= sandbox_lua_pragmatab[i].set;
+                flags &= ~sandbox_lua_pragmatab[i].clear;
+                break;
+            }
+        }
+        if (sandbox_lua_pragmatab[i].pragma == NULL)
+            SANDBOX_LOG_WARN("unknown pragma '%.*s'\n", (int)len, s);
+
+        if (eol == NULL)
+            break;
+        s = eol + 1;
+    }
+
+    return (flags);
+}
+
+static void
+sandbox_lua_openlibs(lua_State *L, const luaL_Reg *libs)
+{
+    const luaL_Reg *lib = NULL;
+
+    for (lib = libs; lib->func != NULL; lib++) {
+        luaL_requiref(L, lib->name, lib->func, 1);
+        lua_pop(L, 1);
+    }
+}
+
+/* __index of the global table of a state with deferred libraries; upvalue
+ * 1 maps the name of each library not yet opened to its open function
+ */
+static int
+sandbox_lua_libindex(lua_State *L)
+{
+    lua_CFunction openf = NULL;
+
+    /* stack: 1=globals, 2=key */
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    /* stack: 1=globals, 2=key, 3=openf or nil */
+    openf = lua_tocfunction(L, 3);
+    if (openf == NULL)
+        return (1);
+
+    /* forget the library, so that a script that assigns nil to its global
+     * does not get it back
+     */
+    lua_pushvalue(L, 2);
+    lua_pushnil(L);
+    lua_rawset(L, lua_upvalueindex(1));
+    luaL_requiref(L, lua_tostring(L, 2), openf, 1);
+    /* stack: 1=globals, 2=key, 3=openf, 4=lib */
+    return (1);
+}
+
+static void
+sandbox_lua_deferlibs(lua_State *L, const luaL_Reg *libs)
+{
+    const luaL_Reg *lib = NULL;
+
+    lua_pushglobaltable(L);
+    lua_createtable(L, 0, 1);
+    lua_newtable(L);
+    /* stack: -3=globals, -2=mt, -1=libs */
+    for (lib = libs; lib->func != NULL; lib++) {
+        lua_pushcfunction(L, lib->func);
+        lua_setfield(L, -2, lib->name);
+    }
+    lua_pushcclosure(L, sandbox_lua_libindex, 1);
+    /* stack: -3=globals, -2=mt, -1=libindex */
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
+    /* stack: */
+}
+
+/*
+ * State pool
+ *
+ * Creating a state and opening the standard libraries is a large part of
+ * the cost of attaching a sandbox, and closing it of destroying one.  So
+ * released states are reset and kept, up to SANDBOX_LUA_POOLSIZE of them,
+ * for later sandboxes.  A reset state is a little larger than a fresh one,
+ * since Lua never shrinks the registry's hash part once the script has
+ * grown it, but much more than that is something of the old script's that
+ * survived the reset, such as an object whose finalizer re-arms itself, and
+ * the state is closed instead of being handed to another sandbox.
+ */
+
+#define SANDBOX_LUA_POOLSIZE    16
+#define SANDBOX_LUA_POOLPREFILL 4
+
+/* how many times a fresh state's heap a reset one may use */
+#define SANDBOX_LUA_POOLSLACK   2
+
+/* how many times a reset retries clearing the registry, since finalizers
+ * that run during the collection may write to it
+ */
+#define SANDBOX_LUA_MAXCLEARS   4
+
+/* the garbage collector's default pause and step multiplier */
+#define SANDBOX_LUA_GCPAUSE     200
+#define SANDBOX_LUA_GCSTEPMUL   200
+
+static struct {
+    kmutex_t lock;
+    int nstates;
+    klua_State *states[SANDBOX_LUA_POOLSIZE];
+    int basebytes;      /* the heap size of a fresh state */
+    uint64_t nhits;
+    uint64_t nmisses;
+} sandbox_lua_pool;
+
+static klua_State *
+sandbox_lua_createstate(void)
+{
+    klua_State *K = NULL;
+
+    K = kluaL_newstate("sandbox", "sandbox", IPL_NONE);
+    sandbox_lua_openlibs(K->L, sandbox_lua_minlibs);
+    lua_gc(K->L, LUA_GCCOLLECT, 0);
+
+    return (K);
+}
+
+/* the number of bytes the state's heap is using */
+static int
+sandbox_lua_gcbytes(lua_State *L)
+{
+    return (lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0));
+}
+
+/* removes every registry entry but the main thread; returns the number of
+ * entries that were removed
+ */
+static int
+sandbox_lua_clearregistry(lua_State *L)
+{
+    int n = 0;
+
+    lua_pushnil(L);
+    /* stack: -1=key */
+    while (lua_next(L, LUA_REGISTRYINDEX) != 0) {
+        /* stack: -2=key, -1=value */
+        lua_pop(L, 1);
+        /* stack: -1=key */
+        if (lua_isinteger(L, -1) &&
+                lua_tointeger(L, -1) == LUA_RIDX_MAINTHREAD)
+            continue;
+        /* clearing a field during a traversal is allowed */
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+        n++;
+    }
+    /* stack: */
+
+    return (n);
+}
+
+/* Returns a used state to the condition of one fresh from
+ * sandbox_lua_createstate(): the script's globals, registry entries,
+ * metatables and hooks are dropped, the garbage they leave is collected,
+ * and the minimal libraries are opened again in a new global table.  Run
+ * with lua_pcall(), since finalizers run by the collection may raise
+ * errors.
+ */
+static int
+sandbox_lua_resetstate(lua_State *L)
+{
+    int i = 0;
+
+    lua_sethook(L, NULL, 0, 0);
+
+    for (i = 0; i < SANDBOX_LUA_MAXCLEARS; i++) {
+        if (sandbox_lua_clearregistry(L) == 0 && i > 0)
+            break;
+        lua_gc(L, LUA_GCCOLLECT, 0);
+    }
+    if (i == SANDBOX_LUA_MAXCLEARS)
+        return luaL_error(L, "registry not cleared");
+
+    /* the metatables shared by all values of a basic type; strings get
+     * theirs back from the string library
+     */
+    lua_pushnil(L);
+    lua_pushboolean(L, 0);
+    lua_pushlightuserdata(L, NULL);
+    lua_pushinteger(L, 0);
+    lua_pushliteral(L, "");
+    lua_pushcfunction(L, sandbox_lua_resetstate);
+    lua_pushthread(L);
+    /* stack: 1..7=values */
+    for (i = 1; i <= 7; i++) {
+        lua_pushnil(L);
+        lua_setmetatable(L, i);
+    }
+    lua_settop(L, 0);
+    /* stack: */
+
+    lua_newtable(L);
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    sandbox_lua_openlibs(L, sandbox_lua_minlibs);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    lua_gc(L, LUA_GCRESTART, 0);
+    lua_gc(L, LUA_GCSETPAUSE, SANDBOX_LUA_GCPAUSE);
+    lua_gc(L, LUA_GCSETSTEPMUL, SANDBOX_LUA_GCSTEPMUL);
+
+    return (0);
+}
+
+void
+sandbox_lua_init(void)
+{
+    klua_State *K = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    mutex_init(&sandbox_lua_pool.lock, MUTEX_DEFAULT, IPL_NONE);
+    while (sandbox_lua_pool.nstates < SANDBOX_LUA_POOLPREFILL) {
+        K = sandbox_lua_createstate();
+        sandbox_lua_pool.states[sandbox_lua_pool.nstates++] = K;
+    }
+    sandbox_lua_pool.basebytes = sandbox_lua_gcbytes(K->L);
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+void
+sandbox_lua_fini(void)
+{
+    SANDBOX_LOG_TRACE_ENTER;
+
+    while (sandbox_lua_pool.nstates > 0)
+        klua_close(sandbox_lua_pool.states[--sandbox_lua_pool.nstates]);
+    mutex_destroy(&sandbox_lua_pool.lock);
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+void
+sandbox_lua_poolstats(uint64_t *nhits, uint64_t *nmisses)
+{
+    mutex_enter(&sandbox_lua_pool.lock);
+    *nhits = sandbox_lua_pool.nhits;
+    *nmisses = sandbox_lua_pool.nmisses;
+    mutex_exit(&sandbox_lua_pool.lock);
+}
+
+/* gives the sandbox a state, from the pool if there is one, with its
+ * library profile and the sandbox library installed
+ */
 void
 sandbox_lua_newstate(struct sandbox *sandbox)
 {
@@ -1005,10 +2744,76 @@ sandbox_lua_newstate(struct sandbox *sandbox)
 
     SANDBOX_LOG_TRACE_ENTER;
 
-    K = kluaL_newstate("sandbox", "sandbox", IPL_NONE);
-    luaL_openlibs(K->L);
+    mutex_enter(&sandbox_lua_pool.lock);
+    if (sandbox_lua_pool.nstates > 0) {
+        K = sandbox_lua_pool.states[--sandbox_lua_pool.nstates];
+        sandbox_lua_pool.nhits++;
+    } else {
+        sandbox_lua_pool.nmisses++;
+    }
+    mutex_exit(&sandbox_lua_pool.lock);
+
+    if (K == NULL)
+        K = sandbox_lua_createstate();
     sandbox->K = K;
+    if (sandbox->flags & SANDBOX_FULLLIBS)
+        sandbox_lua_openlibs(K->L, sandbox_lua_optlibs);
+    else
+        sandbox_lua_deferlibs(K->L, sandbox_lua_optlibs);
     sandbox_lua_open(sandbox);
 
     SANDBOX_LOG_TRACE_EXIT;
 }
+
+/* takes the sandbox's state and either resets it into the pool or, if the
+ * pool is full or the reset fails or leaves much more than a fresh state
+ * has, closes it
+ */
+void
+sandbox_lua_closestate(struct sandbox *sandbox)
+{
+    int error = 0;
+    klua_State *K = sandbox->K;
+    lua_State *L = K->L;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    sandbox->K = NULL;
+
+    mutex_enter(&sandbox_lua_pool.lock);
+    error = sandbox_lua_pool.nstates == SANDBOX_LUA_POOLSIZE;
+    mutex_exit(&sandbox_lua_pool.lock);
+    if (error)
+        goto fail;
+
+    klua_lock(K);
+    lua_settop(L, 0);
+    lua_pushcfunction(L, sandbox_lua_resetstate);
+    error = lua_pcall(L, 0, 0, 0);
+    if (error != LUA_OK) {
+        SANDBOX_LOG_WARN("failed to reset Lua state: %s\n",
+                lua_tostring(L, -1));
+        lua_settop(L, 0);
+    } else if (sandbox_lua_gcbytes(L) >
+            SANDBOX_LUA_POOLSLACK * sandbox_lua_pool.basebytes) {
+        SANDBOX_LOG_INFO("Lua state holds %d bytes after reset, "
+                "a fresh one %d; closing it\n", sandbox_lua_gcbytes(L),
+                sandbox_lua_pool.basebytes);
+        error = LUA_ERRRUN;
+    }
+    klua_unlock(K);
+    if (error != LUA_OK)
+        goto fail;
+
+    mutex_enter(&sandbox_lua_pool.lock);
+    if (sandbox_lua_pool.nstates < SANDBOX_LUA_POOLSIZE) {
+        sandbox_lua_pool.states[sandbox_lua_pool.nstates++] = K;
+        K = NULL;
+    }
+    mutex_exit(&sandbox_lua_pool.lock);
+
+fail:
+    if (K != NULL)
+        klua_close(K);
+    SANDBOX_LOG_TRACE_EXIT;
+}
@@ -36,13 +36,29 @@
 #include <sys/lua.h>
 
 #include "sandbox.h"
+#include "sandbox_ref.h"
 #include "sandbox_rule.h"
 
-int sandbox_lua_load(klua_State *K, const char *script);
+int sandbox_lua_load(klua_State *K, const char *script,
+        const char *params, size_t paramslen);
 
-int sandbox_lua_veval(klua_State *K, int funcref, kauth_cred_t cred, 
-        const struct sandbox_rule *rule, const char *fmt, va_list ap);
+int sandbox_lua_seal(struct sandbox *sandbox);
+
+int sandbox_lua_veval(klua_State *K, const struct sandbox_ref *funcref,
+        kauth_cred_t cred, const struct sandbox_rule *rule, const char *fmt,
+        va_list ap);
+
+struct sandbox_snapshot;
+int sandbox_lua_evalsnapshot(klua_State *K, const struct sandbox_ref *funcref,
+        const struct sandbox_snapshot *snap);
+
+void sandbox_lua_init(void);
+void sandbox_lua_fini(void);
+void sandbox_lua_poolstats(uint64_t *nhits, uint64_t *nmisses);
+
+int sandbox_lua_pragmas(const char *script, int flags);
 
 void sandbox_lua_newstate(struct sandbox *sandbox);
+void sandbox_lua_closestate(struct sandbox *sandbox);
 
 #endif /* !_SANDBOX_LUA_H_ */
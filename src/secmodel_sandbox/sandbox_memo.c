@@ -0,0 +1,203 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/systm.h>
+#include <sys/kmem.h>
+#include <sys/mutex.h>
+#include <sys/kauth.h>
+
+#include "sandbox_memo.h"
+#include "sandbox_pred.h"
+
+#include "sandbox_log.h"
+
+#define SANDBOX_MEMO_FNV_OFFSET 0xcbf29ce484222325ULL
+#define SANDBOX_MEMO_FNV_PRIME  0x100000001b3ULL
+
+/* size is rounded up to a power of two no greater than
+ * SANDBOX_MEMO_MAXSIZE; ttl is in nsecs
+ */
+struct sandbox_memo *
+sandbox_memo_create(u_int size, uint64_t ttl)
+{
+    u_int n = 1;
+    struct sandbox_memo *memo = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    if (size == 0)
+        size = SANDBOX_MEMO_DEFSIZE;
+    if (size > SANDBOX_MEMO_MAXSIZE)
+        size = SANDBOX_MEMO_MAXSIZE;
+    while (n < size)
+        n <<= 1;
+
+    memo = kmem_zalloc(sizeof(*memo), KM_SLEEP);
+    mutex_init(&memo->lock, MUTEX_DEFAULT, IPL_NONE);
+    memo->ttl = ttl;
+    memo->size = n;
+    memo->entries = kmem_zalloc(n * sizeof(*memo->entries), KM_SLEEP);
+
+    SANDBOX_LOG_TRACE_EXIT;
+    return (memo);
+}
+
+/* returns 0 on success, or 1 if the memo already has the maximum number of
+ * keys
+ */
+int
+sandbox_memo_addkey(struct sandbox_memo *memo,
+        const struct sandbox_pred_operand *key)
+{
+    if (memo->nkeys == SANDBOX_MEMO_MAXKEYS)
+        return (1);
+
+    memo->keys[memo->nkeys++] = *key;
+    return (0);
+}
+
+void
+sandbox_memo_destroy(struct sandbox_memo *memo)
+{
+    SANDBOX_LOG_TRACE_ENTER;
+
+    mutex_destroy(&memo->lock);
+    kmem_free(memo->entries, memo->size * sizeof(*memo->entries));
+    kmem_free(memo, sizeof(*memo));
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+/* Fills keys with the request's values of the memo's key fields.  Returns
+ * 0 on success, or 1 if the request lacks one of them (say, an argument
+ * that is not an integer), in which case the verdict cannot be cached.
+ */
+int
+sandbox_memo_getkeys(const struct sandbox_memo *memo, kauth_cred_t cred,
+        const struct sandbox_pred_args *args, int64_t *keys)
+{
+    int i = 0;
+
+    for (i = 0; i < memo->nkeys; i++) {
+        if (sandbox_pred_operand_get(&memo->keys[i], cred, args, &keys[i]))
+            return (1);
+    }
+
+    return (0);
+}
+
+static u_int
+sandbox_memo_hash(const struct sandbox_memo *memo, const int64_t *keys)
+{
+    int i = 0;
+    int b = 0;
+    uint64_t h = SANDBOX_MEMO_FNV_OFFSET;
+    uint64_t k = 0;
+
+    for (i = 0; i < memo->nkeys; i++) {
+        k = (uint64_t)keys[i];
+        for (b = 0; b < 8; b++) {
+            h ^= (k >> (b * 8)) & 0xff;
+            h *= SANDBOX_MEMO_FNV_PRIME;
+        }
+    }
+
+    return ((u_int)(h ^ (h >> 32)) & (memo->size - 1));
+}
+
+static bool
+sandbox_memo_live(const struct sandbox_memo *memo,
+        const struct sandbox_memo_entry *entry, uint64_t gen, uint64_t now)
+{
+    return (entry->gen == gen && (entry->expires == 0 || now < entry->expires));
+}
+
+/* returns 0 and sets *result on a hit, or 1 on a miss */
+int
+sandbox_memo_lookup(struct sandbox_memo *memo, uint64_t gen, uint64_t now,
+        const int64_t *keys, int *result)
+{
+    int error = 1;
+    u_int i = 0;
+    u_int slot = 0;
+    struct sandbox_memo_entry *entry = NULL;
+
+    slot = sandbox_memo_hash(memo, keys);
+
+    mutex_enter(&memo->lock);
+    for (i = 0; i < SANDBOX_MEMO_NPROBES && i < memo->size; i++) {
+        entry = &memo->entries[(slot + i) & (memo->size - 1)];
+        if (sandbox_memo_live(memo, entry, gen, now) &&
+                memcmp(entry->keys, keys, memo->nkeys * sizeof(*keys)) == 0) {
+            *result = entry->result;
+            error = 0;
+            break;
+        }
+    }
+    if (error == 0)
+        memo->nhits++;
+    else
+        memo->nmisses++;
+    mutex_exit(&memo->lock);
+
+    return (error);
+}
+
+/* Records a verdict in the first free, stale, or expired slot among the
+ * probe slots for keys, or failing that, in the first probe slot.
+ */
+void
+sandbox_memo_insert(struct sandbox_memo *memo, uint64_t gen, uint64_t now,
+        const int64_t *keys, int result)
+{
+    u_int i = 0;
+    u_int slot = 0;
+    struct sandbox_memo_entry *entry = NULL;
+    struct sandbox_memo_entry *victim = NULL;
+
+    slot = sandbox_memo_hash(memo, keys);
+
+    mutex_enter(&memo->lock);
+    for (i = 0; i < SANDBOX_MEMO_NPROBES && i < memo->size; i++) {
+        entry = &memo->entries[(slot + i) & (memo->size - 1)];
+        if (!sandbox_memo_live(memo, entry, gen, now)) {
+            victim = entry;
+            break;
+        }
+    }
+    if (victim == NULL)
+        victim = &memo->entries[slot];
+
+    victim->gen = gen;
+    victim->expires = memo->ttl == 0 ? 0 : now + memo->ttl;
+    memset(victim->keys, 0, sizeof(victim->keys));
+    memcpy(victim->keys, keys, memo->nkeys * sizeof(*keys));
+    victim->result = result;
+    mutex_exit(&memo->lock);
+}
@@ -0,0 +1,89 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SANDBOX_MEMO_H_
+#define _SANDBOX_MEMO_H_
+
+#include <sys/types.h>
+#include <sys/mutex.h>
+#include <sys/kauth.h>
+
+#include "sandbox_pred.h"
+
+/* A memo caches the verdicts of a function declared pure with
+ * sandbox.on(rule, fn, {pure=true, key={...}}).  Verdicts are keyed by the
+ * values of the key fields, which are sandbox_pred operands, so only
+ * integer arguments and cred and proc fields can be part of a key.  The
+ * table holds a fixed number of entries; a new verdict evicts an old one
+ * when its few probe slots are full.
+ *
+ * Each entry records the sandbox's generation when it was made, and is
+ * ignored once the generation moves on (see sandbox.invalidate()).
+ */
+
+#define SANDBOX_MEMO_MAXKEYS    4
+#define SANDBOX_MEMO_DEFSIZE    64
+#define SANDBOX_MEMO_MAXSIZE    4096
+#define SANDBOX_MEMO_NPROBES    4
+
+struct sandbox_memo_entry {
+    uint64_t gen;       /* 0 if the entry is empty */
+    uint64_t expires;   /* in nsecs since boot, or 0 for never */
+    int64_t keys[SANDBOX_MEMO_MAXKEYS];
+    int result;
+};
+
+struct sandbox_memo {
+    kmutex_t lock;
+    int nkeys;
+    struct sandbox_pred_operand keys[SANDBOX_MEMO_MAXKEYS];
+    uint64_t ttl;       /* in nsecs; 0 means entries never expire */
+    u_int size;         /* a power of two */
+    struct sandbox_memo_entry *entries;
+    uint64_t nhits;
+    uint64_t nmisses;
+};
+
+struct sandbox_memo * sandbox_memo_create(u_int size, uint64_t ttl);
+
+int sandbox_memo_addkey(struct sandbox_memo *memo,
+        const struct sandbox_pred_operand *key);
+
+void sandbox_memo_destroy(struct sandbox_memo *memo);
+
+int sandbox_memo_getkeys(const struct sandbox_memo *memo, kauth_cred_t cred,
+        const struct sandbox_pred_args *args, int64_t *keys);
+
+int sandbox_memo_lookup(struct sandbox_memo *memo, uint64_t gen,
+        uint64_t now, const int64_t *keys, int *result);
+
+void sandbox_memo_insert(struct sandbox_memo *memo, uint64_t gen,
+        uint64_t now, const int64_t *keys, int result);
+
+#endif /* !_SANDBOX_MEMO_H_ */
@@ -0,0 +1,141 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/systm.h>
+#include <sys/pool.h>
+#include <sys/atomic.h>
+
+#include "sandbox.h"
+#include "sandbox_objcache.h"
+#include "sandbox_path.h"
+#include "sandbox_ref.h"
+#include "sandbox_ruleset.h"
+
+#include "sandbox_log.h"
+
+static const struct {
+    const char *name;
+    size_t size;
+} sandbox_objcache_types[SANDBOX_OBJCACHE_NTYPES] = {
+    [SANDBOX_OBJCACHE_LIST] = {"sandboxlist", sizeof(struct sandbox_list)},
+    [SANDBOX_OBJCACHE_SANDBOX] = {"sandbox", sizeof(struct sandbox)},
+    [SANDBOX_OBJCACHE_RULESET] = {"sandboxrules",
+        sizeof(struct sandbox_ruleset)},
+    [SANDBOX_OBJCACHE_PATH] = {"sandboxpath", sizeof(struct sandbox_path)},
+    [SANDBOX_OBJCACHE_REF] = {"sandboxref", sizeof(struct sandbox_ref)},
+};
+
+static struct {
+    pool_cache_t cache;
+    struct sandbox_objcache_stats stats;
+} sandbox_objcaches[SANDBOX_OBJCACHE_NTYPES];
+
+void
+sandbox_objcache_init(void)
+{
+    int i = 0;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    for (i = 0; i < SANDBOX_OBJCACHE_NTYPES; i++) {
+        sandbox_objcaches[i].cache = pool_cache_init(
+                sandbox_objcache_types[i].size, 0, 0, 0,
+                sandbox_objcache_types[i].name, NULL, IPL_NONE,
+                NULL, NULL, NULL);
+        memset(&sandbox_objcaches[i].stats, 0,
+                sizeof(sandbox_objcaches[i].stats));
+    }
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+/* every object must have been put back by now */
+void
+sandbox_objcache_fini(void)
+{
+    int i = 0;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    for (i = 0; i < SANDBOX_OBJCACHE_NTYPES; i++) {
+        pool_cache_destroy(sandbox_objcaches[i].cache);
+        sandbox_objcaches[i].cache = NULL;
+    }
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+void *
+sandbox_objcache_get(int type)
+{
+    void *obj = NULL;
+
+    KASSERT(type >= 0 && type < SANDBOX_OBJCACHE_NTYPES);
+
+    obj = pool_cache_get(sandbox_objcaches[type].cache, PR_WAITOK);
+    memset(obj, 0, sandbox_objcache_types[type].size);
+    atomic_inc_64(&sandbox_objcaches[type].stats.nallocs);
+
+    return (obj);
+}
+
+void
+sandbox_objcache_put(int type, void *obj)
+{
+    KASSERT(type >= 0 && type < SANDBOX_OBJCACHE_NTYPES);
+
+    pool_cache_put(sandbox_objcaches[type].cache, obj);
+    atomic_inc_64(&sandbox_objcaches[type].stats.nfrees);
+}
+
+void
+sandbox_objcache_stats(
+        struct sandbox_objcache_stats stats[SANDBOX_OBJCACHE_NTYPES])
+{
+    int i = 0;
+
+    for (i = 0; i < SANDBOX_OBJCACHE_NTYPES; i++)
+        stats[i] = sandbox_objcaches[i].stats;
+}
+
+/* true if any object has not been put back */
+int
+sandbox_objcache_busy(void)
+{
+    int i = 0;
+    struct sandbox_objcache_stats stats[SANDBOX_OBJCACHE_NTYPES];
+
+    sandbox_objcache_stats(stats);
+    for (i = 0; i < SANDBOX_OBJCACHE_NTYPES; i++) {
+        if (stats[i].nallocs != stats[i].nfrees)
+            return (1);
+    }
+
+    return (0);
+}
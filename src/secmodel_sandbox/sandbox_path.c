@@ -47,6 +47,7 @@
 
 #include <ufs/ufs/dir.h>    /* XXX only for DIRBLKSIZ */
 
+#include "sandbox_objcache.h"
 #include "sandbox_path.h"
 
 #include "sandbox_log.h"
@@ -61,7 +62,7 @@ sandbox_path_create(const char *path, bool resolve)
 
     KASSERT(path != NULL);
 
-    sp = kmem_zalloc(sizeof(*sp), KM_SLEEP);
+    sp = sandbox_objcache_get(SANDBOX_OBJCACHE_PATH);
     sp->refcnt = 1;
     /* TODO: check for overflow */
     memcpy(sp->path, path, strlen(path)); 
@@ -115,7 +116,7 @@ sandbox_path_destroy(struct sandbox_path *sp)
     SANDBOX_LOG_DEBUG("destroying sandbox_path\n");
     if (sp->vp != NULL)
         holdrele(sp->vp);
-    kmem_free(sp, sizeof(*sp));
+    sandbox_objcache_put(SANDBOX_OBJCACHE_PATH, sp);
 
 done:
     SANDBOX_LOG_TRACE_EXIT;
@@ -0,0 +1,100 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SANDBOX_PERMISSIVE_H_
+#define _SANDBOX_PERMISSIVE_H_
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/kauth.h>
+#include <sys/socket.h>
+#include <sys/vnode.h>
+#include <sys/workqueue.h>
+
+#include "sandbox_pred.h"
+#include "sandbox_ref.h"
+#include "sandbox_rule.h"
+#include "sandbox_ruleset.h"
+
+struct sandbox;
+
+/* A sandbox with SANDBOX_PERMISSIVE decides each request by its native
+ * rules alone, and its Lua functions only audit: the request's arguments
+ * are copied into a snapshot, which a workqueue thread later runs the
+ * functions on, recording the requests they would have denied.  The
+ * request never waits on Lua; if too many snapshots are queued, it drops
+ * its own.
+ */
+
+#define SANDBOX_PERMISSIVE_MAXQUEUE 1024
+
+/* one argument of a request, as its format character says */
+struct sandbox_snaparg {
+    int type;
+    union {
+        struct vnode *vp;               /* 'v', referenced; named from
+                                           the system root, not the
+                                           process's */
+        struct {
+            pid_t pid;
+            pid_t ppid;
+            int nice;
+            char comm[MAXCOMLEN + 1];
+        } proc;                         /* 'p' */
+        int64_t i;                      /* 'i' */
+        struct sockaddr_storage sa;     /* 'a'; zeroed past sa_len */
+    } u;
+};
+
+struct sandbox_snapshot {
+    struct work work;
+    struct sandbox *sandbox;    /* the version, held, and counted in its
+                                   nevals */
+    const struct sandbox_rulenode *node;
+    kauth_cred_t cred;          /* held */
+    pid_t pid;
+    lwpid_t lid;
+    struct sandbox_rule rule;   /* names point into buf */
+    char buf[SANDBOX_RULE_MAXNAMES][SANDBOX_RULE_MAXNAMELEN];
+    int nargs;
+    struct sandbox_snaparg args[SANDBOX_PRED_MAXARGS];
+};
+
+void sandbox_permissive_init(void);
+
+void sandbox_permissive_fini(void);
+
+void sandbox_permissive_enqueue(struct sandbox *sandbox,
+        const struct sandbox_rulenode *node, kauth_cred_t cred,
+        const struct sandbox_rule *rule, const char *fmt, va_list ap);
+
+void sandbox_permissive_stats(uint64_t *queued, uint64_t *dropped,
+        uint64_t *denies);
+
+#endif /* !_SANDBOX_PERMISSIVE_H_ */
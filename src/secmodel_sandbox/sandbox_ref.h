@@ -30,19 +30,65 @@
 #ifndef _SANDBOX_REF_H_
 #define _SANDBOX_REF_H_
 
+#include <sys/types.h>
 #include <sys/queue.h>
 
+#include "sandbox_expr.h"
+#include "sandbox_memo.h"
+
+/* nargs value for a function whose arity is unknown or that is variadic;
+ * such functions are passed every argument
+ */
+#define SANDBOX_REF_NARGS_ALL   (-1)
+
+/* sandbox_ref flags */
+#define SANDBOX_REF_UNORDERED   (1 << 0)    /* may run before functions that
+                                               were registered earlier */
+
+/* a dispatcher is reordered every this many evaluations */
+#define SANDBOX_REF_REORDER_PERIOD  256
+
+/* struct sandbox_ref_list { }; */
+SIMPLEQ_HEAD(sandbox_ref_list, sandbox_ref);
+
+struct sandbox_ref_stats {
+    uint64_t nevals;
+    uint64_t ndenies;
+    uint64_t nsecs;         /* total time spent evaluating */
+};
+
 struct sandbox_ref {
     int value;
+    int nargs;      /* number of arguments the function declares */
+    int flags;
+    int index;      /* position in the rule's function list at registration */
+    struct sandbox_expr *prog;  /* if non-NULL, run instead of the function */
+    struct sandbox_memo *memo;  /* if non-NULL, the function is pure */
+    struct sandbox_ref_stats stats;
+
+    /* for a dispatcher that runs several functions (see sandbox_lua.c) */
+    struct sandbox_ref_list members;
+    u_int nsincereorder;
+    uint64_t saving;        /* estimated nsecs per evaluation that the
+                               current order saves over the original */
+    uint64_t savednsecs;    /* sum of saving over all evaluations */
+
     SIMPLEQ_ENTRY(sandbox_ref) ref_next;
 };
 
-/* struct sandbox_ref_list { }; */
-SIMPLEQ_HEAD(sandbox_ref_list, sandbox_ref);
-
 struct sandbox_ref * sandbox_ref_create(int value);
 void sandbox_ref_destroy(struct sandbox_ref *ref);
 
+/* Nonzero while every evaluation is timed and counted, for
+ * SANDBOX_IOC_STATS; otherwise only the sandboxes with SANDBOX_REORDER,
+ * whose dispatchers sort by the counts, pay for them.
+ */
+extern int sandbox_refstats;
+
+uint64_t sandbox_ref_clock(void);
+void sandbox_ref_record(struct sandbox_ref *ref, int result, uint64_t nsecs);
+void sandbox_ref_reorder(struct sandbox_ref *dispatcher);
+
 /* does not destroy ref_list head, just the elements */
 void sandbox_ref_list_destroy(struct sandbox_ref_list *ref_list);
 
@@ -0,0 +1,93 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SANDBOX_REGISTRY_H_
+#define _SANDBOX_REGISTRY_H_
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include "sandbox.h"
+
+/* The registry maps a policy -- its script, template parameters and spec
+ * flags -- and the sandboxes it is stacked on to the live sandbox made
+ * from them, so that processes that attach the same policy onto the same
+ * stack share one sandbox rather than each building its own.
+ *
+ * The registry holds no reference to a sandbox unless it is pinned, as a
+ * preloaded policy is; an entry goes away with the last reference to its
+ * sandbox.  While a sandbox is live, so are the sandboxes below it, since
+ * every sandbox list that holds it also holds them, and so an entry's
+ * below pointer cannot be reused by some other sandbox.
+ *
+ * A policy's id is a hash of its content.  Lookups compare the scripts
+ * themselves, so two policies whose ids collide are never confused,
+ * though only one of them can be pinned.
+ */
+
+#define SANDBOX_REGISTRY_NBUCKETS   256
+
+struct sandbox_regent {
+    uint64_t id;
+    int flags;
+    char *script;
+    size_t scriptlen;   /* including the NUL */
+    char *params;       /* NULL if there are none */
+    size_t paramslen;
+    struct sandbox *sandbox;
+    int pinned;
+    LIST_ENTRY(sandbox_regent) regent_next;
+};
+
+void sandbox_registry_init(void);
+
+void sandbox_registry_fini(void);
+
+uint64_t sandbox_registry_id(const char *script, const char *params,
+        size_t paramslen, int flags);
+
+struct sandbox * sandbox_registry_lookup(uint64_t id, const char *script,
+        const char *params, size_t paramslen, int flags,
+        const struct sandbox *below);
+
+struct sandbox * sandbox_registry_insert(struct sandbox *sandbox,
+        uint64_t id, const char *script, const char *params, size_t paramslen,
+        int flags);
+
+u_int sandbox_registry_release(struct sandbox *sandbox);
+
+int sandbox_registry_pin(struct sandbox *sandbox);
+
+int sandbox_registry_unpin(uint64_t id);
+
+struct sandbox * sandbox_registry_lookupid(uint64_t id);
+
+void sandbox_registry_stats(uint64_t *nhits, uint64_t *nmisses);
+
+#endif /* !_SANDBOX_REGISTRY_H_ */
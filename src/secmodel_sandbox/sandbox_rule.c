@@ -81,8 +81,14 @@ sandbox_rule_freenames(struct sandbox_rule *rule)
     }
 }
 
-int 
-sandbox_rule_initfromstring(const char *s, struct sandbox_rule *rule)
+/* Splits rule string s into names, which it copies into buf, the storage for
+ * SANDBOX_RULE_MAXNAMES names; rule's names then point into buf.  This lets
+ * callers that parse many rules at once, such as sandbox.rules{}, keep all
+ * of the names in one allocation.
+ */
+int
+sandbox_rule_initfrombuf(const char *s, struct sandbox_rule *rule,
+        char (*buf)[SANDBOX_RULE_MAXNAMELEN])
 {
     int error = 0;
     int i = 0;
@@ -91,48 +97,70 @@ sandbox_rule_initfromstring(const char *s, struct sandbox_rule *rule)
 
     SANDBOX_LOG_TRACE_ENTER;
 
+    SANDBOX_RULE_MAKE(rule, NULL, NULL, NULL);
     a = s;
     b = s;
 
-    while (*b) {
-        if (*b == '.') {
-            if (i >= SANDBOX_RULE_MAXNAMES) {
-                SANDBOX_LOG_ERROR("rule string '%s' contains too many names\n", s);
-                goto fail;
-            }
-            if ((b - a) == 0) {
-                SANDBOX_LOG_ERROR("rule string '%s' contains an empty name\n", s);
-                goto fail;
-            }
-            rule->names[i] = kmem_zalloc(SANDBOX_RULE_MAXNAMELEN, KM_SLEEP);
-            /* TODO: error checking */
-            memcpy(__UNCONST(rule->names[i]), a, b - a);
-            a = b + 1;
-            i++;
+    for (;;) {
+        if (*b != '.' && *b != '\0') {
+            b++;
+            continue;
         }
-        b++;
-    }
-
-    if (i >= SANDBOX_RULE_MAXNAMES) {
-        SANDBOX_LOG_ERROR("rule string '%s' contains too many names\n", s);
-        goto fail;
-    }
-
-    if ((b - a) == 0) {
-        SANDBOX_LOG_ERROR("rule string '%s' contains an empty name\n", s);
-        goto fail;
+        if (i >= SANDBOX_RULE_MAXNAMES) {
+            SANDBOX_LOG_ERROR("rule string '%s' contains too many names\n", s);
+            goto fail;
+        }
+        if ((b - a) == 0) {
+            SANDBOX_LOG_ERROR("rule string '%s' contains an empty name\n", s);
+            goto fail;
+        }
+        if ((b - a) >= SANDBOX_RULE_MAXNAMELEN) {
+            SANDBOX_LOG_ERROR("rule string '%s' contains a name that is too long\n", s);
+            goto fail;
+        }
+        memcpy(buf[i], a, b - a);
+        buf[i][b - a] = '\0';
+        rule->names[i] = buf[i];
+        i++;
+        if (*b == '\0')
+            break;
+        a = ++b;
     }
-
-    rule->names[i] = kmem_zalloc(SANDBOX_RULE_MAXNAMELEN, KM_SLEEP);
-    /* TODO: error checking */
-    memcpy(__UNCONST(rule->names[i]), a, b - a);
     goto succeed;
 
 fail:
     error = 1;
-    sandbox_rule_freenames(rule);
+    SANDBOX_RULE_MAKE(rule, NULL, NULL, NULL);
 
 succeed:
     SANDBOX_LOG_TRACE_EXIT;
     return (error);
 }
+
+int 
+sandbox_rule_initfromstring(const char *s, struct sandbox_rule *rule)
+{
+    int error = 0;
+    int i = 0;
+    char buf[SANDBOX_RULE_MAXNAMES][SANDBOX_RULE_MAXNAMELEN];
+    struct sandbox_rule parsed;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    SANDBOX_RULE_MAKE(rule, NULL, NULL, NULL);
+    error = sandbox_rule_initfrombuf(s, &parsed, buf);
+    if (error)
+        goto done;
+
+    for (i = 0; i < SANDBOX_RULE_MAXNAMES; i++) {
+        if (parsed.names[i] == NULL)
+            break;
+        rule->names[i] = kmem_zalloc(SANDBOX_RULE_MAXNAMELEN, KM_SLEEP);
+        memcpy(__UNCONST(rule->names[i]), parsed.names[i],
+                strlen(parsed.names[i]));
+    }
+
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
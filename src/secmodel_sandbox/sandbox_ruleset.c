@@ -30,32 +30,58 @@
 #include <sys/systm.h>
 #include <sys/queue.h>
 #include <sys/kmem.h>
+#include <sys/kauth.h>
 
+#include "sandbox_addr.h"
+#include "sandbox_arena.h"
+#include "sandbox_objcache.h"
 #include "sandbox_path.h"
+#include "sandbox_pred.h"
 #include "sandbox_ref.h"
 #include "sandbox_rule.h"
 #include "sandbox_ruleset.h"
 
 #include "sandbox_log.h"
 
+/* adds addrs to the address set at *setp, which then owns it */
+static void
+sandbox_rulenode_addaddrs(struct sandbox_addr_set **setp,
+        struct sandbox_addr_set *addrs)
+{
+    if (*setp == NULL) {
+        *setp = addrs;
+        return;
+    }
+
+    sandbox_addr_set_merge(*setp, addrs);
+    sandbox_addr_set_destroy(addrs);
+}
+
+/* obj is the struct sandbox_ref of a FUNCTION rule, the struct sandbox_pred
+ * of a PREDICATE rule, or the struct sandbox_addr_set of an ADDRALLOW or
+ * ADDRDENY rule; it is unused for other types.
+ */
 static struct sandbox_rulenode *
-sandbox_rulenode_create(int level, const char *name, int type,
-        int value, struct sandbox_path_list *paths)
+sandbox_rulenode_create(struct sandbox_arena *arena, int level,
+        const char *name, int type, int value,
+        struct sandbox_path_list *paths, void *obj)
 {
     struct sandbox_rulenode *node = NULL;
-    struct sandbox_ref *funcref = NULL;
 
     SANDBOX_LOG_TRACE_ENTER;
 
-    node = kmem_zalloc(sizeof(*node), KM_SLEEP);
+    node = sandbox_arena_get(arena);
     SIMPLEQ_INIT(&node->whitelist);
     SIMPLEQ_INIT(&node->blacklist);
     SIMPLEQ_INIT(&node->funclist);
+    SIMPLEQ_INIT(&node->predlist);
     TAILQ_INIT(&node->children);
 
     node->level = level;
     strncpy(node->name, name, SANDBOX_RULE_MAXNAMELEN - 1);  
     node->type = type;
+    node->sampledeny = SANDBOX_SAMPLE_INHERIT;
+    node->sampleallow = SANDBOX_SAMPLE_INHERIT;
 
     switch (type) {
     case SANDBOX_RULETYPE_NONE:
@@ -70,8 +96,18 @@ sandbox_rulenode_create(int level, const char *name, int type,
         sandbox_path_list_concat(&node->blacklist, paths);
         break;
     case SANDBOX_RULETYPE_FUNCTION:
-        funcref = sandbox_ref_create(value);
-        SIMPLEQ_INSERT_TAIL(&node->funclist, funcref, ref_next);
+        SIMPLEQ_INSERT_TAIL(&node->funclist, (struct sandbox_ref *)obj,
+                ref_next);
+        break;
+    case SANDBOX_RULETYPE_PREDICATE:
+        SIMPLEQ_INSERT_TAIL(&node->predlist, (struct sandbox_pred *)obj,
+                pred_next);
+        break;
+    case SANDBOX_RULETYPE_ADDRALLOW:
+        sandbox_rulenode_addaddrs(&node->addrallow, obj);
+        break;
+    case SANDBOX_RULETYPE_ADDRDENY:
+        sandbox_rulenode_addaddrs(&node->addrdeny, obj);
         break;
     default:
         SANDBOX_LOG_WARN("unknown ruletype %d\n", type);
@@ -84,10 +120,8 @@ sandbox_rulenode_create(int level, const char *name, int type,
 
 static void
 sandbox_rulenode_update(struct sandbox_rulenode *node, int type, int value,
-        struct sandbox_path_list *paths)
+        struct sandbox_path_list *paths, void *obj)
 {
-    struct sandbox_ref *funcref = NULL;
-
     SANDBOX_LOG_TRACE_ENTER;
 
     switch (type) {
@@ -103,8 +137,18 @@ sandbox_rulenode_update(struct sandbox_rulenode *node, int type, int value,
         sandbox_path_list_concat(&node->blacklist, paths);
         break;
     case SANDBOX_RULETYPE_FUNCTION:
-        funcref = sandbox_ref_create(value);
-        SIMPLEQ_INSERT_TAIL(&node->funclist, funcref, ref_next);
+        SIMPLEQ_INSERT_TAIL(&node->funclist, (struct sandbox_ref *)obj,
+                ref_next);
+        break;
+    case SANDBOX_RULETYPE_PREDICATE:
+        SIMPLEQ_INSERT_TAIL(&node->predlist, (struct sandbox_pred *)obj,
+                pred_next);
+        break;
+    case SANDBOX_RULETYPE_ADDRALLOW:
+        sandbox_rulenode_addaddrs(&node->addrallow, obj);
+        break;
+    case SANDBOX_RULETYPE_ADDRDENY:
+        sandbox_rulenode_addaddrs(&node->addrdeny, obj);
         break;
     default:
         SANDBOX_LOG_WARN("unknown ruletype %d\n", type);
@@ -118,32 +162,36 @@ done:
     return;
 }
 
+/* releases what the node holds; the node itself goes with the ruleset's
+ * arena
+ */
 static void
-sandbox_rulenode_destroy(struct sandbox_rulenode *node)
+sandbox_rulenode_release(void *obj, void *arg)
 {
-    SANDBOX_LOG_TRACE_ENTER;
+    struct sandbox_rulenode *node = obj;
+
+    if (!(node->type & ~SANDBOX_RULETYPE_TRILEAN))
+        return;
 
-    struct sandbox_rulenode *child = NULL;
-    struct sandbox_rulenode *tmp = NULL;
-    
-    TAILQ_FOREACH_SAFE(child, &node->children, node_next, tmp)
-        sandbox_rulenode_destroy(child);
-    
     sandbox_path_list_destroy(&node->whitelist);
     sandbox_path_list_destroy(&node->blacklist);
     sandbox_ref_list_destroy(&node->funclist);
-    kmem_free(node, sizeof(*node));
-
-    SANDBOX_LOG_TRACE_EXIT;
+    sandbox_pred_list_destroy(&node->predlist);
+    if (node->addrallow != NULL)
+        sandbox_addr_set_destroy(node->addrallow);
+    if (node->addrdeny != NULL)
+        sandbox_addr_set_destroy(node->addrdeny);
 }
 
-#define SANDBOX_RULENODE_CREATE_INTERMEDIATE(level, name) \
-    sandbox_rulenode_create(level, name, SANDBOX_RULETYPE_NONE, 0, NULL)
+#define SANDBOX_RULENODE_CREATE_INTERMEDIATE(arena, level, name) \
+    sandbox_rulenode_create(arena, level, name, SANDBOX_RULETYPE_NONE, 0, \
+            NULL, NULL)
 
 static int 
-sandbox_rulenode_insert(struct sandbox_rulenode *node, int level,
+sandbox_rulenode_insert(struct sandbox_arena *arena,
+        struct sandbox_rulenode *node, int level,
         const struct sandbox_rule *rule, int type, int value, 
-        struct sandbox_path_list *paths)
+        struct sandbox_path_list *paths, void *obj)
 {
     struct sandbox_rulenode *child = NULL;
     struct sandbox_rulenode *newnode = NULL;
@@ -170,11 +218,11 @@ sandbox_rulenode_insert(struct sandbox_rulenode *node, int level,
             if (rule_size == level) {
                 /* update */
                 SANDBOX_LOG_DEBUG("found a match.  updating node\n");
-                sandbox_rulenode_update(child, type, value, paths);
+                sandbox_rulenode_update(child, type, value, paths, obj);
                 goto done;
             } else {
                 SANDBOX_LOG_DEBUG("found a match. searching node's children\n");
-                error = sandbox_rulenode_insert(child, level + 1, rule, type, value, paths);
+                error = sandbox_rulenode_insert(arena, child, level + 1, rule, type, value, paths, obj);
                 goto done;
             }
         } else if (cmp < 0) {
@@ -182,15 +230,15 @@ sandbox_rulenode_insert(struct sandbox_rulenode *node, int level,
             if (rule_size == level) {
                 /* terminal node */
                 SANDBOX_LOG_DEBUG("inserting terminal node before existing node.\n");
-                newnode = sandbox_rulenode_create(level, rule->names[level-1], type, value, paths);
+                newnode = sandbox_rulenode_create(arena, level, rule->names[level-1], type, value, paths, obj);
                 TAILQ_INSERT_BEFORE(child, newnode, node_next);
                 goto done;
             }  else {
                 /* intermediate node; inherit parent's values */
                 SANDBOX_LOG_DEBUG("inserting intermediate node before existing node.\n");
-                newnode = SANDBOX_RULENODE_CREATE_INTERMEDIATE(level, rule->names[level-1]);
+                newnode = SANDBOX_RULENODE_CREATE_INTERMEDIATE(arena, level, rule->names[level-1]);
                 TAILQ_INSERT_BEFORE(child, newnode, node_next);
-                error = sandbox_rulenode_insert(newnode, level + 1, rule, type, value, paths);
+                error = sandbox_rulenode_insert(arena, newnode, level + 1, rule, type, value, paths, obj);
                 goto done;
             }
         }
@@ -203,15 +251,15 @@ sandbox_rulenode_insert(struct sandbox_rulenode *node, int level,
         if (rule_size == level) {
             /* terminal node */
             SANDBOX_LOG_DEBUG("could not find a place in the list. inserting terminal node.\n");
-            newnode = sandbox_rulenode_create(level, rule->names[level-1], type, value, paths);
+            newnode = sandbox_rulenode_create(arena, level, rule->names[level-1], type, value, paths, obj);
             TAILQ_INSERT_TAIL(&node->children, newnode, node_next);
             goto done;
         } else {
             /* intermediate node; inherit parent' values */
             SANDBOX_LOG_DEBUG("could not find a place in the list. inserting intermediate node.\n");
-            newnode = SANDBOX_RULENODE_CREATE_INTERMEDIATE(level, rule->names[level-1]);
+            newnode = SANDBOX_RULENODE_CREATE_INTERMEDIATE(arena, level, rule->names[level-1]);
             TAILQ_INSERT_TAIL(&node->children, newnode, node_next);
-            error = sandbox_rulenode_insert(newnode, level + 1, rule, type, value, paths);
+            error = sandbox_rulenode_insert(arena, newnode, level + 1, rule, type, value, paths, obj);
         }
     }
 
@@ -265,6 +313,102 @@ done:
     return (result);
 }
 
+/* finds the rulenode named exactly by rule, whatever its type */
+static struct sandbox_rulenode *
+sandbox_rulenode_find(struct sandbox_rulenode *node,
+        const struct sandbox_rule *rule)
+{
+    int level = 0;
+    int rule_size = 0;
+    struct sandbox_rulenode *child = NULL;
+
+    rule_size = sandbox_rule_size(rule);
+    for (level = 0; level < rule_size && node != NULL; level++) {
+        TAILQ_FOREACH(child, &node->children, node_next) {
+            if (strcmp(rule->names[level], child->name) == 0)
+                break;
+        }
+        node = child;
+    }
+
+    return (node);
+}
+
+/* rulename holds the dotted name of node's parent, and has room for a full
+ * rule name
+ */
+static void
+sandbox_rulenode_foreach(struct sandbox_rulenode *node, char *rulename,
+        sandbox_ruleset_visit_t visit, void *arg)
+{
+    struct sandbox_rulenode *child = NULL;
+    size_t len = 0;
+
+    len = strlen(rulename);
+    TAILQ_FOREACH(child, &node->children, node_next) {
+        if (len == 0)
+            strcpy(rulename, child->name);
+        else
+            snprintf(rulename + len, SANDBOX_RULE_MAXNAMELEN + 1, ".%s",
+                    child->name);
+        visit(child, rulename, arg);
+        sandbox_rulenode_foreach(child, rulename, visit, arg);
+        rulename[len] = '\0';
+    }
+}
+
+/* indexed by the bit of the SANDBOX_SCOPE_* flag */
+static const char * sandbox_ruleset_scopenames[SANDBOX_NSCOPES] = {
+    "system",
+    "process",
+    "network",
+    "machdep",
+    "device",
+    "vnode",
+};
+
+static void
+sandbox_rulenode_namelen(void *obj, void *arg)
+{
+    struct sandbox_rulenode *node = obj;
+    size_t *len = arg;
+
+    *len += strlen(node->name) + 1;
+}
+
+/* finds the child of hot with the name, by binary search */
+static const struct sandbox_rulehot *
+sandbox_ruleindex_child(const struct sandbox_ruleindex *index,
+        const struct sandbox_rulehot *hot, const char *name)
+{
+    uint32_t lo = hot->children;
+    uint32_t hi = hot->children + hot->nchildren;
+    uint32_t mid = 0;
+    int cmp = 0;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = strcmp(name, index->names + index->hot[mid].name);
+        if (cmp == 0)
+            return (&index->hot[mid]);
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return (NULL);
+}
+
+static void
+sandbox_ruleindex_destroy(struct sandbox_ruleindex *index)
+{
+    kmem_free(index->hot, index->nnodes * sizeof(*index->hot));
+    kmem_free(index->cold, index->nnodes * sizeof(*index->cold));
+    kmem_free(index->names, index->nameslen);
+    kmem_free(index, sizeof(*index));
+}
+
 /* ===  API == */
 
 struct sandbox_ruleset *
@@ -274,8 +418,13 @@ sandbox_ruleset_create(int value)
 
     SANDBOX_LOG_TRACE_ENTER;
 
-    set = kmem_zalloc(sizeof(*set), KM_SLEEP);
-    set->root = sandbox_rulenode_create(0, "", SANDBOX_RULETYPE_TRILEAN, value, NULL);
+    set = sandbox_objcache_get(SANDBOX_OBJCACHE_RULESET);
+    sandbox_arena_init(&set->nodes, sizeof(struct sandbox_rulenode));
+    set->root = sandbox_rulenode_create(&set->nodes, 0, "",
+            SANDBOX_RULETYPE_TRILEAN, value, NULL, NULL);
+    /* by default, every deny is recorded and no allow */
+    set->root->sampledeny = 1;
+    set->root->sampleallow = 0;
 
     SANDBOX_LOG_TRACE_EXIT;
     return (set);
@@ -289,9 +438,16 @@ sandbox_ruleset_insert(struct sandbox_ruleset *set,
     int error = 0;
     int rule_size = 0;
     int isvnode = 0;
+    struct sandbox_ref *funcref = NULL;
 
     SANDBOX_LOG_TRACE_ENTER;
 
+    if (set->index != NULL) {
+        SANDBOX_LOG_ERROR("the ruleset is sealed\n");
+        error = 1;
+        goto done;
+    }
+
     rule_size = sandbox_rule_size(rule); 
     isvnode = sandbox_rule_isvnode(rule);
 
@@ -314,12 +470,348 @@ sandbox_ruleset_insert(struct sandbox_ruleset *set,
         goto done;
     } 
 
-    error = sandbox_rulenode_insert(set->root, 1, rule, type, value, paths);
+    if (type == SANDBOX_RULETYPE_FUNCTION)
+        funcref = sandbox_ref_create(value);
+
+    error = sandbox_rulenode_insert(&set->nodes, set->root, 1, rule, type,
+            value, paths, funcref);
+
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+
+}
+
+/* like sandbox_ruleset_insert() with SANDBOX_RULETYPE_FUNCTION, except that
+ * the caller supplies the sandbox_ref.  On success, the ruleset owns ref.
+ */
+int
+sandbox_ruleset_insertref(struct sandbox_ruleset *set,
+        const struct sandbox_rule *rule, struct sandbox_ref *ref)
+{
+    int error = 0;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    KASSERT(ref != NULL);
+
+    if (set->index != NULL) {
+        SANDBOX_LOG_ERROR("the ruleset is sealed\n");
+        error = 1;
+        goto done;
+    }
+
+    if (sandbox_rule_size(rule) == 0) {
+        SANDBOX_LOG_ERROR("the default rule must be of type boolean\n");
+        error = 1;
+        goto done;
+    }
+
+    error = sandbox_rulenode_insert(&set->nodes, set->root, 1, rule,
+            SANDBOX_RULETYPE_FUNCTION, ref->value, NULL, ref);
+
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* adds a sandbox.when() predicate to the rule.  On success, the ruleset owns
+ * pred.
+ */
+int
+sandbox_ruleset_insertpred(struct sandbox_ruleset *set,
+        const struct sandbox_rule *rule, struct sandbox_pred *pred)
+{
+    int error = 0;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    KASSERT(pred != NULL);
+
+    if (set->index != NULL) {
+        SANDBOX_LOG_ERROR("the ruleset is sealed\n");
+        error = 1;
+        goto done;
+    }
+
+    if (sandbox_rule_size(rule) == 0) {
+        SANDBOX_LOG_ERROR("the default rule must be of type boolean\n");
+        error = 1;
+        goto done;
+    }
+
+    error = sandbox_rulenode_insert(&set->nodes, set->root, 1, rule,
+            SANDBOX_RULETYPE_PREDICATE, 0, NULL, pred);
+
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* adds the sockaddrs in addrs to the rule's allowed (type
+ * SANDBOX_RULETYPE_ADDRALLOW) or denied (SANDBOX_RULETYPE_ADDRDENY) sets.
+ * On success, the ruleset owns addrs.
+ */
+int
+sandbox_ruleset_insertaddrs(struct sandbox_ruleset *set,
+        const struct sandbox_rule *rule, int type,
+        struct sandbox_addr_set *addrs)
+{
+    int error = 0;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    KASSERT(addrs != NULL);
+    KASSERT(type == SANDBOX_RULETYPE_ADDRALLOW ||
+            type == SANDBOX_RULETYPE_ADDRDENY);
+
+    if (set->index != NULL) {
+        SANDBOX_LOG_ERROR("the ruleset is sealed\n");
+        error = 1;
+        goto done;
+    }
+
+    if (sandbox_rule_size(rule) == 0) {
+        SANDBOX_LOG_ERROR("the default rule must be of type boolean\n");
+        error = 1;
+        goto done;
+    }
+
+    error = sandbox_rulenode_insert(&set->nodes, set->root, 1, rule, type,
+            0, NULL, addrs);
+
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* Sets the sampling rates of the rule's events (see struct
+ * sandbox_rulenode); a rate of SANDBOX_SAMPLE_INHERIT leaves the rule's
+ * rate as it was.  The rules beneath the rule inherit its rates unless
+ * they set their own.  A rate set on a name that has no rule of its own
+ * only applies to the rules beneath it, since requests for the name are
+ * decided by the rule above it.
+ */
+int
+sandbox_ruleset_insertsampling(struct sandbox_ruleset *set,
+        const struct sandbox_rule *rule, int deny, int allow)
+{
+    int error = 0;
+    struct sandbox_rulenode *node = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    if (set->index != NULL) {
+        SANDBOX_LOG_ERROR("the ruleset is sealed\n");
+        error = 1;
+        goto done;
+    }
+
+    if (sandbox_rule_size(rule) > 0) {
+        error = sandbox_rulenode_insert(&set->nodes, set->root, 1, rule,
+                SANDBOX_RULETYPE_NONE, 0, NULL, NULL);
+        if (error)
+            goto done;
+    }
+
+    node = sandbox_rulenode_find(set->root, rule);
+    KASSERT(node != NULL);
+    if (deny != SANDBOX_SAMPLE_INHERIT)
+        node->sampledeny = deny;
+    if (allow != SANDBOX_SAMPLE_INHERIT)
+        node->sampleallow = allow;
+
+done:
+    SANDBOX_LOG_TRACE_EXIT;
+    return (error);
+}
+
+/* orders rule entries by name, level by level; a rule sorts before the
+ * rules beneath it
+ */
+static int
+sandbox_ruleentry_cmp(const struct sandbox_ruleentry *a,
+        const struct sandbox_ruleentry *b)
+{
+    int i = 0;
+    int cmp = 0;
+    const char *na = NULL;
+    const char *nb = NULL;
+
+    for (i = 0; i < SANDBOX_RULE_MAXNAMES; i++) {
+        na = a->rule.names[i];
+        nb = b->rule.names[i];
+        if (na == NULL || nb == NULL)
+            return ((na != NULL) - (nb != NULL));
+        cmp = strcmp(na, nb);
+        if (cmp != 0)
+            return (cmp);
+    }
+
+    return (0);
+}
+
+/* A bottom-up merge sort of v, using tmp, which also holds n entries.  The
+ * sort is stable, so that of entries for the same rule, the last given is
+ * still applied last.
+ */
+static void
+sandbox_ruleentry_sort(const struct sandbox_ruleentry **v,
+        const struct sandbox_ruleentry **tmp, size_t n)
+{
+    const struct sandbox_ruleentry **from = v;
+    const struct sandbox_ruleentry **to = tmp;
+    const struct sandbox_ruleentry **swap = NULL;
+    size_t width = 0;
+    size_t lo = 0;
+    size_t mid = 0;
+    size_t hi = 0;
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+
+    for (width = 1; width < n; width *= 2) {
+        for (lo = 0; lo < n; lo += 2 * width) {
+            mid = (lo + width < n) ? lo + width : n;
+            hi = (lo + 2 * width < n) ? lo + 2 * width : n;
+            i = lo;
+            j = mid;
+            k = lo;
+            while (i < mid && j < hi) {
+                if (sandbox_ruleentry_cmp(from[j], from[i]) < 0)
+                    to[k++] = from[j++];
+                else
+                    to[k++] = from[i++];
+            }
+            while (i < mid)
+                to[k++] = from[i++];
+            while (j < hi)
+                to[k++] = from[j++];
+        }
+        swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != v)
+        memcpy(v, from, n * sizeof(*v));
+}
+
+/* Allows or denies each rule in entries, as sandbox_ruleset_insert() with
+ * SANDBOX_RULETYPE_TRILEAN would, but builds the trie in one pass: the
+ * entries are sorted once, and then each level of each rule is looked up
+ * starting from where the previous rule's was found, rather than from the
+ * head of the children list.  Loading n rules thus takes O(n log n)
+ * comparisons rather than O(n^2).
+ */
+int
+sandbox_ruleset_insertbulk(struct sandbox_ruleset *set,
+        const struct sandbox_ruleentry *entries, size_t n)
+{
+    int error = 0;
+    int cmp = 0;
+    int size = 0;
+    int level = 0;
+    int depth = 0;
+    size_t i = 0;
+    const char *name = NULL;
+    const struct sandbox_ruleentry **sorted = NULL;
+    struct sandbox_rulenode *path[SANDBOX_RULE_MAXNAMES + 1];
+    struct sandbox_rulenode *node = NULL;
+    struct sandbox_rulenode *child = NULL;
+    struct sandbox_rulenode *newnode = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    if (set->index != NULL) {
+        SANDBOX_LOG_ERROR("the ruleset is sealed\n");
+        error = 1;
+        goto done;
+    }
+
+    if (n == 0)
+        goto done;
+
+    sorted = kmem_alloc(2 * n * sizeof(*sorted), KM_SLEEP);
+    for (i = 0; i < n; i++)
+        sorted[i] = &entries[i];
+    sandbox_ruleentry_sort(sorted, sorted + n, n);
+
+    /* path[1..depth] are the nodes of the previous rule's names */
+    path[0] = set->root;
+    for (i = 0; i < n; i++) {
+        size = sandbox_rule_size(&sorted[i]->rule);
+        node = set->root;
+        for (level = 1; level <= size; level++) {
+            name = sorted[i]->rule.names[level - 1];
+            if (level <= depth) {
+                cmp = strcmp(name, path[level]->name);
+                if (cmp == 0) {
+                    node = path[level];
+                    continue;
+                }
+                /* the rules are sorted, so the name follows the previous
+                 * rule's in the children list
+                 */
+                KASSERT(cmp > 0);
+                child = TAILQ_NEXT(path[level], node_next);
+            } else {
+                child = TAILQ_FIRST(&node->children);
+            }
+
+            cmp = 1;
+            while (child != NULL && (cmp = strcmp(name, child->name)) > 0)
+                child = TAILQ_NEXT(child, node_next);
+
+            if (cmp != 0) {
+                newnode = SANDBOX_RULENODE_CREATE_INTERMEDIATE(&set->nodes,
+                        level, name);
+                if (child == NULL)
+                    TAILQ_INSERT_TAIL(&node->children, newnode, node_next);
+                else
+                    TAILQ_INSERT_BEFORE(child, newnode, node_next);
+                child = newnode;
+            }
+
+            path[level] = child;
+            depth = level;
+            node = child;
+        }
+        depth = size;
+
+        sandbox_rulenode_update(node, SANDBOX_RULETYPE_TRILEAN,
+                sorted[i]->value, NULL, NULL);
+    }
+
+    kmem_free(sorted, 2 * n * sizeof(*sorted));
 
 done:
     SANDBOX_LOG_TRACE_EXIT;
     return (error);
+}
+
+/* Returns the SANDBOX_SCOPE_* flags of the scopes in which the ruleset
+ * may return something other than KAUTH_RESULT_DEFER: all of them if the
+ * default rule allows or denies, and otherwise those that have rules.
+ */
+int
+sandbox_ruleset_scopes(const struct sandbox_ruleset *set)
+{
+    int i = 0;
+    int scopes = 0;
+    const struct sandbox_rulenode *child = NULL;
+
+    if (set->root->value != KAUTH_RESULT_DEFER)
+        return (SANDBOX_SCOPE_ALL);
 
+    TAILQ_FOREACH(child, &set->root->children, node_next) {
+        for (i = 0; i < SANDBOX_NSCOPES; i++) {
+            if (strcmp(child->name, sandbox_ruleset_scopenames[i]) == 0)
+                scopes |= 1 << i;
+        }
+    }
+
+    return (scopes);
 }
 
 /* finds rulenode with longest prefix match */
@@ -335,7 +827,10 @@ sandbox_ruleset_search(const struct sandbox_ruleset *set,
     SANDBOX_LOG_DEBUG("search for rule: %s.%s.%s\n", rule->names[0], rule->names[1], rule->names[2]);
 
     rule_size = sandbox_rule_size(rule); 
-    if (rule_size == 0) {
+    if (set->index != NULL) {
+        node = SANDBOX_RULESET_COLD(set,
+                sandbox_ruleset_searchhot(set, rule));
+    } else if (rule_size == 0) {
         node = set->root; 
     } else {
         node = sandbox_rulenode_search(set->root, rule, 1);
@@ -347,14 +842,161 @@ sandbox_ruleset_search(const struct sandbox_ruleset *set,
     return (node);
 }
 
+/* Builds the ruleset's index (see sandbox_ruleset.h), which searches use
+ * from then on.  The ruleset takes no more rules once it is sealed, and
+ * its rulenodes' types and values must no longer change.
+ */
+void
+sandbox_ruleset_seal(struct sandbox_ruleset *set)
+{
+    size_t i = 0;
+    size_t n = 0;
+    size_t len = 0;
+    struct sandbox_ruleindex *index = NULL;
+    struct sandbox_rulehot *hot = NULL;
+    struct sandbox_rulenode *node = NULL;
+    struct sandbox_rulenode *child = NULL;
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    KASSERT(set->index == NULL);
+
+    index = kmem_zalloc(sizeof(*index), KM_SLEEP);
+    index->nnodes = set->nodes.nobjs;
+    index->hot = kmem_zalloc(index->nnodes * sizeof(*index->hot), KM_SLEEP);
+    index->cold = kmem_zalloc(index->nnodes * sizeof(*index->cold),
+            KM_SLEEP);
+    sandbox_arena_foreach(&set->nodes, sandbox_rulenode_namelen,
+            &index->nameslen);
+    index->names = kmem_zalloc(index->nameslen, KM_SLEEP);
+
+    /* cold doubles as the queue of the breadth-first walk */
+    index->cold[n++] = set->root;
+    for (i = 0; i < n; i++) {
+        node = index->cold[i];
+        hot = &index->hot[i];
+        hot->name = len;
+        hot->type = node->type;
+        hot->value = node->value;
+        hot->children = n;
+        node->id = i;
+        TAILQ_FOREACH(child, &node->children, node_next) {
+            /* parents are resolved before their children */
+            if (child->sampledeny == SANDBOX_SAMPLE_INHERIT)
+                child->sampledeny = node->sampledeny;
+            if (child->sampleallow == SANDBOX_SAMPLE_INHERIT)
+                child->sampleallow = node->sampleallow;
+            index->cold[n++] = child;
+        }
+        hot->nchildren = n - hot->children;
+        strcpy(index->names + len, node->name);
+        len += strlen(node->name) + 1;
+    }
+    KASSERT(n == index->nnodes);
+    KASSERT(len == index->nameslen);
+
+    set->index = index;
+    SANDBOX_LOG_DEBUG("indexed %zu rulenodes in %zu bytes\n", n,
+            n * (sizeof(*index->hot) + sizeof(*index->cold)) + len);
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+/* like sandbox_ruleset_search(), for a sealed ruleset, but returns the
+ * rulenode's header in the index
+ */
+const struct sandbox_rulehot *
+sandbox_ruleset_searchhot(const struct sandbox_ruleset *set,
+        const struct sandbox_rule *rule)
+{
+    int level = 0;
+    int rule_size = 0;
+    const struct sandbox_ruleindex *index = set->index;
+    const struct sandbox_rulehot *hot = NULL;
+    const struct sandbox_rulehot *result = NULL;
+
+    KASSERT(index != NULL);
+
+    rule_size = sandbox_rule_size(rule);
+    hot = result = &index->hot[0];
+    for (level = 0; level < rule_size; level++) {
+        hot = sandbox_ruleindex_child(index, hot, rule->names[level]);
+        if (hot == NULL)
+            break;
+        /* nodes of type NONE only lead to the rules below them */
+        if (hot->type != SANDBOX_RULETYPE_NONE)
+            result = hot;
+    }
+
+    return (result);
+}
+
+/* calls visit on every node below the root, parents before children */
+void
+sandbox_ruleset_foreach(struct sandbox_ruleset *set,
+        sandbox_ruleset_visit_t visit, void *arg)
+{
+    char rulename[SANDBOX_RULE_MAXNAMES * SANDBOX_RULE_MAXNAMELEN];
+
+    SANDBOX_LOG_TRACE_ENTER;
+
+    rulename[0] = '\0';
+    sandbox_rulenode_foreach(set->root, rulename, visit, arg);
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+/* removes ref from node's function list and destroys it */
+void
+sandbox_rulenode_removeref(struct sandbox_rulenode *node,
+        struct sandbox_ref *ref)
+{
+    SANDBOX_LOG_TRACE_ENTER;
+
+    KASSERT(node->type & SANDBOX_RULETYPE_FUNCTION);
+
+    SIMPLEQ_REMOVE(&node->funclist, ref, sandbox_ref, ref_next);
+    sandbox_ref_destroy(ref);
+    if (SIMPLEQ_EMPTY(&node->funclist))
+        node->type &= ~SANDBOX_RULETYPE_FUNCTION;
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
+/* Replaces the function ref, which always evaluates to value, with the
+ * equivalent trilean setting, and destroys ref.  The caller must already
+ * have released ref's Lua reference.
+ *
+ * A deny anywhere on a node wins, and an allow counts only when nothing
+ * denies, so an allow does not override a trilean deny.
+ */
+void
+sandbox_rulenode_demoteref(struct sandbox_rulenode *node,
+        struct sandbox_ref *ref, int value)
+{
+    SANDBOX_LOG_TRACE_ENTER;
+
+    sandbox_rulenode_removeref(node, ref);
+
+    if (value == KAUTH_RESULT_DENY ||
+            !(node->type & SANDBOX_RULETYPE_TRILEAN))
+        node->value = value;
+    node->type |= SANDBOX_RULETYPE_TRILEAN;
+
+    SANDBOX_LOG_TRACE_EXIT;
+}
+
 void
 sandbox_ruleset_destroy(struct sandbox_ruleset *set)
 {
     SANDBOX_LOG_TRACE_ENTER;
 
-    SANDBOX_LOG_DEBUG("destroying ruleset\n");
-    sandbox_rulenode_destroy(set->root);
-    kmem_free(set, sizeof(*set));
+    SANDBOX_LOG_DEBUG("destroying ruleset of %zu nodes\n", set->nodes.nobjs);
+    if (set->index != NULL)
+        sandbox_ruleindex_destroy(set->index);
+    sandbox_arena_foreach(&set->nodes, sandbox_rulenode_release, NULL);
+    sandbox_arena_destroy(&set->nodes);
+    sandbox_objcache_put(SANDBOX_OBJCACHE_RULESET, set);
 
     SANDBOX_LOG_TRACE_EXIT;
 }
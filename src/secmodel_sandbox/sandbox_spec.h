@@ -39,6 +39,19 @@
  * sandbox_spec flags
  */
 #define SANDBOX_ON_DENY_ABORT  (1 << 0)
+#define SANDBOX_REORDER        (1 << 1)    /* reorder {unordered=true} functions
+                                              by cost and deny rate */
+#define SANDBOX_FULLLIBS       (1 << 2)    /* open every Lua library up front
+                                              rather than on first use */
+#define SANDBOX_PRIVATE        (1 << 3)    /* never share the sandbox with
+                                              other attaches of the policy */
+#define SANDBOX_PERMISSIVE     (1 << 4)    /* decide by native rules only,
+                                              and run Lua functions later
+                                              to audit what they would
+                                              have denied */
+
+/* script_len counts the script's terminating NUL */
+#define SANDBOX_SCRIPT_MAXLEN   (1024 * 1024)
 
 struct sandbox_spec {
     char    *script;
@@ -46,8 +59,256 @@ struct sandbox_spec {
     int     flags;
 };
 
+/*
+ * sandbox_funcstat kinds
+ */
+#define SANDBOX_FUNCSTAT_LUA        0   /* a Lua function */
+#define SANDBOX_FUNCSTAT_EXPR       1   /* a compiled expression */
+#define SANDBOX_FUNCSTAT_DISPATCHER 2   /* the Lua functions that follow it */
+#define SANDBOX_FUNCSTAT_MEMBER     3   /* a Lua function run by the
+                                           preceding dispatcher */
+
+/*
+ * sandbox_funcstat flags
+ */
+#define SANDBOX_FUNCSTAT_UNORDERED  (1 << 0)    /* {unordered=true} */
+#define SANDBOX_FUNCSTAT_PURE       (1 << 1)    /* {pure=true} */
+
+#define SANDBOX_FUNCSTAT_RULELEN    64
+#define SANDBOX_STATS_MAXFUNCS      4096
+
+/* the runtime stats of one sandbox.on() function; evaluations are only
+ * timed and counted while security.models.sandbox.stats is set, or if the
+ * sandbox has SANDBOX_REORDER
+ */
+struct sandbox_funcstat {
+    char        rule[SANDBOX_FUNCSTAT_RULELEN];
+    int         sandbox;    /* 0 is the most recently attached */
+    int         kind;
+    int         index;      /* a member's order of registration */
+    int         flags;
+    uint64_t    nevals;
+    uint64_t    ndenies;
+    uint64_t    nsecs;
+    uint64_t    savednsecs; /* a dispatcher's estimated savings from
+                               reordering its members */
+    uint64_t    nhits;      /* a pure function's cached verdicts */
+    uint64_t    nmisses;
+};
+
+/*
+ * the kinds of objects the module allocates from its object caches, which
+ * index sandbox_stats.objs
+ */
+#define SANDBOX_OBJSTAT_LIST        0
+#define SANDBOX_OBJSTAT_SANDBOX     1
+#define SANDBOX_OBJSTAT_RULESET     2
+#define SANDBOX_OBJSTAT_PATH        3
+#define SANDBOX_OBJSTAT_REF         4
+#define SANDBOX_OBJSTAT_NTYPES      5
+
+struct sandbox_objstat {
+    uint64_t    nallocs;
+    uint64_t    nfrees;     /* nallocs - nfrees are live */
+};
+
+struct sandbox_stats {
+    pid_t                   pid;    /* 0 for the calling process */
+    struct sandbox_funcstat *funcs;
+    size_t                  nfuncs; /* in: length of funcs; out: number of
+                                       functions, which may be more */
+    /* out: system-wide */
+    uint64_t                nattaches;
+    uint64_t                attachnsecs;
+    uint64_t                poolhits;   /* Lua states reused */
+    uint64_t                poolmisses; /* Lua states created */
+    uint64_t                registryhits;   /* attaches that shared a
+                                               live sandbox */
+    uint64_t                registrymisses;
+    uint64_t                chunkhits;  /* scripts loaded from the chunk
+                                           cache rather than parsed */
+    uint64_t                chunkmisses;
+    uint64_t                chunkevictions;
+    struct sandbox_objstat  objs[SANDBOX_OBJSTAT_NTYPES];
+    uint64_t                permqueued; /* SANDBOX_PERMISSIVE snapshots
+                                           waiting for their functions */
+    uint64_t                permdropped;    /* snapshots dropped because
+                                               the queue was full */
+    uint64_t                permdenies; /* requests that the functions
+                                           would have denied */
+};
+
+/* the policy to make into a sandbox for SANDBOX_IOC_PRELOAD, and the id
+ * to attach it by
+ */
+struct sandbox_preload {
+    struct sandbox_spec     spec;
+    uint64_t                id;     /* out */
+};
+
+/* The parameters of a policy template, which the script reads from the
+ * sandbox.params table, packed as NUL-terminated names and values:
+ * "name\0value\0name\0value\0".  SANDBOX_IOC_SETTMPL attaches spec
+ * bound to them; SANDBOX_IOC_ATTACHTMPL ignores spec and attaches the
+ * preloaded template with the id.
+ */
+#define SANDBOX_PARAMS_MAXLEN   4096
+
+struct sandbox_template {
+    struct sandbox_spec     spec;
+    uint64_t                id;
+    char                    *params;
+    size_t                  params_len;
+};
+
+/*
+ * trace subsystems, each with its own level, a SANDBOX_LOG_LEVEL_* (see
+ * sandbox_log.h), under the sysctl node security.models.sandbox.trace
+ */
+#define SANDBOX_TRACE_CORE          0   /* sandboxes and their rules */
+#define SANDBOX_TRACE_SECMODEL      1   /* the module, its kauth listeners
+                                           and cred inheritance */
+#define SANDBOX_TRACE_LUA           2
+#define SANDBOX_TRACE_DEVICE        3   /* /dev/sandbox */
+#define SANDBOX_TRACE_VNODE         4
+#define SANDBOX_TRACE_NSUBSYS       5
+
+#define SANDBOX_TRACE_MAXARGS       6
+#define SANDBOX_TRACE_STRLEN        56
+
+/* One log call, as recorded in the kernel's trace rings: the id of its
+ * format, which SANDBOX_IOC_TRACEFMT describes, and its arguments, which
+ * the reader formats.  The string of each %s argument is copied into strs,
+ * truncated if need be, and its argument is its offset there.
+ */
+struct sandbox_tracerec {
+    uint64_t    nsecs;      /* since boot */
+    uint32_t    fmtid;      /* 0 if the kernel ran out of ids */
+    uint16_t    cpu;
+    uint8_t     subsys;
+    uint8_t     level;
+    int32_t     pid;
+    int32_t     lid;
+    uint64_t    args[SANDBOX_TRACE_MAXARGS];
+    char        strs[SANDBOX_TRACE_STRLEN];
+};
+
+/* drains the trace rings, which only the superuser may do */
+struct sandbox_trace {
+    struct sandbox_tracerec *recs;
+    size_t                  nrecs;  /* in: length of recs; out: number of
+                                       records, 0 once the rings are empty */
+    uint64_t                nlost;  /* out: records overwritten before they
+                                       were read, since the last read */
+};
+
+#define SANDBOX_TRACE_FILELEN       32
+#define SANDBOX_TRACE_FUNCLEN       48
+#define SANDBOX_TRACE_FMTLEN        128
+
+/* the log call that a trace record's fmtid stands for */
+struct sandbox_tracefmt {
+    uint32_t    id;         /* in */
+    int         line;
+    char        file[SANDBOX_TRACE_FILELEN];
+    char        func[SANDBOX_TRACE_FUNCLEN];
+    char        fmt[SANDBOX_TRACE_FMTLEN];
+};
+
+/*
+ * the event ring, which the superuser maps from /dev/sandbox: a struct
+ * sandbox_eventring, followed, at its offset, by its nevents events
+ */
+#define SANDBOX_EVENT_MAXEVENTS     (1 << 18)
+
+/* sandbox_event results */
+#define SANDBOX_EVENT_ALLOW         0
+#define SANDBOX_EVENT_DENY          1
+#define SANDBOX_EVENT_WOULDDENY     2   /* by a function of a
+                                           SANDBOX_PERMISSIVE sandbox */
+
+/* what a sandbox_event's obj describes */
+#define SANDBOX_EVENT_OBJ_NONE      0
+#define SANDBOX_EVENT_OBJ_VNODE     1
+#define SANDBOX_EVENT_OBJ_SOCKADDR  2
+
+#define SANDBOX_EVENT_NAMELEN       32
+#define SANDBOX_EVENT_PATHLEN       32
+
+/* One request that a sandbox decided.  Its rule is the names[0] through
+ * names[level - 1] of the request, which is the rule's id'th in its
+ * ruleset.  The event is written once seq is its position in the ring
+ * plus one.
+ */
+struct sandbox_event {
+    volatile uint64_t   seq;
+    uint64_t            nsecs;      /* since boot */
+    uint32_t            ruleid;
+    int32_t             pid;
+    int32_t             lid;
+    uint32_t            uid;        /* effective */
+    uint8_t             result;     /* SANDBOX_EVENT_* */
+    uint8_t             level;
+    uint8_t             objtype;    /* SANDBOX_EVENT_OBJ_* */
+    uint8_t             pad[5];
+    char                names[3][SANDBOX_EVENT_NAMELEN];   /* scope,
+                                                           action and req */
+    union {
+        struct {
+            uint64_t    fsid;
+            uint64_t    fileid;     /* 0 if the vnode's lock was
+                                       not free */
+            uint32_t    type;       /* enum vtype */
+        } vnode;
+        struct {
+            uint8_t     family;
+            uint8_t     pad;
+            uint16_t    port;       /* host order */
+            uint8_t     pad2[4];
+            uint8_t     addr[16];
+            char        path[SANDBOX_EVENT_PATHLEN];   /* AF_LOCAL,
+                                                        truncated */
+        } sockaddr;
+    } obj;
+};
+
+/* Events are added at head by the kernel and consumed at tail by the
+ * reader, which writes tail after it has read each event.  An event that
+ * finds the ring full is dropped.  The kernel treats a tail more than
+ * nevents behind head as a full ring, and one past head as an empty one.
+ */
+struct sandbox_eventring {
+    uint32_t            version;    /* SANDBOX_VERSION */
+    uint32_t            eventsize;  /* sizeof(struct sandbox_event) */
+    uint64_t            nevents;    /* a power of two */
+    uint64_t            offset;     /* of the first event */
+    volatile uint64_t   head;
+    volatile uint64_t   ndropped;
+    uint64_t            pad[3];
+    volatile uint64_t   tail;       /* in a cache line of its own */
+};
+
+/* starts (nevents > 0) or stops (nevents = 0) recording events, which only
+ * the superuser may do.  The ring is allocated when first started, and
+ * keeps its length until the module is unloaded.
+ */
+struct sandbox_events {
+    size_t  nevents;    /* in; out: the ring's */
+    size_t  size;       /* out: of the mapping */
+};
+
 #define SANDBOX_IOC_VERSION  _IOR('S', 0, int)
 #define SANDBOX_IOC_SETSPEC  _IOW('S', 1, struct sandbox_spec)
 #define SANDBOX_IOC_NLISTS   _IOR('S', 2, int)
+#define SANDBOX_IOC_STATS    _IOWR('S', 3, struct sandbox_stats)
+#define SANDBOX_IOC_PRELOAD  _IOWR('S', 4, struct sandbox_preload)
+#define SANDBOX_IOC_ATTACHID _IOW('S', 5, uint64_t)
+#define SANDBOX_IOC_UNLOAD   _IOW('S', 6, uint64_t)
+#define SANDBOX_IOC_SETTMPL  _IOW('S', 7, struct sandbox_template)
+#define SANDBOX_IOC_ATTACHTMPL _IOW('S', 8, struct sandbox_template)
+#define SANDBOX_IOC_RELOAD   _IOW('S', 9, struct sandbox_spec)
+#define SANDBOX_IOC_TRACEREAD _IOWR('S', 10, struct sandbox_trace)
+#define SANDBOX_IOC_TRACEFMT _IOWR('S', 11, struct sandbox_tracefmt)
+#define SANDBOX_IOC_EVENTS   _IOWR('S', 12, struct sandbox_events)
 
 #endif /* !_SANDBOX_SPEC_H_ */
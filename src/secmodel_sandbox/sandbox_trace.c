@@ -0,0 +1,446 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/atomic.h>
+#include <sys/cpu.h>
+#include <sys/intr.h>
+#include <sys/kmem.h>
+#include <sys/lwp.h>
+#include <sys/mutex.h>
+#include <sys/proc.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/xcall.h>
+
+#include "sandbox_spec.h"
+#include "sandbox_trace.h"
+
+/* for the levels only: a log call in this file could recurse */
+#include "sandbox_log.h"
+
+#define SANDBOX_TRACE_MASK  (SANDBOX_TRACE_NRECS - 1)
+
+/* the length modifiers of the conversions that log calls use */
+#define SANDBOX_TRACE_LMOD_INT      0
+#define SANDBOX_TRACE_LMOD_LONG     1
+#define SANDBOX_TRACE_LMOD_LLONG    2
+#define SANDBOX_TRACE_LMOD_SIZE     3
+#define SANDBOX_TRACE_LMOD_INTMAX   4
+
+struct sandbox_tracering {
+    volatile u_int head;    /* records ever written; only the ring's CPU
+                               writes */
+    u_int tail;             /* records read or lost, under
+                               sandbox_tracelock */
+    struct sandbox_tracerec *recs;
+} __aligned(COHERENCY_UNIT);
+
+int sandbox_tracelevels[SANDBOX_TRACE_NSUBSYS] = {
+    [SANDBOX_TRACE_CORE] = SANDBOX_LOG_LEVEL_WARN,
+    [SANDBOX_TRACE_SECMODEL] = SANDBOX_LOG_LEVEL_WARN,
+    [SANDBOX_TRACE_LUA] = SANDBOX_LOG_LEVEL_WARN,
+    [SANDBOX_TRACE_DEVICE] = SANDBOX_LOG_LEVEL_WARN,
+    [SANDBOX_TRACE_VNODE] = SANDBOX_LOG_LEVEL_WARN,
+};
+
+static const char *sandbox_trace_subsysnames[SANDBOX_TRACE_NSUBSYS] = {
+    [SANDBOX_TRACE_CORE] = "core",
+    [SANDBOX_TRACE_SECMODEL] = "secmodel",
+    [SANDBOX_TRACE_LUA] = "lua",
+    [SANDBOX_TRACE_DEVICE] = "device",
+    [SANDBOX_TRACE_VNODE] = "vnode",
+};
+
+/* indexed by level */
+static const char sandbox_trace_levelchars[] = "-EWIDT";
+
+/* also print records to the console */
+static int sandbox_traceconsole = 0;
+
+/* NULL until sandbox_trace_init() and after sandbox_trace_fini(), when log
+ * calls only go to the console; a writer loads it once, at IPL_SOFTSERIAL
+ */
+static struct sandbox_tracering * volatile sandbox_tracerings = NULL;
+static u_int sandbox_tracencpus = 0;
+static kmutex_t sandbox_tracelock;
+
+/* sandbox_tracesites[id] is the call site with the id, 1 through
+ * sandbox_tracensites
+ */
+static struct sandbox_tracesite *sandbox_tracesites[SANDBOX_TRACE_MAXSITES];
+static u_int sandbox_tracensites = 0;
+
+/* gives the site an id, or 0 once the ids run out */
+static uint32_t
+sandbox_trace_register(struct sandbox_tracesite *site)
+{
+    u_int id = 0;
+
+    if (sandbox_tracensites >= SANDBOX_TRACE_MAXSITES - 1)
+        return (0);
+
+    id = atomic_inc_uint_nv(&sandbox_tracensites);
+    if (id >= SANDBOX_TRACE_MAXSITES)
+        return (0);
+
+    sandbox_tracesites[id] = site;
+    membar_producer();
+
+    /* if another CPU registered the site first, id stays an alias of
+     * its id
+     */
+    (void)atomic_cas_32(&site->id, 0, id);
+    return (site->id);
+}
+
+static uint64_t
+sandbox_trace_arg(int lmod, int issigned, va_list *ap)
+{
+    switch (lmod) {
+    case SANDBOX_TRACE_LMOD_LONG:
+        return (issigned ? (uint64_t)va_arg(*ap, long) :
+                (uint64_t)va_arg(*ap, u_long));
+    case SANDBOX_TRACE_LMOD_LLONG:
+        return (issigned ? (uint64_t)va_arg(*ap, long long) :
+                (uint64_t)va_arg(*ap, unsigned long long));
+    case SANDBOX_TRACE_LMOD_SIZE:
+        return (issigned ? (uint64_t)va_arg(*ap, ssize_t) :
+                (uint64_t)va_arg(*ap, size_t));
+    case SANDBOX_TRACE_LMOD_INTMAX:
+        return (issigned ? (uint64_t)va_arg(*ap, intmax_t) :
+                (uint64_t)va_arg(*ap, uintmax_t));
+    default:
+        return (issigned ? (uint64_t)va_arg(*ap, int) :
+                (uint64_t)va_arg(*ap, u_int));
+    }
+}
+
+/* Copies the arguments of a log call into its record, by the conversions
+ * of its format.  Encoding stops at the first conversion that it does not
+ * know, which the reader does not know either.
+ */
+static void
+sandbox_trace_encode(struct sandbox_tracerec *rec, const char *fmt,
+        va_list ap)
+{
+    int n = 0;
+    int lmod = 0;
+    size_t len = 0;
+    size_t off = 0;
+    const char *c = NULL;
+    const char *str = NULL;
+    va_list aq;
+
+    /* ap may be an array, which cannot be passed by address */
+    va_copy(aq, ap);
+    for (c = fmt; *c != '\0' && n < SANDBOX_TRACE_MAXARGS; c++) {
+        if (*c != '%')
+            continue;
+
+        /* flags, width and precision */
+        for (c++; *c != '\0' && strchr("-+ #0123456789.", *c) != NULL; c++)
+            continue;
+
+        lmod = SANDBOX_TRACE_LMOD_INT;
+        for (;; c++) {
+            if (*c == 'l')
+                lmod = (lmod == SANDBOX_TRACE_LMOD_LONG) ?
+                    SANDBOX_TRACE_LMOD_LLONG : SANDBOX_TRACE_LMOD_LONG;
+            else if (*c == 'q')
+                lmod = SANDBOX_TRACE_LMOD_LLONG;
+            else if (*c == 'z')
+                lmod = SANDBOX_TRACE_LMOD_SIZE;
+            else if (*c == 'j')
+                lmod = SANDBOX_TRACE_LMOD_INTMAX;
+            else if (*c != 'h')
+                break;
+        }
+
+        switch (*c) {
+        case '%':
+            break;
+        case 's':
+            str = va_arg(aq, const char *);
+            if (str == NULL)
+                str = "(null)";
+            len = strnlen(str, SANDBOX_TRACE_STRLEN - 1 - off);
+            memcpy(rec->strs + off, str, len);
+            rec->strs[off + len] = '\0';
+            rec->args[n++] = off;
+            off = MIN(off + len + 1, SANDBOX_TRACE_STRLEN - 1);
+            break;
+        case 'p':
+            rec->args[n++] = (uintptr_t)va_arg(aq, void *);
+            break;
+        case 'c':
+        case 'd':
+        case 'i':
+            rec->args[n++] = sandbox_trace_arg(lmod, 1, &aq);
+            break;
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            rec->args[n++] = sandbox_trace_arg(lmod, 0, &aq);
+            break;
+        default:
+            goto done;
+        }
+    }
+
+done:
+    va_end(aq);
+}
+
+/* Records a log call in the ring of the current CPU.  The ring is written
+ * at IPL_SOFTSERIAL, so that a log call from a softint cannot interleave
+ * with one it interrupted, and the writer stays on its CPU.
+ */
+void
+sandbox_trace(struct sandbox_tracesite *site, int subsys, int level, ...)
+{
+    int s = 0;
+    u_int head = 0;
+    uint32_t id = 0;
+    const char *file = NULL;
+    struct cpu_info *ci = NULL;
+    struct timespec ts;
+    struct sandbox_tracering *rings = NULL;
+    struct sandbox_tracering *ring = NULL;
+    struct sandbox_tracerec *rec = NULL;
+    va_list ap;
+
+    id = site->id;
+    if (__predict_false(id == 0))
+        id = sandbox_trace_register(site);
+
+    s = splsoftserial();
+    rings = sandbox_tracerings;
+    if (rings != NULL) {
+        membar_consumer();
+        nanouptime(&ts);
+        ci = curcpu();
+        ring = &rings[cpu_index(ci)];
+        head = ring->head;
+        rec = &ring->recs[head & SANDBOX_TRACE_MASK];
+        memset(rec, 0, sizeof(*rec));
+        rec->nsecs = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        rec->fmtid = id;
+        rec->cpu = cpu_index(ci);
+        rec->subsys = subsys;
+        rec->level = level;
+        rec->pid = curproc->p_pid;
+        rec->lid = curlwp->l_lid;
+        va_start(ap, level);
+        sandbox_trace_encode(rec, site->format, ap);
+        va_end(ap);
+        membar_producer();
+        ring->head = head + 1;
+    }
+    splx(s);
+
+    if (sandbox_traceconsole) {
+        file = strrchr(site->file, '/');
+        printf("%c %s:%d:%s ", sandbox_trace_levelchars[level],
+                file != NULL ? file + 1 : site->file, site->line, site->func);
+        va_start(ap, level);
+        vprintf(site->format, ap);
+        va_end(ap);
+    }
+}
+
+/* Copies out the records that the rings hold, oldest first on each CPU,
+ * and counts those that were overwritten before they could be read.
+ * Records are copied through a bounce buffer, as the rings' CPUs keep on
+ * writing meanwhile.
+ */
+int
+sandbox_trace_read(struct sandbox_trace *trace)
+{
+    int error = 0;
+    u_int i = 0;
+    u_int j = 0;
+    u_int head = 0;
+    u_int start = 0;
+    u_int drop = 0;
+    size_t n = 0;
+    size_t max = 0;
+    size_t ncopy = 0;
+    struct sandbox_tracering *rings = sandbox_tracerings;
+    struct sandbox_tracering *ring = NULL;
+    struct sandbox_tracerec *buf = NULL;
+
+    trace->nlost = 0;
+    max = MIN(trace->nrecs, SANDBOX_TRACE_NRECS);
+    if (max == 0 || rings == NULL) {
+        trace->nrecs = 0;
+        return (0);
+    }
+
+    buf = kmem_alloc(max * sizeof(*buf), KM_SLEEP);
+
+    mutex_enter(&sandbox_tracelock);
+    for (i = 0; i < sandbox_tracencpus && n < max; i++) {
+        ring = &rings[i];
+        head = ring->head;
+        membar_consumer();
+        if (head - ring->tail > SANDBOX_TRACE_NRECS) {
+            trace->nlost += head - SANDBOX_TRACE_NRECS - ring->tail;
+            ring->tail = head - SANDBOX_TRACE_NRECS;
+        }
+
+        start = ring->tail;
+        ncopy = MIN(head - start, max - n);
+        for (j = 0; j < ncopy; j++)
+            buf[n + j] = ring->recs[(start + j) & SANDBOX_TRACE_MASK];
+        ring->tail = start + ncopy;
+
+        /* the write of record h overwrites record h - NRECS, so drop the
+         * records that the CPU may have overwritten while they were copied
+         */
+        membar_consumer();
+        head = ring->head;
+        drop = 0;
+        if (head - start >= SANDBOX_TRACE_NRECS)
+            drop = MIN(head - start - SANDBOX_TRACE_NRECS + 1, ncopy);
+        if (drop > 0) {
+            memmove(&buf[n], &buf[n + drop], (ncopy - drop) * sizeof(*buf));
+            ncopy -= drop;
+            trace->nlost += drop;
+        }
+        n += ncopy;
+    }
+    mutex_exit(&sandbox_tracelock);
+
+    if (n > 0)
+        error = copyout(buf, trace->recs, n * sizeof(*buf));
+    trace->nrecs = n;
+
+    kmem_free(buf, max * sizeof(*buf));
+    return (error);
+}
+
+int
+sandbox_trace_getfmt(struct sandbox_tracefmt *tf)
+{
+    const char *file = NULL;
+    struct sandbox_tracesite *site = NULL;
+
+    if (tf->id == 0 || tf->id > MIN(sandbox_tracensites,
+                SANDBOX_TRACE_MAXSITES - 1))
+        return (ENOENT);
+
+    site = sandbox_tracesites[tf->id];
+    membar_consumer();
+    if (site == NULL)
+        return (ENOENT);
+
+    file = strrchr(site->file, '/');
+    strlcpy(tf->file, file != NULL ? file + 1 : site->file,
+            sizeof(tf->file));
+    strlcpy(tf->func, site->func, sizeof(tf->func));
+    strlcpy(tf->fmt, site->format, sizeof(tf->fmt));
+    tf->line = site->line;
+
+    return (0);
+}
+
+/* creates security.models.sandbox.trace under rnode */
+int
+sandbox_trace_sysctl(struct sysctllog **clog, const struct sysctlnode *rnode)
+{
+    int error = 0;
+    int i = 0;
+    const struct sysctlnode *tnode = NULL;
+
+    error = sysctl_createv(clog, 0, &rnode, &tnode,
+            CTLFLAG_PERMANENT, CTLTYPE_NODE, "trace",
+            NULL, NULL, 0, NULL, 0,
+            CTL_CREATE, CTL_EOL);
+    if (error)
+        return (error);
+
+    for (i = 0; i < SANDBOX_TRACE_NSUBSYS; i++) {
+        error = sysctl_createv(clog, 0, &tnode, NULL,
+                CTLFLAG_PERMANENT | CTLFLAG_READWRITE, CTLTYPE_INT,
+                sandbox_trace_subsysnames[i],
+                NULL, NULL, 0, &sandbox_tracelevels[i], 0,
+                CTL_CREATE, CTL_EOL);
+        if (error)
+            return (error);
+    }
+
+    error = sysctl_createv(clog, 0, &tnode, NULL,
+            CTLFLAG_PERMANENT | CTLFLAG_READWRITE, CTLTYPE_INT, "console",
+            NULL, NULL, 0, &sandbox_traceconsole, 0,
+            CTL_CREATE, CTL_EOL);
+
+    return (error);
+}
+
+void
+sandbox_trace_init(void)
+{
+    u_int i = 0;
+    struct sandbox_tracering *rings = NULL;
+
+    mutex_init(&sandbox_tracelock, MUTEX_DEFAULT, IPL_NONE);
+
+    rings = kmem_zalloc(ncpu * sizeof(*rings), KM_SLEEP);
+    for (i = 0; i < ncpu; i++)
+        rings[i].recs = kmem_zalloc(
+                SANDBOX_TRACE_NRECS * sizeof(*rings[i].recs), KM_SLEEP);
+
+    sandbox_tracencpus = ncpu;
+    membar_producer();
+    sandbox_tracerings = rings;
+}
+
+void
+sandbox_trace_fini(void)
+{
+    u_int i = 0;
+    struct sandbox_tracering *rings = sandbox_tracerings;
+
+    /* a writer loads the pointer and writes through it at IPL_SOFTSERIAL,
+     * so once every CPU has passed the barrier, none is still writing
+     */
+    sandbox_tracerings = NULL;
+    xc_barrier(0);
+
+    for (i = 0; i < sandbox_tracencpus; i++)
+        kmem_free(rings[i].recs,
+                SANDBOX_TRACE_NRECS * sizeof(*rings[i].recs));
+    kmem_free(rings, sandbox_tracencpus * sizeof(*rings));
+    sandbox_tracencpus = 0;
+
+    mutex_destroy(&sandbox_tracelock);
+}
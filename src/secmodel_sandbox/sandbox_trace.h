@@ -0,0 +1,80 @@
+/*-
+ * Copyright (c) 2020 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Stephen Herwig.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SANDBOX_TRACE_H_
+#define _SANDBOX_TRACE_H_
+
+#include <sys/types.h>
+#include <sys/sysctl.h>
+
+#include "sandbox_spec.h"
+
+/* The trace rings record the module's log calls in binary, one ring per
+ * CPU, for /dev/sandbox to drain (SANDBOX_IOC_TRACEREAD).  A record holds
+ * the id of its call site and the call's arguments; formatting is left to
+ * the reader, which asks for the site's format by its id
+ * (SANDBOX_IOC_TRACEFMT).  A writer only ever touches the ring of its own
+ * CPU, and so takes no locks; when a ring is full, its oldest records are
+ * overwritten, and the reader counts them as lost.
+ *
+ * Each subsystem's level is set under security.models.sandbox.trace, and is
+ * the only gate on its log calls.  If security.models.sandbox.trace.console
+ * is set, which it is not by default, records are printed to the console as
+ * well.
+ */
+
+#define SANDBOX_TRACE_NRECS     512     /* per CPU; a power of two */
+#define SANDBOX_TRACE_MAXSITES  1024
+
+/* a log call; see SANDBOX_LOG() */
+struct sandbox_tracesite {
+    const char *file;
+    const char *func;
+    const char *format;
+    int line;
+    uint32_t id;        /* 0 until the site is first recorded */
+};
+
+extern int sandbox_tracelevels[SANDBOX_TRACE_NSUBSYS];
+
+void sandbox_trace_init(void);
+
+void sandbox_trace_fini(void);
+
+int sandbox_trace_sysctl(struct sysctllog **clog,
+        const struct sysctlnode *rnode);
+
+void sandbox_trace(struct sandbox_tracesite *site, int subsys, int level,
+        ...);
+
+int sandbox_trace_read(struct sandbox_trace *trace);
+
+int sandbox_trace_getfmt(struct sandbox_tracefmt *tf);
+
+#endif /* !_SANDBOX_TRACE_H_ */
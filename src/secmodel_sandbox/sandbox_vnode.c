@@ -48,6 +48,7 @@
 #include "sandbox_vnode.h"
 #include "sandbox_path.h"
 
+#define SANDBOX_LOG_SUBSYS SANDBOX_TRACE_VNODE
 #include "sandbox_log.h"
 
 
@@ -61,7 +62,8 @@
             vp->v_holdcnt, \
             VOP_ISLOCKED(vp))
 
-static ino_t
+/* vp must be locked */
+ino_t
 sandbox_vnode_getfileid(struct vnode *vp, kauth_cred_t cred)
 {
     int error = 0;
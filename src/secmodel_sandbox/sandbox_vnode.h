@@ -31,8 +31,11 @@
 #define _SANDBOX_VNODE_H_
 
 #include <sys/types.h>
+#include <sys/kauth.h>
 #include <sys/vnode.h>
 
+ino_t sandbox_vnode_getfileid(struct vnode *vp, kauth_cred_t cred);
+
 int sandbox_vnode_to_path(struct vnode *vp, char *out, size_t outlen);
 
 #endif /* !_SANDBOX_VNODE_H_ */
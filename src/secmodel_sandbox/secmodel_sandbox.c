@@ -33,6 +33,7 @@
 
 #include <sys/queue.h>
 
+#include <sys/atomic.h>
 #include <sys/filedesc.h>
 #include <sys/kauth.h>
 #include <sys/kmem.h>
@@ -45,23 +46,40 @@
 #include <secmodel/secmodel.h>
 
 #include "sandbox.h"
+#include "sandbox_chunkcache.h"
 #include "sandbox_device.h"
+#include "sandbox_event.h"
 #include "sandbox_lua.h"
+#include "sandbox_objcache.h"
+#include "sandbox_permissive.h"
+#include "sandbox_ref.h"
+#include "sandbox_registry.h"
+#include "sandbox_trace.h"
 #include "secmodel_sandbox.h"
 
+#define SANDBOX_LOG_SUBSYS SANDBOX_TRACE_SECMODEL
 #include "sandbox_log.h"
 
 MODULE(MODULE_CLASS_SECMODEL, secmodel_sandbox, "lua");
 
 kauth_key_t secmodel_sandbox_key;
 
+/* indexed by the bit of the SANDBOX_SCOPE_* flag */
+static struct secmodel_sandbox_scope {
+    const char *id;
+    kauth_scope_callback_t cb;
+    kauth_listener_t listener;
+    u_int refcnt;           /* of the live sandboxes with rules in it */
+} secmodel_sandbox_scopes[SANDBOX_NSCOPES] = {
+    { KAUTH_SCOPE_SYSTEM, secmodel_sandbox_system_cb, NULL, 0 },
+    { KAUTH_SCOPE_PROCESS, secmodel_sandbox_process_cb, NULL, 0 },
+    { KAUTH_SCOPE_NETWORK, secmodel_sandbox_network_cb, NULL, 0 },
+    { KAUTH_SCOPE_MACHDEP, secmodel_sandbox_machdep_cb, NULL, 0 },
+    { KAUTH_SCOPE_DEVICE, secmodel_sandbox_device_cb, NULL, 0 },
+    { KAUTH_SCOPE_VNODE, secmodel_sandbox_vnode_cb, NULL, 0 },
+};
+
 static secmodel_t secmodel_sandbox = NULL;
-static kauth_listener_t l_system = NULL;
-static kauth_listener_t l_process = NULL;
-static kauth_listener_t l_network = NULL;
-static kauth_listener_t l_machdep = NULL;
-static kauth_listener_t l_device = NULL;
-static kauth_listener_t l_vnode = NULL;
 static kauth_listener_t l_cred = NULL;
 static struct sysctllog *sandbox_sysctl_log = NULL;
 
@@ -78,7 +96,7 @@ static int secmodel_sandbox_n = 0;
 static int secmodel_sandbox_register(void);
 static void secmodel_sandbox_deregister(void);
 static int secmodel_sandbox_modinit(void);
-static void secmodel_sandbox_modfini(void);
+static int secmodel_sandbox_modfini(void);
 static int secmodel_sandbox_cred_cb(kauth_cred_t cred, kauth_action_t action,
         void *cookie, void *arg0, void *arg1, void *arg2, void *arg3);
 
@@ -149,12 +167,22 @@ static int
 secmodel_sandbox_modinit(void)
 {
     int error = 0;
+
+    sandbox_trace_init();
+
     SANDBOX_LOG_TRACE_ENTER;
 
     error = secmodel_sandbox_register();
     if (error != 0)
         goto fail;
-        
+
+    sandbox_objcache_init();
+    sandbox_chunkcache_init();
+    sandbox_lua_init();
+    sandbox_registry_init();
+    sandbox_init();
+    sandbox_event_init();
+    sandbox_permissive_init();
     secmodel_sandbox_start();
     error = sysctl_security_sandbox_setup(&sandbox_sysctl_log);
     if (error != 0)
@@ -173,12 +201,32 @@ succeed:
     return (error);
 }
 
-static void
+/* Fails with EBUSY, leaving the module as it was, while any object from
+ * the object caches is still out: the sandbox lists of sandboxed
+ * processes' creds, pinned policies, or requests on the permissive queue.
+ * So too while /dev/sandbox is open or the event ring has been mapped.
+ * Detaching the device first keeps new sandboxes from being made, and the
+ * device from being opened, while the module checks.
+ */
+static int
 secmodel_sandbox_modfini(void)
 {
+    int error = 0;
+
     SANDBOX_LOG_TRACE_ENTER;
  
     sandbox_device_fini();
+    if (sandbox_objcache_busy()) {
+        SANDBOX_LOG_WARN("sandbox objects still in use\n");
+        error = EBUSY;
+    } else if (sandbox_event_busy()) {
+        SANDBOX_LOG_WARN("sandbox device open or event ring mapped\n");
+        error = EBUSY;
+    }
+    if (error != 0) {
+        (void)sandbox_device_init();
+        goto done;
+    }
 
     if (sandbox_sysctl_log != NULL) {
         sysctl_teardown(&sandbox_sysctl_log);
@@ -186,9 +234,21 @@ secmodel_sandbox_modfini(void)
     }
 
     secmodel_sandbox_stop();
+    sandbox_permissive_fini();
+    sandbox_event_fini();
+    sandbox_fini();
+    sandbox_registry_fini();
+    sandbox_lua_fini();
+    sandbox_chunkcache_fini();
+    sandbox_objcache_fini();
     secmodel_sandbox_deregister();
 
+done:
     SANDBOX_LOG_TRACE_EXIT;
+
+    if (error == 0)
+        sandbox_trace_fini();
+    return (error);
 }
 
 /*
@@ -216,12 +276,17 @@ secmodel_sandbox_cred_cb(kauth_cred_t cred, kauth_action_t action,
         sandbox_list_copy(sandbox_list, tocred);
         break;
     case KAUTH_CRED_FORK:
-        /* see sys/kern/kern_auth.c::kauth_proc_fork */
+        /* see sys/kern/kern_auth.c::kauth_proc_fork
+         *
+         * The child holds a reference to the parent's cred, and so shares
+         * its sandbox list, which is never changed in place; a process
+         * that attaches a sandbox gets a cred and list of its own (see
+         * secmodel_sandbox_attachcurproc()).
+         */
         parent = (struct proc *)arg0;
         child = (struct proc *)arg1;
-        SANDBOX_LOG_INFO("KAUTH_CRED_FORK (%ld -> %ld\n",
+        SANDBOX_LOG_INFO("KAUTH_CRED_FORK (%ld -> %ld)\n",
                 (long)parent->p_pid, (long)child->p_pid);
-        sandbox_list_fork(parent, child, cred);
         break;
     case KAUTH_CRED_CHROOT:
         //SANDBOX_LOG_DEBUG("KAUTH_CRED_CHROOT\n");
@@ -315,6 +380,21 @@ sysctl_security_sandbox_setup(struct sysctllog **clog)
         goto fail;
     }
 
+	error = sysctl_createv(clog, 0, &rnode, NULL,
+		       CTLFLAG_PERMANENT | CTLFLAG_READWRITE, CTLTYPE_INT, "stats",
+               NULL, NULL, 0, &sandbox_refstats, 0,
+		       CTL_CREATE, CTL_EOL);
+    if (error) {
+        SANDBOX_LOG_ERROR("sysctl_createv('stats') failed: error=%d\n", error);
+        goto fail;
+    }
+
+    error = sandbox_trace_sysctl(clog, rnode);
+    if (error) {
+        SANDBOX_LOG_ERROR("sysctl_createv('trace') failed: error=%d\n", error);
+        goto fail;
+    }
+
     goto succeed;
 
 fail:
@@ -328,23 +408,28 @@ succeed:
     return (error);
 }
 
+/*
+ * SCOPE LISTENERS
+ *
+ * The listeners stay registered for as long as the module is loaded, since
+ * kauth cannot wait for the callers of a listener to leave it before the
+ * listener is removed.  Instead, each scope counts the live sandboxes that
+ * have rules in it, and while a scope's count is zero its callback returns
+ * at once, without looking up the cred's sandboxes.
+ */
+
 void
 secmodel_sandbox_start(void)
 {
+    int i = 0;
+    struct secmodel_sandbox_scope *scope = NULL;
+
     SANDBOX_LOG_TRACE_ENTER;
 
-    l_system = kauth_listen_scope(KAUTH_SCOPE_SYSTEM,
-            secmodel_sandbox_system_cb, NULL);
-    l_process = kauth_listen_scope(KAUTH_SCOPE_PROCESS,
-            secmodel_sandbox_process_cb, NULL);
-    l_network = kauth_listen_scope(KAUTH_SCOPE_NETWORK,
-            secmodel_sandbox_network_cb, NULL);
-    l_machdep = kauth_listen_scope(KAUTH_SCOPE_MACHDEP,
-            secmodel_sandbox_machdep_cb, NULL);
-    l_device = kauth_listen_scope(KAUTH_SCOPE_DEVICE,
-            secmodel_sandbox_device_cb, NULL);
-    l_vnode = kauth_listen_scope(KAUTH_SCOPE_VNODE,
-            secmodel_sandbox_vnode_cb, NULL);
+    for (i = 0; i < SANDBOX_NSCOPES; i++) {
+        scope = &secmodel_sandbox_scopes[i];
+        scope->listener = kauth_listen_scope(scope->id, scope->cb, NULL);
+    }
     l_cred = kauth_listen_scope(KAUTH_SCOPE_CRED,
             secmodel_sandbox_cred_cb, NULL);
 
@@ -354,32 +439,57 @@ secmodel_sandbox_start(void)
 void
 secmodel_sandbox_stop(void)
 {
+    int i = 0;
+    struct secmodel_sandbox_scope *scope = NULL;
+
     SANDBOX_LOG_TRACE_ENTER;
 
     /* XXX: kauth_unlisten_scope checks for a NULL argument */
 
-    kauth_unlisten_scope(l_system);
-    l_system = NULL;
-    
-    kauth_unlisten_scope(l_process);
-    l_process = NULL;
+    for (i = 0; i < SANDBOX_NSCOPES; i++) {
+        scope = &secmodel_sandbox_scopes[i];
+        kauth_unlisten_scope(scope->listener);
+        scope->listener = NULL;
+    }
 
-    kauth_unlisten_scope(l_network);
-    l_network = NULL;
+    kauth_unlisten_scope(l_cred);
+    l_cred = NULL;
 
-    kauth_unlisten_scope(l_machdep);
-    l_machdep = NULL;
+    SANDBOX_LOG_TRACE_EXIT;
+}
 
-    kauth_unlisten_scope(l_device);
-    l_device = NULL;
+/* takes a reference on each of the scopes */
+void
+secmodel_sandbox_holdscopes(int scopes)
+{
+    int i = 0;
 
-    kauth_unlisten_scope(l_vnode);
-    l_vnode = NULL;
+    for (i = 0; i < SANDBOX_NSCOPES; i++) {
+        if (scopes & (1 << i))
+            atomic_inc_uint(&secmodel_sandbox_scopes[i].refcnt);
+    }
+}
 
-    kauth_unlisten_scope(l_cred);
-    l_cred = NULL;
+/* drops a reference on each of the scopes */
+void
+secmodel_sandbox_releasescopes(int scopes)
+{
+    int i = 0;
 
-    SANDBOX_LOG_TRACE_EXIT;
+    for (i = 0; i < SANDBOX_NSCOPES; i++) {
+        if (!(scopes & (1 << i)))
+            continue;
+        KASSERT(secmodel_sandbox_scopes[i].refcnt > 0);
+        atomic_dec_uint(&secmodel_sandbox_scopes[i].refcnt);
+    }
+}
+
+/* true if no live sandbox has rules in the scope, a SANDBOX_SCOPE_* flag */
+static inline bool
+secmodel_sandbox_scopeidle(int scope)
+{
+    return (atomic_load_relaxed(
+                &secmodel_sandbox_scopes[ffs(scope) - 1].refcnt) == 0);
 }
 
 #if 0
@@ -398,6 +508,9 @@ secmodel_sandbox_system_cb(kauth_cred_t cred, kauth_action_t action,
     struct sandbox_list *sandbox_list = NULL;
     enum kauth_system_req req = (enum kauth_system_req)arg0;
     
+    if (secmodel_sandbox_scopeidle(SANDBOX_SCOPE_SYSTEM))
+        return (result);
+
     sandbox_list = kauth_cred_getdata(cred, secmodel_sandbox_key);
     if (sandbox_list != NULL) {
         result = sandbox_list_evalsystem(sandbox_list, cred, action, req, arg1,
@@ -416,6 +529,9 @@ secmodel_sandbox_process_cb(kauth_cred_t cred, kauth_action_t action,
     struct sandbox_list *sandbox_list = NULL;
     struct proc *p = (struct proc *)arg0;
 
+    if (secmodel_sandbox_scopeidle(SANDBOX_SCOPE_PROCESS))
+        return (result);
+
     sandbox_list = kauth_cred_getdata(cred, secmodel_sandbox_key);
     if (sandbox_list != NULL) {
         result = sandbox_list_evalprocess(sandbox_list, cred, action, p, arg1,
@@ -434,6 +550,9 @@ secmodel_sandbox_network_cb(kauth_cred_t cred, kauth_action_t action,
     struct sandbox_list *sandbox_list = NULL;
     enum kauth_network_req req = (enum kauth_network_req)arg0;
 
+    if (secmodel_sandbox_scopeidle(SANDBOX_SCOPE_NETWORK))
+        return (result);
+
     sandbox_list = kauth_cred_getdata(cred, secmodel_sandbox_key);
     if (sandbox_list != NULL) {
         result = sandbox_list_evalnetwork(sandbox_list, cred, action, req, arg1,
@@ -451,6 +570,9 @@ secmodel_sandbox_machdep_cb(kauth_cred_t cred, kauth_action_t action,
     int result = KAUTH_RESULT_DEFER;
     struct sandbox_list *sandbox_list = NULL;
 
+    if (secmodel_sandbox_scopeidle(SANDBOX_SCOPE_MACHDEP))
+        return (result);
+
     sandbox_list = kauth_cred_getdata(cred, secmodel_sandbox_key);
     if (sandbox_list != NULL) {
         result = sandbox_list_evalmachdep(sandbox_list, cred, action, arg0,
@@ -468,6 +590,9 @@ secmodel_sandbox_device_cb(kauth_cred_t cred, kauth_action_t action,
     int result = KAUTH_RESULT_DEFER;
     struct sandbox_list *sandbox_list = NULL;
 
+    if (secmodel_sandbox_scopeidle(SANDBOX_SCOPE_DEVICE))
+        return (result);
+
     sandbox_list = kauth_cred_getdata(cred, secmodel_sandbox_key);
     if (sandbox_list != NULL) {
         result = sandbox_list_evaldevice(sandbox_list, cred, action, arg0,
@@ -487,6 +612,9 @@ secmodel_sandbox_vnode_cb(kauth_cred_t cred, kauth_action_t action,
     vnode_t *vp = (vnode_t *) arg0;
     vnode_t *dvp = (vnode_t *)arg1;
 
+    if (secmodel_sandbox_scopeidle(SANDBOX_SCOPE_VNODE))
+        return (result);
+
     sandbox_list = kauth_cred_getdata(cred, secmodel_sandbox_key);
     if (sandbox_list != NULL) {
         result = sandbox_list_evalvnode(sandbox_list, cred, action, vp, dvp);
@@ -500,13 +628,20 @@ secmodel_sandbox_vnode_cb(kauth_cred_t cred, kauth_action_t action,
  * ATTACH A SANDBOX (INTERFACE BETWEEN SANDBOX DEVICE AND SANDBOX SECMODEL)
  */
 
-/* look at sys/kern/kern_prot.c::do_setresgid() as an example */
-/* XXX: why do we have to alloc a new cred? */
-void 
-secmodel_sandbox_attachcurproc(struct sandbox_list *sandbox_list)
+/* Gives the calling process a new cred with sandbox stacked on its
+ * sandboxes, in the manner of sys/kern/kern_prot.c::do_setresgid().
+ * Cloning the cred copies its sandbox list, if it has one (see
+ * sandbox_list_copy()), and the copy takes over the caller's reference to
+ * sandbox.  Returns EAGAIN if another LWP of the process attached a
+ * sandbox after sandbox was stacked on the process's topmost one.
+ */
+int
+secmodel_sandbox_attachcurproc(struct sandbox *sandbox)
 {
+    int error = 0;
     kauth_cred_t cred;
     kauth_cred_t ncred;
+    struct sandbox_list *sandbox_list = NULL;
 
     SANDBOX_LOG_TRACE_ENTER;
 
@@ -517,12 +652,27 @@ secmodel_sandbox_attachcurproc(struct sandbox_list *sandbox_list)
     proc_crmod_enter();
     cred = curlwp->l_proc->p_cred;
     kauth_cred_clone(cred, ncred);
-    kauth_cred_setdata(ncred, secmodel_sandbox_key, sandbox_list);
+    sandbox_list = kauth_cred_getdata(ncred, secmodel_sandbox_key);
+    if (sandbox_list == NULL) {
+        sandbox_list = sandbox_list_create();
+        kauth_cred_setdata(ncred, secmodel_sandbox_key, sandbox_list);
+    }
+
+    if (SLIST_FIRST(&sandbox_list->head) !=
+            SLIST_NEXT(sandbox, sandbox_next)) {
+        proc_crmod_leave(NULL, NULL, false);
+        kauth_cred_free(ncred);
+        error = EAGAIN;
+        goto done;
+    }
+
+    SLIST_FIRST(&sandbox_list->head) = sandbox;
     /* Broadcast our credentials to the process and other LWPs */
     proc_crmod_leave(ncred, cred, true);
 
+done:
     SANDBOX_LOG_TRACE_EXIT;
-    return;
+    return (error);
 }
 
 /*
@@ -541,11 +691,11 @@ secmodel_sandbox_modcmd(modcmd_t cmd, void *arg __unused)
         SANDBOX_LOG_INFO("loading sandbox module\n");
         error = secmodel_sandbox_modinit();
         if (error != 0)
-            secmodel_sandbox_modfini();
+            (void)secmodel_sandbox_modfini();
         break;
     case MODULE_CMD_FINI:
         SANDBOX_LOG_INFO("unloading sandbox module\n");
-        secmodel_sandbox_modfini();
+        error = secmodel_sandbox_modfini();
         break;
     case MODULE_CMD_STAT:
         break;
@@ -47,8 +47,10 @@ extern kauth_key_t secmodel_sandbox_key;
 void secmodel_sandbox_init(void);
 void secmodel_sandbox_start(void);
 int sysctl_security_sandbox_setup(struct sysctllog **clog);
-void secmodel_sandbox_attachcurproc(struct sandbox_list *sandbox_list);
+int secmodel_sandbox_attachcurproc(struct sandbox *sandbox);
 void secmodel_sandbox_stop(void);
+void secmodel_sandbox_holdscopes(int scopes);
+void secmodel_sandbox_releasescopes(int scopes);
 void secmodel_sandbox_fini(void);
 
 int secmodel_sandbox_system_cb(kauth_cred_t, kauth_action_t,